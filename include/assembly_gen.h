@@ -2,6 +2,8 @@
 #define ASSEMBLY_GEN_H
 
 #include "command.h"
+#include "profile.h"
+#include "stack_arena.h"
 
 #include <stdio.h>
 
@@ -9,6 +11,30 @@
  * the Assembly Generation Module */
 
 
+#define ASSEMBLY_STATIC_START 16   /* Static variables live in RAM [16, 256) */
+#define ASSEMBLY_STATIC_END   256
+
+/* What the cost model weighs where a command has several expansions, the default
+ * keeps the usual ones */
+typedef enum {
+    ASSEMBLY_GOAL_DEFAULT,
+    ASSEMBLY_GOAL_SIZE,     /* Fewest ROM words, then fewest cycles */
+    ASSEMBLY_GOAL_SPEED,    /* Fewest cycles, then fewest ROM words */
+} assembly_goal_t;
+
+/* ROM addresses of the instructions generated for one command, end is exclusive */
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+} rom_range_t;
+
+/* Where assemblyGenLayoutStatics put one file's static variables */
+typedef struct {
+    const char* filename;
+    uint16_t    base;                           /* RAM address of static 0 */
+    uint16_t    size;                           /* Highest static index used plus one */
+} static_layout_t;
+
 typedef struct {
     command_module_t* commands;
     size_t            static_variable_base;     /* Base number for the static variable addresses
@@ -16,14 +42,53 @@ typedef struct {
                                                  * through the whole program, but the indexes are relative
                                                  * to the file */
     size_t            total_static_variables;   /* Holds the number of static variables used in the current file */
+    const static_layout_t* static_layouts;      /* Optional, one per file in the order they are generated,
+                                                 * see assemblyGenLayoutStatics */
+    size_t            total_static_layouts;
+
+    size_t            rom_address;              /* ROM address the next generated instruction will land on */
+    rom_range_t*      rom_ranges;               /* Optional, one entry per command of the module given to
+                                                 * assemblyGen, filled in as the commands are translated */
 
     FILE*             output_file;
+    FILE*             map_file;                 /* Optional source map, see assemblyGenOpenMap */
+    FILE*             label_file;               /* Optional file id table, see assemblyGenOpenLabelTable */
+    const char*       function;                 /* Function the command being translated is in */
+    assembly_goal_t   goal;                     /* See assemblyGenSetGoal */
+    size_t            compare_expansion;        /* How lt / gt / eq, call and return are expanded, */
+    size_t            call_expansion;           /* picked for the whole program by assemblyGenSetGoal */
+    size_t            return_expansion;
+    int32_t           keep_calls;               /* Set before assemblyGenSetGoal to keep calls to the OS
+                                                 * routines -O 2 and -O s otherwise expand in place */
+    const profile_t*  profile;                  /* Optional, commands it counts at least hot_count */
+    uint64_t          hot_count;                /* times take the fastest expansions instead */
+
+    uint32_t          file_id;                  /* Generated labels are $<file_id>.<label_counter> in base 36, */
+    uint64_t          label_counter;            /* file id 0 is the preamble */
+
+    int32_t           outlining;                /* Set between assemblyGenBeginOutline and assemblyGenEndOutline, */
+    stack_arena_t     outline_instructions;     /* which keep the instructions back here, with copies of */
+    stack_arena_t     outline_labels;           /* their labels, and generate them from outline_rom_start */
+    size_t            outline_rom_start;
 } assembly_gen_t;
 
 int32_t assemblyGenInitialize(assembly_gen_t* assembly_gen, const char* filepath);
+int32_t assemblyGenInitializeStream(assembly_gen_t* assembly_gen, FILE* output_file);
+void    assemblyGenSetGoal(assembly_gen_t* assembly_gen, assembly_goal_t goal, const command_module_t* commands,
+                           const profile_t* profile);
+int32_t assemblyGenOpenMap(assembly_gen_t* assembly_gen, const char* filepath);
+int32_t assemblyGenLayoutStatics(assembly_gen_t* assembly_gen, static_layout_t* layouts, command_module_t* const* modules,
+                                  const char* const* filenames, size_t total_modules, FILE* report);
+int32_t assemblyGenOpenLabelTable(assembly_gen_t* assembly_gen, const char* filepath);
 void    assemblyGenDestroy(assembly_gen_t* assembly_gen);
 int32_t assemblyGenPreamble(assembly_gen_t* assembly_gen, char* entry_function);
 int32_t assemblyGen(assembly_gen_t* assembly_gen, command_module_t* commands, const char* filename);
+int32_t assemblyGenBeginOutline(assembly_gen_t* assembly_gen);
+int32_t assemblyGenEndOutline(assembly_gen_t* assembly_gen);
+
+/* Single command interface, for callers that feed commands in as they come */
+int32_t assemblyGenBeginFile(assembly_gen_t* assembly_gen, const char* filename);
+char*   assemblyGenCommand(assembly_gen_t* assembly_gen, stack_arena_t* stack_arena, command_t* command, const char* filename);
 
 
 #endif
@@ -0,0 +1,84 @@
+#ifndef CFG_H
+#define CFG_H
+
+#include "command.h"
+#include "stack_arena.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Defines the structures and function interface for the Control Flow Graph Module.
+ * A cfg_t is a view over a command_module_t, every function is split into basic
+ * blocks at labels and after goto / if-goto / return. Passes look at the blocks,
+ * edit or remove commands in the module, and the graph is rebuilt between passes.
+ * Building is linear in the number of commands */
+
+#define CFG_NO_BLOCK UINT32_MAX
+
+/* Block flags */
+#define CFG_BLOCK_CALLS      0x01   /* Contains a call, or a multiply that may be one, which may change any segment */
+#define CFG_BLOCK_RETURNS    0x02   /* Ends in a return or tail call */
+#define CFG_BLOCK_ESCAPES    0x04   /* Ends in a jump to a label not defined in its function */
+#define CFG_BLOCK_REACHABLE  0x08   /* Set by cfgMarkReachable */
+
+typedef struct {
+    size_t   first_command;         /* Index into the command module */
+    size_t   total_commands;
+    uint32_t function;              /* Index into the function array */
+    uint32_t successors[2];         /* Fall through first, then the branch target, CFG_NO_BLOCK if absent */
+    uint32_t total_predecessors;
+    int32_t  stack_effect;          /* Net change of the stack depth across the block */
+    int32_t  stack_low;             /* Lowest depth reached, relative to the depth on entry */
+    uint32_t segment_uses;          /* 1 << memory_segment_t for every segment read */
+    uint32_t segment_defs;          /* 1 << memory_segment_t for every segment written */
+    uint32_t flags;
+} cfg_block_t;
+
+typedef struct {
+    const char* name;               /* NULL for commands ahead of the first function */
+    size_t      first_block;
+    size_t      total_blocks;
+} cfg_function_t;
+
+typedef struct {
+    command_module_t* commands;
+
+    cfg_block_t*      blocks;
+    size_t            total_blocks;
+    cfg_function_t*   functions;
+    size_t            total_functions;
+
+    uint32_t*         command_blocks;   /* Per command, the block it is in */
+    uint8_t*          removed;          /* Per command, set by cfgRemoveCommand */
+    size_t            total_removed;
+    size_t            total_unresolved; /* Jumps to labels not defined in their function */
+
+    uint32_t*         labels;           /* Open addressing table of label commands, index + 1 */
+    size_t            label_capacity;
+
+    stack_arena_t     stack_arena;
+} cfg_t;
+
+/* A pass returns the number of changes it made, or -1 on failure */
+typedef int32_t (*cfg_pass_function_t)(cfg_t* cfg, void* context);
+
+typedef struct {
+    const char*         name;
+    cfg_pass_function_t run;
+    void*               context;
+} cfg_pass_t;
+
+int32_t cfgBuild(cfg_t* cfg, command_module_t* commands);
+void    cfgDestroy(cfg_t* cfg);
+
+int32_t cfgStackEffect(const command_t* command);
+uint32_t cfgFindLabel(cfg_t* cfg, uint32_t function, const char* label);
+
+void    cfgRemoveCommand(cfg_t* cfg, size_t command_index);
+int32_t cfgCompact(cfg_t* cfg);
+int32_t cfgReplaceCommands(cfg_t* cfg, command_t* commands, size_t total_commands);
+void    cfgMarkReachable(cfg_t* cfg);
+
+int32_t cfgRunPasses(cfg_t* cfg, const cfg_pass_t* passes, size_t total_passes);
+
+#endif
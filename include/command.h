@@ -1,6 +1,8 @@
 #ifndef COMMAND_H
 #define COMMAND_H
 
+#include "stack_arena.h"
+
 #include <stdint.h>
 #include <sys/types.h>
 
@@ -39,10 +41,42 @@ typedef enum {
     OP_FUNCTION,
     OP_CALL,
     OP_RETURN,
+    OP_IFNOTGOTO, // Jumps when the popped value is zero, the optimizer produces these
+    OP_MOVE,      // A push straight into a pop, the optimizer produces these
+
+    /* A comparison straight into an if-goto, they pop two values and jump when the
+     * comparison of the lower one with the top one holds, the optimizer produces these */
+    OP_IFLT,
+    OP_IFGT,
+    OP_IFEQ,
+    OP_IFGE,
+    OP_IFLE,
+    OP_IFNE,
+
+    OP_TAILCALL, // A call straight into a return, reuses the frame, the optimizer produces these
+
+    /* A function without locals or calls, its calls and its returns, which save and
+     * restore only ARG and the return address, the optimizer produces these */
+    OP_LEAFFUNCTION,
+    OP_LEAFCALL,
+    OP_LEAFRETURN,
+
+    OP_MULTIPLY, // A multiplication of the top value by a constant, the optimizer produces these from Math.multiply calls
 
     OP_MAX,
 } operator_t;
 
+/* The function a multiply came from, assembly gen may call it again */
+#define OP_MULTIPLY_FUNCTION "Math.multiply"
+
+/* Every operator that jumps depending on what it pops */
+#define OP_IS_CONDITIONAL(op) ((op) == OP_IFGOTO || (op) == OP_IFNOTGOTO || ((op) >= OP_IFLT && (op) <= OP_IFNE))
+
+/* Either calling convention */
+#define OP_IS_FUNCTION(op)    ((op) == OP_FUNCTION || (op) == OP_LEAFFUNCTION)
+#define OP_IS_CALL(op)        ((op) == OP_CALL || (op) == OP_LEAFCALL)
+#define OP_IS_RETURN(op)      ((op) == OP_RETURN || (op) == OP_LEAFRETURN)
+
 
 /* Enumeration of all the memory segment keywords
  * NOTE: Enum positions / values are relevant to a string mapping in parser.c*/
@@ -64,11 +98,12 @@ typedef enum {
 
 typedef struct {
     operator_t op; // The operator keyword, pop, push, add, sub, ..., etc
+    uint32_t line; // Line of the source file the command was parsed from, 1 based
 
     // Defines the potential arugments ( if any )
     union {
         
-        // Defines arguments in terms of memory access, pop or push
+        // Defines arguments in terms of memory access, pop or push, and the constant of a multiply
         struct {
             memory_segment_t segment;
             uint16_t index;
@@ -80,6 +115,14 @@ typedef struct {
             char* label;
             uint16_t locals;
         } flow;
+
+        // Defines arguments in terms of a move, from the pushed location to the popped one
+        struct {
+            memory_segment_t from_segment;
+            uint16_t from_index;
+            memory_segment_t to_segment;
+            uint16_t to_index;
+        } move;
     } arguments;
 
 } command_t;
@@ -91,6 +134,8 @@ typedef struct {
     command_t* commands;
     size_t total_commands;
 
+    stack_arena_t* stack_arena; // What the commands and their labels were parsed onto, passes that add commands use it too
+
 } command_module_t;
 
 /* no functions currently, possibly some to come */
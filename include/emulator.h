@@ -0,0 +1,92 @@
+#ifndef EMULATOR_H
+#define EMULATOR_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Defines the structures and function interface for the Hack CPU Emulator Module.
+ * ROM words are decoded once, when a program is loaded, into compact micro-ops
+ * so the run loop never has to pick apart instruction bits */
+
+#define EMULATOR_ROM_SIZE    32768
+#define EMULATOR_RAM_SIZE    32768
+#define EMULATOR_ADDRESS_MASK 0x7FFF  /* The address bus is 15 bits wide */
+
+/* ALU operations a decoded instruction can perform. 0 is reserved so that
+ * the zero initialized entries of the decode table mean "invalid" */
+typedef enum {
+    ALU_INVALID = 0,
+    ALU_LOAD,           /* A-instruction, A=value */
+    ALU_HALT,           /* Fills the ROM past the end of the program */
+    ALU_0,
+    ALU_1,
+    ALU_NEG_1,
+    ALU_D,
+    ALU_A,
+    ALU_NOT_D,
+    ALU_NOT_A,
+    ALU_NEG_D,
+    ALU_NEG_A,
+    ALU_D_PLUS_1,
+    ALU_A_PLUS_1,
+    ALU_D_MINUS_1,
+    ALU_A_MINUS_1,
+    ALU_D_PLUS_A,
+    ALU_D_MINUS_A,
+    ALU_A_MINUS_D,
+    ALU_D_AND_A,
+    ALU_D_OR_A,
+    ALU_M,
+    ALU_NOT_M,
+    ALU_NEG_M,
+    ALU_M_PLUS_1,
+    ALU_M_MINUS_1,
+    ALU_D_PLUS_M,
+    ALU_D_MINUS_M,
+    ALU_M_MINUS_D,
+    ALU_D_AND_M,
+    ALU_D_OR_M,
+} alu_t;
+
+typedef enum {
+    EMULATOR_ERROR = -1,
+    EMULATOR_HALTED,        /* The program ran off the end of the ROM or entered a tight @X / 0;JMP loop */
+    EMULATOR_BUDGET,        /* The cycle budget ran out before the program halted */
+} emulator_status_t;
+
+/* A pre-decoded ROM word */
+typedef struct {
+    uint16_t value;         /* The constant loaded by an A-instruction */
+    uint8_t  alu;           /* alu_t operation */
+    uint8_t  control;       /* dest bits << 3 | jump bits, exactly as in the instruction word */
+} emulator_op_t;
+
+/* Masks for the control byte of an emulator_op_t */
+#define CONTROL_DEST_A 0x20
+#define CONTROL_DEST_D 0x10
+#define CONTROL_DEST_M 0x08
+#define CONTROL_JUMP   0x07
+
+typedef struct {
+    emulator_op_t* rom;
+    size_t         rom_size;        /* Number of instructions loaded */
+    uint16_t*      ram;
+
+    uint16_t       a;
+    uint16_t       d;
+    uint16_t       pc;
+
+    uint64_t       cycles;          /* Cycles executed since the last reset */
+} emulator_t;
+
+int32_t emulatorInitialize(emulator_t* emulator);
+void    emulatorDestroy(emulator_t* emulator);
+
+int32_t emulatorLoadHack(emulator_t* emulator, const char* text, size_t size);
+int32_t emulatorLoadAssembly(emulator_t* emulator, const char* text, size_t size);
+int32_t emulatorLoadFile(emulator_t* emulator, const char* filepath);
+
+void    emulatorReset(emulator_t* emulator);
+emulator_status_t emulatorRun(emulator_t* emulator, uint64_t budget);
+
+#endif
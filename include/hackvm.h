@@ -0,0 +1,36 @@
+#ifndef HACKVM_H
+#define HACKVM_H
+
+#include "stack_arena.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Defines the structure and function interface of libhackvm, the translator as
+ * a library. A hackvm_t owns everything a translation needs, so any number of
+ * them can translate at once, one per thread. VM text is taken from memory and
+ * the assembly is handed to a callback or written into a caller's buffer */
+
+#define HACKVM_API __attribute__((visibility("default")))
+
+/* Receives the assembly in pieces, in order
+ * Return 0 to carry on
+ * Return -1 to stop the translation */
+typedef int32_t (*hackvm_write_t)(void* user, const char* data, size_t size);
+
+typedef struct {
+    int32_t       level;            /* Optimization level, as Hack-VM -O */
+    stack_arena_t stack_arena;      /* Kept between translations so its pages stay warm,
+                                     * grown when a bigger source comes along */
+    const char*   error;            /* Why the last translation failed, static storage */
+} hackvm_t;
+
+HACKVM_API int32_t hackvmInitialize(hackvm_t* hackvm, int32_t level, size_t arena_size);
+HACKVM_API void    hackvmDestroy(hackvm_t* hackvm);
+
+HACKVM_API int32_t hackvmTranslate(hackvm_t* hackvm, const char* source, size_t size, const char* filename,
+                                   hackvm_write_t write, void* user);
+HACKVM_API int32_t hackvmTranslateBuffer(hackvm_t* hackvm, const char* source, size_t size, const char* filename,
+                                         char* buffer, size_t capacity, size_t* length);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "emulator.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Defines the structure and function interface for the JIT Module, a tier on top
+ * of the emulator that compiles basic blocks of decoded Hack instructions into
+ * x86-64 code. A and D live in host registers and RAM is the emulator's buffer,
+ * the emulator's interpreter finishes whatever the native code can't */
+
+typedef struct {
+    emulator_t* emulator;
+
+    uint8_t*    code;               /* mmap'd executable buffer */
+    size_t      code_size;
+    size_t      code_position;
+    size_t      exit_offset;        /* Where the shared exit stub starts */
+
+    uint32_t*   blocks;             /* Per ROM address, offset + 1 of the compiled block, 0 if not compiled */
+
+    size_t      total_blocks;       /* Statistics, blocks compiled and cache flushes */
+    size_t      total_flushes;
+} jit_t;
+
+int32_t jitInitialize(jit_t* jit, emulator_t* emulator, size_t code_size);
+void    jitDestroy(jit_t* jit);
+void    jitFlush(jit_t* jit);
+
+emulator_status_t jitRun(jit_t* jit, uint64_t budget);
+
+#endif
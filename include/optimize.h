@@ -0,0 +1,37 @@
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+
+#include "assembly_gen.h"
+#include "cfg.h"
+#include "command.h"
+#include "profile.h"
+
+#include <stdint.h>
+
+#define OPTIMIZE_LEVEL_SPEED 2          /* -O 2, the level 1 passes and the fastest expansions */
+#define OPTIMIZE_LEVEL_SIZE  3          /* -O s, the level 1 passes and the smallest expansions */
+
+#define OPTIMIZE_TAIL_CALL_ARGUMENTS 8  /* Most arguments a call can have and still become a tail call */
+#define OPTIMIZE_ENTRY_FUNCTION "main"  /* Called by the preamble, so it keeps the standard frame */
+
+/* Defines the function interface for the Optimize Module, the cfg_t passes run
+ * over a command module before assembly is generated. Every pass returns the
+ * number of changes it made, or -1 on failure */
+
+int32_t optimizeRemoveUnreachable(cfg_t* cfg, void* context);
+int32_t optimizeRemoveDeadLabels(cfg_t* cfg, void* context);
+int32_t optimizeThreadJumps(cfg_t* cfg, void* context);
+int32_t optimizeSimplifyBranches(cfg_t* cfg, void* context);
+int32_t optimizeFuseMoves(cfg_t* cfg, void* context);
+int32_t optimizeFuseCompares(cfg_t* cfg, void* context);
+int32_t optimizeStrengthReduce(cfg_t* cfg, void* context);
+int32_t optimizeTailCalls(cfg_t* cfg, void* context);
+int32_t optimizeLayoutBlocks(cfg_t* cfg, void* context);
+
+int32_t optimizeCommands(command_module_t* commands, int32_t level, const profile_t* profile, int32_t keep_calls);
+int32_t optimizeFoldFunctions(command_module_t** modules, size_t total_modules);
+int32_t optimizeLeafCalls(command_module_t** modules, size_t total_modules, int32_t level, const profile_t* const* profiles);
+int32_t optimizeParseLevel(const char* text);
+assembly_goal_t optimizeGoal(int32_t level);
+
+#endif
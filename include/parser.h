@@ -23,4 +23,8 @@ int32_t parserInitialize(parser_t* parser, const char* filepath);
 void parserDestroy(parser_t* parser);
 
 int32_t parserParseCommands(parser_t* parser, command_module_t* command_module, stack_arena_t* stack_arena);
+int32_t parserParseReachable(parser_t* parser, command_module_t* command_module, stack_arena_t* stack_arena,
+                             const char* entry_function);
+int32_t parserParseLine(stack_arena_t* stack_arena, char* line, command_t* command);
+int32_t parserFormatCommand(const command_t* command, char* buffer, size_t size);
 #endif
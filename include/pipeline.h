@@ -0,0 +1,66 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "assembly_gen.h"
+#include "command.h"
+#include "parser.h"
+#include "stack_arena.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Defines the structures and function interface for the Pipeline Module, which
+ * runs parsing, assembly generation and writing on three threads. Batches of
+ * commands and buffers of assembly are handed between the stages through bounded
+ * single producer / single consumer rings and handed back through a second ring
+ * once consumed, so nothing is allocated after start up */
+
+#define PIPELINE_BATCHES        8           /* Both powers of two, they size the rings */
+#define PIPELINE_BUFFERS        8
+#define PIPELINE_BATCH_COMMANDS 4096
+#define PIPELINE_BATCH_LABELS   (64 * 1024) /* Label bytes a batch can hold */
+#define PIPELINE_BUFFER_SIZE    (256 * 1024)
+
+/* Lock free ring of pointers, head and tail sit on their own cache lines so the
+ * producer and consumer don't fight over them */
+typedef struct {
+    void*                   slots[PIPELINE_BATCHES > PIPELINE_BUFFERS ? PIPELINE_BATCHES : PIPELINE_BUFFERS];
+    size_t                  capacity;
+    _Alignas(64) atomic_size_t head;        /* Next slot the consumer reads */
+    _Alignas(64) atomic_size_t tail;        /* Next slot the producer writes */
+} spsc_ring_t;
+
+/* Parser to generator, a batch with no commands ends the stream */
+typedef struct {
+    command_t     commands[PIPELINE_BATCH_COMMANDS];
+    size_t        total_commands;
+    stack_arena_t stack_arena;              /* Labels of the commands */
+} command_batch_t;
+
+/* Generator to writer, a buffer with no data ends the stream */
+typedef struct {
+    char*  data;
+    size_t size;
+} output_buffer_t;
+
+typedef struct {
+    parser_t*        parser;
+    assembly_gen_t*  assembly_gen;
+    const char*      filename;
+
+    command_batch_t* batches;
+    output_buffer_t  buffers[PIPELINE_BUFFERS];
+    stack_arena_t    stack_arena;           /* Backs the batches and buffers */
+
+    spsc_ring_t      full_batches;
+    spsc_ring_t      free_batches;
+    spsc_ring_t      full_buffers;
+    spsc_ring_t      free_buffers;
+
+    atomic_int       failed;                /* Set by any stage that fails, the others drain out */
+} pipeline_t;
+
+int32_t pipelineTranslate(parser_t* parser, assembly_gen_t* assembly_gen, const char* filename);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "stack_arena.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Defines the structure and function interface for the Profile Module, the execution
+ * counts Hack-Emu -e writes for a program, read back to guide its next translation.
+ * Counts are kept per source line, which every command carries through the optimizer:
+ *
+ *     # comment
+ *     file.vm:line<tab>count
+ *
+ * Commands the profile doesn't mention never ran. A command counts as hot once it
+ * ran at least hot_count times, a 1 / PROFILE_HOT_RATIO share of the hottest one.
+ * The counts live on the arena given, like the commands they describe */
+
+#define PROFILE_HOT_RATIO 64
+
+typedef struct {
+    uint64_t* counts;               /* Per line, indexed by the line number */
+    size_t    total_lines;
+    uint64_t  hottest;
+    uint64_t  hot_count;
+} profile_t;
+
+/* Executions of the command parsed from line */
+#define PROFILE_COUNT(profile, line) ((line) < (profile)->total_lines ? (profile)->counts[line] : 0)
+
+int32_t profileLoad(profile_t* profile, const char* filepath, const char* filename, stack_arena_t* stack_arena);
+
+#endif
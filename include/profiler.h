@@ -0,0 +1,82 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "assembly_gen.h"
+#include "command.h"
+#include "emulator.h"
+#include "jit.h"
+#include "stack_arena.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Defines the structures and function interface for the Profiler Module. The
+ * profiler runs a program on the emulator (or JIT) in slices of period cycles,
+ * every slice is charged to the VM command and function it started in, and to
+ * the call stack found by walking the saved LCL / return address chain */
+
+/* A translated file together with the ROM ranges assemblyGen recorded for it */
+typedef struct {
+    const char*       filename;
+    command_module_t* commands;
+    rom_range_t*      rom_ranges;
+} profiler_source_t;
+
+typedef struct {
+    const char* name;
+    uint64_t    cycles;         /* Self cycles */
+} profiler_function_t;
+
+/* A distinct call stack and the cycles spent in it */
+typedef struct {
+    uint32_t hash;
+    uint32_t depth;
+    size_t   frames;            /* Offset into the frame pool, leaf first */
+    uint64_t cycles;
+} profiler_stack_t;
+
+typedef struct {
+    emulator_t*          emulator;
+    jit_t*               jit;                   /* Optional, runs slices natively when set */
+
+    profiler_source_t*   sources;
+    size_t               total_sources;
+    size_t               total_commands;        /* Across all sources */
+
+    uint32_t*            address_commands;      /* Per ROM address, global command number + 1, 0 for runtime code */
+    uint32_t*            address_functions;     /* Per ROM address, function index, 0 is the runtime */
+    uint32_t*            call_targets;          /* Per global command, the function a call command calls */
+    uint64_t*            command_cycles;        /* Per global command */
+    uint64_t*            command_counts;        /* Per global command, samples taken at its first
+                                                 * instruction weighed like cycles, so exact at period 1 */
+
+    profiler_function_t* functions;
+    size_t               total_functions;
+    uint32_t             entry_function;
+
+    profiler_stack_t*    stacks;                /* Open addressing table */
+    size_t               stack_capacity;
+    size_t               total_stacks;
+    uint32_t*            frames;
+    size_t               frame_capacity;
+    size_t               total_frames;
+    uint64_t             dropped_cycles;        /* Cycles whose stack didn't fit in the tables */
+
+    uint64_t             period;
+    uint64_t             total_cycles;
+
+    stack_arena_t        stack_arena;
+} profiler_t;
+
+int32_t profilerInitialize(profiler_t* profiler, emulator_t* emulator, jit_t* jit, profiler_source_t* sources,
+                           size_t total_sources, const char* entry_function, uint64_t period);
+void    profilerDestroy(profiler_t* profiler);
+
+emulator_status_t profilerRun(profiler_t* profiler, uint64_t budget);
+
+int32_t profilerWriteFlat(profiler_t* profiler, FILE* output_file);
+int32_t profilerWriteCollapsed(profiler_t* profiler, FILE* output_file);
+int32_t profilerWriteCounts(profiler_t* profiler, FILE* output_file);
+
+#endif
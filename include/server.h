@@ -0,0 +1,84 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "hackvm.h"
+#include "stack_arena.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Defines the structures and function interface for the Server Module, which keeps
+ * a pool of worker threads with warm libhackvm contexts and serves translations
+ * without a process per file. Jobs come framed over a stream, stdin / stdout or the
+ * connections of a Unix domain socket:
+ *
+ *     request   uint32 length, length bytes of VM text
+ *     response  uint32 status, uint32 length, length bytes
+ *
+ * Numbers are little endian. Status 0 means the bytes are the assembly, otherwise
+ * they are the reason the translation failed. Responses come in request order */
+
+#define SERVER_MAX_REQUEST  (64 * 1024 * 1024)
+#define SERVER_OUTPUT_SIZE  (1024 * 1024)       /* Starting room for a response, grown as needed */
+#define SERVER_CONNECTIONS  64                  /* Accepted connections waiting for a worker */
+#define SERVER_ARENA_SIZE   (16 * 1024 * 1024)  /* Each worker's libhackvm arena, set aside at start up */
+
+#define SERVER_STATUS_OK     0
+#define SERVER_STATUS_FAILED 1
+
+/* A request and its response */
+typedef struct {
+    stack_arena_t input;                    /* Reserved for SERVER_MAX_REQUEST, only touched pages are backed */
+    size_t        input_size;
+    stack_arena_t output;
+    size_t        output_size;
+    const char*   error;                    /* NULL when output holds the assembly */
+    int32_t       done;
+} server_slot_t;
+
+struct server;
+
+typedef struct {
+    struct server* server;
+    size_t         index;
+    pthread_t      thread;
+    hackvm_t       hackvm;
+} server_worker_t;
+
+typedef struct server {
+    server_worker_t* workers;
+    size_t           total_workers;
+    server_slot_t*   slots;                 /* Stream mode cycles through all of them, socket mode
+                                             * gives each worker the one of its index */
+    size_t           total_slots;
+    stack_arena_t    stack_arena;           /* Backs the arrays above */
+
+    pthread_mutex_t  lock;
+    pthread_cond_t   changed;
+
+    /* Stream mode, slots are filled at tail, claimed at next and written out at head */
+    size_t           head;
+    size_t           next;
+    size_t           tail;
+    int32_t          end;                   /* No more requests are coming */
+    int              output_fd;
+    int32_t          failed;
+
+    /* Socket mode */
+    int              listen_fd;
+    int              connections[SERVER_CONNECTIONS];
+    size_t           connection_head;
+    size_t           connection_tail;
+    atomic_int       stopping;
+} server_t;
+
+int32_t serverInitialize(server_t* server, size_t total_workers, int32_t level);
+void    serverDestroy(server_t* server);
+
+int32_t serverServeStream(server_t* server, int input_fd, int output_fd);
+int32_t serverServeSocket(server_t* server, const char* path);
+void    serverStop(server_t* server);
+
+#endif
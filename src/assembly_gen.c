@@ -4,6 +4,7 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 
@@ -134,14 +135,167 @@ void createMneumonic(mneumonic_t* mneumonic, opcode_t opcode, char* label, comp_
     }
 }
 
+/* A 64 bit number is at most 13 base 36 digits, the file id at most 7 as it is 32 bits,
+ * 1 for the $, 1 for the period and 1 for \0 */
+#define LABEL_BYTES (1 + 7 + 1 + 13 + 1)
+
+/* Create the next generated label, $<file id>.<counter> with both in base 36.
+ * VM identifiers can't contain $, so these never clash with a program's own labels
+ * Return valid char* on success
+ * Return NULL on failure */
+static char* createLabel(assembly_gen_t* assembly_gen, stack_arena_t* stack_arena)
+{
+    static const char DIGITS[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+
+    char* label = stackArenaPush(stack_arena, LABEL_BYTES);
+    if (label == NULL) {
+        return NULL;
+    }
+
+    uint64_t numbers[2] = {assembly_gen->file_id, assembly_gen->label_counter++};
+    char* position = label;
+    *position++ = '$';
+
+    for (size_t index = 0; index < 2; index++) {
+        char digits[13];
+        size_t total_digits = 0;
+        uint64_t number = numbers[index];
+        do {
+            digits[total_digits++] = DIGITS[number % 36];
+            number /= 36;
+        } while (number != 0);
+
+        while (total_digits != 0) {
+            *position++ = digits[--total_digits];
+        }
+        *position++ = index == 0 ? '.' : '\0';
+    }
+
+    return label;
+}
+
+/* Outlining, see assemblyGenBeginOutline */
+#define OUTLINE_CAPACITY      (1 << 20)     /* Instructions a program can have kept back */
+#define OUTLINE_LABEL_BYTES   16            /* Room per instruction kept back for a copy of its label */
+#define OUTLINE_MIN_LENGTH    5             /* Shortest run a routine can pay for */
+#define OUTLINE_MAX_LENGTH    40
+#define OUTLINE_CALL_WORDS    4             /* @return, D=A, @routine, 0;JMP */
+#define OUTLINE_ROUTINE_WORDS 5             /* @R15, M=D ahead of the run and @R15, A=M, 0;JMP after */
+
+#define OUTLINE_HOT   0x01                  /* Generated for a command a profile found hot */
+#define OUTLINE_TAKEN 0x02                  /* In a run already outlined */
+#define OUTLINE_R15   0x04                  /* Uses R15 or runs while it holds a value, routines keep their return address there */
+
+typedef struct {
+    mneumonic_t mneumonic;
+    uint8_t     flags;
+} outline_instruction_t;
+
+/* Return 1 if the instructions fit in what is left of the room to hold them back, with
+ * 2 more for a jump and the labels assemblyGenEndOutline creates
+ * Return 0 otherwise */
+static int32_t outlineRoom(assembly_gen_t* assembly_gen, mneumonic_t* mneumonics, size_t total_mneumonics)
+{
+    size_t held = stackArenaPosition(&assembly_gen->outline_instructions) / sizeof(outline_instruction_t) + total_mneumonics + 2;
+
+    /* A routine and a return label at most for every shortest run */
+    size_t label_bytes = (2 * held / OUTLINE_MIN_LENGTH + 2) * LABEL_BYTES;
+    for (size_t index = 0; index < total_mneumonics; index++) {
+        if (mneumonics[index].opcode == OPCODE_A_SYMBOL || mneumonics[index].opcode == OPCODE_SYMBOL) {
+            label_bytes += strlen(mneumonics[index].variants.label) + 1;
+        }
+    }
+
+    return held <= OUTLINE_CAPACITY &&
+           stackArenaPosition(&assembly_gen->outline_labels) + label_bytes <= assembly_gen->outline_labels.size;
+}
+
+/* Keep instructions back for assemblyGenEndOutline. Their labels are copied, the
+ * arena they are on is reused for every command
+ * Return an empty string on stack_arena on success
+ * Return NULL on failure */
+static char* outlineKeep(assembly_gen_t* assembly_gen, mneumonic_t* mneumonics, size_t total_mneumonics, stack_arena_t* stack_arena)
+{
+    /* R15 only ever holds a value within the instructions of one command or routine */
+    size_t first_r15 = total_mneumonics, last_r15 = 0;
+    for (size_t index = 0; index < total_mneumonics; index++) {
+        if ((mneumonics[index].opcode == OPCODE_A_SYMBOL && strcmp(mneumonics[index].variants.label, "R15") == 0) ||
+            (mneumonics[index].opcode == OPCODE_A_NUMBER && mneumonics[index].variants.number == 15)) {
+            first_r15 = first_r15 < index ? first_r15 : index;
+            last_r15 = index;
+        }
+    }
+
+    for (size_t index = 0; index < total_mneumonics; index++) {
+        outline_instruction_t* instruction = stackArenaPush(&assembly_gen->outline_instructions, sizeof(outline_instruction_t));
+        if (instruction == NULL) {
+            return NULL;
+        }
+        instruction->mneumonic = mneumonics[index];
+        instruction->flags = assembly_gen->goal == ASSEMBLY_GOAL_SPEED ? OUTLINE_HOT : 0;
+        if (index >= first_r15 && index <= last_r15) {
+            instruction->flags |= OUTLINE_R15;
+        }
+
+        opcode_t opcode = mneumonics[index].opcode;
+        if (opcode == OPCODE_A_SYMBOL || opcode == OPCODE_SYMBOL) {
+            size_t length = strlen(mneumonics[index].variants.label) + 1;
+            char* label = stackArenaPush(&assembly_gen->outline_labels, length);
+            if (label == NULL) {
+                return NULL;
+            }
+            memcpy(label, mneumonics[index].variants.label, length);
+            instruction->mneumonic.variants.label = label;
+        }
+
+        if (opcode != OPCODE_SYMBOL) {
+            assembly_gen->rom_address++;
+        }
+    }
+
+    char* empty = stackArenaPush(stack_arena, 1);
+    if (empty != NULL) {
+        *empty = '\0';
+    }
+    return empty;
+}
+
 /* Generate an assembly string from an array of mneumonic structures,
- * the string returned will be null terminated and allocated on stack_arena
+ * the string returned will be null terminated and allocated on stack_arena.
+ * The ROM address of assembly_gen is advanced past every real instruction
  * Return NULL on failure
  * Return valid char* on success */
-char* generateMneumonics(mneumonic_t* mneumonics, size_t total_mneumonics, stack_arena_t* stack_arena)
+char* generateMneumonics(assembly_gen_t* assembly_gen, mneumonic_t* mneumonics, size_t total_mneumonics, stack_arena_t* stack_arena)
 {
     char* final_string = NULL;
 
+    /* While outlining nothing is written until the whole program is in. A program too
+     * big to hold has what is held written out, with a jump over the routines that
+     * follow it, and the rest generated without outlining */
+    if (assembly_gen->outlining) {
+        if (outlineRoom(assembly_gen, mneumonics, total_mneumonics)) {
+            return outlineKeep(assembly_gen, mneumonics, total_mneumonics, stack_arena);
+        }
+
+        mneumonic_t resume[3];
+        char* resume_label = createLabel(assembly_gen, stack_arena);
+        if (resume_label == NULL) {
+            return NULL;
+        }
+        createMneumonic(&resume[0], OPCODE_A_SYMBOL, resume_label, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);              // @resume
+        createMneumonic(&resume[1], OPCODE_JUMP, NULL, COMP_0, DEST_UNKNOWN, JUMP_JMP, 0);                                     // 0;JMP
+        createMneumonic(&resume[2], OPCODE_SYMBOL, resume_label, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);                // (resume)
+        if (outlineKeep(assembly_gen, resume, 2, stack_arena) == NULL || assemblyGenEndOutline(assembly_gen) < 0) {
+            return NULL;
+        }
+
+        char* label_string = generateMneumonics(assembly_gen, &resume[2], 1, stack_arena);
+        if (label_string == NULL ||
+            fwrite(label_string, 1, strlen(label_string), assembly_gen->output_file) < strlen(label_string)) {
+            return NULL;
+        }
+    }
+
     for (size_t index = 0; index < total_mneumonics; index++) {
 
         ssize_t bytes_written = 0;
@@ -189,7 +343,7 @@ char* generateMneumonics(mneumonic_t* mneumonics, size_t total_mneumonics, stack
              * if the length of the label is greater than there is room for.
              * 5 is used because the buffer is by default 9, -2 for the '()',
              * and -1 for the \n, -1 for '\0' */
-            if (strlen(mneumonics[index].variants.label) > 6 && 
+            if (strlen(mneumonics[index].variants.label) > 5 && 
                 stackArenaPush(stack_arena, strlen(mneumonics[index].variants.label) - 5) == NULL) {
                 return NULL;
             }
@@ -203,6 +357,11 @@ char* generateMneumonics(mneumonic_t* mneumonics, size_t total_mneumonics, stack
         }
 
 
+        /* Labels don't take up ROM */
+        if (mneumonics[index].opcode != OPCODE_SYMBOL) {
+            assembly_gen->rom_address++;
+        }
+
         /* strip the null terminator off */
         stackArenaPop(stack_arena, 1);
 
@@ -227,6 +386,120 @@ char* generateMneumonics(mneumonic_t* mneumonics, size_t total_mneumonics, stack
 }
 
 
+/* The cost model, for commands with more than one expansion. An expansion costs ROM
+ * words every time it is generated and cycles every time it runs. A shared routine
+ * costs its call site plus a run of the routine, the routine's own words are paid
+ * once in the preamble. Straight line code takes a cycle per word, and the cycles
+ * of a branch are those of its longer path */
+typedef struct {
+    uint32_t instructions;
+    uint32_t cycles;
+} cost_t;
+
+/* lt / gt / eq, through preable_true / preable_false, inline, or through a routine of their own.
+ * The _ONCE words are what the preamble carries for each */
+enum { COMPARE_SHARED, COMPARE_INLINE, COMPARE_ROUTINE };
+static const cost_t COMPARE_COSTS[] = {{14, 25}, {12, 12}, {3, 20}};
+static const uint32_t COMPARE_ONCE[] = {15, 0, 51};
+
+/* call and return, inline or through preamble_call / preamble_return */
+enum { FRAME_INLINE, FRAME_ROUTINE };
+static const cost_t CALL_COSTS[] = {{23, 23}, {11, 35}};
+static const uint32_t CALL_ONCE[] = {0, 26};
+static const cost_t RETURN_COSTS[] = {{38, 38}, {2, 40}};
+static const uint32_t RETURN_ONCE[] = {0, 38};
+
+/* Return 1 if a is the better of two expansions for the goal of assembly_gen */
+static int32_t costBetter(const assembly_gen_t* assembly_gen, cost_t a, cost_t b)
+{
+    if (assembly_gen->goal == ASSEMBLY_GOAL_SIZE) {
+        return a.instructions < b.instructions || (a.instructions == b.instructions && a.cycles < b.cycles);
+    }
+    return a.cycles < b.cycles || (a.cycles == b.cycles && a.instructions < b.instructions);
+}
+
+/* Pick between expansions, ties go to the earlier one and the default goal always takes the first
+ * Return the index of the expansion picked */
+static size_t costPick(const assembly_gen_t* assembly_gen, const cost_t* costs, size_t total_costs)
+{
+    size_t best = 0;
+    if (assembly_gen->goal == ASSEMBLY_GOAL_DEFAULT) {
+        return best;
+    }
+
+    for (size_t index = 1; index < total_costs; index++) {
+        if (costBetter(assembly_gen, costs[index], costs[best])) {
+            best = index;
+        }
+    }
+    return best;
+}
+
+/* Pick between expansions for every one of uses commands, where each also costs
+ * once words, as for costPick
+ * Return the index of the expansion picked */
+static size_t costPlan(const assembly_gen_t* assembly_gen, const cost_t* costs, const uint32_t* once, size_t total_costs, size_t uses)
+{
+    cost_t totals[3];
+    assert(total_costs <= 3);
+
+    for (size_t index = 0; index < total_costs; index++) {
+        totals[index].instructions = (uint32_t) uses * costs[index].instructions + once[index];
+        totals[index].cycles = (uint32_t) uses * costs[index].cycles;
+    }
+    return costPick(assembly_gen, totals, total_costs);
+}
+
+/* Step A from the base address in M up to base + index with A=M+1 and A=A+1, which
+ * leaves D alone. index is at least 1
+ * Return the number of instructions written */
+static size_t stepAddress(mneumonic_t* instructions, uint16_t index)
+{
+    size_t total = 0;
+
+    createMneumonic(&instructions[total++], OPCODE_COMPUTE, NULL, COMP_M_PLUS_1, DEST_A, JUMP_UNKNOWN, 0);              // A=M+1
+    for (uint16_t step = 1; step < index; step++) {
+        createMneumonic(&instructions[total++], OPCODE_COMPUTE, NULL, COMP_A_PLUS_1, DEST_A, JUMP_UNKNOWN, 0);          // A=A+1
+    }
+    return total;
+}
+
+/* Symbol holding the base address of the argument, local, this and that segments
+ * Return NULL for the other segments */
+static char* segmentBaseSymbol(memory_segment_t segment)
+{
+    switch (segment) {
+        case SEG_ARGUMENT: return "ARG";
+        case SEG_LOCAL:    return "LCL";
+        case SEG_THIS:     return "THIS";
+        case SEG_THAT:     return "THAT";
+        default:           return NULL;
+    }
+}
+
+/* Fixed address of a pointer, temp or static location, statics are counted for the file
+ * Return 0 for the other segments, or a static past the end of the static segment */
+static uint16_t segmentFixedAddress(assembly_gen_t* assembly_gen, memory_segment_t segment, uint16_t index)
+{
+    switch (segment) {
+        case SEG_POINTER:
+            return index == 0 ? 3 : 4;
+        case SEG_TEMP:
+            /* 5 is the start of the temp segment in memory */
+            return 5 + index;
+        case SEG_STATIC:
+            if (ASSEMBLY_STATIC_START + assembly_gen->static_variable_base + index >= ASSEMBLY_STATIC_END) {
+                return 0;
+            }
+            if (index >= assembly_gen->total_static_variables) {
+                 assembly_gen->total_static_variables = index + 1u;
+            }
+            return ASSEMBLY_STATIC_START + index + assembly_gen->static_variable_base;
+        default:
+            return 0;
+    }
+}
+
 /* Initialize the Assembly Gen module by opening an output file
  * Return -1 - failed to open file
  * Return 0  - Success */
@@ -244,20 +517,287 @@ int32_t assemblyGenInitialize(assembly_gen_t* assembly_gen, const char* filepath
     return 0;
 }
 
+/* Initialize the Assembly Gen module around an already open stream, such as
+ * one from open_memstream, it is closed by assemblyGenDestroy
+ * Return 0  - Success */
+int32_t assemblyGenInitializeStream(assembly_gen_t* assembly_gen, FILE* output_file)
+{
+    assert(output_file != NULL && assembly_gen != NULL);
+
+    memset(assembly_gen, 0, sizeof(assembly_gen_t));
+    assembly_gen->output_file = output_file;
+
+    return 0;
+}
+
+/* Memory.peek(address), the value at address replaces it */
+static size_t intrinsicPeek(mneumonic_t* instructions, char* label)
+{
+    size_t total = 0;
+    createMneumonic(&instructions[total++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);       // @SP
+    createMneumonic(&instructions[total++], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                    // A=M
+    createMneumonic(&instructions[total++], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                    // A=M
+    createMneumonic(&instructions[total++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                    // D=M
+    createMneumonic(&instructions[total++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);       // @SP
+    createMneumonic(&instructions[total++], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                    // A=M
+    createMneumonic(&instructions[total++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                    // M=D
+    return total;
+}
+
+/* Memory.poke(address, value), stores value and leaves the 0 a void function returns */
+static size_t intrinsicPoke(mneumonic_t* instructions, char* label)
+{
+    size_t total = 0;
+    createMneumonic(&instructions[total++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);       // @SP
+    createMneumonic(&instructions[total++], OPCODE_COMPUTE, NULL, COMP_M_MINUS_1, DEST_AM, JUMP_UNKNOWN, 0);           // AM=M-1
+    createMneumonic(&instructions[total++], OPCODE_COMPUTE, NULL, COMP_A_PLUS_1, DEST_A, JUMP_UNKNOWN, 0);             // A=A+1
+    createMneumonic(&instructions[total++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                    // D=M
+    createMneumonic(&instructions[total++], OPCODE_COMPUTE, NULL, COMP_A_MINUS_1, DEST_A, JUMP_UNKNOWN, 0);            // A=A-1
+    createMneumonic(&instructions[total++], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                    // A=M
+    createMneumonic(&instructions[total++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                    // M=D
+    createMneumonic(&instructions[total++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);       // @SP
+    createMneumonic(&instructions[total++], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                    // A=M
+    createMneumonic(&instructions[total++], OPCODE_COMPUTE, NULL, COMP_0, DEST_M, JUMP_UNKNOWN, 0);                    // M=0
+    return total;
+}
+
+/* Math.abs(x), negated unless it is at least 0 */
+static size_t intrinsicAbs(mneumonic_t* instructions, char* label)
+{
+    size_t total = 0;
+    createMneumonic(&instructions[total++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);       // @SP
+    createMneumonic(&instructions[total++], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                    // A=M
+    createMneumonic(&instructions[total++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                    // D=M
+    createMneumonic(&instructions[total++], OPCODE_A_SYMBOL, label, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);      // @$file.counter
+    createMneumonic(&instructions[total++], OPCODE_JUMP, NULL, COMP_D, DEST_UNKNOWN, JUMP_JGE, 0);                     // D;JGE
+    createMneumonic(&instructions[total++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);       // @SP
+    createMneumonic(&instructions[total++], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                    // A=M
+    createMneumonic(&instructions[total++], OPCODE_COMPUTE, NULL, COMP_NEG_D, DEST_M, JUMP_UNKNOWN, 0);                // M=-D
+    createMneumonic(&instructions[total++], OPCODE_SYMBOL, label, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);        // ($file.counter)
+    return total;
+}
+
+/* Math.min(a, b) and Math.max(a, b), a stays unless a - b jumps, otherwise taking
+ * a - b away from it leaves b. Like lt and gt the difference can overflow */
+static size_t intrinsicPick(mneumonic_t* instructions, char* label, jump_t keep)
+{
+    size_t total = 0;
+    createMneumonic(&instructions[total++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);       // @SP
+    createMneumonic(&instructions[total++], OPCODE_COMPUTE, NULL, COMP_M_MINUS_1, DEST_AM, JUMP_UNKNOWN, 0);           // AM=M-1
+    createMneumonic(&instructions[total++], OPCODE_COMPUTE, NULL, COMP_A_PLUS_1, DEST_A, JUMP_UNKNOWN, 0);             // A=A+1
+    createMneumonic(&instructions[total++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                    // D=M
+    createMneumonic(&instructions[total++], OPCODE_COMPUTE, NULL, COMP_A_MINUS_1, DEST_A, JUMP_UNKNOWN, 0);            // A=A-1
+    createMneumonic(&instructions[total++], OPCODE_COMPUTE, NULL, COMP_M_MINUS_D, DEST_D, JUMP_UNKNOWN, 0);            // D=M-D
+    createMneumonic(&instructions[total++], OPCODE_A_SYMBOL, label, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);      // @$file.counter
+    createMneumonic(&instructions[total++], OPCODE_JUMP, NULL, COMP_D, DEST_UNKNOWN, keep, 0);                         // D;JLE or D;JGE
+    createMneumonic(&instructions[total++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);       // @SP
+    createMneumonic(&instructions[total++], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                    // A=M
+    createMneumonic(&instructions[total++], OPCODE_COMPUTE, NULL, COMP_M_MINUS_D, DEST_M, JUMP_UNKNOWN, 0);            // M=M-D
+    createMneumonic(&instructions[total++], OPCODE_SYMBOL, label, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);        // ($file.counter)
+    return total;
+}
+
+static size_t intrinsicMin(mneumonic_t* instructions, char* label)
+{
+    return intrinsicPick(instructions, label, JUMP_JLE);
+}
+
+static size_t intrinsicMax(mneumonic_t* instructions, char* label)
+{
+    return intrinsicPick(instructions, label, JUMP_JGE);
+}
+
+/* OS routines whose calls are expanded in place, leaving the stack as their call and
+ * return would. Each takes at most INTRINSIC_INSTRUCTIONS words, less than a call
+ * through preamble_call, so they pay for every goal. Calls that name one with another
+ * number of arguments are left alone */
+#define INTRINSIC_INSTRUCTIONS 12
+
+typedef struct {
+    const char* name;
+    uint16_t    arguments;
+    size_t      (*expand)(mneumonic_t* instructions, char* label);
+} intrinsic_t;
+
+static const intrinsic_t INTRINSICS[] = {
+    {"Memory.peek", 1, intrinsicPeek},
+    {"Memory.poke", 2, intrinsicPoke},
+    {"Math.abs",    1, intrinsicAbs},
+    {"Math.min",    2, intrinsicMin},
+    {"Math.max",    2, intrinsicMax},
+};
+
+/* Return the intrinsic a call is expanded to,
+ * Return NULL if it stays a call */
+static const intrinsic_t* findIntrinsic(const assembly_gen_t* assembly_gen, const command_t* command)
+{
+    if (assembly_gen->goal == ASSEMBLY_GOAL_DEFAULT || assembly_gen->keep_calls ||
+        (command->op != OP_CALL && command->op != OP_LEAFCALL)) {
+        return NULL;
+    }
+
+    for (size_t index = 0; index < sizeof(INTRINSICS) / sizeof(INTRINSICS[0]); index++) {
+        if (INTRINSICS[index].arguments == command->arguments.flow.locals &&
+            strcmp(INTRINSICS[index].name, command->arguments.flow.label) == 0) {
+            return &INTRINSICS[index];
+        }
+    }
+    return NULL;
+}
+
+/* Translate a call to an intrinsic in place
+ * Return valid null terminated char* on success,
+ * Return NULL otherwise  */
+static char* translateIntrinsic(assembly_gen_t* assembly_gen, stack_arena_t* stack_arena, const intrinsic_t* intrinsic)
+{
+    mneumonic_t* instructions = stackArenaPush(stack_arena, INTRINSIC_INSTRUCTIONS * sizeof(mneumonic_t));
+    char* label = createLabel(assembly_gen, stack_arena);
+    if (instructions == NULL || label == NULL) {
+        return NULL;
+    }
+
+    return generateMneumonics(assembly_gen, instructions, intrinsic->expand(instructions, label), stack_arena);
+}
+
+/* Return 1 if the profile has command running often enough to take the fastest expansions */
+static int32_t commandHot(const assembly_gen_t* assembly_gen, const command_t* command)
+{
+    return assembly_gen->profile != NULL && PROFILE_COUNT(assembly_gen->profile, command->line) >= assembly_gen->hot_count;
+}
+
+/* Return 1 if the profile has the preamble's call to the entry function, which runs once, hot */
+static int32_t entryHot(const assembly_gen_t* assembly_gen)
+{
+    return assembly_gen->profile != NULL && assembly_gen->hot_count <= 1;
+}
+
+/* Set what the cost model weighs, before the preamble. commands is the whole program,
+ * counted to decide whether comparisons, calls and returns go through routines in the
+ * preamble, which only pays for size when enough of them share it.
+ * With a profile the goal picks which commands are hot instead, for speed any that
+ * ran and for size the hottest. Hot commands take the fastest expansions and the rest
+ * the smallest, planned over the cold commands alone. The default goal ignores it */
+void assemblyGenSetGoal(assembly_gen_t* assembly_gen, assembly_goal_t goal, const command_module_t* commands,
+                        const profile_t* profile)
+{
+    assert(assembly_gen != NULL && commands != NULL);
+
+    assembly_gen->goal = goal;
+    assembly_gen->profile = goal != ASSEMBLY_GOAL_DEFAULT ? profile : NULL;
+    if (assembly_gen->profile != NULL) {
+        assembly_gen->hot_count = goal == ASSEMBLY_GOAL_SPEED ? 1 : profile->hot_count;
+        assembly_gen->goal = ASSEMBLY_GOAL_SIZE;
+    }
+
+    /* The preamble calls the entry function, once */
+    size_t compares = 0, calls = !entryHot(assembly_gen), returns = 0;
+    for (size_t index = 0; index < commands->total_commands; index++) {
+        if (commandHot(assembly_gen, &commands->commands[index])) {
+            continue;
+        }
+        compares += commands->commands[index].op == OP_LT || commands->commands[index].op == OP_GT ||
+                    commands->commands[index].op == OP_EQ;
+        calls += commands->commands[index].op == OP_CALL && findIntrinsic(assembly_gen, &commands->commands[index]) == NULL;
+        returns += commands->commands[index].op == OP_RETURN;
+    }
+
+    assembly_gen->compare_expansion = costPlan(assembly_gen, COMPARE_COSTS, COMPARE_ONCE, 3, compares);
+    assembly_gen->call_expansion = costPlan(assembly_gen, CALL_COSTS, CALL_ONCE, 2, calls);
+    assembly_gen->return_expansion = costPlan(assembly_gen, RETURN_COSTS, RETURN_ONCE, 2, returns);
+}
+
+/* Open a source map file, from then on a line is written to it for every
+ * translated command: file, line, function and its ROM range [start, end)
+ * Return -1 - failed to open file
+ * Return 0  - Success */
+int32_t assemblyGenOpenMap(assembly_gen_t* assembly_gen, const char* filepath)
+{
+    assert(filepath != NULL && assembly_gen != NULL && assembly_gen->map_file == NULL);
+
+    assembly_gen->map_file = fopen(filepath, "w");
+    if (assembly_gen->map_file == NULL) {
+        return -1;
+    }
+
+    if (fprintf(assembly_gen->map_file, "# file\tline\tfunction\trom_start\trom_end\n") < 0) {
+        fclose(assembly_gen->map_file);
+        assembly_gen->map_file = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Open a label table file, from then on it gets a line mapping every file id
+ * used in generated labels back to the file's name
+ * Return -1 - failed to open file
+ * Return 0  - Success */
+int32_t assemblyGenOpenLabelTable(assembly_gen_t* assembly_gen, const char* filepath)
+{
+    assert(filepath != NULL && assembly_gen != NULL && assembly_gen->label_file == NULL);
+
+    assembly_gen->label_file = fopen(filepath, "w");
+    if (assembly_gen->label_file == NULL) {
+        return -1;
+    }
+
+    if (fprintf(assembly_gen->label_file, "# id\tfile\n") < 0) {
+        fclose(assembly_gen->label_file);
+        assembly_gen->label_file = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
 /* Destroys an assebmly gen instance */
 void assemblyGenDestroy(assembly_gen_t* assembly_gen)
 {
     assert(assembly_gen != NULL && assembly_gen->output_file != NULL);
 
     fclose(assembly_gen->output_file);
+    if (assembly_gen->map_file != NULL) {
+        fclose(assembly_gen->map_file);
+    }
+    if (assembly_gen->label_file != NULL) {
+        fclose(assembly_gen->label_file);
+    }
+    if (assembly_gen->outline_instructions.memory != NULL) {
+        stackArenaRelease(&assembly_gen->outline_instructions);
+        stackArenaRelease(&assembly_gen->outline_labels);
+    }
 
     memset(assembly_gen, 0, sizeof(assembly_gen_t));
 }
 
+/* Fill in the comparison of the top two stack values, which leaves true or false in their
+ * place without touching R13, so it serves both inline and in a routine
+ * Return the number of instructions written, always 13 */
+static size_t compareInstructions(mneumonic_t* instructions, char* label, jump_t jump)
+{
+    size_t instructions_index = 0;
+
+    createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);   // @SP
+    createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                // A=M
+    createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                // D=M
+    createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);   // @SP
+    createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M_MINUS_1, DEST_AM, JUMP_UNKNOWN, 0);       // AM=M-1
+    createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M_MINUS_D, DEST_D, JUMP_UNKNOWN, 0);        // D=M-D
+    createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_NEG_1, DEST_M, JUMP_UNKNOWN, 0);            // M=-1
+    createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, label, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);  // @label
+    createMneumonic(&instructions[instructions_index++], OPCODE_JUMP, NULL, COMP_D, DEST_UNKNOWN, jump, 0);                     // D;Jxx
+    createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);   // @SP
+    createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                // A=M
+    createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_0, DEST_M, JUMP_UNKNOWN, 0);                // M=0
+    createMneumonic(&instructions[instructions_index++], OPCODE_SYMBOL, label, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);    // (label)
+
+    return instructions_index;
+}
+
 /* Translate a logical VM command into assembly
  * return valid char* on success,
  * return NULL on failure */
-char* translateLogicalCommand(stack_arena_t* stack_arena, command_t* command, const char* filename)
+char* translateLogicalCommand(assembly_gen_t* assembly_gen, stack_arena_t* stack_arena, command_t* command)
 {
     /* All logical commands are uninary operators
      * They take 2 items off the stack, perform an operation on them
@@ -274,13 +814,6 @@ char* translateLogicalCommand(stack_arena_t* stack_arena, command_t* command, co
      * M=#OPERATION Perform the operation on the data
      */
 
-    /* This variable is used to count the instructions overall, it is needed to create labels
-     * to jump back to for conditional operations */
-    static uint16_t instruction_counter = 0;
-    if (instruction_counter == UINT16_MAX) {
-        return NULL;
-    }
-    
     mneumonic_t* instructions = NULL;
     size_t total_instructions = 0;
 
@@ -308,6 +841,35 @@ char* translateLogicalCommand(stack_arena_t* stack_arena, command_t* command, co
     }
     
     /* These operations all use one number and branching jumps */
+    else if ((command->op == OP_LT || command->op == OP_GT || command->op == OP_EQ) &&
+             assembly_gen->compare_expansion != COMPARE_SHARED) {
+        /* Inline the comparison, or call the routine of its own with the return address in D */
+        static char* const ROUTINES[] = {"preamble_eq", "preamble_gt", "preamble_lt"};
+        static const jump_t COMPARE_JUMPS[] = {JUMP_JEQ, JUMP_JGT, JUMP_JLT};
+        size_t which = command->op == OP_EQ ? 0 : (command->op == OP_GT ? 1 : 2);
+
+        instructions = stackArenaPush(stack_arena, 13 * sizeof(mneumonic_t));
+        if (instructions == NULL) {
+            return NULL;
+        }
+
+        char* label_str = createLabel(assembly_gen, stack_arena);
+        if (label_str == NULL) {
+            return NULL;
+        }
+
+        if (assembly_gen->compare_expansion == COMPARE_INLINE) {
+            total_instructions = compareInstructions(instructions, label_str, COMPARE_JUMPS[which]);
+        }
+        else {
+            createMneumonic(&instructions[total_instructions++], OPCODE_A_SYMBOL, label_str, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);      // @$file.counter
+            createMneumonic(&instructions[total_instructions++], OPCODE_COMPUTE, NULL, COMP_A, DEST_D, JUMP_UNKNOWN, 0);                        // D=A
+            createMneumonic(&instructions[total_instructions++], OPCODE_A_SYMBOL, ROUTINES[which], COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0); // @preamble_xx
+            createMneumonic(&instructions[total_instructions++], OPCODE_JUMP, NULL, COMP_0, DEST_UNKNOWN, JUMP_JMP, 0);                         // 0;JMP
+            createMneumonic(&instructions[total_instructions++], OPCODE_SYMBOL, label_str, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);        // ($file.counter)
+        }
+    }
+
     else if (command->op == OP_LT || command->op == OP_GT || command->op == OP_EQ) {
         /* Comparison operations will call to a predefined label called preable_true and preable_false
          * at these labels will be instructions to set the value at the top of the stack to true and false
@@ -319,25 +881,24 @@ char* translateLogicalCommand(stack_arena_t* stack_arena, command_t* command, co
         }
         total_instructions = 15;
 
-        /* Create a temp string to hold the unique label for this operation, 9 is chosen to add on because
-         * 1 for \0, 4 or the '.op.' part, and 4 for the operation number, which will be in hex */
-        char* label_str = stackArenaPush(stack_arena, strlen(filename) + 9);
+        /* Unique label to jump back to after the comparison */
+        char* label_str = createLabel(assembly_gen, stack_arena);
         if (label_str == NULL) {
             return NULL;
         }
-        sprintf(label_str, "%s.op.%x", filename, instruction_counter++);
         
-        createMneumonic(&instructions[6], OPCODE_A_SYMBOL, label_str, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);        // @FILENAME.op.operation_number
-        createMneumonic(&instructions[7], OPCODE_COMPUTE, NULL, COMP_A, DEST_D, JUMP_UNKNOWN, 0);                          // D=A
-        createMneumonic(&instructions[8], OPCODE_A_SYMBOL, "R13", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);            // @R13
-        createMneumonic(&instructions[9], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                          // M=D
-        createMneumonic(&instructions[0], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);             // @SP
-        createMneumonic(&instructions[1], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                          // A=M
-        createMneumonic(&instructions[2], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                          // D=M
-        createMneumonic(&instructions[3], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);             // @SP
-        createMneumonic(&instructions[4], OPCODE_COMPUTE, NULL, COMP_M_MINUS_1, DEST_AM, JUMP_UNKNOWN, 0);                 // AM=M-1
-        createMneumonic(&instructions[5], OPCODE_COMPUTE, NULL, COMP_D_MINUS_M, DEST_MD, JUMP_UNKNOWN, 0);                 // MD=D-M
-        createMneumonic(&instructions[10], OPCODE_A_SYMBOL, "PREABLE_TRUE", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);  // @PREABLE_TRUE
+        /* The return address has to be stored before the difference is computed, because it goes through D */
+        createMneumonic(&instructions[0], OPCODE_A_SYMBOL, label_str, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);        // @$file.counter
+        createMneumonic(&instructions[1], OPCODE_COMPUTE, NULL, COMP_A, DEST_D, JUMP_UNKNOWN, 0);                          // D=A
+        createMneumonic(&instructions[2], OPCODE_A_SYMBOL, "R13", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);            // @R13
+        createMneumonic(&instructions[3], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                          // M=D
+        createMneumonic(&instructions[4], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);             // @SP
+        createMneumonic(&instructions[5], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                          // A=M
+        createMneumonic(&instructions[6], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                          // D=M
+        createMneumonic(&instructions[7], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);             // @SP
+        createMneumonic(&instructions[8], OPCODE_COMPUTE, NULL, COMP_M_MINUS_1, DEST_AM, JUMP_UNKNOWN, 0);                 // AM=M-1
+        createMneumonic(&instructions[9], OPCODE_COMPUTE, NULL, COMP_M_MINUS_D, DEST_MD, JUMP_UNKNOWN, 0);                 // MD=M-D
+        createMneumonic(&instructions[10], OPCODE_A_SYMBOL, "preable_true", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);  // @preable_true
 
         switch (command->op) {
             case OP_LT:
@@ -354,9 +915,9 @@ char* translateLogicalCommand(stack_arena_t* stack_arena, command_t* command, co
                 return NULL;
         }
 
-        createMneumonic(&instructions[12], OPCODE_A_SYMBOL, "PREABLE_FALSE", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);  // @PREABLE_FALSE
+        createMneumonic(&instructions[12], OPCODE_A_SYMBOL, "preable_false", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);  // @preable_false
         createMneumonic(&instructions[13], OPCODE_JUMP, NULL, COMP_0, DEST_UNKNOWN, JUMP_JMP, 0);                           // 0;JMP
-        createMneumonic(&instructions[14], OPCODE_SYMBOL, label_str, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);          // FILENAME.op.operation_number:
+        createMneumonic(&instructions[14], OPCODE_SYMBOL, label_str, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);          // ($file.counter)
 
     }
 
@@ -379,7 +940,7 @@ char* translateLogicalCommand(stack_arena_t* stack_arena, command_t* command, co
                 createMneumonic(&instructions[5], OPCODE_COMPUTE, NULL, COMP_D_PLUS_M, DEST_M, JUMP_UNKNOWN, 0);  // M=D+M
                 break;
             case OP_SUB:
-                createMneumonic(&instructions[5], OPCODE_COMPUTE, NULL, COMP_D_MINUS_M, DEST_M, JUMP_UNKNOWN, 0); // M=D-M
+                createMneumonic(&instructions[5], OPCODE_COMPUTE, NULL, COMP_M_MINUS_D, DEST_M, JUMP_UNKNOWN, 0); // M=M-D
                 break;
             case OP_AND:
                 createMneumonic(&instructions[5], OPCODE_COMPUTE, NULL, COMP_D_AND_M, DEST_M, JUMP_UNKNOWN, 0);   // M=D&M
@@ -392,10 +953,10 @@ char* translateLogicalCommand(stack_arena_t* stack_arena, command_t* command, co
         }
     }
 
-    return generateMneumonics(instructions, total_instructions, stack_arena);
+    return generateMneumonics(assembly_gen, instructions, total_instructions, stack_arena);
 }
 
-char* translateFlowCommand(stack_arena_t* stack_arena, command_t* command, const char* filename, uint16_t call_counter)
+char* translateFlowCommand(assembly_gen_t* assembly_gen, stack_arena_t* stack_arena, command_t* command)
 {
     size_t instructions_index = 0;
     mneumonic_t* instructions = NULL;
@@ -413,14 +974,44 @@ char* translateFlowCommand(stack_arena_t* stack_arena, command_t* command, const
                 COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);                                                                           // (label)
     }
 
+    else if (command->op == OP_CALL && assembly_gen->call_expansion == FRAME_ROUTINE) {
+        /* preamble_call builds the frame, given the arguments in R13, the function in R14
+         * and the return address in D */
+        char* return_label = createLabel(assembly_gen, stack_arena);
+        if (return_label == NULL) {
+            return NULL;
+        }
+
+        /* 12 instructions are needed for this operation */
+        instructions = stackArenaPush(stack_arena, 13 * sizeof(mneumonic_t));
+        if (instructions == NULL) {
+            return NULL;
+        }
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_NUMBER, NULL, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN,
+                command->arguments.flow.locals);                                                                                        // @#arguments
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_A, DEST_D, JUMP_UNKNOWN, 0);                    // D=A
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "R13", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);      // @R13
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                    // M=D
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, command->arguments.flow.label,
+                COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);                                                                           // @function
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_A, DEST_D, JUMP_UNKNOWN, 0);                    // D=A
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "R14", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);      // @R14
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                    // M=D
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, return_label,
+                COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);                                                                           // @return
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_A, DEST_D, JUMP_UNKNOWN, 0);                    // D=A
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "preamble_call", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0); // @preamble_call
+        createMneumonic(&instructions[instructions_index++], OPCODE_JUMP, NULL, COMP_0, DEST_UNKNOWN, JUMP_JMP, 0);                     // 0;JMP
+        createMneumonic(&instructions[instructions_index++], OPCODE_SYMBOL, return_label,
+                COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);                                                                           // (return)
+    }
+
     else if (command->op == OP_CALL) {
 
-        /* The + 7 is for the 4 hex characters that represent call_counter, 1 for the null terminator, and 2 for the periods*/
-        char* return_label = stackArenaPush(stack_arena, strlen(command->arguments.flow.label) + strlen(filename) + 7);
+        char* return_label = createLabel(assembly_gen, stack_arena);
         if (return_label == NULL) {
             return NULL;
         }
-        sprintf(return_label, "%s.%s.%x", filename, command->arguments.flow.label, call_counter);
 
         /* 24 instructions are needed for this operation */
         instructions = stackArenaPush(stack_arena, 24 * sizeof(mneumonic_t));
@@ -434,7 +1025,7 @@ char* translateFlowCommand(stack_arena_t* stack_arena, command_t* command, const
         createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                    // M=D
         createMneumonic(&instructions[instructions_index++], OPCODE_A_NUMBER, NULL, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 
                 command->arguments.flow.locals);                                                                                        // @#arguments
-        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_A_PLUS_1, DEST_D, JUMP_UNKNOWN, 0);             // D=A+1
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_A, DEST_D, JUMP_UNKNOWN, 0);                    // D=A
         createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);       // @SP
         createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M_MINUS_D, DEST_D, JUMP_UNKNOWN, 0);            // D=M-D
         createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "ARG", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);      // @ARG
@@ -456,43 +1047,156 @@ char* translateFlowCommand(stack_arena_t* stack_arena, command_t* command, const
         createMneumonic(&instructions[instructions_index++], OPCODE_SYMBOL, return_label, 
                 COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);                                                                           // (return_label)
     }
-    else if (command->op == OP_GOTO) {
-        /* 2 instructions are needed for this operation */
-        instructions = stackArenaPush(stack_arena, 2 * sizeof(mneumonic_t));
-        if (instructions == NULL) {
-            return NULL;
-        }
-
-        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, command->arguments.flow.label, 
-                COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);                                                                           // @label
-        createMneumonic(&instructions[instructions_index++], OPCODE_JUMP, NULL, COMP_0, DEST_UNKNOWN, JUMP_JMP, 0);                     // 0;JMP
-    }
-
-    else if (command->op == OP_IFGOTO) {
-        /* 6 instructions are needed for this operation */
-        instructions = stackArenaPush(stack_arena, 6 * sizeof(mneumonic_t));
+    else if (command->op == OP_TAILCALL) {
+        /* The frame of the function making the call is handed on, so the callee returns
+         * straight to its caller. The return address and saved ARG are read first and LCL
+         * goes back to the caller's frame, which nothing below touches, so the profiler
+         * always finds a valid frame. The arguments then move down over the old ones and
+         * the frame goes right after them, which is where call would have put it */
+        size_t total_arguments = command->arguments.flow.locals;
+
+        /* At most 42 + 7 per argument instructions are needed for this operation */
+        instructions = stackArenaPush(stack_arena, (42 + 7 * total_arguments) * sizeof(mneumonic_t));
         if (instructions == NULL) {
             return NULL;
         }
 
-        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);       // @SP
-        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M_MINUS_1, DEST_MD, JUMP_UNKNOWN, 0);           // MD=M-1
-        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D_PLUS_1, DEST_A, JUMP_UNKNOWN, 0);             // A=D+1
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "LCL", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);      // @LCL
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M_MINUS_1, DEST_A, JUMP_UNKNOWN, 0);            // A=M-1
         createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                    // D=M
-        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, command->arguments.flow.label, 
-                COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);                                                                           // @label
-        createMneumonic(&instructions[instructions_index++], OPCODE_JUMP, NULL, COMP_D, DEST_UNKNOWN, JUMP_JNE, 0);                     // D;JNE
-    }
-
-    else if (command->op == OP_RETURN) {
-        /* 38 instructions are needed for this operation */
-        instructions = stackArenaPush(stack_arena, 39 * sizeof(mneumonic_t));
-        if (instructions == NULL) {
-            return NULL;
-        }
-
-        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);       // @SP
-        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                    // A=M
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "R15", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);      // @R15
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                    // M=D
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "LCL", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);      // @LCL
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M_MINUS_1, DEST_A, JUMP_UNKNOWN, 0);            // A=M-1
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_A_MINUS_1, DEST_A, JUMP_UNKNOWN, 0);            // A=A-1
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_A_MINUS_1, DEST_A, JUMP_UNKNOWN, 0);            // A=A-1
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                    // D=M
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "R13", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);      // @R13
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                    // M=D
+
+        /* LCL is set again by the callee, until then it holds the saved LCL */
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "LCL", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);      // @LCL
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M_MINUS_1, DEST_A, JUMP_UNKNOWN, 0);            // A=M-1
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_A_MINUS_1, DEST_A, JUMP_UNKNOWN, 0);            // A=A-1
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                    // D=M
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "LCL", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);      // @LCL
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                    // M=D
+
+        /* R14 walks the destination, starting right below ARG */
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "ARG", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);      // @ARG
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M_MINUS_1, DEST_D, JUMP_UNKNOWN, 0);            // D=M-1
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "R14", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);      // @R14
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                    // M=D
+
+        /* The arguments, lowest first, the destination is always below the source */
+        for (size_t argument = 0; argument < total_arguments; argument++) {
+            size_t depth = total_arguments - 1 - argument;
+
+            createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);   // @SP
+            if (depth > 1) {
+                createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);            // D=M
+                createMneumonic(&instructions[instructions_index++], OPCODE_A_NUMBER, NULL, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN,
+                        (uint16_t) depth);                                                                                              // @depth
+                createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D_MINUS_A, DEST_A, JUMP_UNKNOWN, 0);    // A=D-A
+            }
+            else {
+                createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL,
+                        depth == 1 ? COMP_M_MINUS_1 : COMP_M, DEST_A, JUMP_UNKNOWN, 0);                                                 // A=M-1 or A=M
+            }
+            createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                // D=M
+            createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "R14", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);  // @R14
+            createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M_PLUS_1, DEST_AM, JUMP_UNKNOWN, 0);        // AM=M+1
+            createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                // M=D
+        }
+
+        /* Then the frame, saved ARG, saved LCL and the return address */
+        static char* const FRAME[] = {"R13", "LCL", "R15"};
+        for (size_t word = 0; word < 3; word++) {
+            createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, FRAME[word], COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0); // @register
+            createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                // D=M
+            createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "R14", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);  // @R14
+            createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M_PLUS_1, DEST_AM, JUMP_UNKNOWN, 0);        // AM=M+1
+            createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                // M=D
+        }
+
+        /* The return address is the top of the stack, as after a call */
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_A, DEST_D, JUMP_UNKNOWN, 0);                    // D=A
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);       // @SP
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                    // M=D
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, command->arguments.flow.label,
+                 COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);                                                                          // @function_name
+        createMneumonic(&instructions[instructions_index++], OPCODE_JUMP, NULL, COMP_0, DEST_UNKNOWN, JUMP_JMP, 0);                     // 0;JMP
+    }
+    else if (command->op == OP_GOTO) {
+        /* 2 instructions are needed for this operation */
+        instructions = stackArenaPush(stack_arena, 2 * sizeof(mneumonic_t));
+        if (instructions == NULL) {
+            return NULL;
+        }
+
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, command->arguments.flow.label, 
+                COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);                                                                           // @label
+        createMneumonic(&instructions[instructions_index++], OPCODE_JUMP, NULL, COMP_0, DEST_UNKNOWN, JUMP_JMP, 0);                     // 0;JMP
+    }
+
+    else if (command->op == OP_IFGOTO || command->op == OP_IFNOTGOTO) {
+        /* 6 instructions are needed for this operation */
+        instructions = stackArenaPush(stack_arena, 6 * sizeof(mneumonic_t));
+        if (instructions == NULL) {
+            return NULL;
+        }
+
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);       // @SP
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M_MINUS_1, DEST_MD, JUMP_UNKNOWN, 0);           // MD=M-1
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D_PLUS_1, DEST_A, JUMP_UNKNOWN, 0);             // A=D+1
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                    // D=M
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, command->arguments.flow.label, 
+                COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);                                                                           // @label
+        createMneumonic(&instructions[instructions_index++], OPCODE_JUMP, NULL, COMP_D, DEST_UNKNOWN,
+                command->op == OP_IFGOTO ? JUMP_JNE : JUMP_JEQ, 0);                                                                     // D;JNE or D;JEQ
+    }
+
+    else if (command->op >= OP_IFLT && command->op <= OP_IFNE) {
+        /* 9 instructions are needed for this operation, the difference of the two values decides */
+        instructions = stackArenaPush(stack_arena, 9 * sizeof(mneumonic_t));
+        if (instructions == NULL) {
+            return NULL;
+        }
+
+        static const jump_t JUMPS[] = {JUMP_JLT, JUMP_JGT, JUMP_JEQ, JUMP_JGE, JUMP_JLE, JUMP_JNE};
+
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);       // @SP
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M_MINUS_1, DEST_AM, JUMP_UNKNOWN, 0);           // AM=M-1
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                    // D=M
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_A_PLUS_1, DEST_A, JUMP_UNKNOWN, 0);             // A=A+1
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D_MINUS_M, DEST_D, JUMP_UNKNOWN, 0);            // D=D-M
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);       // @SP
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M_MINUS_1, DEST_M, JUMP_UNKNOWN, 0);            // M=M-1
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, command->arguments.flow.label, 
+                COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);                                                                           // @label
+        createMneumonic(&instructions[instructions_index++], OPCODE_JUMP, NULL, COMP_D, DEST_UNKNOWN,
+                JUMPS[command->op - OP_IFLT], 0);                                                                                       // D;Jxx
+    }
+
+    else if (command->op == OP_RETURN && assembly_gen->return_expansion == FRAME_ROUTINE) {
+        instructions = stackArenaPush(stack_arena, 2 * sizeof(mneumonic_t));
+        if (instructions == NULL) {
+            return NULL;
+        }
+
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "preamble_return", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0); // @preamble_return
+        createMneumonic(&instructions[instructions_index++], OPCODE_JUMP, NULL, COMP_0, DEST_UNKNOWN, JUMP_JMP, 0);                     // 0;JMP
+    }
+
+    else if (command->op == OP_RETURN) {
+        /* 38 instructions are needed for this operation */
+        instructions = stackArenaPush(stack_arena, 39 * sizeof(mneumonic_t));
+        if (instructions == NULL) {
+            return NULL;
+        }
+
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);       // @SP
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                    // A=M
         createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                    // D=M
         createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "R13", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);      // @R13
         createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                    // M=D
@@ -551,7 +1255,115 @@ char* translateFlowCommand(stack_arena_t* stack_arena, command_t* command, const
         createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                    // M=D
     }
 
-    return generateMneumonics(instructions, instructions_index, stack_arena);
+    else if (command->op == OP_LEAFFUNCTION) {
+        /* No locals to make room for, and LCL stays the caller's since nothing here uses it */
+        instructions = stackArenaPush(stack_arena, sizeof(mneumonic_t));
+        if (instructions == NULL) {
+            return NULL;
+        }
+
+        createMneumonic(&instructions[instructions_index++], OPCODE_SYMBOL, command->arguments.flow.label, 
+                COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);                                                                           // (function)
+    }
+
+    else if (command->op == OP_LEAFCALL) {
+        /* The frame is [saved ARG][return address] right above the arguments, LCL is left
+         * alone because the leaf function never changes it */
+        char* return_label = createLabel(assembly_gen, stack_arena);
+        if (return_label == NULL) {
+            return NULL;
+        }
+
+        uint16_t arguments = command->arguments.flow.locals;
+
+        /* 17 instructions are needed for this operation at most */
+        instructions = stackArenaPush(stack_arena, 18 * sizeof(mneumonic_t));
+        if (instructions == NULL) {
+            return NULL;
+        }
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "ARG", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);      // @ARG
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                    // D=M
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);       // @SP
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M_PLUS_1, DEST_AM, JUMP_UNKNOWN, 0);            // AM=M+1
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                    // M=D
+
+        /* A still holds SP, ARG = SP - #arguments */
+        if (arguments > 1) {
+            createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_A, DEST_D, JUMP_UNKNOWN, 0);                // D=A
+            createMneumonic(&instructions[instructions_index++], OPCODE_A_NUMBER, NULL, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN,
+                    arguments);                                                                                                         // @#arguments
+            createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D_MINUS_A, DEST_D, JUMP_UNKNOWN, 0);        // D=D-A
+        }
+        else {
+            createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL,
+                    arguments == 1 ? COMP_A_MINUS_1 : COMP_A, DEST_D, JUMP_UNKNOWN, 0);                                                 // D=A-1 or D=A
+        }
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "ARG", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);      // @ARG
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                    // M=D
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, return_label,
+                COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);                                                                           // @return
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_A, DEST_D, JUMP_UNKNOWN, 0);                    // D=A
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);       // @SP
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M_PLUS_1, DEST_AM, JUMP_UNKNOWN, 0);            // AM=M+1
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                    // M=D
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, command->arguments.flow.label,
+                 COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);                                                                          // @function
+        createMneumonic(&instructions[instructions_index++], OPCODE_JUMP, NULL, COMP_0, DEST_UNKNOWN, JUMP_JMP, 0);                     // 0;JMP
+        createMneumonic(&instructions[instructions_index++], OPCODE_SYMBOL, return_label, 
+                COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);                                                                           // (return)
+    }
+
+    else if (command->op == OP_LEAFRETURN) {
+        /* The frame is found from ARG and the number of arguments, and read before the
+         * return value goes over the first argument, which with none is the saved ARG */
+        uint16_t arguments = command->arguments.flow.locals;
+
+        /* 30 instructions are needed for this operation at most */
+        instructions = stackArenaPush(stack_arena, 30 * sizeof(mneumonic_t));
+        if (instructions == NULL) {
+            return NULL;
+        }
+
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "ARG", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);      // @ARG
+        if (arguments > 1) {
+            createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                // D=M
+            createMneumonic(&instructions[instructions_index++], OPCODE_A_NUMBER, NULL, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN,
+                    arguments);                                                                                                         // @#arguments
+            createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D_PLUS_A, DEST_D, JUMP_UNKNOWN, 0);         // D=D+A
+        }
+        else {
+            createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL,
+                    arguments == 1 ? COMP_M_PLUS_1 : COMP_M, DEST_D, JUMP_UNKNOWN, 0);                                                  // D=M+1 or D=M
+        }
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "R14", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);      // @R14
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_AM, JUMP_UNKNOWN, 0);                   // AM=D
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                    // D=M
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "R13", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);      // @R13
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                    // M=D
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "R14", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);      // @R14
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M_PLUS_1, DEST_A, JUMP_UNKNOWN, 0);             // A=M+1
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                    // D=M
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "R14", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);      // @R14
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                    // M=D
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);       // @SP
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                    // A=M
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                    // D=M
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "ARG", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);      // @ARG
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                    // A=M
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                    // M=D
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_A, DEST_D, JUMP_UNKNOWN, 0);                    // D=A
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);       // @SP
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                    // M=D
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "R13", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);      // @R13
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                    // D=M
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "ARG", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);      // @ARG
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                    // M=D
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "R14", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);      // @R14
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                    // A=M
+        createMneumonic(&instructions[instructions_index++], OPCODE_JUMP, NULL, COMP_0, DEST_UNKNOWN, JUMP_JMP, 0);                     // 0;JMP
+    }
+
+    return generateMneumonics(assembly_gen, instructions, instructions_index, stack_arena);
 }
 
 /* Translates a push memory command into assembly
@@ -562,6 +1374,7 @@ char* translatePushCommand(assembly_gen_t* assembly_gen, stack_arena_t* stack_ar
     /* I try not to make functions this gargantuan, but this function is really simple so it will have to do */
 
     size_t instructions_index = 0;
+    uint16_t address = 0;
     /* 10 is the most possible assembly instructions needed */
     mneumonic_t* instructions = stackArenaPush(stack_arena, 10 * sizeof(mneumonic_t));
     if (instructions == NULL) {
@@ -584,13 +1397,12 @@ char* translatePushCommand(assembly_gen_t* assembly_gen, stack_arena_t* stack_ar
             break;
 
         case SEG_STATIC:
-            if (command->arguments.memory.index > assembly_gen->total_static_variables) {
-                 assembly_gen->total_static_variables = command->arguments.memory.index;
+            address = segmentFixedAddress(assembly_gen, SEG_STATIC, command->arguments.memory.index);
+            if (address == 0) {
+                return NULL;
             }
-            /* 16 is the memory address at which the static segment starts */
             createMneumonic(&instructions[instructions_index++], OPCODE_A_NUMBER, NULL, 
-            COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 16 + command->arguments.memory.index + assembly_gen->static_variable_base);          // @index
-            createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                   // A=M
+            COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, address);                                                                            // @index
             createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                   // D=M
             break;
 
@@ -605,13 +1417,12 @@ char* translatePushCommand(assembly_gen_t* assembly_gen, stack_arena_t* stack_ar
             break;
 
         case SEG_THAT:
-            createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "THIS", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);    // @THAT
+            createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "THAT", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);    // @THAT
             break;
 
         case SEG_TEMP:
             createMneumonic(&instructions[instructions_index++], OPCODE_A_NUMBER, NULL, 
             COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 5 + command->arguments.memory.index);                                                // @index
-            createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                   // A=M
             createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                   // D=M
             break;
 
@@ -623,7 +1434,14 @@ char* translatePushCommand(assembly_gen_t* assembly_gen, stack_arena_t* stack_ar
     if (command->arguments.memory.segment == SEG_ARGUMENT || command->arguments.memory.segment == SEG_LOCAL || 
         command->arguments.memory.segment == SEG_THIS || command->arguments.memory.segment == SEG_THAT) {
 
-        if (command->arguments.memory.index > 0) {
+        /* Index arithmetic or stepping A up, the cost model decides */
+        cost_t costs[] = {{4, 4}, {command->arguments.memory.index + 1u, command->arguments.memory.index + 1u}};
+
+        if (command->arguments.memory.index > 0 && costPick(assembly_gen, costs, 2) == 1) {
+            instructions_index += stepAddress(&instructions[instructions_index], command->arguments.memory.index);
+            createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                // D=M
+        }
+        else if (command->arguments.memory.index > 0) {
             createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                // D=M
             createMneumonic(&instructions[instructions_index++], OPCODE_A_NUMBER, NULL, 
                     COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, command->arguments.memory.index);                                         // @index
@@ -648,7 +1466,78 @@ char* translatePushCommand(assembly_gen_t* assembly_gen, stack_arena_t* stack_ar
         stackArenaPop(stack_arena, (10 - instructions_index) * sizeof(mneumonic_t));
     }
 
-    return generateMneumonics(instructions, instructions_index, stack_arena);
+    return generateMneumonics(assembly_gen, instructions, instructions_index, stack_arena);
+}
+
+/* Translate a pop the way the cost model prefers. The value comes off with SP left
+ * below it, and far into a base segment the address is either worked out into R13
+ * before the pop or stepped up to after it, which leaves D alone
+ * Return valid null terminated char* on success,
+ * Return NULL otherwise  */
+static char* translateModelPop(assembly_gen_t* assembly_gen, stack_arena_t* stack_arena, command_t* command)
+{
+    memory_segment_t segment = command->arguments.memory.segment;
+    uint16_t index = command->arguments.memory.index;
+    char* base = segmentBaseSymbol(segment);
+
+    if (base == NULL && segment != SEG_POINTER && segment != SEG_TEMP && segment != SEG_STATIC) {
+        return NULL;
+    }
+
+    uint16_t address = base == NULL ? segmentFixedAddress(assembly_gen, segment, index) : 0;
+    if (base == NULL && address == 0) {
+        return NULL;
+    }
+
+    size_t instructions_index = 0;
+    /* 13 is the most possible assembly instructions needed, stepping is only picked when it is shorter */
+    mneumonic_t* instructions = stackArenaPush(stack_arena, 13 * sizeof(mneumonic_t));
+    if (instructions == NULL) {
+        return NULL;
+    }
+
+    cost_t costs[] = {{13, 13}, {index + 6u, index + 6u}};
+    int32_t first = base != NULL && index > 1 && costPick(assembly_gen, costs, 2) == 0;
+
+    if (first) {
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, base, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);        // @base
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                    // D=M
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_NUMBER, NULL, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, index);   // @index
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D_PLUS_A, DEST_D, JUMP_UNKNOWN, 0);             // D=D+A
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "R13", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);      // @R13
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                    // M=D
+    }
+
+    createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);           // @SP
+    createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M_MINUS_1, DEST_M, JUMP_UNKNOWN, 0);                // M=M-1
+    createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M_PLUS_1, DEST_A, JUMP_UNKNOWN, 0);                 // A=M+1
+    createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                        // D=M
+
+    if (first) {
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "R13", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);      // @R13
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                    // A=M
+    }
+    else if (base != NULL) {
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, base, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);       // @base
+        if (index == 0) {
+            createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                // A=M
+        }
+        else {
+            instructions_index += stepAddress(&instructions[instructions_index], index);
+        }
+    }
+    else {
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_NUMBER, NULL, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN,
+                address);                                                                                                               // @address
+    }
+    createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                        // M=D
+
+    /* Reclaim some memory if applicable, 13 is the total structures initially allocated */
+    if (instructions_index < 13) {
+        stackArenaPop(stack_arena, (13 - instructions_index) * sizeof(mneumonic_t));
+    }
+
+    return generateMneumonics(assembly_gen, instructions, instructions_index, stack_arena);
 }
 
 /* Translate a pop memory command into assembly
@@ -656,7 +1545,12 @@ char* translatePushCommand(assembly_gen_t* assembly_gen, stack_arena_t* stack_ar
  * Return NULL otherwise  */
 char* translatePopCommand(assembly_gen_t* assembly_gen, stack_arena_t* stack_arena, command_t* command)
 {
+    if (assembly_gen->goal != ASSEMBLY_GOAL_DEFAULT) {
+        return translateModelPop(assembly_gen, stack_arena, command);
+    }
+
     size_t instructions_index = 0;
+    uint16_t address = 0;
     /* 18 is the most possible assembly instructions needed */
     mneumonic_t* instructions = stackArenaPush(stack_arena, 18 * sizeof(mneumonic_t));
     if (instructions == NULL) {
@@ -704,12 +1598,12 @@ char* translatePopCommand(assembly_gen_t* assembly_gen, stack_arena_t* stack_are
             break;
 
         case SEG_STATIC:
-            if (command->arguments.memory.index > assembly_gen->total_static_variables) {
-                 assembly_gen->total_static_variables = command->arguments.memory.index;
+            address = segmentFixedAddress(assembly_gen, SEG_STATIC, command->arguments.memory.index);
+            if (address == 0) {
+                return NULL;
             }
-            /* 16 is the memory address at which the static segment starts */
             createMneumonic(&instructions[instructions_index++], OPCODE_A_NUMBER, NULL, 
-            COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 16 + command->arguments.memory.index + assembly_gen->static_variable_base);               // @index
+            COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, address);                                                                                 // @index
             break;
 
         case SEG_THIS:
@@ -750,10 +1644,16 @@ char* translatePopCommand(assembly_gen_t* assembly_gen, stack_arena_t* stack_are
             createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                        // D=M
             createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "R14", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);          // @R14
             createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                        // A=M
-            createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_D, JUMP_UNKNOWN, 0);                        // M=D
+            createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                        // M=D
         }
     }
 
+    /* Pointer, temp and static already hold the target address in A */
+    else if (command->arguments.memory.segment == SEG_POINTER || command->arguments.memory.segment == SEG_TEMP ||
+             command->arguments.memory.segment == SEG_STATIC) {
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                         // M=D
+    }
+
     else {
         createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                         // A=M
         createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                         // M=D
@@ -764,58 +1664,425 @@ char* translatePopCommand(assembly_gen_t* assembly_gen, stack_arena_t* stack_are
         stackArenaPop(stack_arena, (18 - instructions_index) * sizeof(mneumonic_t));
     }
 
-    return generateMneumonics(instructions, instructions_index, stack_arena);
+    return generateMneumonics(assembly_gen, instructions, instructions_index, stack_arena);
 }
 
-/* Translate VM command to assembly
- * Returns valid char* to a string of assembly instruction(s) on success
- * Returns NULL on failur */
-char* translateCommand(assembly_gen_t* assembly_gen, stack_arena_t* stack_arena, command_t* command, const char* filename)
+/* Translate a move, a push straight into a pop, into assembly that copies the value
+ * without touching the stack. Constants 0 and 1 are stored without going through D
+ * Return valid null terminated char* on success,
+ * Return NULL otherwise  */
+char* translateMoveCommand(assembly_gen_t* assembly_gen, stack_arena_t* stack_arena, command_t* command)
 {
-    /* This variable is used to count the number of function calls within a function */
-    static uint16_t call_counter = 0;
-
-    switch (command->op) {
-        case OP_ADD:
-        case OP_SUB:
-        case OP_NEG:
-        case OP_EQ:
-        case OP_LT:
-        case OP_GT:
-        case OP_AND:
-        case OP_OR:
-        case OP_NOT:
-            return translateLogicalCommand(stack_arena, command, filename);
+    memory_segment_t from_segment = command->arguments.move.from_segment;
+    uint16_t from_index = command->arguments.move.from_index;
+    memory_segment_t to_segment = command->arguments.move.to_segment;
+    uint16_t to_index = command->arguments.move.to_index;
 
-        case OP_FUNCTION:
-            call_counter = 0;  // Reset counter when a new function is declared
-        case OP_LABEL:
-        case OP_CALL:
-            call_counter++;    // Otherwise on a call increment it
-        case OP_GOTO:
-        case OP_IFGOTO:
-        case OP_RETURN:
-            return translateFlowCommand(stack_arena, command, filename, call_counter);
+    char* from_base = segmentBaseSymbol(from_segment);
+    char* to_base = segmentBaseSymbol(to_segment);
 
-        case OP_POP:
-            return translatePopCommand(assembly_gen, stack_arena, command);
-        case OP_PUSH:
-            return translatePushCommand(assembly_gen, stack_arena, command);
+    int32_t from_fixed = from_segment == SEG_POINTER || from_segment == SEG_TEMP || from_segment == SEG_STATIC;
+    int32_t to_fixed = to_segment == SEG_POINTER || to_segment == SEG_TEMP || to_segment == SEG_STATIC;
 
-        default:
-            return NULL;
+    /* Nothing can be popped into a constant */
+    if ((from_base == NULL && !from_fixed && from_segment != SEG_CONSTANT) || (to_base == NULL && !to_fixed)) {
+        return NULL;
     }
-}
 
-/* Generates the preamble assembly code that kicks off the program. Needs to
- * be given an entry function name / symbol so that it knows where to jump to.
- * Returns -1 on failure
- * Return 0 on success */
-int32_t assemblyGenPreamble(assembly_gen_t* assembly_gen, char* entry_function)
-{
-    stack_arena_t stack_arena;
-    if (stackArenaInitialize(&stack_arena, 1024) < 0) {
-        return -1;
+    uint16_t from_address = from_fixed ? segmentFixedAddress(assembly_gen, from_segment, from_index) : 0;
+    uint16_t to_address = to_fixed ? segmentFixedAddress(assembly_gen, to_segment, to_index) : 0;
+    if ((from_fixed && from_address == 0) || (to_fixed && to_address == 0)) {
+        return NULL;
+    }
+
+    size_t instructions_index = 0;
+    /* 14 is the most possible assembly instructions needed */
+    mneumonic_t* instructions = stackArenaPush(stack_arena, 14 * sizeof(mneumonic_t));
+    if (instructions == NULL) {
+        return NULL;
+    }
+
+    /* What gets stored, constants 0 and 1 are computed in place */
+    comp_t stored = COMP_D;
+    if (from_segment == SEG_CONSTANT && from_index <= 1) {
+        stored = from_index == 0 ? COMP_0 : COMP_1;
+    }
+
+    /* Far into a segment the address is worked out with D, or A is stepped up to it which
+     * leaves D alone, as the cost model picks. When D will hold the value a worked out
+     * address is kept in R13 */
+    cost_t to_costs[] = {{stored == COMP_D ? 9u : 5u, stored == COMP_D ? 9u : 5u}, {to_index + 2u, to_index + 2u}};
+    int32_t to_step = to_base != NULL && to_index > 1 && costPick(assembly_gen, to_costs, 2) == 1;
+    int32_t spill = to_base != NULL && to_index > 1 && stored == COMP_D && !to_step;
+    if (spill) {
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, to_base, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);     // @base
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                    // D=M
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_NUMBER, NULL, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, to_index); // @index
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D_PLUS_A, DEST_D, JUMP_UNKNOWN, 0);             // D=D+A
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "R13", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);      // @R13
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                    // M=D
+    }
+
+    /* Load the value into D */
+    if (stored == COMP_D) {
+        if (from_segment == SEG_CONSTANT) {
+            createMneumonic(&instructions[instructions_index++], OPCODE_A_NUMBER, NULL, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, from_index); // @constant
+            createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_A, DEST_D, JUMP_UNKNOWN, 0);                      // D=A
+        }
+        else if (from_fixed) {
+            createMneumonic(&instructions[instructions_index++], OPCODE_A_NUMBER, NULL, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN,
+                    from_address);                                                                                                      // @address
+            createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                      // D=M
+        }
+        else {
+            cost_t from_costs[] = {{5, 5}, {from_index + 2u, from_index + 2u}};
+
+            createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, from_base, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);    // @base
+            if (from_index > 1 && costPick(assembly_gen, from_costs, 2) == 1) {
+                instructions_index += stepAddress(&instructions[instructions_index], from_index);
+            }
+            else if (from_index > 1) {
+                createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                  // D=M
+                createMneumonic(&instructions[instructions_index++], OPCODE_A_NUMBER, NULL, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, from_index); // @index
+                createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D_PLUS_A, DEST_A, JUMP_UNKNOWN, 0);           // A=D+A
+            }
+            else {
+                createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL,
+                        from_index == 1 ? COMP_M_PLUS_1 : COMP_M, DEST_A, JUMP_UNKNOWN, 0);                                              // A=M+1 or A=M
+            }
+            createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                      // D=M
+        }
+    }
+
+    /* Point A at the destination and store */
+    if (spill) {
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "R13", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);          // @R13
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                        // A=M
+    }
+    else if (to_fixed) {
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_NUMBER, NULL, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN,
+                to_address);                                                                                                            // @address
+    }
+    else {
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, to_base, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);        // @base
+        if (to_step) {
+            instructions_index += stepAddress(&instructions[instructions_index], to_index);
+        }
+        else if (to_index > 1) {
+            createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                    // D=M
+            createMneumonic(&instructions[instructions_index++], OPCODE_A_NUMBER, NULL, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, to_index); // @index
+            createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D_PLUS_A, DEST_A, JUMP_UNKNOWN, 0);             // A=D+A
+        }
+        else {
+            createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL,
+                    to_index == 1 ? COMP_M_PLUS_1 : COMP_M, DEST_A, JUMP_UNKNOWN, 0);                                                    // A=M+1 or A=M
+        }
+    }
+    createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, stored, DEST_M, JUMP_UNKNOWN, 0);                            // M=D, M=0 or M=1
+
+    /* Reclaim some memory if applicable, 14 is the total structures initially allocated */
+    if (instructions_index < 14) {
+        stackArenaPop(stack_arena, (14 - instructions_index) * sizeof(mneumonic_t));
+    }
+
+    return generateMneumonics(assembly_gen, instructions, instructions_index, stack_arena);
+}
+
+/* Write constant in signed binary digits, lowest first, where no two neighbouring
+ * digits are both non zero, so 7 is 8 - 1. Constants are 16 bits, so 17 digits at most
+ * Return the number of digits */
+static size_t multiplyDigits(uint16_t constant, int8_t digits[17])
+{
+    size_t total_digits = 0;
+
+    for (uint32_t value = constant; value != 0; value >>= 1) {
+        int8_t digit = 0;
+        if (value & 1) {
+            digit = (value & 3) == 3 ? -1 : 1;
+            value = digit < 0 ? value + 1 : value - 1;
+        }
+        digits[total_digits++] = digit;
+    }
+    return total_digits;
+}
+
+/* Words the addition chain of a multiplication by constant takes. Times 0 clears the
+ * value, a power of two takes 2 words a doubling and the rest 2 more for every other
+ * non zero digit, and 8 to load, keep and store the value */
+static uint32_t multiplyWords(uint16_t constant)
+{
+    int8_t digits[17];
+    size_t total_digits = multiplyDigits(constant, digits);
+    uint32_t total_nonzero = 0;
+    for (size_t digit = 0; digit < total_digits; digit++) {
+        total_nonzero += digits[digit] != 0;
+    }
+
+    return total_digits == 0 ? 3 : total_nonzero == 1 ? 2 + 2 * (uint32_t) (total_digits - 1)
+                                 : 8 + 2 * (uint32_t) (total_digits - 1) + 2 * (total_nonzero - 1);
+}
+
+/* A multiply either runs its addition chain or goes back to the call it came from,
+ * Math.multiply's shift and add loop takes at least this many cycles on top of the call */
+static char MULTIPLY_FUNCTION[] = OP_MULTIPLY_FUNCTION;
+#define MULTIPLY_CALL_CYCLES 200
+
+/* Translate "push constant k, call Math.multiply 2" as it was before the optimizer
+ * folded it into a multiply */
+static char* translateMultiplyCall(assembly_gen_t* assembly_gen, stack_arena_t* stack_arena, command_t* command)
+{
+    command_t push = *command;
+    push.op = OP_PUSH;
+
+    command_t call = *command;
+    call.op = OP_CALL;
+    call.arguments.flow.label = MULTIPLY_FUNCTION;
+    call.arguments.flow.locals = 2;
+
+    char* push_str = translatePushCommand(assembly_gen, stack_arena, &push);
+    char* call_str = push_str != NULL ? translateFlowCommand(assembly_gen, stack_arena, &call) : NULL;
+    if (call_str == NULL) {
+        return NULL;
+    }
+
+    size_t push_length = strlen(push_str), call_length = strlen(call_str);
+    char* assembly_str = stackArenaPush(stack_arena, push_length + call_length + 1);
+    if (assembly_str != NULL) {
+        memcpy(assembly_str, push_str, push_length);
+        memcpy(assembly_str + push_length, call_str, call_length + 1);
+    }
+    return assembly_str;
+}
+
+/* Translate a multiplication of the top of the stack by a constant into an addition
+ * chain. Powers of two double the value in place, other constants keep it in R13 and
+ * double D, adding or taking it away for every non zero signed digit. Wrapping at 16
+ * bits gives the low 16 bits of the product, as Math.multiply does. Where the call
+ * it came from is smaller and size is the goal it stays a call
+ * Return valid null terminated char* on success,
+ * Return NULL otherwise  */
+char* translateMultiplyCommand(assembly_gen_t* assembly_gen, stack_arena_t* stack_arena, command_t* command)
+{
+    int8_t digits[17];
+    size_t total_digits = multiplyDigits(command->arguments.memory.index, digits);
+    size_t total_nonzero = 0;
+    for (size_t digit = 0; digit < total_digits; digit++) {
+        total_nonzero += digits[digit] != 0;
+    }
+
+    /* The call is only ever smaller, and only for long chains */
+    uint32_t words = multiplyWords(command->arguments.memory.index);
+    cost_t costs[] = {{words, words}, {5 + CALL_COSTS[assembly_gen->call_expansion].instructions,
+                                       5 + CALL_COSTS[assembly_gen->call_expansion].cycles + MULTIPLY_CALL_CYCLES}};
+    if (costPick(assembly_gen, costs, 2) == 1) {
+        return translateMultiplyCall(assembly_gen, stack_arena, command);
+    }
+
+    /* At most 8 + 4 per digit instructions are needed for this operation */
+    size_t instructions_index = 0;
+    mneumonic_t* instructions = stackArenaPush(stack_arena, (8 + 4 * 17) * sizeof(mneumonic_t));
+    if (instructions == NULL) {
+        return NULL;
+    }
+
+    createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);           // @SP
+    createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                        // A=M
+
+    if (total_digits == 0) {
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_0, DEST_M, JUMP_UNKNOWN, 0);                    // M=0
+    }
+    else if (total_nonzero == 1) {
+        for (size_t digit = 1; digit < total_digits; digit++) {
+            createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                // D=M
+            createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D_PLUS_M, DEST_M, JUMP_UNKNOWN, 0);         // M=D+M
+        }
+    }
+    else {
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                    // D=M
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "R13", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);      // @R13
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                    // M=D
+
+        /* The highest digit is always 1, the value itself */
+        for (size_t digit = total_digits - 1; digit-- > 0;) {
+            createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_A, JUMP_UNKNOWN, 0);                // A=D
+            createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D_PLUS_A, DEST_D, JUMP_UNKNOWN, 0);         // D=D+A
+            if (digits[digit] != 0) {
+                createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "R13", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0); // @R13
+                createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL,
+                        digits[digit] > 0 ? COMP_D_PLUS_M : COMP_D_MINUS_M, DEST_D, JUMP_UNKNOWN, 0);                                   // D=D+M or D=D-M
+            }
+        }
+
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);       // @SP
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                    // A=M
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                    // M=D
+    }
+
+    return generateMneumonics(assembly_gen, instructions, instructions_index, stack_arena);
+}
+
+/* Translate VM command to assembly
+ * Returns valid char* to a string of assembly instruction(s) on success
+ * Returns NULL on failur */
+char* translateCommand(assembly_gen_t* assembly_gen, stack_arena_t* stack_arena, command_t* command)
+{
+    const intrinsic_t* intrinsic = findIntrinsic(assembly_gen, command);
+    if (intrinsic != NULL) {
+        return translateIntrinsic(assembly_gen, stack_arena, intrinsic);
+    }
+
+    switch (command->op) {
+        case OP_ADD:
+        case OP_SUB:
+        case OP_NEG:
+        case OP_EQ:
+        case OP_LT:
+        case OP_GT:
+        case OP_AND:
+        case OP_OR:
+        case OP_NOT:
+            return translateLogicalCommand(assembly_gen, stack_arena, command);
+
+        case OP_FUNCTION:
+        case OP_LABEL:
+        case OP_CALL:
+        case OP_GOTO:
+        case OP_IFGOTO:
+        case OP_IFNOTGOTO:
+        case OP_IFLT:
+        case OP_IFGT:
+        case OP_IFEQ:
+        case OP_IFGE:
+        case OP_IFLE:
+        case OP_IFNE:
+        case OP_TAILCALL:
+        case OP_RETURN:
+        case OP_LEAFFUNCTION:
+        case OP_LEAFCALL:
+        case OP_LEAFRETURN:
+            return translateFlowCommand(assembly_gen, stack_arena, command);
+
+        case OP_POP:
+            return translatePopCommand(assembly_gen, stack_arena, command);
+        case OP_PUSH:
+            return translatePushCommand(assembly_gen, stack_arena, command);
+        case OP_MOVE:
+            return translateMoveCommand(assembly_gen, stack_arena, command);
+        case OP_MULTIPLY:
+            return translateMultiplyCommand(assembly_gen, stack_arena, command);
+
+        default:
+            return NULL;
+    }
+}
+
+/* Generate instructions and write them straight out
+ * Return 0 on success
+ * Return -1 on failure */
+static int32_t writeMneumonics(assembly_gen_t* assembly_gen, stack_arena_t* stack_arena, mneumonic_t* instructions, size_t total_instructions)
+{
+    char* assembly_str = generateMneumonics(assembly_gen, instructions, total_instructions, stack_arena);
+    if (assembly_str == NULL || fwrite(assembly_str, 1, strlen(assembly_str), assembly_gen->output_file) < strlen(assembly_str)) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Write the runtime routines the cost model picked over inline code. The comparisons
+ * take their return address in D, preamble_call takes it in D with the number of
+ * arguments in R13 and the function in R14, and preamble_return is the usual return
+ * Return 0 on success
+ * Return -1 on failure */
+static int32_t generateRoutines(assembly_gen_t* assembly_gen, stack_arena_t* stack_arena)
+{
+    static char* const ROUTINES[] = {"preamble_eq", "preamble_gt", "preamble_lt"};
+    static char* const TRUE_LABELS[] = {"preamble_eq_true", "preamble_gt_true", "preamble_lt_true"};
+    static const jump_t COMPARE_JUMPS[] = {JUMP_JEQ, JUMP_JGT, JUMP_JLT};
+
+    mneumonic_t instructions[28];
+    size_t instructions_index = 0;
+
+    for (size_t which = 0; which < 3 && assembly_gen->compare_expansion == COMPARE_ROUTINE; which++) {
+        instructions_index = 0;
+        createMneumonic(&instructions[instructions_index++], OPCODE_SYMBOL, ROUTINES[which], COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);  // (preamble_xx)
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "R13", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);          // @R13
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                        // M=D
+        instructions_index += compareInstructions(&instructions[instructions_index], TRUE_LABELS[which], COMPARE_JUMPS[which]);
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "R13", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);          // @R13
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                        // A=M
+        createMneumonic(&instructions[instructions_index++], OPCODE_JUMP, NULL, COMP_0, DEST_UNKNOWN, JUMP_JMP, 0);                         // 0;JMP
+
+        if (writeMneumonics(assembly_gen, stack_arena, instructions, instructions_index) < 0) {
+            return -1;
+        }
+    }
+
+    if (assembly_gen->call_expansion == FRAME_ROUTINE) {
+        instructions_index = 0;
+        createMneumonic(&instructions[instructions_index++], OPCODE_SYMBOL, "preamble_call", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);  // (preamble_call)
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "R15", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);          // @R15
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                        // M=D
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "ARG", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);          // @ARG
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                        // D=M
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);           // @SP
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M_PLUS_1, DEST_AM, JUMP_UNKNOWN, 0);                // AM=M+1
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                        // M=D
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "R13", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);          // @R13
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                        // D=M
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);           // @SP
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M_MINUS_D, DEST_D, JUMP_UNKNOWN, 0);                // D=M-D
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "ARG", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);          // @ARG
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                        // M=D
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "LCL", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);          // @LCL
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                        // D=M
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);           // @SP
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M_PLUS_1, DEST_AM, JUMP_UNKNOWN, 0);                // AM=M+1
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                        // M=D
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "R15", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);          // @R15
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_D, JUMP_UNKNOWN, 0);                        // D=M
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);           // @SP
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M_PLUS_1, DEST_AM, JUMP_UNKNOWN, 0);                // AM=M+1
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                        // M=D
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "R14", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);          // @R14
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                        // A=M
+        createMneumonic(&instructions[instructions_index++], OPCODE_JUMP, NULL, COMP_0, DEST_UNKNOWN, JUMP_JMP, 0);                         // 0;JMP
+
+        if (writeMneumonics(assembly_gen, stack_arena, instructions, instructions_index) < 0) {
+            return -1;
+        }
+    }
+
+    if (assembly_gen->return_expansion == FRAME_ROUTINE) {
+        createMneumonic(&instructions[0], OPCODE_SYMBOL, "preamble_return", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);                   // (preamble_return)
+        if (writeMneumonics(assembly_gen, stack_arena, instructions, 1) < 0) {
+            return -1;
+        }
+
+        /* The body is the usual return */
+        command_t command;
+        command.op = OP_RETURN;
+
+        assembly_gen->return_expansion = FRAME_INLINE;
+        char* assembly_str = translateFlowCommand(assembly_gen, stack_arena, &command);
+        assembly_gen->return_expansion = FRAME_ROUTINE;
+
+        if (assembly_str == NULL || fwrite(assembly_str, 1, strlen(assembly_str), assembly_gen->output_file) < strlen(assembly_str)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Generates the preamble assembly code that kicks off the program. Needs to
+ * be given an entry function name / symbol so that it knows where to jump to.
+ * Returns -1 on failure
+ * Return 0 on success */
+int32_t assemblyGenPreamble(assembly_gen_t* assembly_gen, char* entry_function)
+{
+    stack_arena_t stack_arena;
+    if (stackArenaInitialize(&stack_arena, 4096) < 0) {
+        return -1;
     }
 
     command_t command;
@@ -843,7 +2110,7 @@ int32_t assemblyGenPreamble(assembly_gen_t* assembly_gen, char* entry_function)
     createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "THAT", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);         // @THAT
     createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                        // M=D
                                                                                                                                         
-    assembly_str[0] = generateMneumonics(instructions, instructions_index, &stack_arena);
+    assembly_str[0] = generateMneumonics(assembly_gen, instructions, instructions_index, &stack_arena);
     instructions_index = 0; // Reset
 
     if (assembly_str[0] == NULL) {
@@ -852,7 +2119,12 @@ int32_t assemblyGenPreamble(assembly_gen_t* assembly_gen, char* entry_function)
     }
 
     /* Generate the needed code to call the starting function */
-    assembly_str[1] = translateFlowCommand(&stack_arena, &command, "preamble", 0);
+    size_t call_expansion = assembly_gen->call_expansion;
+    if (entryHot(assembly_gen)) {
+        assembly_gen->call_expansion = FRAME_INLINE;
+    }
+    assembly_str[1] = translateFlowCommand(assembly_gen, &stack_arena, &command);
+    assembly_gen->call_expansion = call_expansion;
     if (assembly_str[1] == NULL) {
         stackArenaRelease(&stack_arena);
         return -1;
@@ -868,26 +2140,29 @@ int32_t assemblyGenPreamble(assembly_gen_t* assembly_gen, char* entry_function)
     createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "preamble_end", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);                // @preamble_end
     createMneumonic(&instructions[instructions_index++], OPCODE_SYMBOL, "preamble_end", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);                   // (preamble_end)
     createMneumonic(&instructions[instructions_index++], OPCODE_JUMP, NULL, COMP_0, DEST_UNKNOWN, JUMP_JMP, 0);                                        // 0;JMP
-    createMneumonic(&instructions[instructions_index++], OPCODE_SYMBOL, "preable_bool_jumpback", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);         // (preable_bool_jumpback)
-    createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);                          // @SP
-    createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                                       // A=M
-    createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                                       // M=D
-    createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "R13", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);                         // @R13
-    createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                                       // A=M
-    createMneumonic(&instructions[instructions_index++], OPCODE_JUMP, NULL, COMP_0, DEST_UNKNOWN, JUMP_JMP, 0);                                        // 0;JMP
-    createMneumonic(&instructions[instructions_index++], OPCODE_SYMBOL, "preable_true", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);                  // (preable_true)
-    createMneumonic(&instructions[instructions_index++], OPCODE_A_NUMBER, NULL, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 32767);                      // @32765
-    createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_A_PLUS_1, DEST_D, JUMP_UNKNOWN, 0);                                // D=A+1
-    createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D_PLUS_A, DEST_D, JUMP_UNKNOWN, 0);                                // D=D+A
-    createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "preable_bool_jumpback", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);       // @preable_bool_jumpback
-    createMneumonic(&instructions[instructions_index++], OPCODE_JUMP, NULL, COMP_0, DEST_UNKNOWN, JUMP_JMP, 0);                                        // 0;JMP
-    createMneumonic(&instructions[instructions_index++], OPCODE_SYMBOL, "preable_false", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);                 // (preable_false)
-    createMneumonic(&instructions[instructions_index++], OPCODE_A_NUMBER, NULL, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);                          // @0 
-    createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_A, DEST_D, JUMP_UNKNOWN, 0);                                       // D=A
-    createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "preable_bool_jumpback", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);       // @preable_bool_jumpback
-    createMneumonic(&instructions[instructions_index++], OPCODE_JUMP, NULL, COMP_0, DEST_UNKNOWN, JUMP_JMP, 0);                                        // 0;JMP
-                                                                                                                                                       //
-    if (generateMneumonics(instructions, instructions_index, &stack_arena) == NULL) {
+
+    /* Only needed while comparisons go through them */
+    if (assembly_gen->compare_expansion == COMPARE_SHARED) {
+        createMneumonic(&instructions[instructions_index++], OPCODE_SYMBOL, "preable_bool_jumpback", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);         // (preable_bool_jumpback)
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "SP", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);                          // @SP
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                                       // A=M
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                                       // M=D
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "R13", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);                         // @R13
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                                       // A=M
+        createMneumonic(&instructions[instructions_index++], OPCODE_JUMP, NULL, COMP_0, DEST_UNKNOWN, JUMP_JMP, 0);                                        // 0;JMP
+        createMneumonic(&instructions[instructions_index++], OPCODE_SYMBOL, "preable_true", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);                  // (preable_true)
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_NUMBER, NULL, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 32767);                      // @32765
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_A_PLUS_1, DEST_D, JUMP_UNKNOWN, 0);                                // D=A+1
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_D_PLUS_A, DEST_D, JUMP_UNKNOWN, 0);                                // D=D+A
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "preable_bool_jumpback", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);       // @preable_bool_jumpback
+        createMneumonic(&instructions[instructions_index++], OPCODE_JUMP, NULL, COMP_0, DEST_UNKNOWN, JUMP_JMP, 0);                                        // 0;JMP
+        createMneumonic(&instructions[instructions_index++], OPCODE_SYMBOL, "preable_false", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);                 // (preable_false)
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_NUMBER, NULL, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);                          // @0 
+        createMneumonic(&instructions[instructions_index++], OPCODE_COMPUTE, NULL, COMP_A, DEST_D, JUMP_UNKNOWN, 0);                                       // D=A
+        createMneumonic(&instructions[instructions_index++], OPCODE_A_SYMBOL, "preable_bool_jumpback", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);       // @preable_bool_jumpback
+        createMneumonic(&instructions[instructions_index++], OPCODE_JUMP, NULL, COMP_0, DEST_UNKNOWN, JUMP_JMP, 0);                                        // 0;JMP
+    }
+    if (generateMneumonics(assembly_gen, instructions, instructions_index, &stack_arena) == NULL) {
         stackArenaRelease(&stack_arena);
         return -1;
     }
@@ -900,16 +2175,162 @@ int32_t assemblyGenPreamble(assembly_gen_t* assembly_gen, char* entry_function)
         stackArenaRelease(&stack_arena);
         return -1;
     }
+
+    if (generateRoutines(assembly_gen, &stack_arena) < 0) {
+        stackArenaRelease(&stack_arena);
+        return -1;
+    }
     
     if (fflush(assembly_gen->output_file) < 0) {
         stackArenaRelease(&stack_arena);
         return -1;
     }
 
+    /* The preamble and runtime routines don't belong to any command */
+    if (assembly_gen->map_file != NULL &&
+        fprintf(assembly_gen->map_file, "(preamble)\t0\t(runtime)\t0\t%zu\n", assembly_gen->rom_address) < 0) {
+        stackArenaRelease(&stack_arena);
+        return -1;
+    }
+
+    /* The preamble's labels use file id 0 */
+    if (assembly_gen->label_file != NULL &&
+        fprintf(assembly_gen->label_file, "%u\t(preamble)\n", assembly_gen->file_id) < 0) {
+        stackArenaRelease(&stack_arena);
+        return -1;
+    }
+
     stackArenaRelease(&stack_arena);
     return 0;
 }
 
+/* Lay the static variables of every file of the program out in RAM 16 - 255 before
+ * generating any of them, file after file in the order given, which has to be the order
+ * they are generated in. Each file takes as many words as its highest static index plus
+ * one. When they don't fit, a line per file and the total go to report, if not NULL
+ * Return -1 if they don't fit
+ * Return 0 on success */
+int32_t assemblyGenLayoutStatics(assembly_gen_t* assembly_gen, static_layout_t* layouts, command_module_t* const* modules,
+                                 const char* const* filenames, size_t total_modules, FILE* report)
+{
+    assert(assembly_gen != NULL && layouts != NULL && modules != NULL && filenames != NULL);
+
+    size_t total = 0;
+    for (size_t module = 0; module < total_modules; module++) {
+        size_t size = 0;
+
+        for (size_t index = 0; index < modules[module]->total_commands; index++) {
+            const command_t* command = &modules[module]->commands[index];
+
+            if ((command->op == OP_PUSH || command->op == OP_POP) && command->arguments.memory.segment == SEG_STATIC &&
+                command->arguments.memory.index >= size) {
+                size = command->arguments.memory.index + 1u;
+            }
+            if (command->op == OP_MOVE && command->arguments.move.from_segment == SEG_STATIC &&
+                command->arguments.move.from_index >= size) {
+                size = command->arguments.move.from_index + 1u;
+            }
+            if (command->op == OP_MOVE && command->arguments.move.to_segment == SEG_STATIC &&
+                command->arguments.move.to_index >= size) {
+                size = command->arguments.move.to_index + 1u;
+            }
+        }
+
+        /* Addresses past the end are never generated, base is only kept in range */
+        layouts[module].filename = filenames[module];
+        layouts[module].base = (uint16_t) (ASSEMBLY_STATIC_START + (total < ASSEMBLY_STATIC_END ? total : ASSEMBLY_STATIC_END));
+        layouts[module].size = (uint16_t) size;
+        total += size;
+    }
+
+    if (total > ASSEMBLY_STATIC_END - ASSEMBLY_STATIC_START) {
+        for (size_t module = 0; module < total_modules && report != NULL; module++) {
+            fprintf(report, "%s\t%u static variables\n", layouts[module].filename, layouts[module].size);
+        }
+        if (report != NULL) {
+            fprintf(report, "%zu static variables, RAM %u - %u holds %u\n", total, ASSEMBLY_STATIC_START,
+                    ASSEMBLY_STATIC_END - 1, ASSEMBLY_STATIC_END - ASSEMBLY_STATIC_START);
+        }
+        return -1;
+    }
+
+    assembly_gen->static_layouts = layouts;
+    assembly_gen->total_static_layouts = total_modules;
+    return 0;
+}
+
+/* Start translating a new file, static variables of a file get their own
+ * slice of the shared static segment, the one laid out for it if there is one,
+ * and its labels get the next file id
+ * Return -1 on failure
+ * Return 0 on success */
+int32_t assemblyGenBeginFile(assembly_gen_t* assembly_gen, const char* filename)
+{
+    assert(assembly_gen != NULL && filename != NULL);
+
+    /* file_id counts files begun, starting from the preamble's 0 */
+    if (assembly_gen->file_id < assembly_gen->total_static_layouts) {
+        assembly_gen->static_variable_base = assembly_gen->static_layouts[assembly_gen->file_id].base - ASSEMBLY_STATIC_START;
+    }
+    else {
+        assembly_gen->static_variable_base += assembly_gen->total_static_variables;
+    }
+    assembly_gen->total_static_variables = 0;
+    assembly_gen->function = NULL;
+    assembly_gen->file_id++;
+    assembly_gen->label_counter = 0;
+
+    if (assembly_gen->label_file != NULL &&
+        fprintf(assembly_gen->label_file, "%u\t%s\n", assembly_gen->file_id, filename) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Translate a single command into assembly allocated on stack_arena, writing
+ * its source map line when a map is open
+ * Return NULL on failure
+ * Return valid char* on success */
+char* assemblyGenCommand(assembly_gen_t* assembly_gen, stack_arena_t* stack_arena, command_t* command, const char* filename)
+{
+    assert(assembly_gen != NULL && stack_arena != NULL && command != NULL && filename != NULL);
+
+    size_t rom_start = assembly_gen->rom_address;
+    if (OP_IS_FUNCTION(command->op)) {
+        assembly_gen->function = command->arguments.flow.label;
+    }
+
+    /* The fastest expansions are all inline, so they need nothing from the preamble */
+    assembly_goal_t goal = assembly_gen->goal;
+    size_t expansions[3] = {assembly_gen->compare_expansion, assembly_gen->call_expansion, assembly_gen->return_expansion};
+    if (commandHot(assembly_gen, command)) {
+        assembly_gen->goal = ASSEMBLY_GOAL_SPEED;
+        assembly_gen->compare_expansion = COMPARE_INLINE;
+        assembly_gen->call_expansion = FRAME_INLINE;
+        assembly_gen->return_expansion = FRAME_INLINE;
+    }
+
+    char* assembly_str = translateCommand(assembly_gen, stack_arena, command);
+
+    assembly_gen->goal = goal;
+    assembly_gen->compare_expansion = expansions[0];
+    assembly_gen->call_expansion = expansions[1];
+    assembly_gen->return_expansion = expansions[2];
+    if (assembly_str == NULL) {
+        return NULL;
+    }
+
+    if (assembly_gen->map_file != NULL &&
+        fprintf(assembly_gen->map_file, "%s\t%u\t%s\t%zu\t%zu\n", filename, command->line,
+                assembly_gen->function != NULL ? assembly_gen->function : "(none)",
+                rom_start, assembly_gen->rom_address) < 0) {
+        return NULL;
+    }
+
+    return assembly_str;
+}
+
 /* Generate assembly from the given commands and write them to the output file
  * Return -1 on failure
  * Return 0 on success */
@@ -917,7 +2338,7 @@ int32_t assemblyGen(assembly_gen_t* assembly_gen, command_module_t* commands, co
 {
     /* Steps
      * 1. Create a stack arena of appropriate size
-     * 2. Call translateCommand
+     * 2. Call assemblyGenCommand
      * 4. write output to file
      * 5. Flush output
      * 6. Zero the stack arena
@@ -927,10 +2348,11 @@ int32_t assemblyGen(assembly_gen_t* assembly_gen, command_module_t* commands, co
 
     assert(assembly_gen != NULL && commands != NULL && filename != NULL &&
            assembly_gen->output_file != NULL && commands->total_commands > 0  && 
-           commands->commands[0].op == OP_FUNCTION); 
+           OP_IS_FUNCTION(commands->commands[0].op)); 
 
-    assembly_gen->static_variable_base = assembly_gen->total_static_variables;
-    assembly_gen->total_static_variables = 0;
+    if (assemblyGenBeginFile(assembly_gen, filename) < 0) {
+        return -1;
+    }
 
     stack_arena_t stack_arena;
 
@@ -942,11 +2364,18 @@ int32_t assemblyGen(assembly_gen_t* assembly_gen, command_module_t* commands, co
     size_t command_index = 0;
     for (; command_index < commands->total_commands; command_index++) {
 
-        char* assembly_str = translateCommand(assembly_gen, &stack_arena, &commands->commands[command_index], filename);
+        size_t rom_start = assembly_gen->rom_address;
+
+        char* assembly_str = assemblyGenCommand(assembly_gen, &stack_arena, &commands->commands[command_index], filename);
         if (assembly_str == NULL) {
             break;
         }
 
+        if (assembly_gen->rom_ranges != NULL) {
+            assembly_gen->rom_ranges[command_index].start = (uint32_t) rom_start;
+            assembly_gen->rom_ranges[command_index].end = (uint32_t) assembly_gen->rom_address;
+        }
+
         size_t bytes = fwrite(assembly_str, 1, strlen(assembly_str), assembly_gen->output_file);
         if (bytes < strlen(assembly_str)) {
             break;
@@ -959,11 +2388,311 @@ int32_t assemblyGen(assembly_gen_t* assembly_gen, command_module_t* commands, co
         stackArenaPop(&stack_arena, stack_arena.position);
     }
 
+    stackArenaRelease(&stack_arena);
+
     /* If this condition is true then the loop didn't finish properly */
     if (command_index < commands->total_commands) {
-        stackArenaRelease(&stack_arena);
         return -1;
     }
 
     return 0;
 }
+
+/* Keep every instruction generated from here on back, to be written out by
+ * assemblyGenEndOutline once the whole program is in. ROM addresses move when
+ * runs are outlined, so neither a source map nor ROM ranges can be kept
+ * Return -1 on failure
+ * Return 0 on success */
+int32_t assemblyGenBeginOutline(assembly_gen_t* assembly_gen)
+{
+    assert(assembly_gen != NULL && !assembly_gen->outlining && assembly_gen->outline_instructions.memory == NULL &&
+           assembly_gen->map_file == NULL && assembly_gen->rom_ranges == NULL);
+
+    if (stackArenaInitialize(&assembly_gen->outline_instructions, OUTLINE_CAPACITY * sizeof(outline_instruction_t)) < 0) {
+        return -1;
+    }
+    if (stackArenaInitialize(&assembly_gen->outline_labels, OUTLINE_CAPACITY * OUTLINE_LABEL_BYTES) < 0) {
+        stackArenaRelease(&assembly_gen->outline_instructions);
+        return -1;
+    }
+
+    assembly_gen->outlining = 1;
+    assembly_gen->outline_rom_start = assembly_gen->rom_address;
+    return 0;
+}
+
+/* A window of instructions, by the hash of what they are */
+typedef struct {
+    uint32_t hash;
+    uint32_t first;
+} outline_window_t;
+
+/* A run moved into a routine, called from every place it was found */
+typedef struct {
+    size_t length;
+    size_t first;                   /* Where the routine's copy is taken from */
+    char*  label;
+} outline_routine_t;
+
+static int32_t compareWindows(const void* a, const void* b)
+{
+    const outline_window_t* first = a;
+    const outline_window_t* second = b;
+
+    if (first->hash != second->hash) {
+        return first->hash < second->hash ? -1 : 1;
+    }
+    return first->first < second->first ? -1 : first->first > second->first;
+}
+
+static int32_t sameInstruction(const mneumonic_t* a, const mneumonic_t* b)
+{
+    if (a->opcode != b->opcode) {
+        return 0;
+    }
+    switch (a->opcode) {
+        case OPCODE_A_NUMBER:
+            return a->variants.number == b->variants.number;
+        case OPCODE_A_SYMBOL:
+        case OPCODE_SYMBOL:
+            return strcmp(a->variants.label, b->variants.label) == 0;
+        default:
+            return a->variants.compute.comp == b->variants.compute.comp &&
+                   a->variants.compute.dest == b->variants.compute.dest &&
+                   a->variants.compute.jump == b->variants.compute.jump;
+    }
+}
+
+static uint32_t hashInstruction(uint32_t hash, const mneumonic_t* mneumonic)
+{
+    hash = (hash ^ (uint32_t) mneumonic->opcode) * 16777619u;
+    switch (mneumonic->opcode) {
+        case OPCODE_A_NUMBER:
+            return (hash ^ mneumonic->variants.number) * 16777619u;
+        case OPCODE_A_SYMBOL:
+        case OPCODE_SYMBOL:
+            for (const char* label = mneumonic->variants.label; *label != '\0'; label++) {
+                hash = (hash ^ (uint8_t) *label) * 16777619u;
+            }
+            return hash;
+        default:
+            hash = (hash ^ (uint32_t) mneumonic->variants.compute.comp) * 16777619u;
+            return (hash ^ (uint32_t) mneumonic->variants.compute.dest) * 16777619u;
+    }
+}
+
+/* Return 1 if an instruction can't be in an outlined run: labels and jumps, anything hot
+ * or outlined already, and anything R15 matters to */
+static int32_t outlineBarrier(const outline_instruction_t* instruction)
+{
+    return (instruction->flags & (OUTLINE_HOT | OUTLINE_TAKEN | OUTLINE_R15)) ||
+           instruction->mneumonic.opcode == OPCODE_SYMBOL || instruction->mneumonic.opcode == OPCODE_JUMP;
+}
+
+/* Return 1 if the run starting at first can be a routine's body wherever it is. The call
+ * leaves the return address in D and A, so the run has to set A first and D before
+ * reading it, and whatever follows has to set A before using it */
+static int32_t outlineFits(const outline_instruction_t* instructions, size_t total, size_t first, size_t length)
+{
+    static const uint8_t READS_D[COMP_MAX] = {
+        [COMP_D] = 1, [COMP_NOT_D] = 1, [COMP_NEG_D] = 1, [COMP_D_PLUS_1] = 1, [COMP_D_MINUS_1] = 1,
+        [COMP_D_PLUS_A] = 1, [COMP_D_MINUS_A] = 1, [COMP_A_MINUS_D] = 1, [COMP_D_AND_A] = 1, [COMP_D_OR_A] = 1,
+        [COMP_D_PLUS_M] = 1, [COMP_D_MINUS_M] = 1, [COMP_M_MINUS_D] = 1, [COMP_D_AND_M] = 1, [COMP_D_OR_M] = 1,
+    };
+
+    if (instructions[first].mneumonic.opcode != OPCODE_A_NUMBER && instructions[first].mneumonic.opcode != OPCODE_A_SYMBOL) {
+        return 0;
+    }
+
+    int32_t d_set = 0;
+    for (size_t index = first; index < first + length; index++) {
+        const mneumonic_t* mneumonic = &instructions[index].mneumonic;
+        if (mneumonic->opcode != OPCODE_COMPUTE) {
+            continue;
+        }
+        if (!d_set && READS_D[mneumonic->variants.compute.comp]) {
+            return 0;
+        }
+        dest_t dest = mneumonic->variants.compute.dest;
+        d_set |= dest == DEST_D || dest == DEST_MD || dest == DEST_AD || dest == DEST_AMD;
+    }
+
+    size_t next = first + length;
+    while (next < total && instructions[next].mneumonic.opcode == OPCODE_SYMBOL) {
+        next++;
+    }
+    return d_set && next < total &&
+           (instructions[next].mneumonic.opcode == OPCODE_A_NUMBER || instructions[next].mneumonic.opcode == OPCODE_A_SYMBOL);
+}
+
+/* Find runs worth outlining, longest first. A run found k times at length l saves
+ * (k - 1) * l words, less a call per place and the routine's own words. starts
+ * gets routine index + 1 where a call replaces a run
+ * Return the number of routines */
+static size_t outlineFind(outline_instruction_t* instructions, size_t total, uint32_t* starts, uint32_t* barriers,
+                          outline_window_t* windows, size_t* occurrences, outline_routine_t* routines)
+{
+    size_t total_routines = 0;
+
+    for (size_t length = OUTLINE_MAX_LENGTH; length >= OUTLINE_MIN_LENGTH; length--) {
+        if (total < length) {
+            continue;
+        }
+
+        barriers[0] = 0;
+        for (size_t index = 0; index < total; index++) {
+            barriers[index + 1] = barriers[index] + (uint32_t) outlineBarrier(&instructions[index]);
+        }
+
+        size_t total_windows = 0;
+        for (size_t first = 0; first + length <= total; first++) {
+            if (barriers[first + length] != barriers[first] || !outlineFits(instructions, total, first, length)) {
+                continue;
+            }
+
+            uint32_t hash = 2166136261u;
+            for (size_t index = first; index < first + length; index++) {
+                hash = hashInstruction(hash, &instructions[index].mneumonic);
+            }
+            windows[total_windows++] = (outline_window_t) {hash, (uint32_t) first};
+        }
+        qsort(windows, total_windows, sizeof(outline_window_t), compareWindows);
+
+        for (size_t start = 0, end = 0; start < total_windows; start = end) {
+            for (end = start + 1; end < total_windows && windows[end].hash == windows[start].hash; end++) {
+            }
+
+            /* The places matching the first, not overlapping and not taken by a longer run since */
+            size_t total_occurrences = 0;
+            size_t free_from = 0;
+            const outline_instruction_t* model = &instructions[windows[start].first];
+            for (size_t window = start; window < end; window++) {
+                size_t first = windows[window].first;
+                int32_t same = first >= free_from;
+                for (size_t offset = 0; offset < length && same; offset++) {
+                    same = !(instructions[first + offset].flags & OUTLINE_TAKEN) &&
+                           sameInstruction(&model[offset].mneumonic, &instructions[first + offset].mneumonic);
+                }
+                if (same) {
+                    occurrences[total_occurrences++] = first;
+                    free_from = first + length;
+                }
+            }
+
+            int64_t saving = (int64_t) (total_occurrences - 1) * (int64_t) length -
+                             (int64_t) total_occurrences * OUTLINE_CALL_WORDS - OUTLINE_ROUTINE_WORDS;
+            if (total_occurrences < 2 || saving <= 0) {
+                continue;
+            }
+
+            routines[total_routines] = (outline_routine_t) {length, occurrences[0], NULL};
+            total_routines++;
+            for (size_t occurrence = 0; occurrence < total_occurrences; occurrence++) {
+                starts[occurrences[occurrence]] = (uint32_t) total_routines;
+                for (size_t offset = 0; offset < length; offset++) {
+                    instructions[occurrences[occurrence] + offset].flags |= OUTLINE_TAKEN;
+                }
+            }
+        }
+    }
+
+    return total_routines;
+}
+
+/* Write the instructions kept back since assemblyGenBeginOutline, with every run of
+ * instructions repeated often enough to save ROM moved into a routine after the
+ * program. A run is replaced by a jump to its routine with the return address in
+ * D, which the routine keeps in R15. Runs never hold labels or jumps, so control
+ * only enters at their start and leaves at their end, and runs generated for
+ * commands a profile found hot stay inline
+ * Return -1 on failure
+ * Return 0 on success */
+int32_t assemblyGenEndOutline(assembly_gen_t* assembly_gen)
+{
+    assert(assembly_gen != NULL && assembly_gen->outlining);
+
+    assembly_gen->outlining = 0;
+    outline_instruction_t* instructions = (outline_instruction_t*) assembly_gen->outline_instructions.memory;
+    size_t total = stackArenaPosition(&assembly_gen->outline_instructions) / sizeof(outline_instruction_t);
+
+    /* Run starts, barrier counts, windows, the places of a run and the routines, then
+     * room to generate a routine or a chunk of the program at a time */
+    stack_arena_t stack_arena;
+    size_t arena_size = (total + 1) * (2 * sizeof(uint32_t) + sizeof(outline_window_t) + sizeof(size_t)) +
+                        (total / OUTLINE_MIN_LENGTH + 1) * sizeof(outline_routine_t) + 65536;
+    if (stackArenaInitialize(&stack_arena, arena_size) < 0) {
+        return -1;
+    }
+    uint32_t* starts = stackArenaPush(&stack_arena, (total + 1) * sizeof(uint32_t));
+    uint32_t* barriers = stackArenaPush(&stack_arena, (total + 1) * sizeof(uint32_t));
+    outline_window_t* windows = stackArenaPush(&stack_arena, (total + 1) * sizeof(outline_window_t));
+    size_t* occurrences = stackArenaPush(&stack_arena, (total + 1) * sizeof(size_t));
+    outline_routine_t* routines = stackArenaPush(&stack_arena, (total / OUTLINE_MIN_LENGTH + 1) * sizeof(outline_routine_t));
+
+    size_t total_routines = outlineFind(instructions, total, starts, barriers, windows, occurrences, routines);
+    for (size_t routine = 0; routine < total_routines; routine++) {
+        routines[routine].label = createLabel(assembly_gen, &assembly_gen->outline_labels);
+        if (routines[routine].label == NULL) {
+            stackArenaRelease(&stack_arena);
+            return -1;
+        }
+    }
+
+    /* Generate in chunks, the ROM addresses start over from where outlining began */
+    assembly_gen->rom_address = assembly_gen->outline_rom_start;
+    size_t position = stackArenaPosition(&stack_arena);
+    mneumonic_t chunk[64 + OUTLINE_MAX_LENGTH + OUTLINE_ROUTINE_WORDS];
+    size_t chunk_index = 0;
+    int32_t result = 0;
+
+    for (size_t index = 0; index < total && result == 0;) {
+        if (starts[index] != 0) {
+            outline_routine_t* routine = &routines[starts[index] - 1];
+            char* return_label = createLabel(assembly_gen, &assembly_gen->outline_labels);
+            if (return_label == NULL) {
+                result = -1;
+                break;
+            }
+            createMneumonic(&chunk[chunk_index++], OPCODE_A_SYMBOL, return_label, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);    // @return
+            createMneumonic(&chunk[chunk_index++], OPCODE_COMPUTE, NULL, COMP_A, DEST_D, JUMP_UNKNOWN, 0);                         // D=A
+            createMneumonic(&chunk[chunk_index++], OPCODE_A_SYMBOL, routine->label, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);  // @routine
+            createMneumonic(&chunk[chunk_index++], OPCODE_JUMP, NULL, COMP_0, DEST_UNKNOWN, JUMP_JMP, 0);                          // 0;JMP
+            createMneumonic(&chunk[chunk_index++], OPCODE_SYMBOL, return_label, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);      // (return)
+            index += routine->length;
+        }
+        else {
+            chunk[chunk_index++] = instructions[index++].mneumonic;
+        }
+
+        if (chunk_index >= 64 || index == total) {
+            result = writeMneumonics(assembly_gen, &stack_arena, chunk, chunk_index);
+            stackArenaPop(&stack_arena, stackArenaPosition(&stack_arena) - position);
+            chunk_index = 0;
+        }
+    }
+
+    for (size_t routine = 0; routine < total_routines && result == 0; routine++) {
+        chunk_index = 0;
+        createMneumonic(&chunk[chunk_index++], OPCODE_SYMBOL, routines[routine].label, COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0); // (routine)
+        createMneumonic(&chunk[chunk_index++], OPCODE_A_SYMBOL, "R15", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);                // @R15
+        createMneumonic(&chunk[chunk_index++], OPCODE_COMPUTE, NULL, COMP_D, DEST_M, JUMP_UNKNOWN, 0);                              // M=D
+        for (size_t offset = 0; offset < routines[routine].length; offset++) {
+            chunk[chunk_index++] = instructions[routines[routine].first + offset].mneumonic;
+        }
+        createMneumonic(&chunk[chunk_index++], OPCODE_A_SYMBOL, "R15", COMP_UNKNOWN, DEST_UNKNOWN, JUMP_UNKNOWN, 0);                // @R15
+        createMneumonic(&chunk[chunk_index++], OPCODE_COMPUTE, NULL, COMP_M, DEST_A, JUMP_UNKNOWN, 0);                              // A=M
+        createMneumonic(&chunk[chunk_index++], OPCODE_JUMP, NULL, COMP_0, DEST_UNKNOWN, JUMP_JMP, 0);                               // 0;JMP
+
+        result = writeMneumonics(assembly_gen, &stack_arena, chunk, chunk_index);
+        stackArenaPop(&stack_arena, stackArenaPosition(&stack_arena) - position);
+    }
+
+    if (result == 0 && fflush(assembly_gen->output_file) < 0) {
+        result = -1;
+    }
+
+    stackArenaRelease(&stack_arena);
+    stackArenaRelease(&assembly_gen->outline_instructions);
+    stackArenaRelease(&assembly_gen->outline_labels);
+    return result;
+}
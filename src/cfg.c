@@ -0,0 +1,398 @@
+#include "../include/cfg.h"
+#include "../include/command.h"
+#include "../include/stack_arena.h"
+
+#include <assert.h>
+#include <string.h>
+
+
+static uint32_t hashLabel(uint32_t function, const char* label)
+{
+    uint32_t hash = 2166136261u ^ (function * 0x9E3779B9u);
+    for (; *label != '\0'; label++) {
+        hash = (hash ^ (uint8_t) *label) * 16777619u;
+    }
+    return hash;
+}
+
+/* Number of values a command takes off the stack and puts on it */
+static void stackUse(const command_t* command, int32_t* pops, int32_t* pushes)
+{
+    *pops = 0;
+    *pushes = 0;
+
+    switch (command->op) {
+        case OP_PUSH:
+            *pushes = 1;
+            break;
+        case OP_POP:
+        case OP_IFGOTO:
+        case OP_IFNOTGOTO:
+        case OP_RETURN:
+        case OP_LEAFRETURN:
+            *pops = 1;
+            break;
+        case OP_IFLT:
+        case OP_IFGT:
+        case OP_IFEQ:
+        case OP_IFGE:
+        case OP_IFLE:
+        case OP_IFNE:
+            *pops = 2;
+            break;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_AND:
+        case OP_OR:
+        case OP_EQ:
+        case OP_LT:
+        case OP_GT:
+            *pops = 2;
+            *pushes = 1;
+            break;
+        case OP_NEG:
+        case OP_NOT:
+        case OP_MULTIPLY:
+            *pops = 1;
+            *pushes = 1;
+            break;
+        case OP_CALL:
+        case OP_LEAFCALL:
+            *pops = command->arguments.flow.locals;   // Arguments
+            *pushes = 1;                                // Return value
+            break;
+        case OP_TAILCALL:
+            *pops = command->arguments.flow.locals;   // Arguments, the callee returns for the function
+            break;
+        default:
+            break;
+    }
+}
+
+/* Net change in stack depth a command causes */
+int32_t cfgStackEffect(const command_t* command)
+{
+    assert(command != NULL);
+
+    int32_t pops, pushes;
+    stackUse(command, &pops, &pushes);
+    return pushes - pops;
+}
+
+/* Find the block a label starts in the given function
+ * Return CFG_NO_BLOCK if the function doesn't define it */
+uint32_t cfgFindLabel(cfg_t* cfg, uint32_t function, const char* label)
+{
+    assert(cfg != NULL && label != NULL);
+
+    size_t slot = hashLabel(function, label) & (cfg->label_capacity - 1);
+    while (cfg->labels[slot] != 0) {
+        size_t command_index = cfg->labels[slot] - 1;
+        uint32_t block = cfg->command_blocks[command_index];
+
+        if (cfg->blocks[block].function == function &&
+            strcmp(cfg->commands->commands[command_index].arguments.flow.label, label) == 0) {
+            return block;
+        }
+        slot = (slot + 1) & (cfg->label_capacity - 1);
+    }
+
+    return CFG_NO_BLOCK;
+}
+
+/* Build the graph over a command module, the module is referenced, not copied
+ * Return 0 on success
+ * Return -1 on failure */
+int32_t cfgBuild(cfg_t* cfg, command_module_t* commands)
+{
+    assert(cfg != NULL && commands != NULL);
+
+    memset(cfg, 0, sizeof(cfg_t));
+    cfg->commands = commands;
+
+    size_t total_commands = commands->total_commands;
+    size_t total_labels = 0;
+    size_t total_functions = 1;
+    for (size_t index = 0; index < total_commands; index++) {
+        total_labels += commands->commands[index].op == OP_LABEL;
+        total_functions += OP_IS_FUNCTION(commands->commands[index].op);
+    }
+
+    cfg->label_capacity = 16;
+    while (cfg->label_capacity < total_labels * 2) {
+        cfg->label_capacity <<= 1;
+    }
+
+    /* Blocks get the worklist of cfgMarkReachable on top */
+    size_t arena_size = (total_commands + 1) * (sizeof(cfg_block_t) + sizeof(uint32_t)) +
+                        total_functions * sizeof(cfg_function_t) +
+                        total_commands * (sizeof(uint32_t) + sizeof(uint8_t)) +
+                        cfg->label_capacity * sizeof(uint32_t) + 64;
+
+    if (stackArenaInitialize(&cfg->stack_arena, arena_size) < 0) {
+        return -1;
+    }
+
+    /* The arena is mmap'd so everything starts out zeroed */
+    cfg->blocks = stackArenaPush(&cfg->stack_arena, (total_commands + 1) * sizeof(cfg_block_t));
+    cfg->functions = stackArenaPush(&cfg->stack_arena, total_functions * sizeof(cfg_function_t));
+    cfg->labels = stackArenaPush(&cfg->stack_arena, cfg->label_capacity * sizeof(uint32_t));
+    cfg->command_blocks = stackArenaPush(&cfg->stack_arena, total_commands * sizeof(uint32_t) + 1);
+    cfg->removed = stackArenaPush(&cfg->stack_arena, total_commands + 1);
+    if (cfg->blocks == NULL || cfg->functions == NULL || cfg->labels == NULL ||
+        cfg->command_blocks == NULL || cfg->removed == NULL) {
+
+        stackArenaRelease(&cfg->stack_arena);
+        return -1;
+    }
+
+    /* Pass 1, find the blocks. One starts at every function, every label and
+     * after every goto, if-goto and return */
+    int32_t leader = 1;
+    for (size_t index = 0; index < total_commands; index++) {
+        command_t* command = &commands->commands[index];
+
+        if (OP_IS_FUNCTION(command->op) || index == 0) {
+            if (cfg->total_functions != 0) {
+                cfg_function_t* previous = &cfg->functions[cfg->total_functions - 1];
+                previous->total_blocks = cfg->total_blocks - previous->first_block;
+            }
+
+            cfg_function_t* function = &cfg->functions[cfg->total_functions++];
+            function->name = OP_IS_FUNCTION(command->op) ? command->arguments.flow.label : NULL;
+            function->first_block = cfg->total_blocks;
+            leader = 1;
+        }
+
+        if (command->op == OP_LABEL) {
+            leader = 1;
+        }
+
+        if (leader) {
+            cfg_block_t* block = &cfg->blocks[cfg->total_blocks++];
+            block->first_command = index;
+            block->function = (uint32_t) (cfg->total_functions - 1);
+            block->successors[0] = CFG_NO_BLOCK;
+            block->successors[1] = CFG_NO_BLOCK;
+            leader = 0;
+        }
+
+        uint32_t block = (uint32_t) (cfg->total_blocks - 1);
+        cfg->blocks[block].total_commands++;
+        cfg->command_blocks[index] = block;
+
+        if (command->op == OP_LABEL) {
+            size_t slot = hashLabel(cfg->blocks[block].function, command->arguments.flow.label) & (cfg->label_capacity - 1);
+            while (cfg->labels[slot] != 0) {
+                slot = (slot + 1) & (cfg->label_capacity - 1);
+            }
+            cfg->labels[slot] = (uint32_t) (index + 1);
+        }
+
+        if (command->op == OP_GOTO || OP_IS_CONDITIONAL(command->op) || OP_IS_RETURN(command->op) ||
+            command->op == OP_TAILCALL) {
+            leader = 1;
+        }
+    }
+
+    if (cfg->total_functions != 0) {
+        cfg_function_t* last = &cfg->functions[cfg->total_functions - 1];
+        last->total_blocks = cfg->total_blocks - last->first_block;
+    }
+
+    /* Pass 2, summarize every block and link it to its successors */
+    for (size_t index = 0; index < cfg->total_blocks; index++) {
+        cfg_block_t* block = &cfg->blocks[index];
+        int32_t depth = 0;
+
+        for (size_t offset = 0; offset < block->total_commands; offset++) {
+            command_t* command = &commands->commands[block->first_command + offset];
+            int32_t pops, pushes;
+            stackUse(command, &pops, &pushes);
+
+            if (depth - pops < block->stack_low) {
+                block->stack_low = depth - pops;
+            }
+            depth += pushes - pops;
+
+            if (command->op == OP_PUSH && command->arguments.memory.segment != SEG_CONSTANT) {
+                block->segment_uses |= 1u << command->arguments.memory.segment;
+            }
+            else if (command->op == OP_POP) {
+                block->segment_defs |= 1u << command->arguments.memory.segment;
+            }
+            else if (command->op == OP_MOVE) {
+                if (command->arguments.move.from_segment != SEG_CONSTANT) {
+                    block->segment_uses |= 1u << command->arguments.move.from_segment;
+                }
+                block->segment_defs |= 1u << command->arguments.move.to_segment;
+            }
+            else if (OP_IS_CALL(command->op) || command->op == OP_TAILCALL || command->op == OP_MULTIPLY) {
+                block->flags |= CFG_BLOCK_CALLS;
+            }
+        }
+        block->stack_effect = depth;
+
+        command_t* last = &commands->commands[block->first_command + block->total_commands - 1];
+        if (last->op != OP_GOTO && !OP_IS_RETURN(last->op) && last->op != OP_TAILCALL &&
+            index + 1 < cfg->total_blocks && cfg->blocks[index + 1].function == block->function) {
+
+            block->successors[0] = (uint32_t) (index + 1);
+        }
+
+        if (last->op == OP_GOTO || OP_IS_CONDITIONAL(last->op)) {
+            block->successors[1] = cfgFindLabel(cfg, block->function, last->arguments.flow.label);
+            if (block->successors[1] == CFG_NO_BLOCK) {
+                block->flags |= CFG_BLOCK_ESCAPES;
+                cfg->total_unresolved++;
+            }
+        }
+        else if (OP_IS_RETURN(last->op) || last->op == OP_TAILCALL) {
+            block->flags |= CFG_BLOCK_RETURNS;
+        }
+
+        for (size_t successor = 0; successor < 2; successor++) {
+            if (block->successors[successor] != CFG_NO_BLOCK) {
+                cfg->blocks[block->successors[successor]].total_predecessors++;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* Destroys a graph, the command module is left alone */
+void cfgDestroy(cfg_t* cfg)
+{
+    assert(cfg != NULL && cfg->blocks != NULL);
+
+    stackArenaRelease(&cfg->stack_arena);
+    memset(cfg, 0, sizeof(cfg_t));
+}
+
+/* Mark a command for removal, it is dropped from the module by cfgCompact */
+void cfgRemoveCommand(cfg_t* cfg, size_t command_index)
+{
+    assert(cfg != NULL && command_index < cfg->commands->total_commands);
+
+    if (!cfg->removed[command_index]) {
+        cfg->removed[command_index] = 1;
+        cfg->total_removed++;
+    }
+}
+
+/* Drop the removed commands from the module and rebuild the graph
+ * Return 0 on success
+ * Return -1 on failure, the graph is gone */
+int32_t cfgCompact(cfg_t* cfg)
+{
+    assert(cfg != NULL && cfg->blocks != NULL);
+
+    command_module_t* commands = cfg->commands;
+    size_t kept = 0;
+    for (size_t index = 0; index < commands->total_commands; index++) {
+        if (!cfg->removed[index]) {
+            commands->commands[kept++] = commands->commands[index];
+        }
+    }
+    commands->total_commands = kept;
+
+    cfgDestroy(cfg);
+    return cfgBuild(cfg, commands);
+}
+
+/* Give the module a rearranged array of commands, on memory that outlives the
+ * graph, and rebuild over it. Marks for removal go with the old graph, the
+ * caller leaves those commands out
+ * Return 0 on success
+ * Return -1 on failure, the graph is gone */
+int32_t cfgReplaceCommands(cfg_t* cfg, command_t* commands, size_t total_commands)
+{
+    assert(cfg != NULL && cfg->blocks != NULL && (commands != NULL || total_commands == 0));
+
+    command_module_t* module = cfg->commands;
+    module->commands = commands;
+    module->total_commands = total_commands;
+
+    cfgDestroy(cfg);
+    return cfgBuild(cfg, module);
+}
+
+/* Set CFG_BLOCK_REACHABLE on every block reachable from the start of its
+ * function. Labels jumped to from outside their function are roots too */
+void cfgMarkReachable(cfg_t* cfg)
+{
+    assert(cfg != NULL && cfg->blocks != NULL);
+
+    uint32_t* worklist = stackArenaPush(&cfg->stack_arena, (cfg->total_blocks + 1) * sizeof(uint32_t));
+    assert(worklist != NULL);   // Sized for in cfgBuild
+    size_t total_work = 0;
+
+    for (size_t index = 0; index < cfg->total_blocks; index++) {
+        cfg->blocks[index].flags &= ~CFG_BLOCK_REACHABLE;
+    }
+
+    for (size_t function = 0; function < cfg->total_functions; function++) {
+        if (cfg->functions[function].total_blocks != 0) {
+            uint32_t entry = (uint32_t) cfg->functions[function].first_block;
+            cfg->blocks[entry].flags |= CFG_BLOCK_REACHABLE;
+            worklist[total_work++] = entry;
+        }
+    }
+
+    /* Jumps that escape their function can only land on a label of the same name elsewhere */
+    for (size_t index = 0; index < cfg->total_blocks && cfg->total_unresolved != 0; index++) {
+        cfg_block_t* block = &cfg->blocks[index];
+        if (!(block->flags & CFG_BLOCK_ESCAPES)) {
+            continue;
+        }
+
+        const char* label = cfg->commands->commands[block->first_command + block->total_commands - 1].arguments.flow.label;
+        for (size_t function = 0; function < cfg->total_functions; function++) {
+            uint32_t target = cfgFindLabel(cfg, (uint32_t) function, label);
+            if (target != CFG_NO_BLOCK && !(cfg->blocks[target].flags & CFG_BLOCK_REACHABLE)) {
+                cfg->blocks[target].flags |= CFG_BLOCK_REACHABLE;
+                worklist[total_work++] = target;
+            }
+        }
+    }
+
+    while (total_work != 0) {
+        cfg_block_t* block = &cfg->blocks[worklist[--total_work]];
+        for (size_t successor = 0; successor < 2; successor++) {
+            uint32_t next = block->successors[successor];
+            if (next != CFG_NO_BLOCK && !(cfg->blocks[next].flags & CFG_BLOCK_REACHABLE)) {
+                cfg->blocks[next].flags |= CFG_BLOCK_REACHABLE;
+                worklist[total_work++] = next;
+            }
+        }
+    }
+
+    stackArenaPop(&cfg->stack_arena, (cfg->total_blocks + 1) * sizeof(uint32_t));
+}
+
+/* Run passes in order, the graph is compacted and rebuilt after every pass
+ * that changed something so the next one sees the result
+ * Return the total number of changes on success
+ * Return -1 on failure */
+int32_t cfgRunPasses(cfg_t* cfg, const cfg_pass_t* passes, size_t total_passes)
+{
+    assert(cfg != NULL && cfg->blocks != NULL && (passes != NULL || total_passes == 0));
+
+    int32_t total_changes = 0;
+    for (size_t index = 0; index < total_passes; index++) {
+        int32_t changes = passes[index].run(cfg, passes[index].context);
+        if (changes < 0) {
+            return -1;
+        }
+
+        if (changes > 0) {
+            if (cfgCompact(cfg) < 0) {
+                return -1;
+            }
+            total_changes += changes;
+        }
+    }
+
+    return total_changes;
+}
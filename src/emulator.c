@@ -0,0 +1,579 @@
+#include "../include/emulator.h"
+#include "../include/stack_arena.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/* Decode table indexed by the 7 comp bits (a c1 c2 c3 c4 c5 c6) of a C-instruction */
+static const uint8_t ALU_DECODE_TABLE[128] = {
+    [0x2A] = ALU_0,         [0x3F] = ALU_1,         [0x3A] = ALU_NEG_1,
+    [0x0C] = ALU_D,         [0x30] = ALU_A,         [0x0D] = ALU_NOT_D,
+    [0x31] = ALU_NOT_A,     [0x0F] = ALU_NEG_D,     [0x33] = ALU_NEG_A,
+    [0x1F] = ALU_D_PLUS_1,  [0x37] = ALU_A_PLUS_1,  [0x0E] = ALU_D_MINUS_1,
+    [0x32] = ALU_A_MINUS_1, [0x02] = ALU_D_PLUS_A,  [0x13] = ALU_D_MINUS_A,
+    [0x07] = ALU_A_MINUS_D, [0x00] = ALU_D_AND_A,   [0x15] = ALU_D_OR_A,
+    [0x70] = ALU_M,         [0x71] = ALU_NOT_M,     [0x73] = ALU_NEG_M,
+    [0x77] = ALU_M_PLUS_1,  [0x72] = ALU_M_MINUS_1, [0x42] = ALU_D_PLUS_M,
+    [0x53] = ALU_D_MINUS_M, [0x47] = ALU_M_MINUS_D, [0x40] = ALU_D_AND_M,
+    [0x55] = ALU_D_OR_M,
+};
+
+/* Mnemonic to comp bits mapping used by the assembler, commuted forms are accepted too */
+typedef struct {
+    const char* mnemonic;
+    uint8_t     bits;
+} comp_mnemonic_t;
+
+static const comp_mnemonic_t COMP_MNEMONIC_MAPPING[] = {
+    {"0", 0x2A},   {"1", 0x3F},   {"-1", 0x3A},  {"D", 0x0C},   {"A", 0x30},   {"!D", 0x0D},
+    {"!A", 0x31},  {"-D", 0x0F},  {"-A", 0x33},  {"D+1", 0x1F}, {"A+1", 0x37}, {"D-1", 0x0E},
+    {"A-1", 0x32}, {"D+A", 0x02}, {"A+D", 0x02}, {"D-A", 0x13}, {"A-D", 0x07}, {"D&A", 0x00},
+    {"A&D", 0x00}, {"D|A", 0x15}, {"A|D", 0x15}, {"M", 0x70},   {"!M", 0x71},  {"-M", 0x73},
+    {"M+1", 0x77}, {"M-1", 0x72}, {"D+M", 0x42}, {"M+D", 0x42}, {"D-M", 0x53}, {"M-D", 0x47},
+    {"D&M", 0x40}, {"M&D", 0x40}, {"D|M", 0x55}, {"M|D", 0x55},
+};
+
+static char const* const JUMP_MNEMONIC_MAPPING[8] = {"", "JGT", "JEQ", "JGE", "JLT", "JNE", "JLE", "JMP"};
+
+
+/* Initialize an emulator, allocating its ROM and RAM
+ * Return 0 on success
+ * Return -1 on failure */
+int32_t emulatorInitialize(emulator_t* emulator)
+{
+    assert(emulator != NULL);
+
+    memset(emulator, 0, sizeof(emulator_t));
+
+    /* One extra ROM slot so that pc running off the last word still lands on a halt op */
+    emulator->rom = mmap(NULL, (EMULATOR_ROM_SIZE + 1) * sizeof(emulator_op_t), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (emulator->rom == MAP_FAILED) {
+        emulator->rom = NULL;
+        return -1;
+    }
+
+    emulator->ram = mmap(NULL, EMULATOR_RAM_SIZE * sizeof(uint16_t), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (emulator->ram == MAP_FAILED) {
+        munmap(emulator->rom, (EMULATOR_ROM_SIZE + 1) * sizeof(emulator_op_t));
+        emulator->rom = NULL;
+        emulator->ram = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Destroys an emulator, releasing its ROM and RAM */
+void emulatorDestroy(emulator_t* emulator)
+{
+    assert(emulator != NULL && emulator->rom != NULL && emulator->ram != NULL);
+
+    munmap(emulator->rom, (EMULATOR_ROM_SIZE + 1) * sizeof(emulator_op_t));
+    munmap(emulator->ram, EMULATOR_RAM_SIZE * sizeof(uint16_t));
+
+    memset(emulator, 0, sizeof(emulator_t));
+}
+
+/* Decode a single 16 bit instruction word into a micro-op
+ * Return 0 on success
+ * Return -1 if the word is not a valid instruction */
+static int32_t decodeInstruction(uint16_t word, emulator_op_t* op)
+{
+    if ((word & 0x8000) == 0) {
+        op->alu = ALU_LOAD;
+        op->value = word;
+        op->control = 0;
+        return 0;
+    }
+
+    op->alu = ALU_DECODE_TABLE[(word >> 6) & 0x7F];
+    op->value = 0;
+    op->control = (uint8_t) (word & 0x3F);
+
+    return op->alu == ALU_INVALID ? -1 : 0;
+}
+
+/* Fill the unused part of the ROM with halt ops and reset the machine */
+static void emulatorFinishLoad(emulator_t* emulator, size_t rom_size)
+{
+    for (size_t index = rom_size; index <= EMULATOR_ROM_SIZE; index++) {
+        emulator->rom[index].alu = ALU_HALT;
+        emulator->rom[index].value = 0;
+        emulator->rom[index].control = 0;
+    }
+
+    emulator->rom_size = rom_size;
+    emulatorReset(emulator);
+}
+
+/* Find the end of the line starting at position, stores the length of the line
+ * (without the newline or a trailing carriage return) in line_length.
+ * Return the position of the next line */
+static size_t nextLine(const char* text, size_t size, size_t position, size_t* line_length)
+{
+    const char* newline = memchr(text + position, '\n', size - position);
+    size_t end = newline != NULL ? (size_t) (newline - text) : size;
+
+    *line_length = end - position;
+    if (*line_length > 0 && text[end - 1] == '\r') {
+        *line_length -= 1;
+    }
+
+    return newline != NULL ? end + 1 : size;
+}
+
+/* Load a program in the textual .hack format, one 16 character binary word per line
+ * Return 0 on success
+ * Return -1 on failure */
+int32_t emulatorLoadHack(emulator_t* emulator, const char* text, size_t size)
+{
+    assert(emulator != NULL && emulator->rom != NULL && text != NULL);
+
+    size_t rom_size = 0;
+    size_t position = 0;
+
+    while (position < size) {
+        size_t line_length = 0;
+        const char* line = text + position;
+        position = nextLine(text, size, position, &line_length);
+
+        if (line_length == 0) {
+            continue;
+        }
+
+        if (line_length != 16 || rom_size >= EMULATOR_ROM_SIZE) {
+            return -1;
+        }
+
+        uint16_t word = 0;
+        for (size_t index = 0; index < 16; index++) {
+            if (line[index] != '0' && line[index] != '1') {
+                return -1;
+            }
+            word = (uint16_t) ((word << 1) | (line[index] - '0'));
+        }
+
+        if (decodeInstruction(word, &emulator->rom[rom_size++]) < 0) {
+            return -1;
+        }
+    }
+
+    emulatorFinishLoad(emulator, rom_size);
+    return 0;
+}
+
+
+/* Symbol table used by the assembler, open addressing keyed on the symbol text */
+
+typedef struct {
+    const char* name;
+    size_t      length;
+    uint16_t    value;
+} symbol_t;
+
+typedef struct {
+    symbol_t* symbols;
+    size_t    capacity;         /* Always a power of two */
+} symbol_table_t;
+
+static uint32_t hashSymbol(const char* name, size_t length)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    for (size_t index = 0; index < length; index++) {
+        hash = (hash ^ (uint8_t) name[index]) * 16777619u;
+    }
+    return hash;
+}
+
+/* Find the slot for the given symbol, either the one holding it or the empty one it belongs in */
+static symbol_t* symbolTableFind(symbol_table_t* table, const char* name, size_t length)
+{
+    size_t slot = hashSymbol(name, length) & (table->capacity - 1);
+
+    while (table->symbols[slot].name != NULL) {
+        if (table->symbols[slot].length == length && memcmp(table->symbols[slot].name, name, length) == 0) {
+            break;
+        }
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+
+    return &table->symbols[slot];
+}
+
+static void symbolTableInsert(symbol_table_t* table, const char* name, size_t length, uint16_t value)
+{
+    symbol_t* symbol = symbolTableFind(table, name, length);
+    symbol->name = name;
+    symbol->length = length;
+    symbol->value = value;
+}
+
+/* Strip comments and whitespace from an assembly line in place into buffer.
+ * Return the length of the cleaned line */
+static size_t cleanAssemblyLine(const char* line, size_t line_length, char* buffer)
+{
+    size_t length = 0;
+
+    for (size_t index = 0; index < line_length; index++) {
+        if (line[index] == '/' && index + 1 < line_length && line[index + 1] == '/') {
+            break;
+        }
+        if (line[index] != ' ' && line[index] != '\t' && line[index] != '\r') {
+            buffer[length++] = line[index];
+        }
+    }
+
+    return length;
+}
+
+/* Assemble a C-instruction such as AM=M-1 or D;JGT into its word
+ * Return 0 on success
+ * Return -1 on failure */
+static int32_t assembleComputeInstruction(const char* line, size_t length, uint16_t* word)
+{
+    const char* comp = line;
+    size_t comp_length = length;
+    uint16_t dest = 0;
+    uint16_t jump = 0;
+
+    const char* equals = memchr(line, '=', length);
+    if (equals != NULL) {
+        for (const char* c = line; c < equals; c++) {
+            switch (*c) {
+                case 'A': dest |= CONTROL_DEST_A; break;
+                case 'D': dest |= CONTROL_DEST_D; break;
+                case 'M': dest |= CONTROL_DEST_M; break;
+                default: return -1;
+            }
+        }
+        comp = equals + 1;
+        comp_length = length - (size_t) (comp - line);
+    }
+
+    const char* semicolon = memchr(comp, ';', comp_length);
+    if (semicolon != NULL) {
+        size_t jump_length = comp_length - (size_t) (semicolon - comp) - 1;
+        comp_length = (size_t) (semicolon - comp);
+
+        for (jump = 1; jump < 8; jump++) {
+            if (jump_length == 3 && memcmp(semicolon + 1, JUMP_MNEMONIC_MAPPING[jump], 3) == 0) {
+                break;
+            }
+        }
+        if (jump == 8) {
+            return -1;
+        }
+    }
+
+    for (size_t index = 0; index < sizeof(COMP_MNEMONIC_MAPPING) / sizeof(COMP_MNEMONIC_MAPPING[0]); index++) {
+        if (strlen(COMP_MNEMONIC_MAPPING[index].mnemonic) == comp_length &&
+            memcmp(COMP_MNEMONIC_MAPPING[index].mnemonic, comp, comp_length) == 0) {
+
+            *word = (uint16_t) (0xE000 | (COMP_MNEMONIC_MAPPING[index].bits << 6) | dest | jump);
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* Load a program written in Hack assembly, assembling it in two passes
+ * Return 0 on success
+ * Return -1 on failure */
+int32_t emulatorLoadAssembly(emulator_t* emulator, const char* text, size_t size)
+{
+    /* Steps
+     * 1. Count the lines to size the symbol table and line buffer
+     * 2. First pass, record the ROM address of every (LABEL)
+     * 3. Second pass, assemble every instruction, allocating variables from RAM 16 upwards
+     */
+
+    assert(emulator != NULL && emulator->rom != NULL && text != NULL);
+
+    static char const* const PREDEFINED_SYMBOLS[] = {"SP", "LCL", "ARG", "THIS", "THAT",
+        "R0", "R1", "R2", "R3", "R4", "R5", "R6", "R7", "R8", "R9", "R10", "R11", "R12", "R13", "R14", "R15"};
+    static const uint16_t PREDEFINED_VALUES[] = {0, 1, 2, 3, 4, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+
+    size_t total_lines = 0;
+    size_t longest_line = 0;
+    for (size_t position = 0; position < size; total_lines++) {
+        size_t line_length = 0;
+        position = nextLine(text, size, position, &line_length);
+        if (line_length > longest_line) {
+            longest_line = line_length;
+        }
+    }
+
+    symbol_table_t table;
+    table.capacity = 64;
+    while (table.capacity < 2 * (total_lines + 32)) {
+        table.capacity *= 2;
+    }
+
+    stack_arena_t stack_arena;
+    if (stackArenaInitialize(&stack_arena, table.capacity * sizeof(symbol_t) + longest_line + 1) < 0) {
+        return -1;
+    }
+
+    table.symbols = stackArenaPush(&stack_arena, table.capacity * sizeof(symbol_t));
+    char* buffer = stackArenaPush(&stack_arena, longest_line + 1);
+
+    /* Lines of the program are borrowed as symbol names, so predefined ones need static storage too */
+    for (size_t index = 0; index < sizeof(PREDEFINED_VALUES) / sizeof(PREDEFINED_VALUES[0]); index++) {
+        symbolTableInsert(&table, PREDEFINED_SYMBOLS[index], strlen(PREDEFINED_SYMBOLS[index]), PREDEFINED_VALUES[index]);
+    }
+    symbolTableInsert(&table, "SCREEN", 6, 16384);
+    symbolTableInsert(&table, "KBD", 3, 24576);
+
+    /* First pass, labels */
+    size_t rom_size = 0;
+    for (size_t position = 0; position < size; ) {
+        size_t line_length = 0;
+        const char* line = text + position;
+        position = nextLine(text, size, position, &line_length);
+
+        size_t length = cleanAssemblyLine(line, line_length, buffer);
+        if (length == 0) {
+            continue;
+        }
+
+        if (buffer[0] == '(') {
+            if (length < 3 || buffer[length - 1] != ')') {
+                stackArenaRelease(&stack_arena);
+                return -1;
+            }
+
+            /* Point the symbol at the original text, the buffer gets reused */
+            const char* name = (const char*) memchr(line, '(', line_length) + 1;
+            symbolTableInsert(&table, name, length - 2, (uint16_t) rom_size);
+        }
+        else {
+            rom_size++;
+        }
+    }
+
+    if (rom_size > EMULATOR_ROM_SIZE) {
+        stackArenaRelease(&stack_arena);
+        return -1;
+    }
+
+    /* Second pass, instructions */
+    uint16_t next_variable = 16;
+    rom_size = 0;
+    for (size_t position = 0; position < size; ) {
+        size_t line_length = 0;
+        const char* line = text + position;
+        position = nextLine(text, size, position, &line_length);
+
+        size_t length = cleanAssemblyLine(line, line_length, buffer);
+        if (length == 0 || buffer[0] == '(') {
+            continue;
+        }
+
+        uint16_t word = 0;
+
+        if (buffer[0] == '@') {
+            if (buffer[1] >= '0' && buffer[1] <= '9') {
+                char* endptr = NULL;
+                buffer[length] = '\0';
+                long value = strtol(buffer + 1, &endptr, 10);
+                if (*endptr != '\0' || value < 0 || value > 0x7FFF) {
+                    stackArenaRelease(&stack_arena);
+                    return -1;
+                }
+                word = (uint16_t) value;
+            }
+            else {
+                const char* name = (const char*) memchr(line, '@', line_length) + 1;
+                symbol_t* symbol = symbolTableFind(&table, name, length - 1);
+                if (symbol->name == NULL) {
+                    symbolTableInsert(&table, name, length - 1, next_variable++);
+                }
+                word = symbol->value;
+            }
+        }
+        else if (assembleComputeInstruction(buffer, length, &word) < 0) {
+            stackArenaRelease(&stack_arena);
+            return -1;
+        }
+
+        decodeInstruction(word, &emulator->rom[rom_size++]);
+    }
+
+    stackArenaRelease(&stack_arena);
+
+    emulatorFinishLoad(emulator, rom_size);
+    return 0;
+}
+
+/* Load a program from a file, either .hack binary text or assembly. The format
+ * is sniffed from the first line rather than trusted from the extension
+ * Return 0 on success
+ * Return -1 on failure */
+int32_t emulatorLoadFile(emulator_t* emulator, const char* filepath)
+{
+    assert(emulator != NULL && filepath != NULL);
+
+    int32_t fd = open(filepath, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat file_status;
+    if (fstat(fd, &file_status) < 0 || file_status.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+
+    size_t size = (size_t) file_status.st_size;
+    char* text = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED) {
+        return -1;
+    }
+
+    size_t first_line = 0;
+    nextLine(text, size, 0, &first_line);
+
+    int32_t binary = first_line == 16;
+    for (size_t index = 0; binary && index < first_line; index++) {
+        binary = text[index] == '0' || text[index] == '1';
+    }
+
+    int32_t result = binary ? emulatorLoadHack(emulator, text, size) : emulatorLoadAssembly(emulator, text, size);
+
+    munmap(text, size);
+    return result;
+}
+
+/* Reset the CPU registers, cycle count and RAM, the loaded program is kept */
+void emulatorReset(emulator_t* emulator)
+{
+    assert(emulator != NULL && emulator->ram != NULL);
+
+    memset(emulator->ram, 0, EMULATOR_RAM_SIZE * sizeof(uint16_t));
+    emulator->a = 0;
+    emulator->d = 0;
+    emulator->pc = 0;
+    emulator->cycles = 0;
+}
+
+/* Run the loaded program for at most budget cycles, the machine state is kept
+ * between calls so a run can be resumed
+ * Return EMULATOR_HALTED if the program halted
+ * Return EMULATOR_BUDGET if the budget ran out */
+emulator_status_t emulatorRun(emulator_t* emulator, uint64_t budget)
+{
+    assert(emulator != NULL && emulator->rom != NULL);
+
+    /* Working copies live in locals so the compiler can keep them in registers */
+    const emulator_op_t* const rom = emulator->rom;
+    uint16_t* const ram = emulator->ram;
+    uint16_t a = emulator->a;
+    uint16_t d = emulator->d;
+    uint16_t pc = emulator->pc;
+
+    emulator_status_t status = EMULATOR_BUDGET;
+    uint64_t cycle = 0;
+
+    while (cycle < budget) {
+        const emulator_op_t op = rom[pc];
+        uint16_t result;
+
+        switch (op.alu) {
+            case ALU_LOAD:
+                a = op.value;
+                pc++;
+                cycle++;
+                continue;
+
+            case ALU_0:         result = 0; break;
+            case ALU_1:         result = 1; break;
+            case ALU_NEG_1:     result = 0xFFFF; break;
+            case ALU_D:         result = d; break;
+            case ALU_A:         result = a; break;
+            case ALU_NOT_D:     result = (uint16_t) ~d; break;
+            case ALU_NOT_A:     result = (uint16_t) ~a; break;
+            case ALU_NEG_D:     result = (uint16_t) -d; break;
+            case ALU_NEG_A:     result = (uint16_t) -a; break;
+            case ALU_D_PLUS_1:  result = (uint16_t) (d + 1); break;
+            case ALU_A_PLUS_1:  result = (uint16_t) (a + 1); break;
+            case ALU_D_MINUS_1: result = (uint16_t) (d - 1); break;
+            case ALU_A_MINUS_1: result = (uint16_t) (a - 1); break;
+            case ALU_D_PLUS_A:  result = (uint16_t) (d + a); break;
+            case ALU_D_MINUS_A: result = (uint16_t) (d - a); break;
+            case ALU_A_MINUS_D: result = (uint16_t) (a - d); break;
+            case ALU_D_AND_A:   result = d & a; break;
+            case ALU_D_OR_A:    result = d | a; break;
+            case ALU_M:         result = ram[a & EMULATOR_ADDRESS_MASK]; break;
+            case ALU_NOT_M:     result = (uint16_t) ~ram[a & EMULATOR_ADDRESS_MASK]; break;
+            case ALU_NEG_M:     result = (uint16_t) -ram[a & EMULATOR_ADDRESS_MASK]; break;
+            case ALU_M_PLUS_1:  result = (uint16_t) (ram[a & EMULATOR_ADDRESS_MASK] + 1); break;
+            case ALU_M_MINUS_1: result = (uint16_t) (ram[a & EMULATOR_ADDRESS_MASK] - 1); break;
+            case ALU_D_PLUS_M:  result = (uint16_t) (d + ram[a & EMULATOR_ADDRESS_MASK]); break;
+            case ALU_D_MINUS_M: result = (uint16_t) (d - ram[a & EMULATOR_ADDRESS_MASK]); break;
+            case ALU_M_MINUS_D: result = (uint16_t) (ram[a & EMULATOR_ADDRESS_MASK] - d); break;
+            case ALU_D_AND_M:   result = d & ram[a & EMULATOR_ADDRESS_MASK]; break;
+            case ALU_D_OR_M:    result = d | ram[a & EMULATOR_ADDRESS_MASK]; break;
+
+            /* Ran off the end of the program */
+            default:
+                status = EMULATOR_HALTED;
+                goto finished;
+        }
+
+        cycle++;
+
+        /* The jump target is the value A held before this instruction wrote it */
+        const uint16_t target = a & EMULATOR_ADDRESS_MASK;
+
+        if (op.control & CONTROL_DEST_M) {
+            ram[a & EMULATOR_ADDRESS_MASK] = result;
+        }
+        if (op.control & CONTROL_DEST_A) {
+            a = result;
+        }
+        if (op.control & CONTROL_DEST_D) {
+            d = result;
+        }
+
+        if (op.control & CONTROL_JUMP) {
+            /* j1 is taken on negative, j2 on zero, j3 on positive */
+            uint8_t condition = result == 0 ? 2 : ((result & 0x8000) ? 4 : 1);
+
+            if (op.control & condition) {
+
+                /* A jump that changes no state to itself, or back onto the @X that loads its own address, can never end */
+                if ((op.control & (CONTROL_DEST_A | CONTROL_DEST_D | CONTROL_DEST_M)) == 0 &&
+                    (target == pc || (target + 1 == pc && rom[target].alu == ALU_LOAD && rom[target].value == target))) {
+                    pc = target;
+                    status = EMULATOR_HALTED;
+                    break;
+                }
+
+                pc = target;
+                continue;
+            }
+        }
+
+        pc++;
+    }
+
+finished:
+    emulator->a = a;
+    emulator->d = d;
+    emulator->pc = pc;
+    emulator->cycles += cycle;
+
+    return status;
+}
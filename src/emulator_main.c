@@ -0,0 +1,300 @@
+#include "../include/emulator.h"
+#include "../include/jit.h"
+#include "../include/parser.h"
+#include "../include/command.h"
+#include "../include/assembly_gen.h"
+#include "../include/stack_arena.h"
+#include "../include/profiler.h"
+#include "../include/optimize.h"
+#include "../include/profile.h"
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+void printUsage();
+
+/* A VM program translated in memory, kept around so the profiler can map ROM addresses back to it */
+typedef struct {
+    parser_t          parser;
+    stack_arena_t     stack_arena;
+    command_module_t  command_module;
+    rom_range_t*      rom_ranges;
+    char*             assembly;
+    size_t            assembly_size;
+} translation_t;
+
+/* Translate a VM file into an in memory assembly buffer, recording the ROM range of every command,
+ * guided by the execution counts in profile_path unless it is NULL, keeping calls to OS routines
+ * as calls if keep_calls is set
+ * Return 0 on success
+ * Return -1 on failure */
+static int32_t translate(translation_t* translation, const char* filepath, int32_t level, const char* profile_path,
+                         int32_t keep_calls)
+{
+    assembly_gen_t assembly_generator;
+    profile_t profile;
+
+    memset(translation, 0, sizeof(translation_t));
+    if (parserInitialize(&translation->parser, filepath) < 0) {
+        return -1;
+    }
+
+    /* A profile counts at most one command a byte */
+    if (stackArenaInitialize(&translation->stack_arena, 16 * translation->parser.file_size) < 0) {
+        parserDestroy(&translation->parser);
+        return -1;
+    }
+
+    command_module_t* modules[] = {&translation->command_module};
+    const profile_t* profiles[] = {profile_path != NULL ? &profile : NULL};
+    if (parserParseCommands(&translation->parser, &translation->command_module, &translation->stack_arena) < 0 ||
+        (profile_path != NULL && profileLoad(&profile, profile_path, filepath, &translation->stack_arena) < 0) ||
+        optimizeCommands(&translation->command_module, level, profile_path != NULL ? &profile : NULL, keep_calls) < 0 ||
+        (level > 0 && optimizeFoldFunctions(modules, 1) < 0) ||
+        optimizeLeafCalls(modules, 1, level, profiles) < 0 ||
+        /* assemblyGen wants a function first */
+        translation->command_module.total_commands == 0 ||
+        !OP_IS_FUNCTION(translation->command_module.commands[0].op)) {
+        parserDestroy(&translation->parser);
+        stackArenaRelease(&translation->stack_arena);
+        return -1;
+    }
+
+    translation->rom_ranges = stackArenaPush(&translation->stack_arena,
+                                             (translation->command_module.total_commands + 1) * sizeof(rom_range_t));
+
+    FILE* stream = open_memstream(&translation->assembly, &translation->assembly_size);
+    if (translation->rom_ranges == NULL || stream == NULL ||
+        assemblyGenInitializeStream(&assembly_generator, stream) < 0) {
+
+        if (stream != NULL) {
+            fclose(stream);
+            free(translation->assembly);
+        }
+        parserDestroy(&translation->parser);
+        stackArenaRelease(&translation->stack_arena);
+        return -1;
+    }
+
+    assembly_generator.rom_ranges = translation->rom_ranges;
+    assembly_generator.keep_calls = keep_calls;
+    assemblyGenSetGoal(&assembly_generator, optimizeGoal(level), &translation->command_module,
+                       profile_path != NULL ? &profile : NULL);
+
+    static_layout_t static_layout;
+
+    int32_t result = 0;
+    if (assemblyGenLayoutStatics(&assembly_generator, &static_layout, modules, &filepath, 1, stderr) < 0 ||
+        assemblyGenPreamble(&assembly_generator, "main") < 0 ||
+        assemblyGen(&assembly_generator, &translation->command_module, filepath) < 0) {
+        result = -1;
+    }
+
+    /* Closing the stream finalizes the buffer */
+    assemblyGenDestroy(&assembly_generator);
+
+    if (result < 0) {
+        free(translation->assembly);
+        parserDestroy(&translation->parser);
+        stackArenaRelease(&translation->stack_arena);
+    }
+
+    return result;
+}
+
+static void translationDestroy(translation_t* translation)
+{
+    free(translation->assembly);
+    parserDestroy(&translation->parser);
+    stackArenaRelease(&translation->stack_arena);
+}
+
+static int32_t writeReport(profiler_t* profiler, const char* filepath, int32_t (*write)(profiler_t*, FILE*))
+{
+    FILE* output_file = strcmp(filepath, "-") == 0 ? stdout : fopen(filepath, "w");
+    if (output_file == NULL) {
+        return -1;
+    }
+
+    int32_t result = write(profiler, output_file);
+    if (output_file != stdout) {
+        fclose(output_file);
+    }
+    return result;
+}
+
+int main(int argc, char* argv[])
+{
+    emulator_t emulator;
+    jit_t jit;
+    profiler_t profiler;
+    translation_t translation;
+    uint64_t budget = UINT64_MAX;
+    uint64_t period = 1009;         /* Prime, so sampling doesn't lock onto loops */
+    int32_t use_jit = 0;
+    int32_t level = 0;
+    int32_t keep_calls = 0;
+    const char* flat_path = NULL;
+    const char* collapsed_path = NULL;
+    const char* counts_path = NULL;
+    const char* profile_path = NULL;
+
+    int option;
+    while ((option = getopt(argc, argv, "jkf:c:e:s:O:P:")) != -1) {
+        switch (option) {
+            case 'j':
+                use_jit = 1;
+                break;
+            case 'k':
+                keep_calls = 1;
+                break;
+            case 'f':
+                flat_path = optarg;
+                break;
+            case 'c':
+                collapsed_path = optarg;
+                break;
+            case 'e':
+                counts_path = optarg;
+                break;
+            case 'P':
+                profile_path = optarg;
+                break;
+            case 's':
+                period = strtoull(optarg, NULL, 10);
+                break;
+            case 'O':
+                level = optimizeParseLevel(optarg);
+                if (level < 0) {
+                    printUsage();
+                    return -1;
+                }
+                break;
+            default:
+                printUsage();
+                return -1;
+        }
+    }
+
+    if (optind >= argc || period == 0) {
+        fprintf(stderr, "Improper evocation\n");
+        printUsage();
+        return -1;
+    }
+
+    if (optind + 1 < argc) {
+        budget = strtoull(argv[optind + 1], NULL, 10);
+    }
+
+    const char* filepath = argv[optind];
+    size_t length = strlen(filepath);
+    int32_t is_vm = length > 3 && strcmp(filepath + length - 3, ".vm") == 0;
+    int32_t profiling = flat_path != NULL || collapsed_path != NULL || counts_path != NULL;
+
+    if (profiling && !is_vm) {
+        fprintf(stderr, "Profiling needs a .vm program to map cycles back to\n");
+        return -1;
+    }
+
+    if (emulatorInitialize(&emulator) < 0) {
+        fprintf(stderr, "Failed to initialize emulator\n");
+        return -1;
+    }
+
+    if (is_vm) {
+        if (translate(&translation, filepath, level, profile_path, keep_calls) < 0) {
+            fprintf(stderr, "Failed to translate program, %s\n", filepath);
+            emulatorDestroy(&emulator);
+            return -1;
+        }
+
+        if (emulatorLoadAssembly(&emulator, translation.assembly, translation.assembly_size) < 0) {
+            fprintf(stderr, "Failed to load program, %s\n", filepath);
+            translationDestroy(&translation);
+            emulatorDestroy(&emulator);
+            return -1;
+        }
+    }
+
+    else if (emulatorLoadFile(&emulator, filepath) < 0) {
+        fprintf(stderr, "Failed to load program, %s\n", filepath);
+        emulatorDestroy(&emulator);
+        return -1;
+    }
+
+    /* 16MB of code is far more than a full ROM of blocks needs */
+    if (use_jit && jitInitialize(&jit, &emulator, 16 << 20) < 0) {
+        fprintf(stderr, "Failed to initialize JIT\n");
+        if (is_vm) {
+            translationDestroy(&translation);
+        }
+        emulatorDestroy(&emulator);
+        return -1;
+    }
+
+    profiler_source_t source = {filepath, &translation.command_module, translation.rom_ranges};
+    if (profiling && profilerInitialize(&profiler, &emulator, use_jit ? &jit : NULL, &source, 1, "main", period) < 0) {
+        fprintf(stderr, "Failed to initialize profiler\n");
+        profiling = 0;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    emulator_status_t status;
+    if (profiling) {
+        status = profilerRun(&profiler, budget);
+    }
+    else {
+        status = use_jit ? jitRun(&jit, budget) : emulatorRun(&emulator, budget);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    fprintf(stdout, "%s after %llu cycles (%.3f s, %.1f MIPS)\n",
+            status == EMULATOR_HALTED ? "Halted" : "Budget exhausted",
+            (unsigned long long) emulator.cycles, seconds,
+            seconds > 0 ? (double) emulator.cycles / seconds / 1e6 : 0.0);
+    fprintf(stdout, "SP=%u top=%d\n", emulator.ram[0], (int16_t) emulator.ram[emulator.ram[0] & EMULATOR_ADDRESS_MASK]);
+
+    if (profiling) {
+        if (flat_path != NULL && writeReport(&profiler, flat_path, profilerWriteFlat) < 0) {
+            fprintf(stderr, "Failed to write flat profile, %s\n", flat_path);
+        }
+        if (collapsed_path != NULL && writeReport(&profiler, collapsed_path, profilerWriteCollapsed) < 0) {
+            fprintf(stderr, "Failed to write collapsed stacks, %s\n", collapsed_path);
+        }
+        if (counts_path != NULL && writeReport(&profiler, counts_path, profilerWriteCounts) < 0) {
+            fprintf(stderr, "Failed to write execution counts, %s\n", counts_path);
+        }
+        profilerDestroy(&profiler);
+    }
+
+    if (use_jit) {
+        jitDestroy(&jit);
+    }
+    if (is_vm) {
+        translationDestroy(&translation);
+    }
+    emulatorDestroy(&emulator);
+    return 0;
+}
+
+void printUsage()
+{
+    printf("USAGE: \n\tPROGRAM [-j] [-O level] [-k] [-P profile] [-f flat_profile] [-c collapsed_stacks] [-e counts] [-s sample_period] program.hack|program.asm|program.vm [cycle_budget]\n"
+           "\t-j  compile hot code to x86-64 instead of interpreting\n"
+           "\t-f  write a flat profile of cycles per function and VM command, - for stdout\n"
+           "\t-c  write call stacks in the collapsed format flame graph tools read\n"
+           "\t-e  write how many times each VM line ran, for -P, exact with -s 1\n"
+           "\t-s  cycles between profile samples, 1 counts every cycle exactly (default 1009)\n"
+           "\t-O  optimization level .vm programs are translated at, as with Hack-VM\n"
+           "\t-P  execution counts .vm programs are translated with, as with Hack-VM\n"
+           "\t-k  keep calls to the OS routines -O 1, 2 and s replace or expand in place, as with Hack-VM\n"
+           "\t.vm programs are translated in memory with main as the entry function, profiling needs one\n");
+}
@@ -0,0 +1,204 @@
+/* fopencookie is a GNU extension */
+#define _GNU_SOURCE
+
+#include "../include/hackvm.h"
+#include "../include/parser.h"
+#include "../include/command.h"
+#include "../include/assembly_gen.h"
+#include "../include/stack_arena.h"
+#include "../include/optimize.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Where the assembly of a translation goes, behind the FILE* assembly gen writes to */
+typedef struct {
+    hackvm_write_t write;
+    void*          user;
+
+    char*          buffer;          /* Used instead of write when it is NULL */
+    size_t         capacity;
+    size_t         length;          /* Keeps counting past capacity, so callers learn the size needed */
+} hackvm_output_t;
+
+static ssize_t outputWrite(void* cookie, const char* data, size_t size)
+{
+    hackvm_output_t* output = cookie;
+
+    if (output->write != NULL) {
+        return output->write(output->user, data, size) < 0 ? -1 : (ssize_t) size;
+    }
+
+    if (output->length < output->capacity) {
+        size_t room = output->capacity - output->length;
+        memcpy(output->buffer + output->length, data, size < room ? size : room);
+    }
+    output->length += size;
+    return (ssize_t) size;
+}
+
+/* Initialize a context, arena_size is the memory to set aside up front, 0 lets
+ * the first translation decide
+ * Return 0 on success
+ * Return -1 on failure */
+int32_t hackvmInitialize(hackvm_t* hackvm, int32_t level, size_t arena_size)
+{
+    assert(hackvm != NULL);
+
+    memset(hackvm, 0, sizeof(hackvm_t));
+    hackvm->level = level;
+
+    if (arena_size != 0 && stackArenaInitialize(&hackvm->stack_arena, arena_size) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Destroys a context */
+void hackvmDestroy(hackvm_t* hackvm)
+{
+    assert(hackvm != NULL);
+
+    if (hackvm->stack_arena.memory != NULL) {
+        stackArenaRelease(&hackvm->stack_arena);
+    }
+    memset(hackvm, 0, sizeof(hackvm_t));
+}
+
+/* Translate VM text in the context's arena, writing assembly to output_file,
+ * which is closed either way
+ * Return 0 on success
+ * Return -1 on failure, with hackvm->error set */
+static int32_t translate(hackvm_t* hackvm, const char* source, size_t size, const char* filename, FILE* output_file)
+{
+    /* The parser cuts the text up in place, so it works on a copy that always ends in a
+     * newline and a terminator. Every byte could start a command, and labels are copied */
+    size_t needed = size + 2 + (size + 1) * (sizeof(command_t) + sizeof(char*) + 1) + 64;
+
+    if (hackvm->stack_arena.size < needed) {
+        size_t arena_size = hackvm->stack_arena.size * 2 > needed ? hackvm->stack_arena.size * 2 : needed;
+
+        if (hackvm->stack_arena.memory != NULL) {
+            stackArenaRelease(&hackvm->stack_arena);
+        }
+        if (stackArenaInitialize(&hackvm->stack_arena, arena_size) < 0) {
+            hackvm->error = "out of memory";
+            fclose(output_file);
+            return -1;
+        }
+    }
+    stackArenaPop(&hackvm->stack_arena, stackArenaPosition(&hackvm->stack_arena));
+
+    parser_t parser;
+    parser.file_map = stackArenaPush(&hackvm->stack_arena, size + 2);
+    parser.file_size = size;
+    if (size != 0) {
+        memcpy(parser.file_map, source, size);
+    }
+    if (size == 0 || source[size - 1] != '\n') {
+        parser.file_map[parser.file_size++] = '\n';
+    }
+    parser.file_map[parser.file_size] = '\0';
+
+    command_module_t command_module;
+    if (parserParseCommands(&parser, &command_module, &hackvm->stack_arena) < 0) {
+        hackvm->error = "failed to parse VM code";
+        fclose(output_file);
+        return -1;
+    }
+
+    command_module_t* modules[] = {&command_module};
+    if (optimizeCommands(&command_module, hackvm->level, NULL, 0) < 0 ||
+        (hackvm->level > 0 && optimizeFoldFunctions(modules, 1) < 0) ||
+        optimizeLeafCalls(modules, 1, hackvm->level, NULL) < 0) {
+        hackvm->error = "failed to optimize VM code";
+        fclose(output_file);
+        return -1;
+    }
+
+    /* assemblyGen wants a function first */
+    if (command_module.total_commands == 0 || !OP_IS_FUNCTION(command_module.commands[0].op)) {
+        hackvm->error = "VM code has to start with a function";
+        fclose(output_file);
+        return -1;
+    }
+
+    assembly_gen_t assembly_generator;
+    assemblyGenInitializeStream(&assembly_generator, output_file);
+    assemblyGenSetGoal(&assembly_generator, optimizeGoal(hackvm->level), &command_module, NULL);
+
+    static_layout_t static_layout;
+
+    int32_t result = 0;
+    if (assemblyGenLayoutStatics(&assembly_generator, &static_layout, modules, &filename, 1, NULL) < 0) {
+        hackvm->error = "static variables don't fit in RAM 16 - 255";
+        result = -1;
+    }
+    else if ((hackvm->level == OPTIMIZE_LEVEL_SIZE && assemblyGenBeginOutline(&assembly_generator) < 0) ||
+             assemblyGenPreamble(&assembly_generator, "main") < 0 ||
+             assemblyGen(&assembly_generator, &command_module, filename) < 0 ||
+             (assembly_generator.outlining && assemblyGenEndOutline(&assembly_generator) < 0)) {
+        hackvm->error = "failed to generate assembly";
+        result = -1;
+    }
+
+    /* Closes output_file */
+    assemblyGenDestroy(&assembly_generator);
+    return result;
+}
+
+/* Translate size bytes of VM text, handing the assembly to write in pieces.
+ * filename only names the source, it is never read from disk. Text after
+ * the last newline is a line too
+ * Return 0 on success
+ * Return -1 on failure, with hackvm->error set */
+int32_t hackvmTranslate(hackvm_t* hackvm, const char* source, size_t size, const char* filename,
+                        hackvm_write_t write, void* user)
+{
+    assert(hackvm != NULL && (source != NULL || size == 0) && filename != NULL && write != NULL);
+
+    hackvm_output_t output = {write, user, NULL, 0, 0};
+    cookie_io_functions_t functions = {NULL, outputWrite, NULL, NULL};
+
+    hackvm->error = NULL;
+    FILE* output_file = fopencookie(&output, "w", functions);
+    if (output_file == NULL) {
+        hackvm->error = "out of memory";
+        return -1;
+    }
+
+    return translate(hackvm, source, size, filename, output_file);
+}
+
+/* Translate size bytes of VM text into buffer, length is set to the size of the
+ * assembly, not terminated. When it doesn't fit length is the capacity needed
+ * Return 0 on success
+ * Return -1 on failure, with hackvm->error set */
+int32_t hackvmTranslateBuffer(hackvm_t* hackvm, const char* source, size_t size, const char* filename,
+                              char* buffer, size_t capacity, size_t* length)
+{
+    assert(hackvm != NULL && (source != NULL || size == 0) && filename != NULL &&
+           (buffer != NULL || capacity == 0) && length != NULL);
+
+    hackvm_output_t output = {NULL, NULL, buffer, capacity, 0};
+    cookie_io_functions_t functions = {NULL, outputWrite, NULL, NULL};
+
+    hackvm->error = NULL;
+    *length = 0;
+    FILE* output_file = fopencookie(&output, "w", functions);
+    if (output_file == NULL) {
+        hackvm->error = "out of memory";
+        return -1;
+    }
+
+    int32_t result = translate(hackvm, source, size, filename, output_file);
+    *length = output.length;
+
+    if (result == 0 && output.length > capacity) {
+        hackvm->error = "buffer too small";
+        return -1;
+    }
+    return result;
+}
@@ -0,0 +1,602 @@
+#include "../include/jit.h"
+#include "../include/emulator.h"
+
+#include <sys/mman.h>
+#include <assert.h>
+#include <stddef.h>
+#include <string.h>
+
+
+/* Machine state shared between the driver and the generated code, the offsets
+ * are baked into the entry and exit stubs */
+typedef struct {
+    uint16_t* ram;          /* 0  */
+    int64_t   budget;       /* 8  Cycles left, blocks charge their length on entry */
+    uint32_t  a;            /* 16 */
+    uint32_t  d;            /* 20 */
+    uint32_t  pc;           /* 24 Where execution continues */
+    uint32_t  aux;          /* 28 Patch offset for chain exits, jump address for dispatch exits */
+    uint32_t  reason;       /* 32 */
+} jit_state_t;
+
+_Static_assert(offsetof(jit_state_t, budget) == 8 && offsetof(jit_state_t, a) == 16 &&
+               offsetof(jit_state_t, d) == 20 && offsetof(jit_state_t, pc) == 24 &&
+               offsetof(jit_state_t, aux) == 28 && offsetof(jit_state_t, reason) == 32, "jit_state_t layout");
+
+/* Why the generated code returned to the driver */
+typedef enum {
+    EXIT_CHAIN,             /* Static edge to a block that wasn't compiled yet, aux is the rel32 to patch */
+    EXIT_DISPATCH,          /* Computed jump, aux is the address of the jump instruction */
+    EXIT_HALT,              /* Statically known tight loop */
+    EXIT_BUDGET,            /* Not enough budget left for the whole block, pc is the block start */
+    EXIT_FALLOFF,           /* Ran into the end of the program */
+} exit_reason_t;
+
+typedef void (*jit_entry_t)(jit_state_t* state, void* block);
+
+/* x86-64 registers, as encoded */
+enum {
+    RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+    R12 = 12, R13 = 13, R14 = 14, R15 = 15,
+};
+
+/* Register assignment, A and D are kept zero extended to 32 bits */
+#define REG_A      R14
+#define REG_D      R13
+#define REG_BUDGET R12
+#define REG_RAM    R15
+
+/* Condition codes for jcc, indexed by the jump bits, after test ax, ax */
+static const uint8_t JUMP_CONDITION_MAPPING[8] = {0, 0x8F /* jg */, 0x84 /* je */, 0x8D /* jge */,
+                                                  0x8C /* jl */, 0x85 /* jne */, 0x8E /* jle */, 0};
+
+/* The entry stub lives at offset 0 and the exit stub right after it */
+#define ENTRY_OFFSET 0
+
+/* Longest block compiled before it is split with a fall through edge */
+#define MAX_BLOCK_LENGTH 1024
+
+/* Worst case bytes of x86 per Hack instruction, plus the block's exits */
+#define MAX_INSTRUCTION_BYTES 48
+#define MAX_BLOCK_TAIL_BYTES  128
+
+
+/* -- Emitters -- */
+
+static void emit8(jit_t* jit, uint8_t byte)
+{
+    jit->code[jit->code_position++] = byte;
+}
+
+static void emit32(jit_t* jit, uint32_t value)
+{
+    memcpy(jit->code + jit->code_position, &value, 4);
+    jit->code_position += 4;
+}
+
+static void emitBytes(jit_t* jit, const uint8_t* bytes, size_t count)
+{
+    memcpy(jit->code + jit->code_position, bytes, count);
+    jit->code_position += count;
+}
+
+/* REX prefix, only emitted when it carries information */
+static void emitRex(jit_t* jit, int32_t wide, int32_t reg, int32_t index, int32_t base)
+{
+    uint8_t rex = (uint8_t) (0x40 | (wide << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3));
+    if (rex != 0x40) {
+        emit8(jit, rex);
+    }
+}
+
+/* opcode r/m32, r32 in register direct form, used for mov (89), add (01), sub (29), and (21), or (09) */
+static void emitRegReg(jit_t* jit, uint8_t opcode, int32_t destination, int32_t source)
+{
+    emitRex(jit, 0, source, 0, destination);
+    emit8(jit, opcode);
+    emit8(jit, (uint8_t) (0xC0 | ((source & 7) << 3) | (destination & 7)));
+}
+
+/* mov r32, imm32 */
+static void emitMovImmediate(jit_t* jit, int32_t reg, uint32_t value)
+{
+    emitRex(jit, 0, 0, 0, reg);
+    emit8(jit, (uint8_t) (0xB8 + (reg & 7)));
+    emit32(jit, value);
+}
+
+/* Group 3 unary operation on eax, 2 = not, 3 = neg */
+static void emitUnary(jit_t* jit, uint8_t operation)
+{
+    emit8(jit, 0xF7);
+    emit8(jit, (uint8_t) (0xC0 | (operation << 3)));
+}
+
+/* add / sub eax, imm8, 0 = add, 5 = sub */
+static void emitImmediate8(jit_t* jit, uint8_t operation, uint8_t value)
+{
+    emit8(jit, 0x83);
+    emit8(jit, (uint8_t) (0xC0 | (operation << 3)));
+    emit8(jit, value);
+}
+
+/* ecx = A & 0x7FFF, the RAM index of M */
+static void emitAddress(jit_t* jit)
+{
+    static const uint8_t AND_ECX[] = {0x81, 0xE1, 0xFF, 0x7F, 0x00, 0x00};
+
+    emitRegReg(jit, 0x89, RCX, REG_A);
+    emitBytes(jit, AND_ECX, sizeof(AND_ECX));
+}
+
+/* movzx eax, word [r15 + rcx * 2] */
+static void emitLoadM(jit_t* jit)
+{
+    static const uint8_t LOAD[] = {0x41, 0x0F, 0xB7, 0x04, 0x4F};
+    emitBytes(jit, LOAD, sizeof(LOAD));
+}
+
+/* mov word [r15 + rcx * 2], ax */
+static void emitStoreM(jit_t* jit)
+{
+    static const uint8_t STORE[] = {0x66, 0x41, 0x89, 0x04, 0x4F};
+    emitBytes(jit, STORE, sizeof(STORE));
+}
+
+/* jmp / jcc rel32 to the given code offset, returns the offset of the rel32 field */
+static size_t emitJump(jit_t* jit, uint8_t condition, size_t target)
+{
+    if (condition == 0) {
+        emit8(jit, 0xE9);
+    }
+    else {
+        emit8(jit, 0x0F);
+        emit8(jit, condition);
+    }
+
+    size_t site = jit->code_position;
+    emit32(jit, (uint32_t) (target - (site + 4)));
+    return site;
+}
+
+static void patchJump(jit_t* jit, size_t site, size_t target)
+{
+    uint32_t relative = (uint32_t) (target - (site + 4));
+    memcpy(jit->code + site, &relative, 4);
+}
+
+/* Leave the generated code, eax = pc, ecx = aux, edx = reason */
+static void emitExit(jit_t* jit, uint32_t pc, uint32_t aux, exit_reason_t reason)
+{
+    emitMovImmediate(jit, RAX, pc);
+    emitMovImmediate(jit, RCX, aux);
+    emitMovImmediate(jit, RDX, reason);
+    emitJump(jit, 0, jit->exit_offset);
+}
+
+/* Emit the shared entry and exit stubs at the start of the code buffer */
+static void emitStubs(jit_t* jit)
+{
+    static const uint8_t ENTRY[] = {
+        0x53,                       /* push rbx */
+        0x55,                       /* push rbp */
+        0x41, 0x54,                 /* push r12 */
+        0x41, 0x55,                 /* push r13 */
+        0x41, 0x56,                 /* push r14 */
+        0x41, 0x57,                 /* push r15 */
+        0x57,                       /* push rdi */
+        0x4C, 0x8B, 0x3F,           /* mov r15, [rdi] */
+        0x4C, 0x8B, 0x67, 0x08,     /* mov r12, [rdi + 8] */
+        0x44, 0x8B, 0x77, 0x10,     /* mov r14d, [rdi + 16] */
+        0x44, 0x8B, 0x6F, 0x14,     /* mov r13d, [rdi + 20] */
+        0xFF, 0xE6,                 /* jmp rsi */
+    };
+
+    static const uint8_t EXIT[] = {
+        0x5F,                       /* pop rdi */
+        0x4C, 0x89, 0x67, 0x08,     /* mov [rdi + 8], r12 */
+        0x44, 0x89, 0x77, 0x10,     /* mov [rdi + 16], r14d */
+        0x44, 0x89, 0x6F, 0x14,     /* mov [rdi + 20], r13d */
+        0x89, 0x47, 0x18,           /* mov [rdi + 24], eax */
+        0x89, 0x4F, 0x1C,           /* mov [rdi + 28], ecx */
+        0x89, 0x57, 0x20,           /* mov [rdi + 32], edx */
+        0x41, 0x5F,                 /* pop r15 */
+        0x41, 0x5E,                 /* pop r14 */
+        0x41, 0x5D,                 /* pop r13 */
+        0x41, 0x5C,                 /* pop r12 */
+        0x5D,                       /* pop rbp */
+        0x5B,                       /* pop rbx */
+        0xC3,                       /* ret */
+    };
+
+    jit->code_position = ENTRY_OFFSET;
+    emitBytes(jit, ENTRY, sizeof(ENTRY));
+
+    jit->exit_offset = jit->code_position;
+    emitBytes(jit, EXIT, sizeof(EXIT));
+}
+
+
+/* Initialize a JIT on top of an emulator with a code buffer of the given size
+ * Return 0 on success
+ * Return -1 on failure */
+int32_t jitInitialize(jit_t* jit, emulator_t* emulator, size_t code_size)
+{
+    assert(jit != NULL && emulator != NULL && emulator->rom != NULL && code_size > 4096);
+
+    memset(jit, 0, sizeof(jit_t));
+
+    jit->code = mmap(NULL, code_size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED) {
+        jit->code = NULL;
+        return -1;
+    }
+
+    jit->blocks = mmap(NULL, (EMULATOR_ROM_SIZE + 1) * sizeof(uint32_t), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->blocks == MAP_FAILED) {
+        munmap(jit->code, code_size);
+        jit->code = NULL;
+        jit->blocks = NULL;
+        return -1;
+    }
+
+    jit->emulator = emulator;
+    jit->code_size = code_size;
+    emitStubs(jit);
+
+    return 0;
+}
+
+/* Destroys a JIT, the emulator it runs on is left alone */
+void jitDestroy(jit_t* jit)
+{
+    assert(jit != NULL && jit->code != NULL);
+
+    munmap(jit->code, jit->code_size);
+    munmap(jit->blocks, (EMULATOR_ROM_SIZE + 1) * sizeof(uint32_t));
+
+    memset(jit, 0, sizeof(jit_t));
+}
+
+/* Throw away every compiled block, needed when the code buffer fills up
+ * or a different program is loaded into the emulator */
+void jitFlush(jit_t* jit)
+{
+    assert(jit != NULL && jit->code != NULL);
+
+    memset(jit->blocks, 0, (EMULATOR_ROM_SIZE + 1) * sizeof(uint32_t));
+    emitStubs(jit);
+    jit->total_flushes++;
+}
+
+/* Whether a taken jump from pc to target with no destination is one the emulator treats as a halt */
+static int32_t isHaltLoop(const emulator_op_t* rom, uint32_t pc, uint32_t target)
+{
+    return target == pc || (target + 1 == pc && rom[target].alu == ALU_LOAD && rom[target].value == target);
+}
+
+/* Emit an edge to a statically known ROM address, straight to its block if it's
+ * already compiled, otherwise through an exit the driver patches later */
+static void emitEdge(jit_t* jit, uint8_t condition, uint32_t target, size_t* pending, size_t* total_pending)
+{
+    if (jit->blocks[target] != 0) {
+        emitJump(jit, condition, jit->blocks[target] - 1);
+        return;
+    }
+
+    /* The stub is emitted after the block, remember the site */
+    pending[(*total_pending)++] = emitJump(jit, condition, 0);
+    pending[(*total_pending)++] = target;
+}
+
+/* Compile the ALU part of a C-instruction, leaving the result zero extended in eax */
+static void compileCompute(jit_t* jit, uint8_t alu)
+{
+    switch (alu) {
+        case ALU_0:         emitRegReg(jit, 0x31, RAX, RAX); break;                                  /* xor eax, eax */
+        case ALU_1:         emitMovImmediate(jit, RAX, 1); break;
+        case ALU_NEG_1:     emitMovImmediate(jit, RAX, 0xFFFF); break;
+        case ALU_D:         emitRegReg(jit, 0x89, RAX, REG_D); break;
+        case ALU_A:         emitRegReg(jit, 0x89, RAX, REG_A); break;
+        case ALU_NOT_D:     emitRegReg(jit, 0x89, RAX, REG_D); emitUnary(jit, 2); break;
+        case ALU_NOT_A:     emitRegReg(jit, 0x89, RAX, REG_A); emitUnary(jit, 2); break;
+        case ALU_NEG_D:     emitRegReg(jit, 0x89, RAX, REG_D); emitUnary(jit, 3); break;
+        case ALU_NEG_A:     emitRegReg(jit, 0x89, RAX, REG_A); emitUnary(jit, 3); break;
+        case ALU_D_PLUS_1:  emitRegReg(jit, 0x89, RAX, REG_D); emitImmediate8(jit, 0, 1); break;
+        case ALU_A_PLUS_1:  emitRegReg(jit, 0x89, RAX, REG_A); emitImmediate8(jit, 0, 1); break;
+        case ALU_D_MINUS_1: emitRegReg(jit, 0x89, RAX, REG_D); emitImmediate8(jit, 5, 1); break;
+        case ALU_A_MINUS_1: emitRegReg(jit, 0x89, RAX, REG_A); emitImmediate8(jit, 5, 1); break;
+        case ALU_D_PLUS_A:  emitRegReg(jit, 0x89, RAX, REG_D); emitRegReg(jit, 0x01, RAX, REG_A); break;
+        case ALU_D_MINUS_A: emitRegReg(jit, 0x89, RAX, REG_D); emitRegReg(jit, 0x29, RAX, REG_A); break;
+        case ALU_A_MINUS_D: emitRegReg(jit, 0x89, RAX, REG_A); emitRegReg(jit, 0x29, RAX, REG_D); break;
+        case ALU_D_AND_A:   emitRegReg(jit, 0x89, RAX, REG_D); emitRegReg(jit, 0x21, RAX, REG_A); break;
+        case ALU_D_OR_A:    emitRegReg(jit, 0x89, RAX, REG_D); emitRegReg(jit, 0x09, RAX, REG_A); break;
+
+        /* ecx already holds the address of M */
+        case ALU_M:         emitLoadM(jit); break;
+        case ALU_NOT_M:     emitLoadM(jit); emitUnary(jit, 2); break;
+        case ALU_NEG_M:     emitLoadM(jit); emitUnary(jit, 3); break;
+        case ALU_M_PLUS_1:  emitLoadM(jit); emitImmediate8(jit, 0, 1); break;
+        case ALU_M_MINUS_1: emitLoadM(jit); emitImmediate8(jit, 5, 1); break;
+        case ALU_D_PLUS_M:  emitLoadM(jit); emitRegReg(jit, 0x01, RAX, REG_D); break;
+        case ALU_D_MINUS_M: emitLoadM(jit); emitUnary(jit, 3); emitRegReg(jit, 0x01, RAX, REG_D); break;
+        case ALU_M_MINUS_D: emitLoadM(jit); emitRegReg(jit, 0x29, RAX, REG_D); break;
+        case ALU_D_AND_M:   emitLoadM(jit); emitRegReg(jit, 0x21, RAX, REG_D); break;
+        case ALU_D_OR_M:    emitLoadM(jit); emitRegReg(jit, 0x09, RAX, REG_D); break;
+
+        default:
+            return;
+    }
+
+    /* movzx eax, ax */
+    emit8(jit, 0x0F);
+    emit8(jit, 0xB7);
+    emit8(jit, 0xC0);
+}
+
+/* Compile the basic block starting at the given ROM address
+ * Return the offset of the block on success
+ * Return 0 if the code buffer is full */
+static size_t compileBlock(jit_t* jit, uint32_t start)
+{
+    /* Steps
+     * 1. Charge the whole block against the budget, bail out to the interpreter if it doesn't fit
+     * 2. Translate instructions until one that jumps, tracking A while it holds a known constant
+     * 3. Emit the terminator, static edges are chained, computed ones go back to the driver
+     * 4. Emit the exit stubs for unresolved edges and the budget check
+     */
+
+    const emulator_op_t* rom = jit->emulator->rom;
+
+    /* Each edge takes 2 slots, the rel32 site and the target */
+    size_t pending[4];
+    size_t total_pending = 0;
+
+    if (jit->code_size - jit->code_position < MAX_BLOCK_TAIL_BYTES * 2) {
+        return 0;
+    }
+
+    size_t block = jit->code_position;
+
+    /* sub r12, imm32 ; js budget_exit */
+    emit8(jit, 0x49);
+    emit8(jit, 0x81);
+    emit8(jit, 0xEC);
+    size_t length_site = jit->code_position;
+    emit32(jit, 0);
+    size_t budget_site = emitJump(jit, 0x88, 0);
+
+    int32_t a_known = 0;
+    uint32_t a_value = 0;
+    uint32_t pc = start;
+    uint32_t length = 0;
+
+    for (;;) {
+        const emulator_op_t op = rom[pc];
+
+        if (op.alu == ALU_HALT) {
+            emitExit(jit, pc, 0, EXIT_FALLOFF);
+            break;
+        }
+
+        if (length == MAX_BLOCK_LENGTH ||
+            jit->code_size - jit->code_position < MAX_INSTRUCTION_BYTES + MAX_BLOCK_TAIL_BYTES) {
+
+            /* Split the block, it continues at pc */
+            emitEdge(jit, 0, pc, pending, &total_pending);
+            break;
+        }
+
+        length++;
+
+        if (op.alu == ALU_LOAD) {
+            emitMovImmediate(jit, REG_A, op.value);
+            a_known = 1;
+            a_value = op.value;
+            pc++;
+            continue;
+        }
+
+        uint8_t jump = op.control & CONTROL_JUMP;
+        int32_t uses_m = op.alu >= ALU_M || (op.control & CONTROL_DEST_M);
+
+        if (uses_m) {
+            emitAddress(jit);
+        }
+
+        compileCompute(jit, op.alu);
+
+        /* The jump target is the old A, keep it in ebx if A is about to change */
+        if (jump != 0 && !a_known && (op.control & CONTROL_DEST_A)) {
+            emitRegReg(jit, 0x89, RBX, REG_A);
+        }
+
+        if (op.control & CONTROL_DEST_M) {
+            emitStoreM(jit);
+        }
+        if (op.control & CONTROL_DEST_A) {
+            emitRegReg(jit, 0x89, REG_A, RAX);
+        }
+        if (op.control & CONTROL_DEST_D) {
+            emitRegReg(jit, 0x89, REG_D, RAX);
+        }
+
+        if (jump == 0) {
+            if (op.control & CONTROL_DEST_A) {
+                a_known = 0;
+            }
+            pc++;
+            continue;
+        }
+
+        /* Terminator */
+        uint32_t target = a_value & EMULATOR_ADDRESS_MASK;
+        int32_t halts = a_known && (op.control & (CONTROL_DEST_A | CONTROL_DEST_D | CONTROL_DEST_M)) == 0 &&
+                        isHaltLoop(rom, pc, target);
+
+        uint8_t condition = JUMP_CONDITION_MAPPING[jump];
+        size_t taken_site = 0;
+
+        if (condition != 0) {
+            /* test ax, ax ; jcc taken */
+            emit8(jit, 0x66);
+            emit8(jit, 0x85);
+            emit8(jit, 0xC0);
+
+            if (a_known && !halts) {
+                emitEdge(jit, condition, target, pending, &total_pending);
+            }
+            else {
+                taken_site = emitJump(jit, condition, 0);
+            }
+
+            emitEdge(jit, 0, pc + 1, pending, &total_pending);
+        }
+        else if (a_known && !halts) {
+            emitEdge(jit, 0, target, pending, &total_pending);
+        }
+
+        /* The taken path when it doesn't chain, either a halt or a computed jump */
+        if (condition == 0 || taken_site != 0) {
+            if (taken_site != 0) {
+                patchJump(jit, taken_site, jit->code_position);
+            }
+
+            if (halts) {
+                emitExit(jit, target, 0, EXIT_HALT);
+            }
+            else if (!a_known) {
+                /* mov eax, a or ebx ; and eax, 0x7FFF */
+                emitRegReg(jit, 0x89, RAX, (op.control & CONTROL_DEST_A) ? RBX : REG_A);
+                emit8(jit, 0x25);
+                emit32(jit, EMULATOR_ADDRESS_MASK);
+                emitMovImmediate(jit, RCX, pc);
+                emitMovImmediate(jit, RDX, EXIT_DISPATCH);
+                emitJump(jit, 0, jit->exit_offset);
+            }
+        }
+
+        break;
+    }
+
+    /* Stubs for edges to blocks that don't exist yet */
+    for (size_t index = 0; index < total_pending; index += 2) {
+        patchJump(jit, pending[index], jit->code_position);
+        emitExit(jit, (uint32_t) pending[index + 1], (uint32_t) pending[index], EXIT_CHAIN);
+    }
+
+    /* Not enough budget, undo the charge and let the interpreter run the rest */
+    patchJump(jit, budget_site, jit->code_position);
+    emit8(jit, 0x49);
+    emit8(jit, 0x81);
+    emit8(jit, 0xC4);
+    emit32(jit, length);
+    emitExit(jit, start, 0, EXIT_BUDGET);
+
+    memcpy(jit->code + length_site, &length, 4);
+
+    jit->blocks[start] = (uint32_t) block + 1;
+    jit->total_blocks++;
+
+    return block;
+}
+
+/* Find or compile the block at pc, flushing the cache if it is full
+ * Return the offset of the block */
+static size_t lookupBlock(jit_t* jit, uint32_t pc)
+{
+    if (jit->blocks[pc] != 0) {
+        return jit->blocks[pc] - 1;
+    }
+
+    size_t block = compileBlock(jit, pc);
+    if (block == 0) {
+        jitFlush(jit);
+        block = compileBlock(jit, pc);
+    }
+
+    return block;
+}
+
+/* Run the emulator's program for at most budget cycles through compiled code,
+ * exactly matching what emulatorRun would do
+ * Return EMULATOR_HALTED if the program halted
+ * Return EMULATOR_BUDGET if the budget ran out */
+emulator_status_t jitRun(jit_t* jit, uint64_t budget)
+{
+    assert(jit != NULL && jit->code != NULL);
+
+    emulator_t* emulator = jit->emulator;
+    const emulator_op_t* rom = emulator->rom;
+
+    jit_state_t state;
+    state.ram = emulator->ram;
+    state.a = emulator->a;
+    state.d = emulator->d;
+    state.pc = emulator->pc;
+    state.budget = budget > INT64_MAX ? INT64_MAX : (int64_t) budget;
+
+    const int64_t initial_budget = state.budget;
+    emulator_status_t status = EMULATOR_BUDGET;
+
+    jit_entry_t entry;
+    void* entry_address = jit->code + ENTRY_OFFSET;
+    memcpy(&entry, &entry_address, sizeof(entry));
+
+    for (;;) {
+        if (rom[state.pc].alu == ALU_HALT) {
+            status = EMULATOR_HALTED;
+            break;
+        }
+
+        size_t block = lookupBlock(jit, state.pc);
+        if (block == 0) {
+            /* Couldn't compile even into an empty buffer, interpret */
+            state.reason = EXIT_BUDGET;
+        }
+        else {
+            entry(&state, jit->code + block);
+        }
+
+        if (state.reason == EXIT_CHAIN) {
+            /* Compile the target and link the edge so this exit is never taken again */
+            size_t site = state.aux;
+            size_t flushes = jit->total_flushes;
+            size_t target = lookupBlock(jit, state.pc);
+            if (target != 0 && flushes == jit->total_flushes) {
+                patchJump(jit, site, target);
+            }
+            continue;
+        }
+
+        if (state.reason == EXIT_DISPATCH) {
+            if (isHaltLoop(rom, state.aux, state.pc) &&
+                (rom[state.aux].control & (CONTROL_DEST_A | CONTROL_DEST_D | CONTROL_DEST_M)) == 0) {
+                status = EMULATOR_HALTED;
+                break;
+            }
+            continue;
+        }
+
+        if (state.reason == EXIT_HALT || state.reason == EXIT_FALLOFF) {
+            status = EMULATOR_HALTED;
+            break;
+        }
+
+        /* EXIT_BUDGET, the interpreter runs out the remaining cycles exactly */
+        emulator->a = (uint16_t) state.a;
+        emulator->d = (uint16_t) state.d;
+        emulator->pc = (uint16_t) state.pc;
+        emulator->cycles += (uint64_t) (initial_budget - state.budget);
+
+        return emulatorRun(emulator, (uint64_t) state.budget);
+    }
+
+    emulator->a = (uint16_t) state.a;
+    emulator->d = (uint16_t) state.d;
+    emulator->pc = (uint16_t) state.pc;
+    emulator->cycles += (uint64_t) (initial_budget - state.budget);
+
+    return status;
+}
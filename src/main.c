@@ -2,21 +2,159 @@
 #include "../include/command.h"
 #include "../include/assembly_gen.h"
 #include "../include/stack_arena.h"
+#include "../include/pipeline.h"
+#include "../include/optimize.h"
+#include "../include/profile.h"
+#include "../include/server.h"
 
 
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 void printUsage();
 
+/* Translate with the parser, generator and writer running on their own threads
+ * Return 0 on success
+ * Return -1 on failure */
+static int32_t translatePipelined(parser_t* parser, const char* input, const char* output,
+                                  const char* map_path, const char* label_path)
+{
+    assembly_gen_t assembly_generator;
+
+    if (assemblyGenInitialize(&assembly_generator, output) < 0) {
+        fprintf(stderr, "Failed to initialize assembly generation unit\n");
+        return -1;
+    }
+
+    if (map_path != NULL && assemblyGenOpenMap(&assembly_generator, map_path) < 0) {
+        fprintf(stderr, "Failed to open source map file, %s\n", map_path);
+        assemblyGenDestroy(&assembly_generator);
+        return -1;
+    }
+
+    if (label_path != NULL && assemblyGenOpenLabelTable(&assembly_generator, label_path) < 0) {
+        fprintf(stderr, "Failed to open label table file, %s\n", label_path);
+        assemblyGenDestroy(&assembly_generator);
+        return -1;
+    }
+
+    if (assemblyGenPreamble(&assembly_generator, "main") < 0) {
+        fprintf(stderr, "Failed to generate assembly preamble\n");
+        assemblyGenDestroy(&assembly_generator);
+        return -1;
+    }
+
+    if (pipelineTranslate(parser, &assembly_generator, input) < 0) {
+        fprintf(stderr, "Failed to generate assembly\n");
+        assemblyGenDestroy(&assembly_generator);
+        return -1;
+    }
+
+    assemblyGenDestroy(&assembly_generator);
+    return 0;
+}
+
+/* Serve framed translation requests until stdin ends, or from a socket until killed
+ * Return 0 on success
+ * Return -1 on failure */
+static int32_t serve(const char* socket_path, long workers, int32_t level)
+{
+    server_t server;
+
+    if (workers <= 0) {
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = workers > 0 ? workers : 1;
+    }
+
+    if (serverInitialize(&server, (size_t) workers, level) < 0) {
+        fprintf(stderr, "Failed to initialize server\n");
+        return -1;
+    }
+
+    /* A client that goes away mid response shouldn't take the server down */
+    signal(SIGPIPE, SIG_IGN);
+
+    int32_t result = strcmp(socket_path, "-") == 0 ? serverServeStream(&server, STDIN_FILENO, STDOUT_FILENO)
+                                                   : serverServeSocket(&server, socket_path);
+    if (result < 0) {
+        fprintf(stderr, "Failed to serve on %s\n", strcmp(socket_path, "-") == 0 ? "stdin" : socket_path);
+    }
+
+    serverDestroy(&server);
+    return result;
+}
+
 int main(int argc, char* argv[]) 
 {
     parser_t parser;
     command_module_t command_module;
     stack_arena_t stack_arena;
     assembly_gen_t assembly_generator;
+    profile_t profile;
+    const char* profile_path = NULL;
+    const char* map_path = NULL;
+    const char* label_path = NULL;
+    const char* socket_path = NULL;
+    long workers = 0;
+    int32_t pipelined = 0;
+    int32_t reachable = 0;
+    int32_t keep_calls = 0;
+    int32_t level = 0;
+
+    int option;
+    while ((option = getopt(argc, argv, "m:l:prkO:P:s:w:")) != -1) {
+        switch (option) {
+            case 'm':
+                map_path = optarg;
+                break;
+            case 'l':
+                label_path = optarg;
+                break;
+            case 'p':
+                pipelined = 1;
+                break;
+            case 'r':
+                reachable = 1;
+                break;
+            case 'k':
+                keep_calls = 1;
+                break;
+            case 'O':
+                level = optimizeParseLevel(optarg);
+                if (level < 0) {
+                    printUsage();
+                    return -1;
+                }
+                break;
+            case 'P':
+                profile_path = optarg;
+                break;
+            case 's':
+                socket_path = optarg;
+                break;
+            case 'w':
+                workers = atol(optarg);
+                break;
+            default:
+                printUsage();
+                return -1;
+        }
+    }
+
+    /* Shift the positional arguments down so they keep their old places */
+    argv[optind - 1] = argv[0];
+    argv += optind - 1;
+    argc -= optind - 1;
 
-    if (argc < 3) {
+    if (socket_path != NULL) {
+        return serve(socket_path, workers, level);
+    }
+
+    /* The optimizer and -r need the whole module, the pipeline streams it */
+    if (argc < 3 || (pipelined && (level > 0 || profile_path != NULL || reachable))) {
         fprintf(stderr, "Improper evocation\n");
         printUsage();
         return -1;
@@ -27,6 +165,15 @@ int main(int argc, char* argv[])
         return -1;
     }
 
+    if (pipelined) {
+        int32_t result = translatePipelined(&parser, argv[1], argv[2], map_path, label_path);
+        parserDestroy(&parser);
+        if (result == 0) {
+            fprintf(stdout, "Success\n");
+        }
+        return result;
+    }
+
     if (argc >= 4) {
         /* make the memory pool the specified size */
         if (stackArenaInitialize(&stack_arena, atol(argv[3])) < 0) {
@@ -37,27 +184,93 @@ int main(int argc, char* argv[])
     }
 
     else {
-        /* make the memory pool 2x the file size */
-        if (stackArenaInitialize(&stack_arena, 2 * parser.file_size) < 0) {
+        /* make the memory pool big enough for the worst case, a command and a line pointer
+         * for every byte of the file plus a copy of its labels. Only the pages that get
+         * used are ever backed by memory. A profile counts at most one command a byte too */
+        if (stackArenaInitialize(&stack_arena, (sizeof(command_t) + sizeof(char*) + 1 + sizeof(uint64_t)) * parser.file_size + 64) < 0) {
             fprintf(stderr, "Failed to initialize memory pool\n");
             parserDestroy(&parser);
             return -1;
         }
     }
 
-    if (parserParseCommands(&parser, &command_module, &stack_arena) < 0) {
+    if ((reachable ? parserParseReachable(&parser, &command_module, &stack_arena, "main")
+                   : parserParseCommands(&parser, &command_module, &stack_arena)) < 0) {
         fprintf(stderr, "Failed to parse VM Code\n");
         parserDestroy(&parser);
         stackArenaRelease(&stack_arena);
         return -1;
     }
 
+    if (profile_path != NULL && profileLoad(&profile, profile_path, argv[1], &stack_arena) < 0) {
+        fprintf(stderr, "Failed to load profile, %s\n", profile_path);
+        parserDestroy(&parser);
+        stackArenaRelease(&stack_arena);
+        return -1;
+    }
+
+    command_module_t* modules[] = {&command_module};
+    const profile_t* profiles[] = {profile_path != NULL ? &profile : NULL};
+    if (optimizeCommands(&command_module, level, profiles[0], keep_calls) < 0 ||
+        (level > 0 && optimizeFoldFunctions(modules, 1) < 0) ||
+        optimizeLeafCalls(modules, 1, level, profiles) < 0) {
+        fprintf(stderr, "Failed to optimize VM Code\n");
+        parserDestroy(&parser);
+        stackArenaRelease(&stack_arena);
+        return -1;
+    }
+
+    /* assemblyGen wants a function first */
+    if (command_module.total_commands == 0 || !OP_IS_FUNCTION(command_module.commands[0].op)) {
+        fprintf(stderr, "VM code has to start with a function\n");
+        parserDestroy(&parser);
+        stackArenaRelease(&stack_arena);
+        return -1;
+    }
+
     if (assemblyGenInitialize(&assembly_generator, argv[2]) < 0) {
         fprintf(stderr, "Failed to initialize assembly generation unit\n");
         parserDestroy(&parser);
         stackArenaRelease(&stack_arena);
         return -1;
     }
+    assembly_generator.keep_calls = keep_calls;
+    assemblyGenSetGoal(&assembly_generator, optimizeGoal(level), &command_module, profile_path != NULL ? &profile : NULL);
+
+    static_layout_t static_layout;
+    const char* filenames[] = {argv[1]};
+    if (assemblyGenLayoutStatics(&assembly_generator, &static_layout, modules, filenames, 1, stderr) < 0) {
+        fprintf(stderr, "Static variables don't fit in RAM\n");
+        parserDestroy(&parser);
+        stackArenaRelease(&stack_arena);
+        assemblyGenDestroy(&assembly_generator);
+        return -1;
+    }
+
+    if (map_path != NULL && assemblyGenOpenMap(&assembly_generator, map_path) < 0) {
+        fprintf(stderr, "Failed to open source map file, %s\n", map_path);
+        parserDestroy(&parser);
+        stackArenaRelease(&stack_arena);
+        assemblyGenDestroy(&assembly_generator);
+        return -1;
+    }
+
+    if (label_path != NULL && assemblyGenOpenLabelTable(&assembly_generator, label_path) < 0) {
+        fprintf(stderr, "Failed to open label table file, %s\n", label_path);
+        parserDestroy(&parser);
+        stackArenaRelease(&stack_arena);
+        assemblyGenDestroy(&assembly_generator);
+        return -1;
+    }
+
+    /* At -O s repeated runs of instructions go into routines, which moves code a source map would describe */
+    if (level == OPTIMIZE_LEVEL_SIZE && map_path == NULL && assemblyGenBeginOutline(&assembly_generator) < 0) {
+        fprintf(stderr, "Failed to initialize outlining\n");
+        parserDestroy(&parser);
+        stackArenaRelease(&stack_arena);
+        assemblyGenDestroy(&assembly_generator);
+        return -1;
+    }
 
     if (assemblyGenPreamble(&assembly_generator, "main") < 0) {
         fprintf(stderr, "Failed to generate assembly preamble\n");
@@ -67,7 +280,8 @@ int main(int argc, char* argv[])
         return -1;
     }
 
-    if (assemblyGen(&assembly_generator, &command_module, argv[1]) < 0) {
+    if (assemblyGen(&assembly_generator, &command_module, argv[1]) < 0 ||
+        (assembly_generator.outlining && assemblyGenEndOutline(&assembly_generator) < 0)) {
         fprintf(stderr, "Failed to generate assembly\n");
         parserDestroy(&parser);
         stackArenaRelease(&stack_arena);
@@ -75,6 +289,7 @@ int main(int argc, char* argv[])
         return -1;
     }
 
+    assemblyGenDestroy(&assembly_generator);
     parserDestroy(&parser);
     stackArenaRelease(&stack_arena);
     fprintf(stdout, "Success\n");
@@ -84,5 +299,22 @@ int main(int argc, char* argv[])
 
 void printUsage()
 {
-    printf("USAGE: \n\tPROGRAM input_file.vm output_file.hack [parser_memory_pool_size]\n");
+    printf("USAGE: \n\tPROGRAM [-p] [-r] [-O level] [-k] [-P profile] [-m source_map] [-l label_table] input_file.vm output_file.hack [parser_memory_pool_size]\n"
+           "\t-p  parse, generate and write on three threads at once\n"
+           "\t-r  parse only the functions main can call, directly or not, lines elsewhere aren't checked\n"
+           "\t-O  optimization level, 1 removes unreachable code and unused labels, simplifies jumps,\n"
+           "\t    fuses push / pop pairs into moves and comparisons into jumps, and makes calls\n"
+           "\t    straight into returns tail calls (default 0). 2 and s do the same and pick the\n"
+           "\t    fastest or smallest expansion of each command, with calls to Memory.peek / poke and\n"
+           "\t    Math.abs / min / max expanded in place. From 1 on, multiplying by a constant with\n"
+           "\t    Math.multiply becomes additions and Math.multiply / divide by 1 goes. These names\n"
+           "\t    are taken to be the OS routines, even in a program that defines them itself\n"
+           "\t-k  keep calls to those OS routines as calls, Math.multiply / divide included\n"
+           "\t-P  execution counts from Hack-Emu -e, at -O 2 and s the commands that ran often take\n"
+           "\t    the fastest expansions and the rest the smallest\n"
+           "\t-m  write a line per VM command: file, line, function and ROM range [start, end)\n"
+           "\t-l  write the file behind every id in generated $<id>.<counter> labels\n"
+           "\tPROGRAM -s socket_path|- [-w workers] [-O level]\n"
+           "\t-s  serve length prefixed translation requests on a Unix socket, or stdin / stdout for -\n"
+           "\t-w  worker threads for -s (default one per core)\n");
 }
@@ -0,0 +1,1224 @@
+#include "../include/optimize.h"
+#include "../include/assembly_gen.h"
+#include "../include/cfg.h"
+#include "../include/command.h"
+#include "../include/profile.h"
+#include "../include/stack_arena.h"
+
+#include <assert.h>
+#include <string.h>
+
+
+static uint32_t hashName(const char* name)
+{
+    uint32_t hash = 2166136261u;
+    for (; *name != '\0'; name++) {
+        hash = (hash ^ (uint8_t) *name) * 16777619u;
+    }
+    return hash;
+}
+
+/* Remove every block that can't be reached from the entry of its function,
+ * code after a goto or return that no label leads back into */
+int32_t optimizeRemoveUnreachable(cfg_t* cfg, void* context)
+{
+    assert(cfg != NULL);
+
+    int32_t changes = 0;
+    cfgMarkReachable(cfg);
+
+    for (size_t index = 0; index < cfg->total_blocks; index++) {
+        cfg_block_t* block = &cfg->blocks[index];
+        if (block->flags & CFG_BLOCK_REACHABLE) {
+            continue;
+        }
+
+        for (size_t offset = 0; offset < block->total_commands; offset++) {
+            cfgRemoveCommand(cfg, block->first_command + offset);
+            changes++;
+        }
+    }
+
+    return changes;
+}
+
+/* Remove labels no goto or if-goto names. Labels are emitted as global
+ * assembly symbols, so a reference from any function keeps a label */
+int32_t optimizeRemoveDeadLabels(cfg_t* cfg, void* context)
+{
+    assert(cfg != NULL);
+
+    command_module_t* commands = cfg->commands;
+    size_t total_references = 0;
+    for (size_t index = 0; index < commands->total_commands; index++) {
+        operator_t op = commands->commands[index].op;
+        total_references += op == OP_GOTO || OP_IS_CONDITIONAL(op);
+    }
+
+    size_t capacity = 16;
+    while (capacity < total_references * 2) {
+        capacity <<= 1;
+    }
+
+    /* Set of referenced label names, as pointers to the jump commands' labels */
+    stack_arena_t stack_arena;
+    if (stackArenaInitialize(&stack_arena, capacity * sizeof(const char*)) < 0) {
+        return -1;
+    }
+    const char** referenced = stackArenaPush(&stack_arena, capacity * sizeof(const char*));
+
+    for (size_t index = 0; index < commands->total_commands; index++) {
+        command_t* command = &commands->commands[index];
+        if (command->op != OP_GOTO && !OP_IS_CONDITIONAL(command->op)) {
+            continue;
+        }
+
+        size_t slot = hashName(command->arguments.flow.label) & (capacity - 1);
+        while (referenced[slot] != NULL && strcmp(referenced[slot], command->arguments.flow.label) != 0) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        referenced[slot] = command->arguments.flow.label;
+    }
+
+    int32_t changes = 0;
+    for (size_t index = 0; index < commands->total_commands; index++) {
+        command_t* command = &commands->commands[index];
+        if (command->op != OP_LABEL) {
+            continue;
+        }
+
+        size_t slot = hashName(command->arguments.flow.label) & (capacity - 1);
+        while (referenced[slot] != NULL && strcmp(referenced[slot], command->arguments.flow.label) != 0) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+
+        if (referenced[slot] == NULL) {
+            cfgRemoveCommand(cfg, index);
+            changes++;
+        }
+    }
+
+    stackArenaRelease(&stack_arena);
+    return changes;
+}
+
+/* Point every jump at the end of the chain of unconditional gotos its target
+ * starts, so "goto a ... label a, goto b" jumps straight to b. Labels with
+ * nothing but the fall into the next label in between are stepped over too */
+int32_t optimizeThreadJumps(cfg_t* cfg, void* context)
+{
+    assert(cfg != NULL);
+
+    command_module_t* commands = cfg->commands;
+    int32_t changes = 0;
+
+    for (size_t index = 0; index < commands->total_commands; index++) {
+        command_t* command = &commands->commands[index];
+        if (command->op != OP_GOTO && !OP_IS_CONDITIONAL(command->op)) {
+            continue;
+        }
+
+        uint32_t function = cfg->blocks[cfg->command_blocks[index]].function;
+        uint32_t target = cfgFindLabel(cfg, function, command->arguments.flow.label);
+        char* label = command->arguments.flow.label;
+
+        /* The step limit ends chains that loop back on themselves */
+        for (size_t steps = 0; target != CFG_NO_BLOCK && steps < cfg->total_blocks; steps++) {
+            cfg_block_t* block = &cfg->blocks[target];
+            command_t* last = &commands->commands[block->first_command + block->total_commands - 1];
+
+            if (block->total_commands == 2 && last->op == OP_GOTO) {
+                label = last->arguments.flow.label;
+                target = block->successors[1];
+            }
+            else if (block->total_commands == 1 && last->op == OP_LABEL) {
+                target = block->successors[0];
+            }
+            else {
+                break;
+            }
+        }
+
+        if (strcmp(label, command->arguments.flow.label) != 0) {
+            command->arguments.flow.label = label;
+            changes++;
+        }
+    }
+
+    return changes;
+}
+
+/* Return 1 if the run of labels right after a command contains label */
+static int32_t labelFollows(cfg_t* cfg, size_t index, const char* label)
+{
+    command_module_t* commands = cfg->commands;
+
+    for (index++; index < commands->total_commands && commands->commands[index].op == OP_LABEL; index++) {
+        if (strcmp(commands->commands[index].arguments.flow.label, label) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* The conditional jump taken exactly when the given one isn't */
+static operator_t invertCondition(operator_t op)
+{
+    switch (op) {
+        case OP_IFGOTO:    return OP_IFNOTGOTO;
+        case OP_IFNOTGOTO: return OP_IFGOTO;
+        case OP_IFLT:      return OP_IFGE;
+        case OP_IFGE:      return OP_IFLT;
+        case OP_IFGT:      return OP_IFLE;
+        case OP_IFLE:      return OP_IFGT;
+        case OP_IFEQ:      return OP_IFNE;
+        case OP_IFNE:      return OP_IFEQ;
+        default:           return OP_UNKNOWN;
+    }
+}
+
+/* Remove gotos to the label right after them, and turn
+ * "if-goto a, goto b, label a" into "if-not-goto b, label a",
+ * the same for every other conditional jump */
+int32_t optimizeSimplifyBranches(cfg_t* cfg, void* context)
+{
+    assert(cfg != NULL);
+
+    command_module_t* commands = cfg->commands;
+    int32_t changes = 0;
+
+    for (size_t index = 0; index < commands->total_commands; index++) {
+        command_t* command = &commands->commands[index];
+        if (cfg->removed[index]) {
+            continue;
+        }
+
+        if (command->op == OP_GOTO && labelFollows(cfg, index, command->arguments.flow.label)) {
+            cfgRemoveCommand(cfg, index);
+            changes++;
+        }
+        else if (OP_IS_CONDITIONAL(command->op) &&
+                 index + 1 < commands->total_commands && commands->commands[index + 1].op == OP_GOTO &&
+                 labelFollows(cfg, index + 1, command->arguments.flow.label)) {
+
+            command->op = invertCondition(command->op);
+            command->arguments.flow.label = commands->commands[index + 1].arguments.flow.label;
+            cfgRemoveCommand(cfg, index + 1);
+            changes++;
+        }
+    }
+
+    return changes;
+}
+
+/* Turn "push x, pop y" into one move, which assembly gen copies from x to y
+ * without going through the stack. Pairs that put a value back where it came
+ * from are removed. Labels are commands of their own, so nothing can jump in
+ * between the two */
+int32_t optimizeFuseMoves(cfg_t* cfg, void* context)
+{
+    assert(cfg != NULL);
+
+    command_module_t* commands = cfg->commands;
+    int32_t changes = 0;
+
+    for (size_t index = 0; index + 1 < commands->total_commands; index++) {
+        command_t* push = &commands->commands[index];
+        command_t* pop = &commands->commands[index + 1];
+        if (push->op != OP_PUSH || pop->op != OP_POP || cfg->removed[index] || cfg->removed[index + 1] ||
+            pop->arguments.memory.segment == SEG_CONSTANT) {
+            continue;
+        }
+
+        memory_segment_t from_segment = push->arguments.memory.segment;
+        uint16_t from_index = push->arguments.memory.index;
+
+        if (from_segment == pop->arguments.memory.segment && from_index == pop->arguments.memory.index) {
+            cfgRemoveCommand(cfg, index);
+        }
+        else {
+            push->op = OP_MOVE;
+            push->arguments.move.from_segment = from_segment;
+            push->arguments.move.from_index = from_index;
+            push->arguments.move.to_segment = pop->arguments.memory.segment;
+            push->arguments.move.to_index = pop->arguments.memory.index;
+        }
+        cfgRemoveCommand(cfg, index + 1);
+
+        changes++;
+        index++;
+    }
+
+    return changes;
+}
+
+/* Turn "lt, if-goto a" into "if-lt a", and the same for gt and eq, which
+ * assembly gen makes a single jump on the difference instead of a trip through
+ * the shared comparison routines. A not in between or an if-not-goto flips the
+ * comparison, a not is only safe to fold in after a comparison since it only
+ * negates true and false. Labels are commands of their own, so nothing can
+ * jump in between */
+int32_t optimizeFuseCompares(cfg_t* cfg, void* context)
+{
+    assert(cfg != NULL);
+
+    command_module_t* commands = cfg->commands;
+    int32_t changes = 0;
+
+    for (size_t index = 0; index < commands->total_commands; index++) {
+        command_t* command = &commands->commands[index];
+        if ((command->op != OP_LT && command->op != OP_GT && command->op != OP_EQ) || cfg->removed[index]) {
+            continue;
+        }
+
+        operator_t op = command->op == OP_LT ? OP_IFLT : command->op == OP_GT ? OP_IFGT : OP_IFEQ;
+
+        size_t next = index + 1;
+        for (; next < commands->total_commands && commands->commands[next].op == OP_NOT && !cfg->removed[next]; next++) {
+            op = invertCondition(op);
+        }
+
+        if (next == commands->total_commands || cfg->removed[next] ||
+            (commands->commands[next].op != OP_IFGOTO && commands->commands[next].op != OP_IFNOTGOTO)) {
+            continue;
+        }
+
+        command->op = commands->commands[next].op == OP_IFGOTO ? op : invertCondition(op);
+        command->arguments.flow.label = commands->commands[next].arguments.flow.label;
+        for (size_t removed = index + 1; removed <= next; removed++) {
+            cfgRemoveCommand(cfg, removed);
+        }
+
+        changes++;
+        index = next;
+    }
+
+    return changes;
+}
+
+/* Return 1 if the command at index calls function with two arguments */
+static int32_t callsWithTwo(cfg_t* cfg, size_t index, const char* function)
+{
+    command_t* command = &cfg->commands->commands[index];
+    return command->op == OP_CALL && !cfg->removed[index] && command->arguments.flow.locals == 2 &&
+           strcmp(command->arguments.flow.label, function) == 0;
+}
+
+/* Turn "push constant k, call Math.multiply 2" into "multiply constant k", which
+ * assembly gen makes an addition chain instead of a trip through the shift and add
+ * loop, and "push constant k, push x, call Math.multiply 2" into "push x, multiply
+ * constant k". Multiplying or dividing by 1 is removed. Hack has no right shift, so
+ * division by larger constants stays a call. Math.multiply and Math.divide are taken
+ * to be the OS ones, optimizeCommands leaves the pass out when the calls are kept. A
+ * multiply may still become its call again for size, so Math.multiply keeps the
+ * standard protocol */
+int32_t optimizeStrengthReduce(cfg_t* cfg, void* context)
+{
+    assert(cfg != NULL);
+
+    command_module_t* commands = cfg->commands;
+    int32_t changes = 0;
+
+    for (size_t index = 0; index + 1 < commands->total_commands; index++) {
+        command_t* push = &commands->commands[index];
+        if (push->op != OP_PUSH || push->arguments.memory.segment != SEG_CONSTANT || cfg->removed[index]) {
+            continue;
+        }
+
+        uint16_t constant = push->arguments.memory.index;
+        size_t call = index + 1;
+        if (constant == 1 && callsWithTwo(cfg, call, "Math.divide")) {
+            cfgRemoveCommand(cfg, index);
+        }
+        else if (call + 1 < commands->total_commands && commands->commands[call].op == OP_PUSH && !cfg->removed[call] &&
+                 callsWithTwo(cfg, call + 1, OP_MULTIPLY_FUNCTION)) {
+
+            /* The other value goes first, the constant is folded into the multiply */
+            *push = commands->commands[call];
+            commands->commands[call].op = OP_MULTIPLY;
+            commands->commands[call].arguments.memory.segment = SEG_CONSTANT;
+            commands->commands[call].arguments.memory.index = constant;
+            if (constant == 1) {
+                cfgRemoveCommand(cfg, call);
+            }
+            call++;
+        }
+        else if (callsWithTwo(cfg, call, OP_MULTIPLY_FUNCTION)) {
+            push->op = OP_MULTIPLY;
+            if (constant == 1) {
+                cfgRemoveCommand(cfg, index);
+            }
+        }
+        else {
+            continue;
+        }
+        cfgRemoveCommand(cfg, call);
+
+        changes++;
+        index = call;
+    }
+
+    return changes;
+}
+
+/* Turn "call f n, return" into "tail-call f n", which hands the frame of the
+ * function making the call on to f, so f returns straight to that function's
+ * caller and recursion through tail calls runs in constant stack. Calls with
+ * more than OPTIMIZE_TAIL_CALL_ARGUMENTS arguments are left alone, the copy is
+ * unrolled per argument */
+int32_t optimizeTailCalls(cfg_t* cfg, void* context)
+{
+    assert(cfg != NULL);
+
+    command_module_t* commands = cfg->commands;
+    int32_t changes = 0;
+
+    for (size_t index = 0; index + 1 < commands->total_commands; index++) {
+        command_t* command = &commands->commands[index];
+        if (command->op != OP_CALL || commands->commands[index + 1].op != OP_RETURN ||
+            cfg->removed[index] || cfg->removed[index + 1] || command->arguments.flow.locals > OPTIMIZE_TAIL_CALL_ARGUMENTS) {
+            continue;
+        }
+
+        command->op = OP_TAILCALL;
+        cfgRemoveCommand(cfg, index + 1);
+        changes++;
+    }
+
+    return changes;
+}
+
+#define LEAF_UNCALLED -1    /* No call to the function seen yet */
+#define LEAF_STANDARD -2    /* The function keeps the standard protocol */
+
+/* A function of one of the modules given to optimizeLeafCalls */
+typedef struct {
+    size_t   module;
+    uint32_t function;      /* Its index in the module's graph */
+    int32_t  arguments;     /* Of every call to it, or LEAF_UNCALLED / LEAF_STANDARD */
+} leaf_function_t;
+
+/* The function with a name in a table of function index + 1, NULL if no module has it */
+static leaf_function_t* findFunction(cfg_t* cfgs, leaf_function_t* functions, const uint32_t* names, size_t capacity,
+                                     const char* name)
+{
+    for (size_t slot = hashName(name) & (capacity - 1); names[slot] != 0; slot = (slot + 1) & (capacity - 1)) {
+        leaf_function_t* function = &functions[names[slot] - 1];
+        if (strcmp(cfgs[function->module].functions[function->function].name, name) == 0) {
+            return function;
+        }
+    }
+    return NULL;
+}
+
+/* Return 1 if a function of a graph has no locals and calls nothing, and with a
+ * profile has a command it finds hot */
+static int32_t leafQualifies(cfg_t* cfg, uint32_t index, const profile_t* profile)
+{
+    cfg_function_t* function = &cfg->functions[index];
+    command_t* first = &cfg->commands->commands[cfg->blocks[function->first_block].first_command];
+    if (first->op != OP_FUNCTION || first->arguments.flow.locals != 0 || strcmp(function->name, OPTIMIZE_ENTRY_FUNCTION) == 0) {
+        return 0;
+    }
+
+    uint64_t hottest = 0;
+    for (size_t offset = 0; offset < function->total_blocks; offset++) {
+        cfg_block_t* block = &cfg->blocks[function->first_block + offset];
+        if ((block->flags & (CFG_BLOCK_CALLS | CFG_BLOCK_ESCAPES)) ||
+            ((block->segment_uses | block->segment_defs) & (1u << SEG_LOCAL))) {
+            return 0;
+        }
+
+        for (size_t command = 0; profile != NULL && command < block->total_commands; command++) {
+            uint64_t count = PROFILE_COUNT(profile, cfg->commands->commands[block->first_command + command].line);
+            hottest = count > hottest ? count : hottest;
+        }
+    }
+
+    return profile == NULL || hottest >= profile->hot_count;
+}
+
+/* Give functions without locals that call nothing the leaf convention, their
+ * calls save only ARG and the return address and they return through ARG
+ * instead of LCL. Calls are looked for across all the modules of the program,
+ * so a function called from another file is seen. The entry function, functions
+ * never called, tail call targets, Math.multiply while a multiply may call it,
+ * and functions called with different numbers of arguments keep the standard
+ * protocol, as does every function of a module a jump leaves its function in.
+ * Leaf calls and returns are always expanded in place, -O s does better sharing
+ * the call and return routines, so it only gives the functions its module's
+ * profile finds hot the leaf convention, and without a profile none. profiles
+ * holds one per module, it or any of them may be NULL
+ * Return the number of changes on success
+ * Return -1 on failure */
+int32_t optimizeLeafCalls(command_module_t** modules, size_t total_modules, int32_t level, const profile_t* const* profiles)
+{
+    assert(modules != NULL || total_modules == 0);
+
+    if (level <= 0 || total_modules == 0) {
+        return 0;
+    }
+
+    stack_arena_t stack_arena;
+    if (stackArenaInitialize(&stack_arena, total_modules * sizeof(cfg_t) + 64) < 0) {
+        return -1;
+    }
+    cfg_t* cfgs = stackArenaPush(&stack_arena, total_modules * sizeof(cfg_t));
+    memset(cfgs, 0, total_modules * sizeof(cfg_t));
+
+    /* A graph per module, empty modules have none */
+    int32_t result = 0;
+    size_t total_functions = 0;
+    for (size_t module = 0; module < total_modules && result == 0; module++) {
+        if (modules[module]->total_commands == 0) {
+            continue;
+        }
+        result = cfgBuild(&cfgs[module], modules[module]);
+        total_functions += cfgs[module].total_functions;
+    }
+
+    size_t capacity = 16;
+    while (capacity < total_functions * 2) {
+        capacity <<= 1;
+    }
+
+    /* Function names to function index + 1, and the functions of every module */
+    stack_arena_t table_arena;
+    if (result < 0 || stackArenaInitialize(&table_arena, capacity * sizeof(uint32_t) +
+                                           (total_functions + 1) * sizeof(leaf_function_t) + 64) < 0) {
+        for (size_t module = 0; module < total_modules; module++) {
+            if (cfgs[module].blocks != NULL) {
+                cfgDestroy(&cfgs[module]);
+            }
+        }
+        stackArenaRelease(&stack_arena);
+        return -1;
+    }
+    uint32_t* names = stackArenaPush(&table_arena, capacity * sizeof(uint32_t));
+    leaf_function_t* functions = stackArenaPush(&table_arena, (total_functions + 1) * sizeof(leaf_function_t));
+    memset(names, 0, capacity * sizeof(uint32_t));
+
+    size_t function_index = 0;
+    for (size_t module = 0; module < total_modules; module++) {
+        for (uint32_t index = 0; cfgs[module].blocks != NULL && index < cfgs[module].total_functions; index++) {
+            if (cfgs[module].functions[index].name == NULL) {
+                continue;
+            }
+
+            leaf_function_t* function = &functions[function_index++];
+            function->module = module;
+            function->function = index;
+            function->arguments = LEAF_UNCALLED;
+
+            size_t slot = hashName(cfgs[module].functions[index].name) & (capacity - 1);
+            while (names[slot] != 0) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            names[slot] = (uint32_t) function_index;
+        }
+    }
+
+    /* Every call in every module counts */
+    for (size_t module = 0; module < total_modules; module++) {
+        command_module_t* commands = modules[module];
+        for (size_t index = 0; index < commands->total_commands; index++) {
+            command_t* command = &commands->commands[index];
+            if (command->op != OP_CALL && command->op != OP_TAILCALL && command->op != OP_MULTIPLY) {
+                continue;
+            }
+
+            leaf_function_t* function = findFunction(cfgs, functions, names, capacity,
+                                                     command->op == OP_MULTIPLY ? OP_MULTIPLY_FUNCTION : command->arguments.flow.label);
+            if (function == NULL) {
+                continue;
+            }
+
+            if (command->op != OP_CALL ||
+                (function->arguments != LEAF_UNCALLED && function->arguments != command->arguments.flow.locals)) {
+                function->arguments = LEAF_STANDARD;
+            }
+            else {
+                function->arguments = command->arguments.flow.locals;
+            }
+        }
+    }
+
+    /* Then keep only the functions that qualify */
+    for (size_t index = 0; index < function_index; index++) {
+        leaf_function_t* function = &functions[index];
+        cfg_t* cfg = &cfgs[function->module];
+        const profile_t* profile = level == OPTIMIZE_LEVEL_SIZE && profiles != NULL ? profiles[function->module] : NULL;
+        if (function->arguments < 0) {
+            continue;
+        }
+
+        if (cfg->total_unresolved != 0 || (level == OPTIMIZE_LEVEL_SIZE && profile == NULL) ||
+            !leafQualifies(cfg, function->function, profile)) {
+            function->arguments = LEAF_STANDARD;
+        }
+    }
+
+    for (size_t module = 0; module < total_modules; module++) {
+        command_module_t* commands = modules[module];
+        cfg_t* cfg = &cfgs[module];
+        for (size_t index = 0; index < commands->total_commands; index++) {
+            command_t* command = &commands->commands[index];
+
+            if (command->op == OP_CALL) {
+                leaf_function_t* function = findFunction(cfgs, functions, names, capacity, command->arguments.flow.label);
+                if (function != NULL && function->arguments >= 0) {
+                    command->op = OP_LEAFCALL;
+                    result++;
+                }
+            }
+            else if (command->op == OP_FUNCTION || command->op == OP_RETURN) {
+                uint32_t own = cfg->blocks[cfg->command_blocks[index]].function;
+                const char* name = cfg->functions[own].name;
+                leaf_function_t* function = name != NULL ? findFunction(cfgs, functions, names, capacity, name) : NULL;
+                if (function == NULL || function->module != module || function->function != own || function->arguments < 0) {
+                    continue;
+                }
+
+                if (command->op == OP_FUNCTION) {
+                    command->op = OP_LEAFFUNCTION;
+                }
+                else {
+                    command->op = OP_LEAFRETURN;
+                    command->arguments.flow.label = (char*) name;
+                    command->arguments.flow.locals = (uint16_t) function->arguments;
+                }
+                result++;
+            }
+        }
+    }
+
+    for (size_t module = 0; module < total_modules; module++) {
+        if (cfgs[module].blocks != NULL) {
+            cfgDestroy(&cfgs[module]);
+        }
+    }
+    stackArenaRelease(&table_arena);
+    stackArenaRelease(&stack_arena);
+    return result;
+}
+
+#define LAYOUT_KEEP   0     /* Commands stay in source order */
+#define LAYOUT_ROTATE 1     /* A loop label, its test moves below the body */
+#define LAYOUT_SWAP   2     /* A conditional jump, its two arms trade places */
+
+/* What to do with the commands starting at an index */
+typedef struct {
+    uint8_t kind;
+    size_t  split;          /* Rotate: the exit test. Swap: the goto ending the first arm */
+    size_t  end;            /* Rotate: the goto back to the top. Swap: the label the arms join at */
+    char*   label;          /* Rotate: for the body. Swap: for the first arm */
+} layout_plan_t;
+
+typedef struct {
+    const command_t*     from;
+    const layout_plan_t* plans;
+    command_t*           to;
+    size_t               total;
+} layout_t;
+
+/* Return 1 if control can only leave the command by falling into the next one */
+static int32_t layoutStraight(operator_t op)
+{
+    return op != OP_LABEL && op != OP_GOTO && op != OP_TAILCALL && !OP_IS_CONDITIONAL(op) &&
+           !OP_IS_RETURN(op) && !OP_IS_FUNCTION(op);
+}
+
+/* Executions of the first command from index on that isn't a label, 0 if the range has none */
+static uint64_t layoutCount(const profile_t* profile, const command_t* commands, size_t index, size_t end)
+{
+    while (index < end && commands[index].op == OP_LABEL) {
+        index++;
+    }
+    return index < end ? PROFILE_COUNT(profile, commands[index].line) : 0;
+}
+
+/* Name a label the layout adds, "function$label.suffix". VM names can't hold a '$',
+ * and function names are unique across a program, so no other label can share it */
+static char* layoutLabel(stack_arena_t* stack_arena, const char* function, const char* label, const char* suffix)
+{
+    function = function != NULL ? function : "";
+    size_t function_length = strlen(function);
+    size_t label_length = strlen(label);
+    size_t suffix_length = strlen(suffix);
+
+    char* name = stackArenaPush(stack_arena, function_length + label_length + suffix_length + 2);
+    if (name != NULL) {
+        memcpy(name, function, function_length);
+        name[function_length] = '$';
+        memcpy(name + function_length + 1, label, label_length);
+        memcpy(name + function_length + 1 + label_length, suffix, suffix_length + 1);
+    }
+    return name;
+}
+
+static void layoutAppend(layout_t* layout, const command_t* command, operator_t op, char* label)
+{
+    command_t* copy = &layout->to[layout->total++];
+    *copy = *command;
+    copy->op = op;
+    copy->arguments.flow.label = label;
+}
+
+/* Lay out the commands from index up to end, applying the plans that fit inside */
+static void layoutRange(layout_t* layout, size_t index, size_t end)
+{
+    while (index < end) {
+        const command_t* command = &layout->from[index];
+        const layout_plan_t* plan = &layout->plans[index];
+
+        if (plan->kind == LAYOUT_ROTATE && plan->end < end) {
+            /* "label top, test, if exit, body, goto top" becomes
+             * "goto top, label body, body, label top, test, if not exit goto body" */
+            const command_t* test = &layout->from[plan->split];
+            layoutAppend(layout, command, OP_GOTO, command->arguments.flow.label);
+            layoutAppend(layout, command, OP_LABEL, plan->label);
+            layoutRange(layout, plan->split + 1, plan->end);
+            for (size_t offset = index; offset < plan->split; offset++) {
+                layout->to[layout->total++] = layout->from[offset];
+            }
+            layoutAppend(layout, test, invertCondition(test->op), plan->label);
+            index = plan->end + 1;
+        }
+        else if (plan->kind == LAYOUT_SWAP && plan->end <= end) {
+            /* "if second, first, goto join, label second, second, label join" becomes
+             * "if not first, label second, second, goto join, label first, first, label join" */
+            layoutAppend(layout, command, invertCondition(command->op), plan->label);
+            layoutRange(layout, plan->split + 1, plan->end);
+            layout->to[layout->total++] = layout->from[plan->split];
+            layoutAppend(layout, command, OP_LABEL, plan->label);
+            layoutRange(layout, index + 1, plan->split);
+            index = plan->end;
+        }
+        else {
+            layout->to[layout->total++] = *command;
+            index++;
+        }
+    }
+}
+
+/* Reorder code so unconditional jumps are taken as rarely as possible, a taken
+ * and a fallen through conditional jump cost the same. Loops that test at the
+ * top and jump back at the bottom are rotated to test at the bottom, jumping
+ * back while the test fails, so each pass through the loop saves its goto. With
+ * a profile in context, if / else arms where the first arm, which has to jump
+ * over the second, ran more often trade places. Every fall through the new
+ * order breaks gets a goto, and the labels added are unique to their function.
+ * The module's commands are copied onto its arena, without room the commands
+ * stay where they are */
+int32_t optimizeLayoutBlocks(cfg_t* cfg, void* context)
+{
+    assert(cfg != NULL);
+
+    const profile_t* profile = context;
+    command_module_t* commands = cfg->commands;
+    const command_t* from = commands->commands;
+    size_t total_commands = commands->total_commands;
+    if (commands->stack_arena == NULL || total_commands == 0) {
+        return 0;
+    }
+
+    stack_arena_t stack_arena;
+    if (stackArenaInitialize(&stack_arena, total_commands * sizeof(layout_plan_t)) < 0) {
+        return -1;
+    }
+    layout_plan_t* plans = stackArenaPush(&stack_arena, total_commands * sizeof(layout_plan_t));
+
+    /* Labels go on the module's arena, popped again if nothing comes of them */
+    size_t position = stackArenaPosition(commands->stack_arena);
+    int32_t changes = 0;
+    int32_t room = 1;
+
+    for (size_t index = 0; index < total_commands && room; index++) {
+        const command_t* command = &from[index];
+        if (command->op != OP_GOTO && !OP_IS_CONDITIONAL(command->op)) {
+            continue;
+        }
+
+        uint32_t function = cfg->blocks[cfg->command_blocks[index]].function;
+        uint32_t target = cfgFindLabel(cfg, function, command->arguments.flow.label);
+        if (target == CFG_NO_BLOCK) {
+            continue;
+        }
+        size_t label = cfg->blocks[target].first_command;
+        const char* name = cfg->functions[function].name;
+
+        /* A goto back up to a label followed by straight code, an exit test and then
+         * this goto, with the exit right after it */
+        if (command->op == OP_GOTO && label < index && plans[label].kind == LAYOUT_KEEP) {
+            size_t test = label + 1;
+            while (test < index && layoutStraight(from[test].op)) {
+                test++;
+            }
+            if (test == index || !OP_IS_CONDITIONAL(from[test].op) ||
+                !labelFollows(cfg, index, from[test].arguments.flow.label)) {
+                continue;
+            }
+
+            plans[label] = (layout_plan_t) {LAYOUT_ROTATE, test, index,
+                                            layoutLabel(commands->stack_arena, name, from[label].arguments.flow.label, ".body")};
+            room = plans[label].label != NULL;
+            changes++;
+        }
+
+        /* A conditional jump over a first arm that ends jumping over the second to
+         * where both join, the first ran more often */
+        else if (OP_IS_CONDITIONAL(command->op) && profile != NULL && label > index + 1 &&
+                 plans[index].kind == LAYOUT_KEEP) {
+            size_t jump = label - 1;
+            while (jump > index && from[jump].op == OP_LABEL) {
+                jump--;
+            }
+            if (jump == index || from[jump].op != OP_GOTO) {
+                continue;
+            }
+
+            uint32_t join_block = cfgFindLabel(cfg, function, from[jump].arguments.flow.label);
+            size_t join = join_block != CFG_NO_BLOCK ? cfg->blocks[join_block].first_command : 0;
+            if (join <= label ||
+                layoutCount(profile, from, index + 1, jump) <= layoutCount(profile, from, label, join)) {
+                continue;
+            }
+
+            plans[index] = (layout_plan_t) {LAYOUT_SWAP, jump, join,
+                                            layoutLabel(commands->stack_arena, name, command->arguments.flow.label, ".first")};
+            room = plans[index].label != NULL;
+            changes++;
+        }
+    }
+
+    /* A rotation and a swap each add one command */
+    command_t* to = room && changes > 0 ?
+                    stackArenaPush(commands->stack_arena, (total_commands + (size_t) changes) * sizeof(command_t)) : NULL;
+    if (to == NULL) {
+        stackArenaPop(commands->stack_arena, stackArenaPosition(commands->stack_arena) - position);
+        stackArenaRelease(&stack_arena);
+        return 0;
+    }
+
+    layout_t layout = {from, plans, to, 0};
+    layoutRange(&layout, 0, total_commands);
+    stackArenaRelease(&stack_arena);
+
+    assert(layout.total <= total_commands + (size_t) changes);
+    return cfgReplaceCommands(cfg, to, layout.total) < 0 ? -1 : changes;
+}
+
+#define FOLD_NO_TARGET UINT32_MAX   /* Not a jump, or one leaving its function */
+
+/* A function of one of the modules being folded */
+typedef struct {
+    size_t   module;
+    size_t   first;             /* Index of its function command */
+    size_t   total_commands;
+    size_t   targets;           /* Index of its first command's jump target in the targets array */
+    uint32_t hash;
+    uint32_t survivor;          /* Function index + 1 of the copy it folds into, 0 if kept */
+    uint8_t  foldable;
+    uint8_t  statics;           /* Reads or writes its file's static segment */
+} fold_function_t;
+
+static uint32_t foldMix(uint32_t hash, uint32_t value)
+{
+    return (hash ^ value) * 16777619u;
+}
+
+/* Mix what a command does into hash, leaving out anything specific to where it is:
+ * label names, jump targets but for their place in the function, line numbers and
+ * the function's own name */
+static uint32_t foldHashCommand(uint32_t hash, const command_t* command, uint32_t target)
+{
+    hash = foldMix(hash, (uint32_t) command->op);
+
+    switch (command->op) {
+        case OP_PUSH:
+        case OP_POP:
+        case OP_MULTIPLY:
+            hash = foldMix(hash, (uint32_t) command->arguments.memory.segment);
+            return foldMix(hash, command->arguments.memory.index);
+        case OP_MOVE:
+            hash = foldMix(hash, (uint32_t) command->arguments.move.from_segment);
+            hash = foldMix(hash, command->arguments.move.from_index);
+            hash = foldMix(hash, (uint32_t) command->arguments.move.to_segment);
+            return foldMix(hash, command->arguments.move.to_index);
+        case OP_CALL:
+        case OP_TAILCALL:
+        case OP_LEAFCALL:
+            hash = foldMix(hash, hashName(command->arguments.flow.label));
+            return foldMix(hash, command->arguments.flow.locals);
+        case OP_FUNCTION:
+        case OP_LEAFFUNCTION:
+        case OP_LEAFRETURN:
+            return foldMix(hash, command->arguments.flow.locals);
+        default:
+            return command->op == OP_GOTO || OP_IS_CONDITIONAL(command->op) ? foldMix(hash, target) : hash;
+    }
+}
+
+/* Return 1 if two commands do the same thing at the same place in their functions */
+static int32_t foldSameCommand(const command_t* a, const command_t* b, uint32_t a_target, uint32_t b_target)
+{
+    if (a->op != b->op) {
+        return 0;
+    }
+
+    switch (a->op) {
+        case OP_PUSH:
+        case OP_POP:
+        case OP_MULTIPLY:
+            return a->arguments.memory.segment == b->arguments.memory.segment &&
+                   a->arguments.memory.index == b->arguments.memory.index;
+        case OP_MOVE:
+            return a->arguments.move.from_segment == b->arguments.move.from_segment &&
+                   a->arguments.move.from_index == b->arguments.move.from_index &&
+                   a->arguments.move.to_segment == b->arguments.move.to_segment &&
+                   a->arguments.move.to_index == b->arguments.move.to_index;
+        case OP_CALL:
+        case OP_TAILCALL:
+        case OP_LEAFCALL:
+            return a->arguments.flow.locals == b->arguments.flow.locals &&
+                   strcmp(a->arguments.flow.label, b->arguments.flow.label) == 0;
+        case OP_FUNCTION:
+        case OP_LEAFFUNCTION:
+        case OP_LEAFRETURN:
+            return a->arguments.flow.locals == b->arguments.flow.locals;
+        default:
+            return a->op == OP_GOTO || OP_IS_CONDITIONAL(a->op) ? a_target == b_target : 1;
+    }
+}
+
+/* Return 1 if two functions have the same body, statics only match within a file */
+static int32_t foldSameFunction(command_module_t** modules, const fold_function_t* a, const fold_function_t* b,
+                                const uint32_t* targets)
+{
+    if (a->hash != b->hash || a->total_commands != b->total_commands || a->statics != b->statics ||
+        (a->statics && a->module != b->module)) {
+        return 0;
+    }
+
+    const command_t* a_commands = &modules[a->module]->commands[a->first];
+    const command_t* b_commands = &modules[b->module]->commands[b->first];
+    for (size_t offset = 0; offset < a->total_commands; offset++) {
+        if (!foldSameCommand(&a_commands[offset], &b_commands[offset], targets[a->targets + offset], targets[b->targets + offset])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* One round of folding, calls to the functions folded are pointed at their survivors
+ * and the functions dropped from their modules
+ * Return the number of functions folded on success
+ * Return -1 on failure */
+static int32_t foldRound(command_module_t** modules, size_t total_modules)
+{
+    size_t total_functions = 0;
+    size_t total_commands = 0;
+    size_t total_labels = 0;
+    for (size_t module = 0; module < total_modules; module++) {
+        for (size_t index = 0; index < modules[module]->total_commands; index++) {
+            total_functions += OP_IS_FUNCTION(modules[module]->commands[index].op);
+            total_labels += modules[module]->commands[index].op == OP_LABEL;
+        }
+        total_commands += modules[module]->total_commands;
+    }
+
+    /* Commands outside any function have nothing to fold into */
+    if (total_functions == 0) {
+        return 0;
+    }
+
+    size_t capacity = 16;
+    while (capacity < (total_functions > total_labels ? total_functions : total_labels) * 2) {
+        capacity <<= 1;
+    }
+
+    /* Functions, tables of function names and labels to function index + 1, with the
+     * label's place in its function, one of the bodies kept, and per command the place
+     * of its jump's target */
+    stack_arena_t stack_arena;
+    if (stackArenaInitialize(&stack_arena, (total_functions + 1) * sizeof(fold_function_t) +
+                             capacity * (4 * sizeof(uint32_t) + sizeof(const command_t*)) +
+                             (total_commands + 1) * sizeof(uint32_t) + total_modules * sizeof(size_t) + 64) < 0) {
+        return -1;
+    }
+    fold_function_t* functions = stackArenaPush(&stack_arena, (total_functions + 1) * sizeof(fold_function_t));
+    uint32_t* names = stackArenaPush(&stack_arena, capacity * sizeof(uint32_t));
+    uint32_t* label_functions = stackArenaPush(&stack_arena, capacity * sizeof(uint32_t));
+    uint32_t* label_places = stackArenaPush(&stack_arena, capacity * sizeof(uint32_t));
+    const command_t** labels = stackArenaPush(&stack_arena, capacity * sizeof(const command_t*));
+    uint32_t* copies = stackArenaPush(&stack_arena, capacity * sizeof(uint32_t));
+    uint32_t* targets = stackArenaPush(&stack_arena, (total_commands + 1) * sizeof(uint32_t));
+    size_t* remaining = stackArenaPush(&stack_arena, total_modules * sizeof(size_t));
+
+    /* Find the functions and where their labels are */
+    size_t function_index = 0;
+    size_t target_base = 0;
+    int32_t multiplies = 0;
+    for (size_t module = 0; module < total_modules; module++) {
+        const command_t* commands = modules[module]->commands;
+        for (size_t index = 0; index < modules[module]->total_commands; index++) {
+            if (OP_IS_FUNCTION(commands[index].op)) {
+                fold_function_t* function = &functions[function_index++];
+                function->module = module;
+                function->first = index;
+                function->targets = target_base + index;
+                function->foldable = 1;
+                remaining[module]++;
+
+                size_t slot = hashName(commands[index].arguments.flow.label) & (capacity - 1);
+                while (names[slot] != 0) {
+                    slot = (slot + 1) & (capacity - 1);
+                }
+                names[slot] = (uint32_t) function_index;
+            }
+            multiplies |= commands[index].op == OP_MULTIPLY;
+            if (function_index == 0) {
+                continue;
+            }
+
+            functions[function_index - 1].total_commands++;
+            if (commands[index].op == OP_LABEL) {
+                size_t slot = hashName(commands[index].arguments.flow.label) & (capacity - 1);
+                while (labels[slot] != NULL && strcmp(labels[slot]->arguments.flow.label, commands[index].arguments.flow.label) != 0) {
+                    slot = (slot + 1) & (capacity - 1);
+                }
+                if (labels[slot] == NULL) {
+                    labels[slot] = &commands[index];
+                    label_functions[slot] = (uint32_t) function_index;
+                    label_places[slot] = (uint32_t) (index - functions[function_index - 1].first);
+                }
+            }
+        }
+        target_base += modules[module]->total_commands;
+    }
+
+    /* A multiply the generator turns back into a call goes to Math.multiply by name */
+    for (size_t slot = hashName(OP_MULTIPLY_FUNCTION) & (capacity - 1); multiplies && names[slot] != 0;
+         slot = (slot + 1) & (capacity - 1)) {
+        fold_function_t* function = &functions[names[slot] - 1];
+        if (strcmp(modules[function->module]->commands[function->first].arguments.flow.label, OP_MULTIPLY_FUNCTION) == 0) {
+            function->foldable = 0;
+        }
+    }
+
+    /* Place jump targets and hash the bodies. A jump out of its function, or to a label
+     * defined twice, keeps both ends where they are */
+    for (size_t index = 0; index < function_index; index++) {
+        fold_function_t* function = &functions[index];
+        const command_t* commands = &modules[function->module]->commands[function->first];
+        uint32_t hash = 2166136261u;
+
+        for (size_t offset = 0; offset < function->total_commands; offset++) {
+            const command_t* command = &commands[offset];
+            uint32_t target = FOLD_NO_TARGET;
+
+            if (command->op == OP_GOTO || OP_IS_CONDITIONAL(command->op)) {
+                size_t slot = hashName(command->arguments.flow.label) & (capacity - 1);
+                while (labels[slot] != NULL && strcmp(labels[slot]->arguments.flow.label, command->arguments.flow.label) != 0) {
+                    slot = (slot + 1) & (capacity - 1);
+                }
+                if (labels[slot] == NULL || label_functions[slot] != index + 1) {
+                    function->foldable = 0;
+                    if (labels[slot] != NULL) {
+                        functions[label_functions[slot] - 1].foldable = 0;
+                    }
+                }
+                else {
+                    target = label_places[slot];
+                }
+            }
+            else if ((command->op == OP_PUSH || command->op == OP_POP) && command->arguments.memory.segment == SEG_STATIC) {
+                function->statics = 1;
+            }
+            else if (command->op == OP_MOVE &&
+                     (command->arguments.move.from_segment == SEG_STATIC || command->arguments.move.to_segment == SEG_STATIC)) {
+                function->statics = 1;
+            }
+
+            targets[function->targets + offset] = target;
+            hash = foldHashCommand(hash, command, target);
+        }
+        function->hash = hash;
+    }
+
+    /* Keep the first of every set of copies, the entry function being first of all.
+     * A module keeps at least one function, assembly gen wants one */
+    int32_t folded = 0;
+
+    for (size_t pass = 0; pass < 2; pass++) {
+        for (size_t index = 0; index < function_index; index++) {
+            fold_function_t* function = &functions[index];
+            const char* name = modules[function->module]->commands[function->first].arguments.flow.label;
+            if (!function->foldable || (strcmp(name, OPTIMIZE_ENTRY_FUNCTION) == 0) != (pass == 0)) {
+                continue;
+            }
+
+            size_t slot = function->hash & (capacity - 1);
+            while (copies[slot] != 0 && !foldSameFunction(modules, &functions[copies[slot] - 1], function, targets)) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+
+            if (copies[slot] == 0) {
+                copies[slot] = (uint32_t) index + 1;
+            }
+            else if (pass == 1 && remaining[function->module] > 1) {
+                function->survivor = copies[slot];
+                remaining[function->module]--;
+                folded++;
+            }
+        }
+    }
+
+    /* Point calls at the survivors, then drop the copies */
+    for (size_t module = 0; module < total_modules && folded > 0; module++) {
+        command_module_t* commands = modules[module];
+        for (size_t index = 0; index < commands->total_commands; index++) {
+            command_t* command = &commands->commands[index];
+            if (command->op != OP_CALL && command->op != OP_TAILCALL && command->op != OP_LEAFCALL) {
+                continue;
+            }
+
+            size_t slot = hashName(command->arguments.flow.label) & (capacity - 1);
+            while (names[slot] != 0) {
+                fold_function_t* function = &functions[names[slot] - 1];
+                if (strcmp(modules[function->module]->commands[function->first].arguments.flow.label,
+                           command->arguments.flow.label) == 0) {
+                    if (function->survivor != 0) {
+                        fold_function_t* survivor = &functions[function->survivor - 1];
+                        command->arguments.flow.label = modules[survivor->module]->commands[survivor->first].arguments.flow.label;
+                    }
+                    break;
+                }
+                slot = (slot + 1) & (capacity - 1);
+            }
+        }
+    }
+
+    for (size_t index = 0, module = 0, kept = 0; index < function_index && folded > 0; index++) {
+        fold_function_t* function = &functions[index];
+        command_module_t* commands = modules[function->module];
+        if (function->module != module || index == 0) {
+            module = function->module;
+            kept = function->first;
+        }
+
+        if (function->survivor == 0) {
+            memmove(&commands->commands[kept], &commands->commands[function->first], function->total_commands * sizeof(command_t));
+            kept += function->total_commands;
+        }
+        if (index + 1 == function_index || functions[index + 1].module != module) {
+            commands->total_commands = kept;
+        }
+    }
+
+    stackArenaRelease(&stack_arena);
+    return folded;
+}
+
+/* Fold functions with the same body across the modules of a program into one copy.
+ * Bodies are compared with label names left out, a jump only by the place of its
+ * target in the function, so template copies with their own labels match too, and
+ * calls to each copy dropped go to the one kept. Functions using static variables
+ * only fold within their file, and functions a jump from elsewhere lands in, or
+ * that jump out, stay, as does Math.multiply while a multiply may call it.
+ * Folding calls may make their callers the same, so it runs until nothing more
+ * folds
+ * Return the number of functions folded on success
+ * Return -1 on failure */
+int32_t optimizeFoldFunctions(command_module_t** modules, size_t total_modules)
+{
+    assert(modules != NULL || total_modules == 0);
+
+    int32_t total_folded = 0;
+    int32_t folded;
+    do {
+        folded = foldRound(modules, total_modules);
+        if (folded < 0) {
+            return -1;
+        }
+        total_folded += folded;
+    } while (folded > 0);
+
+    return total_folded;
+}
+
+/* Run the passes of an optimization level over a command module in place,
+ * level 0 leaves the commands alone. profile is optional, see below. keep_calls
+ * leaves calls to Math.multiply and Math.divide alone, as assembly_gen_t's does
+ * for the routines it expands, for programs with routines of their own by those names
+ * Return the number of changes on success
+ * Return -1 on failure */
+int32_t optimizeCommands(command_module_t* commands, int32_t level, const profile_t* profile, int32_t keep_calls)
+{
+    assert(commands != NULL);
+
+    if (level <= 0 || commands->total_commands == 0) {
+        return 0;
+    }
+
+    /* Only the levels that pick expansions by a profile lay blocks out by one */
+    void* layout_profile = level >= OPTIMIZE_LEVEL_SPEED ? (void*) profile : NULL;
+    const cfg_pass_t PASSES[] = {
+        {"remove-unreachable",  optimizeRemoveUnreachable, NULL},
+        {"thread-jumps",        optimizeThreadJumps,       NULL},
+        {"remove-dead-labels",  optimizeRemoveDeadLabels,  NULL},
+        {"remove-unreachable",  optimizeRemoveUnreachable, NULL},
+        {"strength-reduce",     optimizeStrengthReduce,    NULL},
+        {"fuse-compares",       optimizeFuseCompares,      NULL},
+        {"simplify-branches",   optimizeSimplifyBranches,  NULL},
+        {"layout-blocks",       optimizeLayoutBlocks,      layout_profile},
+        {"remove-dead-labels",  optimizeRemoveDeadLabels,  NULL},
+        {"fuse-moves",          optimizeFuseMoves,         NULL},
+        {"tail-calls",          optimizeTailCalls,         NULL},
+    };
+
+    cfg_pass_t passes[sizeof(PASSES) / sizeof(PASSES[0])];
+    size_t total_passes = 0;
+    for (size_t pass = 0; pass < sizeof(PASSES) / sizeof(PASSES[0]); pass++) {
+        if (!keep_calls || PASSES[pass].run != optimizeStrengthReduce) {
+            passes[total_passes++] = PASSES[pass];
+        }
+    }
+
+    cfg_t cfg;
+    if (cfgBuild(&cfg, commands) < 0) {
+        return -1;
+    }
+
+    int32_t changes = cfgRunPasses(&cfg, passes, total_passes);
+
+    /* A failed rebuild leaves no graph behind */
+    if (cfg.blocks != NULL) {
+        cfgDestroy(&cfg);
+    }
+
+    return changes;
+}
+
+/* Parse an optimization level as given to -O, 0, 1, 2 or s
+ * Return the level on success
+ * Return -1 if it isn't one */
+int32_t optimizeParseLevel(const char* text)
+{
+    assert(text != NULL);
+
+    if (strcmp(text, "s") == 0) {
+        return OPTIMIZE_LEVEL_SIZE;
+    }
+    if (text[0] >= '0' && text[0] <= '2' && text[1] == '\0') {
+        return text[0] - '0';
+    }
+    return -1;
+}
+
+/* The expansions assembly gen should favour at an optimization level */
+assembly_goal_t optimizeGoal(int32_t level)
+{
+    return level == OPTIMIZE_LEVEL_SPEED ? ASSEMBLY_GOAL_SPEED :
+           level == OPTIMIZE_LEVEL_SIZE  ? ASSEMBLY_GOAL_SIZE  : ASSEMBLY_GOAL_DEFAULT;
+}
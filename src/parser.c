@@ -13,12 +13,19 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdio.h>
 
 
 /* String to keyword mappings */
 
 /* Mappings are relevent to enum positions */
 static char const* const OPERAND_KEYWORD_MAPPING[17] = {"add", "sub", "neg", "and", "or", "not", "lt", "gt", "eq", "push", "pop", "label", "goto", "if-goto", "function", "call", "return"}; 
+
+/* Names of every operator for parserFormatCommand, the ones only the optimizer produces
+ * included. The parser takes none of those, they skip the checks the optimizer makes */
+static char const* const OPERATOR_NAMES[OP_MAX] = {"add", "sub", "neg", "and", "or", "not", "lt", "gt", "eq", "push", "pop", "label", "goto", "if-goto", "function", "call", "return", "if-not-goto", "move",
+                                                   "if-lt", "if-gt", "if-eq", "if-ge", "if-le", "if-ne", "tail-call",
+                                                   "leaf-function", "leaf-call", "leaf-return", "multiply"};
 static char const* const MEMORY_SEGMENT_KEYWORD_MAPPING[8] = {"argument", "local", "static", "constant", "this", "that", "pointer", "temp"};
 
 
@@ -105,7 +112,7 @@ static void parserChunkFile(parser_t* parser, char** line_pointers, size_t line_
  * Return corresponding operation otherwise */
 static operator_t translateOperatorString(char* str)
 {
-    for (size_t index = 0; index < OP_MAX; index++) {
+    for (size_t index = 0; index < sizeof(OPERAND_KEYWORD_MAPPING) / sizeof(OPERAND_KEYWORD_MAPPING[0]); index++) {
 
         if (strcmp(str, OPERAND_KEYWORD_MAPPING[index]) == 0) {
             return (operator_t) index;
@@ -131,6 +138,41 @@ static memory_segment_t translateMemorySegmentString(char* str)
     return SEG_UNKNOWN;
 }
 
+/* Parse the segment and index tokens of a memory operand, position is the strtok_r state
+ * Return 0 on success
+ * Return -1 on failure */
+static int32_t parseMemoryOperand(char** position, char* line_end, memory_segment_t* segment, uint16_t* index)
+{
+    const char delimeters[] = " \n";
+
+    char* token = strtok_r(NULL, delimeters, position);
+    if (token == NULL) {
+        return -1;
+    }
+
+    *segment = translateMemorySegmentString(token);
+
+    if (*segment == SEG_UNKNOWN) {
+        return -1;
+    }
+
+    // Get index value
+    token = strtok_r(NULL, delimeters, position);
+    if (token == NULL) {
+        return -1;
+    }
+
+    char* endptr = line_end;
+    *index = strtol(token, &endptr, 10);
+
+    /* endptr should be have the value '\0' if the string was valid */
+    if (*endptr != '\0') {
+        return -1;
+    }
+
+    return 0;
+}
+
 /* Parse the given line into a command structure 
  * Return 0 on success
  * Return -1 on failure */
@@ -149,7 +191,9 @@ static int32_t parserParseCommand(stack_arena_t* stack_arena, char* line_pointer
     const char delimeters[] = " \n";
     char* const line_end = strchr(line_pointer, '\n');
 
-    char* token = strtok(line_pointer, delimeters);
+    /* strtok_r keeps its position here instead of in a static, so threads can parse at once */
+    char* position = NULL;
+    char* token = strtok_r(line_pointer, delimeters, &position);
     if (token == NULL) {
         return -1;
     }
@@ -163,28 +207,7 @@ static int32_t parserParseCommand(stack_arena_t* stack_arena, char* line_pointer
     }
     else if (command->op == OP_PUSH || command->op == OP_POP) {
         // memory shiz
-        token = strtok(NULL, delimeters);
-        if (token == NULL) {
-            return -1;
-        }
-
-        command->arguments.memory.segment = translateMemorySegmentString(token);
-
-        if (command->arguments.memory.segment == SEG_UNKNOWN) {
-            return -1;
-        }
-
-        // Get index value
-        token = strtok(NULL, delimeters);
-        if (token == NULL) {
-            return -1;
-        }
-
-        char* endptr = line_end;
-        command->arguments.memory.index = strtol(token, &endptr, 10);
-
-        /* endptr should be have the value '\0' if the string was valid */
-        if (*endptr != '\0') {
+        if (parseMemoryOperand(&position, line_end, &command->arguments.memory.segment, &command->arguments.memory.index) < 0) {
             return -1;
         }
     }
@@ -193,7 +216,7 @@ static int32_t parserParseCommand(stack_arena_t* stack_arena, char* line_pointer
     else if (command->op == OP_LABEL    || command->op == OP_GOTO || command->op == OP_IFGOTO ||
              command->op == OP_FUNCTION || command->op == OP_CALL) {
         // Non uninariy Flow control
-        token = strtok(NULL, delimeters);
+        token = strtok_r(NULL, delimeters, &position);
         if (token == NULL) {
             return -1;
         }
@@ -204,12 +227,13 @@ static int32_t parserParseCommand(stack_arena_t* stack_arena, char* line_pointer
             return -1;
         }
 
-        strncpy(command->arguments.flow.label, token, length); // might be off by one error
+        /* Copy the terminator too, arena memory isn't always fresh */
+        memcpy(command->arguments.flow.label, token, length + 1);
         
         /* The Function and Call keywords have a label and a subsequent number */
         if (command->op == OP_FUNCTION || command->op == OP_CALL) {
 
-            token = strtok(NULL, delimeters);
+            token = strtok_r(NULL, delimeters, &position);
             if (token == NULL) {
                 return -1;
             }
@@ -247,6 +271,8 @@ int32_t parserParseCommands(parser_t* parser, command_module_t* command_module,
 
     assert(parser != NULL && parser->file_map != NULL && command_module != NULL && stack_arena != NULL);
     
+    command_module->stack_arena = stack_arena;
+
     // Count the number of commands
     command_module->total_commands = memCountByte(parser->file_map, (int) '\n', parser->file_size);
 
@@ -273,7 +299,245 @@ int32_t parserParseCommands(parser_t* parser, command_module_t* command_module,
         if (0 > parserParseCommand(stack_arena, line_pointers[index], &command_module->commands[index])) {
             return -1;
         }
+        command_module->commands[index].line = (uint32_t) (index + 1);
+    }
+
+    return 0;
+}
+
+
+/* A function found by the index pass of parserParseReachable */
+typedef struct {
+    const char* name;           /* Points into its line, length bytes long */
+    size_t      length;
+    size_t      first_line;     /* The function line */
+    size_t      end_line;       /* One past its last line */
+    int32_t     reachable;
+} parser_function_t;
+
+/* The name after keyword if a line starts with it, without tokenizing the line
+ * Return the name, length set
+ * Return NULL if the line doesn't start with keyword */
+static const char* keywordOperand(const char* line, const char* keyword, size_t* length)
+{
+    while (*line == ' ') {
+        line++;
+    }
+
+    size_t keyword_length = strlen(keyword);
+    if (strncmp(line, keyword, keyword_length) != 0 || line[keyword_length] != ' ') {
+        return NULL;
+    }
+
+    line += keyword_length;
+    while (*line == ' ') {
+        line++;
+    }
+
+    *length = strcspn(line, " \n");
+    return *length != 0 ? line : NULL;
+}
+
+static size_t hashName(const char* name, size_t length)
+{
+    size_t hash = 2166136261u;
+    for (size_t index = 0; index < length; index++) {
+        hash = (hash ^ (uint8_t) name[index]) * 16777619u;
+    }
+    return hash;
+}
+
+/* Find a function by name, slots hold function index + 1 and 0 when empty
+ * Return the slot it is in, or the empty one it would go in */
+static size_t findFunction(const parser_function_t* functions, const uint32_t* slots, size_t total_slots,
+                           const char* name, size_t length)
+{
+    size_t slot = hashName(name, length) & (total_slots - 1);
+    while (slots[slot] != 0 && (functions[slots[slot] - 1].length != length ||
+                                memcmp(functions[slots[slot] - 1].name, name, length) != 0)) {
+        slot = (slot + 1) & (total_slots - 1);
+    }
+    return slot;
+}
+
+/* Parse only what entry_function can reach into command_module. A first pass indexes
+ * the function lines, then the bodies of reachable functions are scanned for calls,
+ * starting from entry_function, and only their lines are parsed. Lines ahead of the
+ * first function are always parsed. Commands keep the line numbers of the whole file.
+ * Nothing outside those lines is checked, a mistake in an unused function goes
+ * unnoticed. Without entry_function in the file every function is parsed, as by
+ * parserParseCommands. Memory allocations are done on stack_arena AND not free'd on failure
+ * return 0 on success,
+ * return -1 on failure */
+int32_t parserParseReachable(parser_t* parser, command_module_t* command_module, stack_arena_t* stack_arena,
+                             const char* entry_function)
+{
+    assert(parser != NULL && parser->file_map != NULL && command_module != NULL && stack_arena != NULL &&
+           entry_function != NULL);
+
+    command_module->stack_arena = stack_arena;
+
+    /* A function line takes at least 13 bytes, "function f 0\n" */
+    size_t capacity = parser->file_size / 13 + 1;
+    size_t total_slots = 1;
+    while (total_slots < 2 * capacity) {
+        total_slots <<= 1;
+    }
+
+    /* Every line ends in a newline, there are at most as many as bytes */
+    char** line_pointers = stackArenaPush(stack_arena, sizeof(char*) * (parser->file_size + 1));
+    parser_function_t* functions = stackArenaPush(stack_arena, capacity * sizeof(parser_function_t));
+    uint32_t* slots = stackArenaPush(stack_arena, total_slots * sizeof(uint32_t));
+    size_t* pending = stackArenaPush(stack_arena, capacity * sizeof(size_t));
+    if (line_pointers == NULL || functions == NULL || slots == NULL || pending == NULL) {
+        return -1;
+    }
+    memset(slots, 0, total_slots * sizeof(uint32_t));
+
+    /* Find the lines, indexing the function lines on the way. Only lines starting with
+     * f can be one. Lines are only cut off when they are parsed, writing to every line
+     * would copy every page of the mapped file */
+    const char* name;
+    size_t length;
+    size_t total_functions = 0;
+    size_t total_lines = 0;
+    char* const file_end = parser->file_map + parser->file_size;
+    char* end;
+
+    for (char* position = parser->file_map; (end = memchr(position, '\n', (size_t) (file_end - position))) != NULL;
+         position = end + 1) {
+        size_t line = total_lines++;
+        line_pointers[line] = position;
+
+        char* first = line_pointers[line] + strspn(line_pointers[line], " ");
+        if (*first != 'f' || (name = keywordOperand(first, "function", &length)) == NULL || total_functions == capacity) {
+            continue;
+        }
+
+        if (total_functions != 0) {
+            functions[total_functions - 1].end_line = line;
+        }
+        functions[total_functions] = (parser_function_t) {name, length, line, 0, 0};
+
+        /* The first definition of a name is the one calls go to */
+        size_t slot = findFunction(functions, slots, total_slots, name, length);
+        if (slots[slot] == 0) {
+            slots[slot] = (uint32_t) total_functions + 1;
+        }
+        total_functions++;
+    }
+
+    if (total_functions != 0) {
+        functions[total_functions - 1].end_line = total_lines;
+    }
+
+    /* Walk the calls out of every reachable function */
+    size_t function;
+    size_t total_pending = 0;
+    size_t entry = findFunction(functions, slots, total_slots, entry_function, strlen(entry_function));
+    if (slots[entry] == 0) {
+        for (function = 0; function < total_functions; function++) {
+            functions[function].reachable = 1;
+        }
+    }
+    else {
+        functions[slots[entry] - 1].reachable = 1;
+        pending[total_pending++] = slots[entry] - 1;
+    }
+
+    while (total_pending != 0) {
+        parser_function_t* caller = &functions[pending[--total_pending]];
+
+        for (size_t line = caller->first_line + 1; line < caller->end_line; line++) {
+            name = keywordOperand(line_pointers[line], "call", &length);
+            if (name == NULL) {
+                continue;
+            }
+
+            /* A call to a function the file doesn't define is left to the assembler */
+            size_t slot = findFunction(functions, slots, total_slots, name, length);
+            if (slots[slot] != 0 && !functions[slots[slot] - 1].reachable) {
+                functions[slots[slot] - 1].reachable = 1;
+                pending[total_pending++] = slots[slot] - 1;
+            }
+        }
+    }
+
+    /* Parse what is reachable, in the order of the file */
+    size_t first_function_line = total_functions != 0 ? functions[0].first_line : total_lines;
+    command_module->total_commands = first_function_line;
+    for (function = 0; function < total_functions; function++) {
+        if (functions[function].reachable) {
+            command_module->total_commands += functions[function].end_line - functions[function].first_line;
+        }
+    }
+
+    command_module->commands = stackArenaPush(stack_arena, command_module->total_commands * sizeof(command_t) + 1);
+    if (command_module->commands == NULL) {
+        return -1;
+    }
+
+    size_t index = 0;
+    function = 0;
+    for (size_t line = 0; line < total_lines; line++) {
+        while (function < total_functions && line >= functions[function].end_line) {
+            function++;
+        }
+        if (line >= first_function_line && !functions[function].reachable) {
+            line = functions[function].end_line - 1;
+            continue;
+        }
+
+        *strchr(line_pointers[line], '\n') = '\0';
+        if (parserParseCommand(stack_arena, line_pointers[line], &command_module->commands[index]) < 0) {
+            return -1;
+        }
+        command_module->commands[index++].line = (uint32_t) (line + 1);
     }
 
     return 0;
 }
+
+
+/* Parse a single null terminated line into a command, for callers that walk
+ * the mapped file themselves. Labels are allocated on stack_arena, at most
+ * strlen(line) + 1 bytes
+ * return 0 on success,
+ * return -1 on failure */
+int32_t parserParseLine(stack_arena_t* stack_arena, char* line, command_t* command)
+{
+    assert(stack_arena != NULL && line != NULL && command != NULL);
+
+    return parserParseCommand(stack_arena, line, command);
+}
+
+
+/* Write the VM source text of a command into buffer, at most size bytes including the terminator
+ * Return the length the text would have, as snprintf does */
+int32_t parserFormatCommand(const command_t* command, char* buffer, size_t size)
+{
+    assert(command != NULL && buffer != NULL && command->op > OP_UNKNOWN && command->op < OP_MAX);
+
+    if (command->op == OP_PUSH || command->op == OP_POP || command->op == OP_MULTIPLY) {
+        return snprintf(buffer, size, "%s %s %u", OPERATOR_NAMES[command->op],
+                        MEMORY_SEGMENT_KEYWORD_MAPPING[command->arguments.memory.segment], command->arguments.memory.index);
+    }
+
+    if (command->op == OP_MOVE) {
+        return snprintf(buffer, size, "%s %s %u %s %u", OPERATOR_NAMES[command->op],
+                        MEMORY_SEGMENT_KEYWORD_MAPPING[command->arguments.move.from_segment], command->arguments.move.from_index,
+                        MEMORY_SEGMENT_KEYWORD_MAPPING[command->arguments.move.to_segment], command->arguments.move.to_index);
+    }
+
+    if (OP_IS_FUNCTION(command->op) || OP_IS_CALL(command->op) || command->op == OP_TAILCALL ||
+        command->op == OP_LEAFRETURN) {
+        return snprintf(buffer, size, "%s %s %u", OPERATOR_NAMES[command->op],
+                        command->arguments.flow.label, command->arguments.flow.locals);
+    }
+
+    if (command->op == OP_LABEL || command->op == OP_GOTO || OP_IS_CONDITIONAL(command->op)) {
+        return snprintf(buffer, size, "%s %s", OPERATOR_NAMES[command->op], command->arguments.flow.label);
+    }
+
+    return snprintf(buffer, size, "%s", OPERATOR_NAMES[command->op]);
+}
@@ -0,0 +1,319 @@
+#include "../include/pipeline.h"
+#include "../include/assembly_gen.h"
+#include "../include/parser.h"
+#include "../include/stack_arena.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Spins before a waiting stage starts yielding its core */
+#define PIPELINE_SPINS 256
+
+
+static void ringInitialize(spsc_ring_t* ring, size_t capacity)
+{
+    assert((capacity & (capacity - 1)) == 0 && capacity <= sizeof(ring->slots) / sizeof(ring->slots[0]));
+
+    ring->capacity = capacity;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+}
+
+/* Add an item to the ring, waiting while it is full
+ * Return 0 on success
+ * Return -1 if the pipeline failed while waiting */
+static int32_t ringPush(pipeline_t* pipeline, spsc_ring_t* ring, void* item)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    for (uint32_t spins = 0; tail - atomic_load_explicit(&ring->head, memory_order_acquire) == ring->capacity; spins++) {
+        if (atomic_load_explicit(&pipeline->failed, memory_order_relaxed)) {
+            return -1;
+        }
+        if (spins >= PIPELINE_SPINS) {
+            sched_yield();
+        }
+    }
+
+    ring->slots[tail & (ring->capacity - 1)] = item;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return 0;
+}
+
+/* Take an item off the ring, waiting while it is empty
+ * Return NULL if the pipeline failed while waiting */
+static void* ringPop(pipeline_t* pipeline, spsc_ring_t* ring)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    for (uint32_t spins = 0; atomic_load_explicit(&ring->tail, memory_order_acquire) == head; spins++) {
+        if (atomic_load_explicit(&pipeline->failed, memory_order_relaxed)) {
+            return NULL;
+        }
+        if (spins >= PIPELINE_SPINS) {
+            sched_yield();
+        }
+    }
+
+    void* item = ring->slots[head & (ring->capacity - 1)];
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return item;
+}
+
+static void pipelineFail(pipeline_t* pipeline)
+{
+    atomic_store_explicit(&pipeline->failed, 1, memory_order_relaxed);
+}
+
+/* Parser stage, cuts the mapped file into lines and parses them into batches.
+ * Only \n terminated lines are commands, the same as parserParseCommands */
+static void* parserStage(void* argument)
+{
+    pipeline_t* pipeline = argument;
+    char* position = pipeline->parser->file_map;
+    char* const end = position + pipeline->parser->file_size;
+    uint32_t line = 0;
+
+    for (;;) {
+        command_batch_t* batch = ringPop(pipeline, &pipeline->free_batches);
+        if (batch == NULL) {
+            return NULL;
+        }
+
+        batch->total_commands = 0;
+        stackArenaPop(&batch->stack_arena, stackArenaPosition(&batch->stack_arena));
+
+        int32_t done = 0;
+        while (batch->total_commands < PIPELINE_BATCH_COMMANDS) {
+            char* newline = memchr(position, '\n', (size_t) (end - position));
+            if (newline == NULL) {
+                done = 1;
+                break;
+            }
+
+            /* A label is never longer than its line, leave the line for the next batch if it may not fit */
+            if (batch->stack_arena.size - stackArenaPosition(&batch->stack_arena) < (size_t) (newline - position) + 1) {
+                break;
+            }
+
+            *newline = '\0';
+            command_t* command = &batch->commands[batch->total_commands];
+            if (parserParseLine(&batch->stack_arena, position, command) < 0) {
+                fprintf(stderr, "Failed to parse line %u\n", line + 1);
+                pipelineFail(pipeline);
+                return NULL;
+            }
+
+            command->line = ++line;
+            batch->total_commands++;
+            position = newline + 1;
+        }
+
+        /* An empty batch that isn't the end means a line didn't fit at all */
+        if (batch->total_commands == 0 && !done) {
+            fprintf(stderr, "Line %u is too long\n", line + 1);
+            pipelineFail(pipeline);
+            return NULL;
+        }
+
+        if (ringPush(pipeline, &pipeline->full_batches, batch) < 0) {
+            return NULL;
+        }
+
+        /* An empty batch marks the end */
+        if (batch->total_commands == 0) {
+            return NULL;
+        }
+    }
+}
+
+/* Generator stage, translates batches into assembly buffers */
+static void* generatorStage(void* argument)
+{
+    pipeline_t* pipeline = argument;
+    assembly_gen_t* assembly_gen = pipeline->assembly_gen;
+    stack_arena_t stack_arena;
+    stack_arena_t names;
+    char* name = NULL;
+
+    /* The current function's name has to outlive the batch it was parsed into */
+    if (stackArenaInitialize(&stack_arena, 4096) < 0) {
+        pipelineFail(pipeline);
+        return NULL;
+    }
+    if (stackArenaInitialize(&names, pipeline->parser->file_size + 1) < 0) {
+        stackArenaRelease(&stack_arena);
+        pipelineFail(pipeline);
+        return NULL;
+    }
+
+    if (assemblyGenBeginFile(assembly_gen, pipeline->filename) < 0) {
+        stackArenaRelease(&names);
+        stackArenaRelease(&stack_arena);
+        pipelineFail(pipeline);
+        return NULL;
+    }
+
+    output_buffer_t* buffer = ringPop(pipeline, &pipeline->free_buffers);
+    while (buffer != NULL) {
+        command_batch_t* batch = ringPop(pipeline, &pipeline->full_batches);
+        if (batch == NULL) {
+            break;
+        }
+
+        size_t total_commands = batch->total_commands;
+        for (size_t index = 0; index < total_commands; index++) {
+            char* assembly_str = assemblyGenCommand(assembly_gen, &stack_arena, &batch->commands[index], pipeline->filename);
+            if (assembly_str == NULL) {
+                fprintf(stderr, "Failed to generate assembly for line %u\n", batch->commands[index].line);
+                pipelineFail(pipeline);
+                break;
+            }
+
+            size_t length = strlen(assembly_str);
+            if (buffer->size + length > PIPELINE_BUFFER_SIZE) {
+                if (ringPush(pipeline, &pipeline->full_buffers, buffer) < 0 ||
+                    (buffer = ringPop(pipeline, &pipeline->free_buffers)) == NULL) {
+                    break;
+                }
+                buffer->size = 0;
+            }
+
+            memcpy(buffer->data + buffer->size, assembly_str, length);
+            buffer->size += length;
+            stackArenaPop(&stack_arena, stackArenaPosition(&stack_arena));
+        }
+
+        if (buffer == NULL || atomic_load_explicit(&pipeline->failed, memory_order_relaxed)) {
+            break;
+        }
+
+        if (assembly_gen->function != NULL && assembly_gen->function != name) {
+            size_t length = strlen(assembly_gen->function) + 1;
+            stackArenaPop(&names, stackArenaPosition(&names));
+            name = stackArenaPush(&names, length);
+            memcpy(name, assembly_gen->function, length);
+            assembly_gen->function = name;
+        }
+
+        if (ringPush(pipeline, &pipeline->free_batches, batch) < 0) {
+            break;
+        }
+
+        /* End of the stream, hand over what is left then an empty buffer */
+        if (total_commands == 0) {
+            if (buffer->size != 0) {
+                if (ringPush(pipeline, &pipeline->full_buffers, buffer) < 0 ||
+                    (buffer = ringPop(pipeline, &pipeline->free_buffers)) == NULL) {
+                    break;
+                }
+            }
+            buffer->size = 0;
+            ringPush(pipeline, &pipeline->full_buffers, buffer);
+            break;
+        }
+    }
+
+    stackArenaRelease(&names);
+    stackArenaRelease(&stack_arena);
+    return NULL;
+}
+
+/* Writer stage, runs on the calling thread */
+static void writerStage(pipeline_t* pipeline)
+{
+    FILE* output_file = pipeline->assembly_gen->output_file;
+
+    for (;;) {
+        output_buffer_t* buffer = ringPop(pipeline, &pipeline->full_buffers);
+        if (buffer == NULL || buffer->size == 0) {
+            break;
+        }
+
+        if (fwrite(buffer->data, 1, buffer->size, output_file) < buffer->size) {
+            fprintf(stderr, "Failed to write assembly\n");
+            pipelineFail(pipeline);
+            break;
+        }
+
+        if (ringPush(pipeline, &pipeline->free_buffers, buffer) < 0) {
+            break;
+        }
+    }
+
+    if (fflush(output_file) < 0) {
+        pipelineFail(pipeline);
+    }
+}
+
+/* Translate the file held by parser to assembly, with the preamble already generated.
+ * The parser thread, generator thread and the calling thread, which writes,
+ * all work at once so the total time approaches that of the slowest stage.
+ * The mapped file is modified in place, as with parserParseCommands
+ * Return 0 on success
+ * Return -1 on failure */
+int32_t pipelineTranslate(parser_t* parser, assembly_gen_t* assembly_gen, const char* filename)
+{
+    assert(parser != NULL && parser->file_map != NULL && assembly_gen != NULL &&
+           assembly_gen->output_file != NULL && filename != NULL);
+
+    pipeline_t pipeline;
+    memset(&pipeline, 0, sizeof(pipeline_t));
+    pipeline.parser = parser;
+    pipeline.assembly_gen = assembly_gen;
+    pipeline.filename = filename;
+    atomic_init(&pipeline.failed, 0);
+
+    if (stackArenaInitialize(&pipeline.stack_arena,
+                             PIPELINE_BATCHES * sizeof(command_batch_t) + PIPELINE_BUFFERS * PIPELINE_BUFFER_SIZE) < 0) {
+        return -1;
+    }
+
+    pipeline.batches = stackArenaPush(&pipeline.stack_arena, PIPELINE_BATCHES * sizeof(command_batch_t));
+
+    ringInitialize(&pipeline.full_batches, PIPELINE_BATCHES);
+    ringInitialize(&pipeline.free_batches, PIPELINE_BATCHES);
+    ringInitialize(&pipeline.full_buffers, PIPELINE_BUFFERS);
+    ringInitialize(&pipeline.free_buffers, PIPELINE_BUFFERS);
+
+    size_t initialized = 0;
+    for (; initialized < PIPELINE_BATCHES; initialized++) {
+        if (stackArenaInitialize(&pipeline.batches[initialized].stack_arena, PIPELINE_BATCH_LABELS) < 0) {
+            break;
+        }
+        ringPush(&pipeline, &pipeline.free_batches, &pipeline.batches[initialized]);
+    }
+
+    for (size_t index = 0; index < PIPELINE_BUFFERS; index++) {
+        pipeline.buffers[index].data = stackArenaPush(&pipeline.stack_arena, PIPELINE_BUFFER_SIZE);
+        ringPush(&pipeline, &pipeline.free_buffers, &pipeline.buffers[index]);
+    }
+
+    int32_t result = -1;
+    pthread_t parser_thread, generator_thread;
+
+    if (initialized == PIPELINE_BATCHES) {
+        if (pthread_create(&parser_thread, NULL, parserStage, &pipeline) == 0) {
+            if (pthread_create(&generator_thread, NULL, generatorStage, &pipeline) == 0) {
+                writerStage(&pipeline);
+                pthread_join(generator_thread, NULL);
+            }
+            else {
+                pipelineFail(&pipeline);
+            }
+            pthread_join(parser_thread, NULL);
+
+            result = atomic_load(&pipeline.failed) ? -1 : 0;
+        }
+    }
+
+    for (size_t index = 0; index < initialized; index++) {
+        stackArenaRelease(&pipeline.batches[index].stack_arena);
+    }
+    stackArenaRelease(&pipeline.stack_arena);
+
+    return result;
+}
@@ -0,0 +1,112 @@
+#include "../include/profile.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The part of a path after its last slash */
+static const char* baseName(const char* path, size_t length, size_t* base_length)
+{
+    size_t start = length;
+    while (start > 0 && path[start - 1] != '/') {
+        start--;
+    }
+    *base_length = length - start;
+    return path + start;
+}
+
+/* Split a "file:line<tab>count" entry, comments and blank lines are skipped
+ * Return 1 if the entry is for filename
+ * Return 0 if it isn't, or isn't an entry
+ * Return -1 if it is malformed */
+static int32_t parseEntry(char* text, const char* filename, uint32_t* line, uint64_t* count)
+{
+    if (text[0] == '#' || text[0] == '\n' || text[0] == '\0') {
+        return 0;
+    }
+
+    char* tab = strchr(text, '\t');
+    if (tab == NULL) {
+        return -1;
+    }
+
+    char* colon = tab;
+    while (colon > text && *colon != ':') {
+        colon--;
+    }
+    if (colon == text) {
+        return -1;
+    }
+
+    char* end;
+    *line = (uint32_t) strtoul(colon + 1, &end, 10);
+    if (end != tab) {
+        return -1;
+    }
+    *count = strtoull(tab + 1, &end, 10);
+    if (end == tab + 1) {
+        return -1;
+    }
+
+    /* Paths may differ between the run and the translation, the file name has to match */
+    size_t entry_length, name_length;
+    const char* entry = baseName(text, (size_t) (colon - text), &entry_length);
+    const char* name = baseName(filename, strlen(filename), &name_length);
+
+    return entry_length == name_length && memcmp(entry, name, name_length) == 0;
+}
+
+/* Load the counts filepath holds for the source file filename onto stack_arena,
+ * a profile naming lines the arena has no room for can't be for this file
+ * Return 0 on success
+ * Return -1 on failure */
+int32_t profileLoad(profile_t* profile, const char* filepath, const char* filename, stack_arena_t* stack_arena)
+{
+    assert(profile != NULL && filepath != NULL && filename != NULL && stack_arena != NULL);
+
+    memset(profile, 0, sizeof(profile_t));
+
+    FILE* input_file = fopen(filepath, "r");
+    if (input_file == NULL) {
+        return -1;
+    }
+
+    /* The first pass finds the last line, the second fills in the counts */
+    char text[4096];
+    uint32_t line;
+    uint64_t count;
+    int32_t found;
+
+    while (fgets(text, sizeof(text), input_file) != NULL) {
+        found = parseEntry(text, filename, &line, &count);
+        if (found < 0) {
+            fclose(input_file);
+            return -1;
+        }
+        if (found && line >= profile->total_lines) {
+            profile->total_lines = (size_t) line + 1;
+        }
+    }
+
+    profile->counts = stackArenaPush(stack_arena, profile->total_lines * sizeof(uint64_t) + 8);
+    if (profile->counts == NULL) {
+        fclose(input_file);
+        return -1;
+    }
+    memset(profile->counts, 0, profile->total_lines * sizeof(uint64_t));
+
+    rewind(input_file);
+    while (fgets(text, sizeof(text), input_file) != NULL) {
+        if (parseEntry(text, filename, &line, &count) == 1) {
+            profile->counts[line] += count;
+            if (profile->counts[line] > profile->hottest) {
+                profile->hottest = profile->counts[line];
+            }
+        }
+    }
+    fclose(input_file);
+
+    profile->hot_count = profile->hottest / PROFILE_HOT_RATIO > 0 ? profile->hottest / PROFILE_HOT_RATIO : 1;
+    return 0;
+}
@@ -0,0 +1,485 @@
+#include "../include/profiler.h"
+#include "../include/parser.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* Virtual sizes of the call stack tables, the pages are only touched as stacks are recorded */
+#define PROFILER_STACK_CAPACITY (1 << 18)
+#define PROFILER_FRAME_CAPACITY (1 << 24)
+#define PROFILER_MAX_DEPTH      1024
+
+/* Name of function 0, everything that isn't part of a VM command: the preamble
+ * and the shared comparison routines */
+#define PROFILER_RUNTIME_NAME "(runtime)"
+
+/* A command and its cycles, sorted for the flat profile */
+typedef struct {
+    uint64_t cycles;
+    uint32_t command;
+} command_sample_t;
+
+static uint32_t hashName(const char* name)
+{
+    uint32_t hash = 2166136261u;
+    for (; *name != '\0'; name++) {
+        hash = (hash ^ (uint8_t) *name) * 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t hashFrames(const uint32_t* frames, size_t depth)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t index = 0; index < depth; index++) {
+        hash = (hash ^ frames[index]) * 16777619u;
+    }
+    return hash;
+}
+
+/* Find the function called name in the open addressing table names, adding it
+ * to the function array if it isn't there yet
+ * Return the function index */
+static uint32_t internFunction(profiler_t* profiler, uint32_t* names, size_t capacity, const char* name)
+{
+    size_t slot = hashName(name) & (capacity - 1);
+    while (names[slot] != 0) {
+        if (strcmp(profiler->functions[names[slot]].name, name) == 0) {
+            return names[slot];
+        }
+        slot = (slot + 1) & (capacity - 1);
+    }
+
+    uint32_t function = (uint32_t) profiler->total_functions++;
+    profiler->functions[function].name = name;
+    profiler->functions[function].cycles = 0;
+    names[slot] = function;
+    return function;
+}
+
+/* Initialize a profiler over a loaded emulator, sources describe every translated
+ * file in the order they were fed to assemblyGen. entry_function is the function
+ * the preamble calls, period is the sampling interval in cycles, 1 counts every cycle
+ * Return 0 on success
+ * Return -1 on failure */
+int32_t profilerInitialize(profiler_t* profiler, emulator_t* emulator, jit_t* jit, profiler_source_t* sources,
+                           size_t total_sources, const char* entry_function, uint64_t period)
+{
+    assert(profiler != NULL && emulator != NULL && sources != NULL && entry_function != NULL && period != 0);
+
+    memset(profiler, 0, sizeof(profiler_t));
+    profiler->emulator = emulator;
+    profiler->jit = jit;
+    profiler->sources = sources;
+    profiler->total_sources = total_sources;
+    profiler->period = period;
+
+    for (size_t source = 0; source < total_sources; source++) {
+        assert(sources[source].commands != NULL && sources[source].rom_ranges != NULL);
+        profiler->total_commands += sources[source].commands->total_commands;
+    }
+
+    /* Every command could at most name one new function */
+    size_t function_capacity = profiler->total_commands + 2;
+    size_t name_capacity = 16;
+    while (name_capacity < function_capacity * 2) {
+        name_capacity <<= 1;
+    }
+
+    size_t arena_size = 2 * (EMULATOR_ROM_SIZE + 1) * sizeof(uint32_t) +
+                        profiler->total_commands * (sizeof(uint32_t) + 2 * sizeof(uint64_t)) +
+                        function_capacity * sizeof(profiler_function_t) +
+                        name_capacity * sizeof(uint32_t) + 64;
+
+    /* Room for the sorted copies profilerWriteFlat makes */
+    arena_size += function_capacity * sizeof(profiler_function_t) + profiler->total_commands * sizeof(command_sample_t) + 64;
+
+    if (stackArenaInitialize(&profiler->stack_arena, arena_size) < 0) {
+        return -1;
+    }
+
+    /* The arena is mmap'd so everything starts out zeroed */
+    profiler->command_cycles = stackArenaPush(&profiler->stack_arena, profiler->total_commands * sizeof(uint64_t) + 8);
+    profiler->command_counts = stackArenaPush(&profiler->stack_arena, profiler->total_commands * sizeof(uint64_t) + 8);
+    profiler->address_commands = stackArenaPush(&profiler->stack_arena, (EMULATOR_ROM_SIZE + 1) * sizeof(uint32_t));
+    profiler->address_functions = stackArenaPush(&profiler->stack_arena, (EMULATOR_ROM_SIZE + 1) * sizeof(uint32_t));
+    profiler->call_targets = stackArenaPush(&profiler->stack_arena, profiler->total_commands * sizeof(uint32_t) + 4);
+    profiler->functions = stackArenaPush(&profiler->stack_arena, function_capacity * sizeof(profiler_function_t));
+
+    uint32_t* names = stackArenaPush(&profiler->stack_arena, name_capacity * sizeof(uint32_t));
+    if (profiler->command_cycles == NULL || profiler->command_counts == NULL || profiler->address_commands == NULL || profiler->address_functions == NULL ||
+        profiler->call_targets == NULL || profiler->functions == NULL || names == NULL) {
+
+        stackArenaRelease(&profiler->stack_arena);
+        return -1;
+    }
+
+    profiler->functions[0].name = PROFILER_RUNTIME_NAME;
+    profiler->total_functions = 1;
+
+    /* Map every ROM address back to its command and the function that command is in */
+    size_t base = 0;
+    for (size_t source = 0; source < total_sources; source++) {
+        command_module_t* commands = sources[source].commands;
+        uint32_t function = 0;
+
+        for (size_t index = 0; index < commands->total_commands; index++) {
+            command_t* command = &commands->commands[index];
+            if (OP_IS_FUNCTION(command->op)) {
+                function = internFunction(profiler, names, name_capacity, command->arguments.flow.label);
+            }
+
+            rom_range_t range = sources[source].rom_ranges[index];
+            for (uint32_t address = range.start; address < range.end && address <= EMULATOR_ROM_SIZE; address++) {
+                profiler->address_commands[address] = (uint32_t) (base + index + 1);
+                profiler->address_functions[address] = function;
+            }
+        }
+        base += commands->total_commands;
+    }
+
+    /* Resolve call targets, functions that are never defined still get a name. A multiply
+     * assembly gen made a call again calls Math.multiply, one it didn't has no frame to find */
+    base = 0;
+    for (size_t source = 0; source < total_sources; source++) {
+        command_module_t* commands = sources[source].commands;
+        for (size_t index = 0; index < commands->total_commands; index++) {
+            if (commands->commands[index].op == OP_CALL) {
+                profiler->call_targets[base + index] =
+                    internFunction(profiler, names, name_capacity, commands->commands[index].arguments.flow.label);
+            }
+            else if (commands->commands[index].op == OP_MULTIPLY) {
+                profiler->call_targets[base + index] = internFunction(profiler, names, name_capacity, OP_MULTIPLY_FUNCTION);
+            }
+        }
+        base += commands->total_commands;
+    }
+
+    profiler->entry_function = internFunction(profiler, names, name_capacity, entry_function);
+
+    /* The name table is only needed while building */
+    stackArenaPop(&profiler->stack_arena, name_capacity * sizeof(uint32_t));
+
+    profiler->stack_capacity = PROFILER_STACK_CAPACITY;
+    profiler->frame_capacity = PROFILER_FRAME_CAPACITY;
+    profiler->stacks = mmap(NULL, profiler->stack_capacity * sizeof(profiler_stack_t), PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    profiler->frames = mmap(NULL, profiler->frame_capacity * sizeof(uint32_t), PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (profiler->stacks == MAP_FAILED || profiler->frames == MAP_FAILED) {
+        if (profiler->stacks != MAP_FAILED) {
+            munmap(profiler->stacks, profiler->stack_capacity * sizeof(profiler_stack_t));
+        }
+        if (profiler->frames != MAP_FAILED) {
+            munmap(profiler->frames, profiler->frame_capacity * sizeof(uint32_t));
+        }
+        stackArenaRelease(&profiler->stack_arena);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Destroys a profiler, the emulator and sources are left alone */
+void profilerDestroy(profiler_t* profiler)
+{
+    assert(profiler != NULL && profiler->stacks != NULL && profiler->frames != NULL);
+
+    munmap(profiler->stacks, profiler->stack_capacity * sizeof(profiler_stack_t));
+    munmap(profiler->frames, profiler->frame_capacity * sizeof(uint32_t));
+    stackArenaRelease(&profiler->stack_arena);
+
+    profiler->stacks = NULL;
+    profiler->frames = NULL;
+}
+
+/* Walk the call frames of the running program, leaf first.
+ * A frame is [saved ARG, saved LCL, return address] right below LCL, the call
+ * command the return address follows names the function owning the frame. The
+ * leaf function comes from pc since LCL lags behind during call and function
+ * setup. The walk stops at the frame the preamble created
+ * Return the depth of the stack */
+static size_t walkStack(profiler_t* profiler, uint32_t leaf, uint32_t* frames)
+{
+    const uint16_t* ram = profiler->emulator->ram;
+    size_t depth = 0;
+
+    frames[depth++] = leaf;
+
+    uint32_t lcl = ram[1];
+    while (depth < PROFILER_MAX_DEPTH) {
+        if (lcl < 3 || lcl >= EMULATOR_RAM_SIZE) {
+            break;
+        }
+
+        uint32_t return_address = ram[lcl - 1];
+        if (return_address == 0 || return_address > EMULATOR_ROM_SIZE) {
+            break;
+        }
+
+        uint32_t site = return_address - 1;
+        uint32_t command = profiler->address_commands[site];
+        uint32_t function;
+
+        if (command != 0 && profiler->call_targets[command - 1] != 0) {
+            function = profiler->call_targets[command - 1];
+        }
+        else if (command == 0) {
+            function = profiler->entry_function;
+        }
+        else {
+            break;
+        }
+
+        /* The innermost frame usually belongs to the leaf */
+        if (depth > 1 || function != leaf) {
+            frames[depth++] = function;
+        }
+
+        if (command == 0) {
+            break;
+        }
+        lcl = ram[lcl - 2];
+    }
+
+    return depth;
+}
+
+/* Charge weight cycles to a command, function and the call stack frames */
+static void profilerCharge(profiler_t* profiler, uint32_t command, const uint32_t* frames, size_t depth, uint64_t weight)
+{
+    if (command != 0) {
+        profiler->command_cycles[command - 1] += weight;
+    }
+    profiler->functions[frames[0]].cycles += weight;
+    profiler->total_cycles += weight;
+
+    uint32_t hash = hashFrames(frames, depth);
+
+    size_t slot = hash & (profiler->stack_capacity - 1);
+    while (profiler->stacks[slot].depth != 0) {
+        profiler_stack_t* stack = &profiler->stacks[slot];
+        if (stack->hash == hash && stack->depth == depth &&
+            memcmp(&profiler->frames[stack->frames], frames, depth * sizeof(uint32_t)) == 0) {
+
+            stack->cycles += weight;
+            return;
+        }
+        slot = (slot + 1) & (profiler->stack_capacity - 1);
+    }
+
+    /* Keep the table at most half full so probing stays short */
+    if (profiler->total_stacks * 2 >= profiler->stack_capacity ||
+        profiler->total_frames + depth > profiler->frame_capacity) {
+
+        profiler->dropped_cycles += weight;
+        return;
+    }
+
+    memcpy(&profiler->frames[profiler->total_frames], frames, depth * sizeof(uint32_t));
+    profiler->stacks[slot].hash = hash;
+    profiler->stacks[slot].depth = (uint32_t) depth;
+    profiler->stacks[slot].frames = profiler->total_frames;
+    profiler->stacks[slot].cycles = weight;
+
+    profiler->total_frames += depth;
+    profiler->total_stacks++;
+}
+
+/* Run the program for at most budget cycles, sampling once per period.
+ * The state is sampled at the start of every slice and weighed by the cycles
+ * the slice actually ran, so the totals always add up to the cycles executed
+ * Return the status of the emulator, as with emulatorRun */
+emulator_status_t profilerRun(profiler_t* profiler, uint64_t budget)
+{
+    assert(profiler != NULL);
+
+    emulator_t* emulator = profiler->emulator;
+    emulator_status_t status = EMULATOR_BUDGET;
+    uint32_t frames[PROFILER_MAX_DEPTH];
+
+    while (budget > 0) {
+        uint64_t slice = budget < profiler->period ? budget : profiler->period;
+        uint64_t cycles = emulator->cycles;
+
+        uint32_t command = profiler->address_commands[emulator->pc];
+        int32_t entered = command != 0 && (emulator->pc == 0 || profiler->address_commands[emulator->pc - 1] != command);
+        size_t depth = walkStack(profiler, profiler->address_functions[emulator->pc], frames);
+
+        status = profiler->jit != NULL ? jitRun(profiler->jit, slice) : emulatorRun(emulator, slice);
+        if (status == EMULATOR_ERROR) {
+            return status;
+        }
+
+        if (emulator->cycles != cycles) {
+            profilerCharge(profiler, command, frames, depth, emulator->cycles - cycles);
+            if (entered) {
+                profiler->command_counts[command - 1] += emulator->cycles - cycles;
+            }
+        }
+
+        budget -= slice;
+        if (status == EMULATOR_HALTED) {
+            break;
+        }
+    }
+
+    return status;
+}
+
+static int compareFunctions(const void* left, const void* right)
+{
+    const profiler_function_t* a = left;
+    const profiler_function_t* b = right;
+    return a->cycles < b->cycles ? 1 : (a->cycles > b->cycles ? -1 : strcmp(a->name, b->name));
+}
+
+static int compareCommands(const void* left, const void* right)
+{
+    const command_sample_t* a = left;
+    const command_sample_t* b = right;
+    return a->cycles < b->cycles ? 1 : (a->cycles > b->cycles ? -1 : (a->command > b->command) - (a->command < b->command));
+}
+
+/* Write the flat profile, self cycles per function then per command with the
+ * file and line (the command number, one based) it came from
+ * Return 0 on success
+ * Return -1 on failure */
+int32_t profilerWriteFlat(profiler_t* profiler, FILE* output_file)
+{
+    assert(profiler != NULL && output_file != NULL);
+
+    size_t position = stackArenaPosition(&profiler->stack_arena);
+    size_t functions_size = profiler->total_functions * sizeof(profiler_function_t);
+    size_t commands_size = profiler->total_commands * sizeof(command_sample_t) + 1;
+
+    profiler_function_t* functions = stackArenaPush(&profiler->stack_arena, functions_size);
+    command_sample_t* commands = stackArenaPush(&profiler->stack_arena, commands_size);
+    if (functions == NULL || commands == NULL) {
+        stackArenaPop(&profiler->stack_arena, stackArenaPosition(&profiler->stack_arena) - position);
+        return -1;
+    }
+
+    memcpy(functions, profiler->functions, functions_size);
+    qsort(functions, profiler->total_functions, sizeof(profiler_function_t), compareFunctions);
+
+    size_t total_samples = 0;
+    for (size_t index = 0; index < profiler->total_commands; index++) {
+        if (profiler->command_cycles[index] != 0) {
+            commands[total_samples].cycles = profiler->command_cycles[index];
+            commands[total_samples].command = (uint32_t) index;
+            total_samples++;
+        }
+    }
+    qsort(commands, total_samples, sizeof(command_sample_t), compareCommands);
+
+    double total = profiler->total_cycles != 0 ? (double) profiler->total_cycles : 1.0;
+    int32_t result = 0;
+
+    if (fprintf(output_file, "Total cycles: %llu, sample period %llu\n\n%7s %14s  %s\n",
+                (unsigned long long) profiler->total_cycles, (unsigned long long) profiler->period,
+                "%", "self cycles", "function") < 0) {
+        result = -1;
+    }
+
+    for (size_t index = 0; index < profiler->total_functions && result == 0; index++) {
+        if (functions[index].cycles == 0) {
+            break;
+        }
+        if (fprintf(output_file, "%6.2f%% %14llu  %s\n", 100.0 * (double) functions[index].cycles / total,
+                    (unsigned long long) functions[index].cycles, functions[index].name) < 0) {
+            result = -1;
+        }
+    }
+
+    if (result == 0 && fprintf(output_file, "\n%7s %14s  %-24s %s\n", "%", "self cycles", "location", "command") < 0) {
+        result = -1;
+    }
+
+    for (size_t index = 0; index < total_samples && result == 0; index++) {
+        /* Find the source the global command number falls in */
+        size_t source = 0;
+        size_t local = commands[index].command;
+        while (local >= profiler->sources[source].commands->total_commands) {
+            local -= profiler->sources[source].commands->total_commands;
+            source++;
+        }
+
+        char text[128];
+        char location[256];
+        parserFormatCommand(&profiler->sources[source].commands->commands[local], text, sizeof(text));
+        snprintf(location, sizeof(location), "%s:%u", profiler->sources[source].filename,
+                 profiler->sources[source].commands->commands[local].line);
+
+        if (fprintf(output_file, "%6.2f%% %14llu  %-24s %s\n", 100.0 * (double) commands[index].cycles / total,
+                    (unsigned long long) commands[index].cycles, location, text) < 0) {
+            result = -1;
+        }
+    }
+
+    stackArenaPop(&profiler->stack_arena, stackArenaPosition(&profiler->stack_arena) - position);
+    return result;
+}
+
+/* Write the call stacks in the collapsed format flame graph tools read,
+ * one "outer;inner;leaf cycles" line per distinct stack
+ * Return 0 on success
+ * Return -1 on failure */
+int32_t profilerWriteCollapsed(profiler_t* profiler, FILE* output_file)
+{
+    assert(profiler != NULL && output_file != NULL);
+
+    for (size_t slot = 0; slot < profiler->stack_capacity; slot++) {
+        profiler_stack_t* stack = &profiler->stacks[slot];
+        if (stack->depth == 0) {
+            continue;
+        }
+
+        const uint32_t* frames = &profiler->frames[stack->frames];
+        for (size_t index = stack->depth; index-- > 0;) {
+            if (fprintf(output_file, "%s%c", profiler->functions[frames[index]].name, index != 0 ? ';' : ' ') < 0) {
+                return -1;
+            }
+        }
+        if (fprintf(output_file, "%llu\n", (unsigned long long) stack->cycles) < 0) {
+            return -1;
+        }
+    }
+
+    if (profiler->dropped_cycles != 0 &&
+        fprintf(output_file, "(dropped) %llu\n", (unsigned long long) profiler->dropped_cycles) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Write how many times every command ran, a "file:line<tab>count" line each
+ * for the ones that did, which Hack-VM -P reads back
+ * Return 0 on success
+ * Return -1 on failure */
+int32_t profilerWriteCounts(profiler_t* profiler, FILE* output_file)
+{
+    assert(profiler != NULL && output_file != NULL);
+
+    if (fprintf(output_file, "# Executions per VM line, sample period %llu\n", (unsigned long long) profiler->period) < 0) {
+        return -1;
+    }
+
+    size_t base = 0;
+    for (size_t source = 0; source < profiler->total_sources; source++) {
+        command_module_t* commands = profiler->sources[source].commands;
+        for (size_t index = 0; index < commands->total_commands; index++) {
+            if (profiler->command_counts[base + index] != 0 &&
+                fprintf(output_file, "%s:%u\t%llu\n", profiler->sources[source].filename, commands->commands[index].line,
+                        (unsigned long long) profiler->command_counts[base + index]) < 0) {
+                return -1;
+            }
+        }
+        base += commands->total_commands;
+    }
+
+    return 0;
+}
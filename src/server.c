@@ -0,0 +1,432 @@
+#include "../include/server.h"
+#include "../include/hackvm.h"
+#include "../include/stack_arena.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+static uint32_t decode32(const uint8_t* bytes)
+{
+    return (uint32_t) bytes[0] | (uint32_t) bytes[1] << 8 | (uint32_t) bytes[2] << 16 | (uint32_t) bytes[3] << 24;
+}
+
+static void encode32(uint8_t* bytes, uint32_t value)
+{
+    bytes[0] = (uint8_t) value;
+    bytes[1] = (uint8_t) (value >> 8);
+    bytes[2] = (uint8_t) (value >> 16);
+    bytes[3] = (uint8_t) (value >> 24);
+}
+
+/* Read exactly size bytes
+ * Return 0 on success
+ * Return 1 if the stream ended before the first byte
+ * Return -1 on failure or if it ended part way */
+static int32_t readFull(int fd, void* data, size_t size)
+{
+    size_t total = 0;
+    while (total < size) {
+        ssize_t bytes = read(fd, (uint8_t*) data + total, size - total);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            return bytes == 0 && total == 0 ? 1 : -1;
+        }
+        total += (size_t) bytes;
+    }
+    return 0;
+}
+
+/* Return 0 on success
+ * Return -1 on failure */
+static int32_t writeFull(int fd, const void* data, size_t size)
+{
+    size_t total = 0;
+    while (total < size) {
+        ssize_t bytes = write(fd, (const uint8_t*) data + total, size - total);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            return -1;
+        }
+        total += (size_t) bytes;
+    }
+    return 0;
+}
+
+/* Read the next request into a slot. One too large to hold is read and thrown
+ * away, the slot gets an error for its response instead
+ * Return 0 on success
+ * Return 1 at the end of the stream
+ * Return -1 on failure */
+static int32_t readRequest(int fd, server_slot_t* slot)
+{
+    uint8_t header[4];
+    int32_t result = readFull(fd, header, sizeof(header));
+    if (result != 0) {
+        return result;
+    }
+
+    uint32_t length = decode32(header);
+    slot->error = NULL;
+    slot->input_size = length;
+
+    if (length <= slot->input.size) {
+        return length == 0 ? 0 : readFull(fd, slot->input.memory, length) == 0 ? 0 : -1;
+    }
+
+    slot->error = "request too large";
+    while (length != 0) {
+        size_t chunk = length < slot->input.size ? length : slot->input.size;
+        if (readFull(fd, slot->input.memory, chunk) != 0) {
+            return -1;
+        }
+        length -= (uint32_t) chunk;
+    }
+    return 0;
+}
+
+/* Return 0 on success
+ * Return -1 on failure */
+static int32_t writeResponse(int fd, server_slot_t* slot)
+{
+    const char* data = slot->error != NULL ? slot->error : (const char*) slot->output.memory;
+    size_t size = slot->error != NULL ? strlen(slot->error) : slot->output_size;
+
+    uint8_t header[8];
+    encode32(header, slot->error != NULL ? SERVER_STATUS_FAILED : SERVER_STATUS_OK);
+    encode32(header + 4, (uint32_t) size);
+
+    if (writeFull(fd, header, sizeof(header)) < 0) {
+        return -1;
+    }
+    return size == 0 ? 0 : writeFull(fd, data, size);
+}
+
+/* Translate a slot's request into its output, growing the output when the assembly doesn't fit */
+static void translateSlot(hackvm_t* hackvm, server_slot_t* slot)
+{
+    if (slot->error != NULL) {
+        return;
+    }
+
+    for (;;) {
+        size_t length = 0;
+        if (hackvmTranslateBuffer(hackvm, (const char*) slot->input.memory, slot->input_size, "request.vm",
+                                  (char*) slot->output.memory, slot->output.size, &length) == 0) {
+            slot->output_size = length;
+            return;
+        }
+
+        /* A failure past the end of the buffer may only be a failure to fit, find out with more room */
+        if (length <= slot->output.size) {
+            slot->error = hackvm->error;
+            return;
+        }
+
+        size_t size = slot->output.size > SERVER_OUTPUT_SIZE ? slot->output.size : SERVER_OUTPUT_SIZE;
+        while (size < length) {
+            size *= 2;
+        }
+
+        if (slot->output.memory != NULL) {
+            stackArenaRelease(&slot->output);
+        }
+        if (stackArenaInitialize(&slot->output, size) < 0) {
+            slot->error = "out of memory";
+            return;
+        }
+    }
+}
+
+/* Start up the workers' contexts and the slots, nothing runs until a serve call
+ * Return 0 on success
+ * Return -1 on failure */
+int32_t serverInitialize(server_t* server, size_t total_workers, int32_t level)
+{
+    assert(server != NULL && total_workers != 0);
+
+    memset(server, 0, sizeof(server_t));
+    server->total_workers = total_workers;
+    server->total_slots = 2 * total_workers;
+    server->listen_fd = -1;
+    atomic_init(&server->stopping, 0);
+
+    if (stackArenaInitialize(&server->stack_arena, total_workers * sizeof(server_worker_t) +
+                                                   server->total_slots * sizeof(server_slot_t)) < 0) {
+        return -1;
+    }
+    server->workers = stackArenaPush(&server->stack_arena, total_workers * sizeof(server_worker_t));
+    server->slots = stackArenaPush(&server->stack_arena, server->total_slots * sizeof(server_slot_t));
+
+    int32_t failed = 0;
+    for (size_t index = 0; index < total_workers && !failed; index++) {
+        server->workers[index].server = server;
+        server->workers[index].index = index;
+        failed = hackvmInitialize(&server->workers[index].hackvm, level, SERVER_ARENA_SIZE) < 0;
+    }
+    for (size_t index = 0; index < server->total_slots && !failed; index++) {
+        failed = stackArenaInitialize(&server->slots[index].input, SERVER_MAX_REQUEST) < 0 ||
+                 stackArenaInitialize(&server->slots[index].output, SERVER_OUTPUT_SIZE) < 0;
+    }
+
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->changed, NULL);
+
+    if (failed) {
+        serverDestroy(server);
+        return -1;
+    }
+    return 0;
+}
+
+/* Destroys a server, it must not be serving */
+void serverDestroy(server_t* server)
+{
+    assert(server != NULL && server->workers != NULL);
+
+    for (size_t index = 0; index < server->total_workers; index++) {
+        hackvmDestroy(&server->workers[index].hackvm);
+    }
+    for (size_t index = 0; index < server->total_slots; index++) {
+        if (server->slots[index].input.memory != NULL) {
+            stackArenaRelease(&server->slots[index].input);
+        }
+        if (server->slots[index].output.memory != NULL) {
+            stackArenaRelease(&server->slots[index].output);
+        }
+    }
+
+    pthread_mutex_destroy(&server->lock);
+    pthread_cond_destroy(&server->changed);
+    stackArenaRelease(&server->stack_arena);
+    memset(server, 0, sizeof(server_t));
+}
+
+/* Stream worker, claims the oldest unclaimed request and, once translated,
+ * writes out every finished response that is next in line */
+static void* streamWorker(void* argument)
+{
+    server_worker_t* worker = argument;
+    server_t* server = worker->server;
+
+    pthread_mutex_lock(&server->lock);
+    for (;;) {
+        while (server->next == server->tail && !server->end && !server->failed) {
+            pthread_cond_wait(&server->changed, &server->lock);
+        }
+        if (server->next == server->tail || server->failed) {
+            break;
+        }
+
+        server_slot_t* slot = &server->slots[server->next++ % server->total_slots];
+        pthread_mutex_unlock(&server->lock);
+
+        translateSlot(&worker->hackvm, slot);
+
+        pthread_mutex_lock(&server->lock);
+        slot->done = 1;
+        while (server->head != server->next && server->slots[server->head % server->total_slots].done) {
+            server_slot_t* finished = &server->slots[server->head % server->total_slots];
+            if (!server->failed && writeResponse(server->output_fd, finished) < 0) {
+                server->failed = 1;
+            }
+            finished->done = 0;
+            server->head++;
+        }
+        pthread_cond_broadcast(&server->changed);
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    return NULL;
+}
+
+/* Serve framed requests from input_fd until it ends, writing the responses to
+ * output_fd in request order. The calling thread reads, the workers translate
+ * Return 0 on success
+ * Return -1 on failure */
+int32_t serverServeStream(server_t* server, int input_fd, int output_fd)
+{
+    assert(server != NULL && server->workers != NULL);
+
+    server->head = server->next = server->tail = 0;
+    server->end = 0;
+    server->failed = 0;
+    server->output_fd = output_fd;
+
+    size_t started = 0;
+    for (; started < server->total_workers; started++) {
+        if (pthread_create(&server->workers[started].thread, NULL, streamWorker, &server->workers[started]) != 0) {
+            break;
+        }
+    }
+
+    int32_t result = started == server->total_workers ? 0 : -1;
+    pthread_mutex_lock(&server->lock);
+    while (result == 0 && !server->failed) {
+        /* Slots between head and tail are still in use */
+        while (server->tail - server->head == server->total_slots && !server->failed) {
+            pthread_cond_wait(&server->changed, &server->lock);
+        }
+        if (server->failed) {
+            break;
+        }
+
+        server_slot_t* slot = &server->slots[server->tail % server->total_slots];
+        pthread_mutex_unlock(&server->lock);
+        int32_t read = readRequest(input_fd, slot);
+        pthread_mutex_lock(&server->lock);
+
+        if (read != 0) {
+            result = read < 0 ? -1 : 0;
+            break;
+        }
+        server->tail++;
+        pthread_cond_broadcast(&server->changed);
+    }
+
+    /* Requests read so far are still answered */
+    server->end = 1;
+    pthread_cond_broadcast(&server->changed);
+    pthread_mutex_unlock(&server->lock);
+
+    for (size_t index = 0; index < started; index++) {
+        pthread_join(server->workers[index].thread, NULL);
+    }
+
+    return result < 0 || server->failed ? -1 : 0;
+}
+
+/* Socket worker, serves one connection at a time until it closes */
+static void* socketWorker(void* argument)
+{
+    server_worker_t* worker = argument;
+    server_t* server = worker->server;
+    server_slot_t* slot = &server->slots[worker->index];
+
+    pthread_mutex_lock(&server->lock);
+    for (;;) {
+        while (server->connection_head == server->connection_tail && !server->end) {
+            pthread_cond_wait(&server->changed, &server->lock);
+        }
+        if (server->connection_head == server->connection_tail) {
+            break;
+        }
+
+        int fd = server->connections[server->connection_head++ % SERVER_CONNECTIONS];
+        pthread_cond_broadcast(&server->changed);
+        pthread_mutex_unlock(&server->lock);
+
+        while (readRequest(fd, slot) == 0) {
+            translateSlot(&worker->hackvm, slot);
+            if (writeResponse(fd, slot) < 0) {
+                break;
+            }
+        }
+        close(fd);
+
+        pthread_mutex_lock(&server->lock);
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    return NULL;
+}
+
+/* Listen on a Unix domain socket at path and serve its connections until
+ * serverStop, each connection is served by one worker at a time. Connections
+ * still open when it stops are served until they close
+ * Return 0 on success
+ * Return -1 on failure */
+int32_t serverServeSocket(server_t* server, const char* path)
+{
+    assert(server != NULL && server->workers != NULL && path != NULL);
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        return -1;
+    }
+
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr*) &address, sizeof(address)) < 0 || listen(listen_fd, SOMAXCONN) < 0) {
+        close(listen_fd);
+        return -1;
+    }
+
+    server->connection_head = server->connection_tail = 0;
+    server->end = 0;
+    pthread_mutex_lock(&server->lock);
+    server->listen_fd = listen_fd;
+    pthread_mutex_unlock(&server->lock);
+
+    size_t started = 0;
+    for (; started < server->total_workers; started++) {
+        if (pthread_create(&server->workers[started].thread, NULL, socketWorker, &server->workers[started]) != 0) {
+            break;
+        }
+    }
+
+    int32_t result = started == server->total_workers ? 0 : -1;
+    while (result == 0 && !atomic_load(&server->stopping)) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            result = atomic_load(&server->stopping) ? 0 : -1;
+            break;
+        }
+
+        pthread_mutex_lock(&server->lock);
+        while (server->connection_tail - server->connection_head == SERVER_CONNECTIONS) {
+            pthread_cond_wait(&server->changed, &server->lock);
+        }
+        server->connections[server->connection_tail++ % SERVER_CONNECTIONS] = fd;
+        pthread_cond_broadcast(&server->changed);
+        pthread_mutex_unlock(&server->lock);
+    }
+
+    pthread_mutex_lock(&server->lock);
+    server->end = 1;
+    server->listen_fd = -1;
+    pthread_cond_broadcast(&server->changed);
+    pthread_mutex_unlock(&server->lock);
+
+    for (size_t index = 0; index < started; index++) {
+        pthread_join(server->workers[index].thread, NULL);
+    }
+
+    close(listen_fd);
+    unlink(path);
+    atomic_store(&server->stopping, 0);
+    return result;
+}
+
+/* Make serverServeSocket stop accepting connections and return, safe to call from any thread */
+void serverStop(server_t* server)
+{
+    assert(server != NULL);
+
+    atomic_store(&server->stopping, 1);
+
+    /* Wakes the accept call up */
+    pthread_mutex_lock(&server->lock);
+    if (server->listen_fd >= 0) {
+        shutdown(server->listen_fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&server->lock);
+}
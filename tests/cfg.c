@@ -0,0 +1,151 @@
+/* Builds the control flow graph of a small program and checks its blocks, then
+ * times building graphs of growing size to check the build stays linear */
+
+#include "../include/parser.h"
+#include "../include/command.h"
+#include "../include/stack_arena.h"
+#include "../include/cfg.h"
+#include "test_util.h"
+
+
+#include <stdio.h>
+#include <time.h>
+
+
+/* Drops every block cfgMarkReachable didn't reach */
+static int32_t removeUnreachable(cfg_t* cfg, void* context)
+{
+    int32_t changes = 0;
+    cfgMarkReachable(cfg);
+
+    for (size_t index = 0; index < cfg->total_blocks; index++) {
+        cfg_block_t* block = &cfg->blocks[index];
+        if (block->flags & CFG_BLOCK_REACHABLE) {
+            continue;
+        }
+        for (size_t offset = 0; offset < block->total_commands; offset++) {
+            cfgRemoveCommand(cfg, block->first_command + offset);
+            changes++;
+        }
+    }
+
+    return changes;
+}
+
+static int32_t checkSmall(const char* input)
+{
+    parser_t parser;
+    command_module_t command_module;
+    stack_arena_t stack_arena;
+    cfg_t cfg;
+    int32_t failures = 0;
+
+    if (parserInitialize(&parser, input) < 0 || stackArenaInitialize(&stack_arena, 8 * parser.file_size) < 0 ||
+        parserParseCommands(&parser, &command_module, &stack_arena) < 0 || cfgBuild(&cfg, &command_module) < 0) {
+        fprintf(stderr, "Failed to build the graph of %s\n", input);
+        return 1;
+    }
+
+    failures += expect("blocks", cfg.total_blocks, 7) < 0;
+    failures += expect("functions", cfg.total_functions, 2) < 0;
+    failures += expect("unresolved", cfg.total_unresolved, 0) < 0;
+
+    /* main: entry, else, then, join, halt loop, dead code; helper */
+    failures += expect("entry fall through", cfg.blocks[0].successors[0], 1) < 0;
+    failures += expect("entry branch", cfg.blocks[0].successors[1], 2) < 0;
+    failures += expect("entry stack effect", cfg.blocks[0].stack_effect, 0) < 0;
+    failures += expect("entry stack low", cfg.blocks[0].stack_low, 0) < 0;
+    failures += expect("else fall through", cfg.blocks[1].successors[0], CFG_NO_BLOCK) < 0;
+    failures += expect("else branch", cfg.blocks[1].successors[1], 3) < 0;
+    failures += expect("else defs", cfg.blocks[1].segment_defs, 1u << SEG_STATIC) < 0;
+    failures += expect("then fall through", cfg.blocks[2].successors[0], 3) < 0;
+    failures += expect("join predecessors", cfg.blocks[3].total_predecessors, 2) < 0;
+    failures += expect("join uses", cfg.blocks[3].segment_uses, 1u << SEG_STATIC) < 0;
+    failures += expect("join defs", cfg.blocks[3].segment_defs, 1u << SEG_TEMP) < 0;
+    failures += expect("join calls", (cfg.blocks[3].flags & CFG_BLOCK_CALLS) != 0, 1) < 0;
+    failures += expect("join stack effect", cfg.blocks[3].stack_effect, 0) < 0;
+    failures += expect("halt loop", cfg.blocks[4].successors[1], 4) < 0;
+    failures += expect("dead code predecessors", cfg.blocks[5].total_predecessors, 0) < 0;
+    failures += expect("dead code fall through", cfg.blocks[5].successors[0], CFG_NO_BLOCK) < 0;
+    failures += expect("helper entry", cfg.functions[1].first_block, 6) < 0;
+    failures += expect("helper returns", (cfg.blocks[6].flags & CFG_BLOCK_RETURNS) != 0, 1) < 0;
+    failures += expect("helper uses", cfg.blocks[6].segment_uses, 1u << SEG_ARGUMENT) < 0;
+    failures += expect("label lookup", cfgFindLabel(&cfg, 0, "done"), 3) < 0;
+    failures += expect("scoped label lookup", cfgFindLabel(&cfg, 1, "done"), CFG_NO_BLOCK) < 0;
+
+    cfgMarkReachable(&cfg);
+    failures += expect("dead code reachable", (cfg.blocks[5].flags & CFG_BLOCK_REACHABLE) != 0, 0) < 0;
+    failures += expect("join reachable", (cfg.blocks[3].flags & CFG_BLOCK_REACHABLE) != 0, 1) < 0;
+
+    cfg_pass_t passes[] = {{"remove-unreachable", removeUnreachable, NULL}};
+    failures += expect("pass changes", cfgRunPasses(&cfg, passes, 1), 1) < 0;
+    failures += expect("commands after pass", command_module.total_commands, 20) < 0;
+    failures += expect("blocks after pass", cfg.total_blocks, 6) < 0;
+    failures += expect("pass is idempotent", cfgRunPasses(&cfg, passes, 1), 0) < 0;
+
+    cfgDestroy(&cfg);
+    stackArenaRelease(&stack_arena);
+    parserDestroy(&parser);
+    return failures;
+}
+
+/* Time the build of a synthetic program with total_functions functions of 100 commands each */
+static double timeBuild(size_t total_functions, int32_t* failures)
+{
+    stack_arena_t stack_arena;
+    command_module_t command_module;
+    cfg_t cfg;
+    size_t per_function = 100;
+
+    if (stackArenaInitialize(&stack_arena, total_functions * per_function * sizeof(command_t) + 64) < 0) {
+        (*failures)++;
+        return 0.0;
+    }
+
+    command_module.total_commands = total_functions * per_function;
+    command_module.commands = stackArenaPush(&stack_arena, command_module.total_commands * sizeof(command_t));
+
+    static char* const LABELS[] = {"a", "b", "c", "d"};
+    for (size_t function = 0; function < total_functions; function++) {
+        command_t* commands = &command_module.commands[function * per_function];
+        for (size_t index = 0; index < per_function; index++) {
+            command_t* command = &commands[index];
+            switch (index % 10) {
+                case 0:  command->op = OP_LABEL;  command->arguments.flow.label = LABELS[index / 10 % 4]; break;
+                case 5:  command->op = OP_IFGOTO; command->arguments.flow.label = LABELS[(index / 10 + 1) % 4]; break;
+                case 6:  command->op = OP_ADD;    break;
+                default: command->op = OP_PUSH;   command->arguments.memory.segment = SEG_LOCAL; break;
+            }
+        }
+        commands[0].op = OP_FUNCTION;
+        commands[0].arguments.flow.label = "f";
+        commands[per_function - 1].op = OP_RETURN;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (cfgBuild(&cfg, &command_module) < 0) {
+        (*failures)++;
+        stackArenaRelease(&stack_arena);
+        return 0.0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    *failures += expect("synthetic functions", cfg.total_functions, total_functions) < 0;
+    cfgDestroy(&cfg);
+    stackArenaRelease(&stack_arena);
+
+    return (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(int argc, char* argv[])
+{
+    int32_t failures = checkSmall(argc > 1 ? argv[1] : "cfg-test.vm");
+
+    double small = timeBuild(2500, &failures);
+    double large = timeBuild(10000, &failures);
+    fprintf(stdout, "250000 commands in %.4f s, 1000000 commands in %.4f s\n", small, large);
+
+    fprintf(stdout, failures == 0 ? "PASS\n" : "FAILED\n");
+    return failures == 0 ? 0 : -1;
+}
@@ -0,0 +1,66 @@
+/* Translates a VM program, runs it on the emulator and checks
+ * the machine state it halts in */
+
+#include "../include/parser.h"
+#include "../include/command.h"
+#include "../include/assembly_gen.h"
+#include "../include/stack_arena.h"
+#include "../include/emulator.h"
+#include "test_util.h"
+
+
+#include <stdio.h>
+#include <time.h>
+
+
+int main(int argc, char* argv[])
+{
+    emulator_t emulator;
+    int32_t failures = 0;
+
+    const char* input = argc > 1 ? argv[1] : "emulator-test.vm";
+    const char* output = argc > 2 ? argv[2] : "emulator-test.asm";
+
+    if (translate(input, output) < 0) {
+        fprintf(stderr, "Failed to translate %s\n", input);
+        return -1;
+    }
+
+    if (emulatorInitialize(&emulator) < 0) {
+        return -1;
+    }
+
+    if (emulatorLoadFile(&emulator, output) < 0) {
+        fprintf(stderr, "Failed to load %s\n", output);
+        emulatorDestroy(&emulator);
+        return -1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    emulator_status_t status = emulatorRun(&emulator, 100000000);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    uint64_t cycles = emulator.cycles;
+    failures += expect("status", status, EMULATOR_HALTED) < 0;
+    failures += expect("static 0 (6 * 7)", (int16_t) emulator.ram[16], 42) < 0;
+    failures += expect("static 1 (3 < 8)", (int16_t) emulator.ram[17], -1) < 0;
+    failures += expect("static 2 (1 * 30000)", (int16_t) emulator.ram[18], 30000) < 0;
+    failures += expect("temp 1 (9 - 4)", (int16_t) emulator.ram[6], 5) < 0;
+    failures += expect("that 2", (int16_t) emulator.ram[3002], 42) < 0;
+    failures += expect("top of stack", (int16_t) emulator.ram[emulator.ram[0]], 47) < 0;
+
+    /* A budget has to stop the machine exactly where it says */
+    emulatorReset(&emulator);
+    failures += expect("budget status", emulatorRun(&emulator, 1000), EMULATOR_BUDGET) < 0;
+    failures += expect("budget cycles", (int32_t) emulator.cycles, 1000) < 0;
+
+    double seconds = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stdout, "%llu cycles in %.4f s, %.1f MIPS\n", (unsigned long long) cycles, seconds,
+            seconds > 0 ? (double) cycles / seconds / 1e6 : 0.0);
+
+    emulatorDestroy(&emulator);
+
+    fprintf(stdout, failures == 0 ? "PASS\n" : "FAILED\n");
+    return failures == 0 ? 0 : -1;
+}
@@ -0,0 +1,260 @@
+/* Translates a program of three files where the second and third hold copies of
+ * the same functions under their own names and labels, once as they are and once
+ * folded, runs both and checks they compute the same thing in less ROM. Copies
+ * using their file's static variables have to stay apart, and copies calling
+ * copies fold once their callees have. Math.multiply stays when a multiply at
+ * -O s goes back to calling it */
+
+#include "../include/parser.h"
+#include "../include/command.h"
+#include "../include/assembly_gen.h"
+#include "../include/stack_arena.h"
+#include "../include/optimize.h"
+#include "../include/emulator.h"
+#include "test_util.h"
+
+
+#include <stdio.h>
+#include <string.h>
+
+#define TOTAL_FILES 3
+
+static const char* SOURCES[TOTAL_FILES] = {
+    "function main 0\n"
+    "push constant 5\ncall A.twice 1\npop static 0\n"
+    "push constant 6\ncall B.twice 1\npop static 1\n"
+    "push constant 3\ncall A.count 1\npop static 2\n"
+    "push constant 4\ncall B.count 1\npop static 3\n"
+    "push constant 3\ncall A.count 1\npop static 4\n"
+    "push constant 7\ncall A.quad 1\npop static 5\n"
+    "push constant 8\ncall B.quad 1\npop static 6\n"
+    "push constant 4\ncall A.sum 1\npop static 7\n"
+    "push constant 5\ncall B.sum 1\npop static 8\n"
+    "label halt\ngoto halt\n",
+
+    "function A.twice 0\npush argument 0\npush argument 0\nadd\nreturn\n"
+    "function A.count 0\npush static 0\npush argument 0\nadd\npop static 0\npush static 0\nreturn\n"
+    "function A.quad 0\npush argument 0\ncall A.twice 1\ncall A.twice 1\nreturn\n"
+    "function A.sum 1\npush constant 0\npop local 0\n"
+    "label A_LOOP\npush argument 0\nif-goto A_BODY\npush local 0\nreturn\n"
+    "label A_BODY\npush local 0\npush argument 0\nadd\npop local 0\n"
+    "push argument 0\npush constant 1\nsub\npop argument 0\ngoto A_LOOP\n",
+
+    "function B.twice 0\npush argument 0\npush argument 0\nadd\nreturn\n"
+    "function B.count 0\npush static 0\npush argument 0\nadd\npop static 0\npush static 0\nreturn\n"
+    "function B.quad 0\npush argument 0\ncall B.twice 1\ncall B.twice 1\nreturn\n"
+    "function B.sum 1\npush constant 0\npop local 0\n"
+    "label B_LOOP\npush argument 0\nif-goto B_BODY\npush local 0\nreturn\n"
+    "label B_BODY\npush local 0\npush argument 0\nadd\npop local 0\n"
+    "push argument 0\npush constant 1\nsub\npop argument 0\ngoto B_LOOP\n",
+};
+
+static const char* FILENAMES[TOTAL_FILES] = {"fold-main.vm", "fold-a.vm", "fold-b.vm"};
+
+typedef struct {
+    parser_t         parser;
+    stack_arena_t    stack_arena;
+    command_module_t command_module;
+} file_t;
+
+/* Return 0 on success
+ * Return -1 on failure */
+static int32_t parseFile(file_t* file, const char* filepath, const char* source)
+{
+    FILE* output = fopen(filepath, "w");
+    if (output == NULL || fputs(source, output) < 0 || fclose(output) != 0) {
+        return -1;
+    }
+
+    if (parserInitialize(&file->parser, filepath) < 0) {
+        return -1;
+    }
+
+    if (stackArenaInitialize(&file->stack_arena, 8 * file->parser.file_size + 4096) < 0 ||
+        parserParseCommands(&file->parser, &file->command_module, &file->stack_arena) < 0) {
+        parserDestroy(&file->parser);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void destroyFiles(file_t* files)
+{
+    for (size_t index = 0; index < TOTAL_FILES; index++) {
+        parserDestroy(&files[index].parser);
+        stackArenaRelease(&files[index].stack_arena);
+    }
+}
+
+/* Parse the files, folded or not, translate them into output and run it
+ * Return the number of failed checks */
+static int32_t run(emulator_t* emulator, const char* output, int32_t fold, int32_t* folded, size_t* rom_size)
+{
+    file_t files[TOTAL_FILES];
+    command_module_t* modules[TOTAL_FILES];
+    static_layout_t layouts[TOTAL_FILES];
+    assembly_gen_t assembly_generator;
+    int32_t failures = 0;
+
+    for (size_t index = 0; index < TOTAL_FILES; index++) {
+        if (parseFile(&files[index], FILENAMES[index], SOURCES[index]) < 0) {
+            fprintf(stderr, "FAIL parsing %s\n", FILENAMES[index]);
+            return 1;
+        }
+        modules[index] = &files[index].command_module;
+    }
+
+    *folded = fold ? optimizeFoldFunctions(modules, TOTAL_FILES) : 0;
+
+    int32_t result = -1;
+    if (*folded >= 0 && assemblyGenInitialize(&assembly_generator, output) == 0) {
+        if (assemblyGenLayoutStatics(&assembly_generator, layouts, modules, FILENAMES, TOTAL_FILES, stderr) == 0 &&
+            assemblyGenPreamble(&assembly_generator, "main") == 0) {
+
+            result = 0;
+            for (size_t index = 0; index < TOTAL_FILES && result == 0; index++) {
+                result = assemblyGen(&assembly_generator, modules[index], FILENAMES[index]);
+            }
+        }
+        assemblyGenDestroy(&assembly_generator);
+    }
+
+    /* B.count, which has statics of its own, is all that is left of the third file */
+    if (fold) {
+        failures += expect("commands left in fold-b.vm", (int64_t) files[2].command_module.total_commands, 7) < 0;
+        failures += expect("B.count kept", strcmp(files[2].command_module.commands[0].arguments.flow.label, "B.count"), 0) < 0;
+    }
+    destroyFiles(files);
+
+    if (result < 0 || emulatorLoadFile(emulator, output) < 0) {
+        fprintf(stderr, "FAIL translating%s\n", fold ? " folded" : "");
+        return failures + 1;
+    }
+
+    emulatorReset(emulator);
+    failures += expect("status", emulatorRun(emulator, 100000), EMULATOR_HALTED) < 0;
+
+    static const struct {
+        const char* what;
+        int16_t     value;
+    } RESULTS[] = {
+        {"static 0 (A.twice 5)", 10}, {"static 1 (B.twice 6)", 12}, {"static 2 (A.count 3)", 3},
+        {"static 3 (B.count 4)", 4},  {"static 4 (A.count 3)", 6},  {"static 5 (A.quad 7)",  28},
+        {"static 6 (B.quad 8)",  32}, {"static 7 (A.sum 4)",   10}, {"static 8 (B.sum 5)",   15},
+    };
+    for (size_t index = 0; index < sizeof(RESULTS) / sizeof(RESULTS[0]); index++) {
+        failures += expect(RESULTS[index].what, (int16_t) emulator->ram[16 + index], RESULTS[index].value) < 0;
+    }
+
+    *rom_size = emulator->rom_size;
+    return failures;
+}
+
+/* Math.multiply has the same body as A.mul, but a multiply by a constant too long for
+ * an addition chain at -O s goes back to calling it by name
+ * Return the number of failed checks */
+static int32_t runMultiply(emulator_t* emulator, const char* output)
+{
+    static const char* source =
+        "function main 0\n"
+        "push constant 3\npop static 0\n"
+        "push static 0\npush constant 21845\ncall Math.multiply 2\npop static 1\n"
+        "push static 0\npush static 0\ncall A.mul 2\npop static 2\n"
+        "label halt\ngoto halt\n"
+        "function A.mul 1\npush constant 0\npop local 0\n"
+        "label A_LOOP\npush argument 0\nif-goto A_BODY\npush local 0\nreturn\n"
+        "label A_BODY\npush local 0\npush argument 1\nadd\npop local 0\n"
+        "push argument 0\npush constant 1\nsub\npop argument 0\ngoto A_LOOP\n"
+        "function Math.multiply 1\npush constant 0\npop local 0\n"
+        "label M_LOOP\npush argument 0\nif-goto M_BODY\npush local 0\nreturn\n"
+        "label M_BODY\npush local 0\npush argument 1\nadd\npop local 0\n"
+        "push argument 0\npush constant 1\nsub\npop argument 0\ngoto M_LOOP\n";
+    const char* filename = "fold-multiply.vm";
+
+    file_t file;
+    if (parseFile(&file, filename, source) < 0) {
+        fprintf(stderr, "FAIL parsing %s\n", filename);
+        return 1;
+    }
+
+    command_module_t* modules[] = {&file.command_module};
+    static_layout_t layout;
+    assembly_gen_t assembly_generator;
+    int32_t failures = 0;
+
+    int32_t result = -1;
+    if (optimizeCommands(&file.command_module, OPTIMIZE_LEVEL_SIZE, NULL, 0) >= 0 &&
+        optimizeFoldFunctions(modules, 1) >= 0 && assemblyGenInitialize(&assembly_generator, output) == 0) {
+
+        assemblyGenSetGoal(&assembly_generator, optimizeGoal(OPTIMIZE_LEVEL_SIZE), &file.command_module, NULL);
+        if (assemblyGenLayoutStatics(&assembly_generator, &layout, modules, &filename, 1, stderr) == 0 &&
+            assemblyGenPreamble(&assembly_generator, "main") == 0 &&
+            assemblyGen(&assembly_generator, &file.command_module, filename) == 0) {
+            result = 0;
+        }
+        assemblyGenDestroy(&assembly_generator);
+    }
+
+    int32_t kept = 0;
+    for (size_t index = 0; index < file.command_module.total_commands; index++) {
+        const command_t* command = &file.command_module.commands[index];
+        kept |= OP_IS_FUNCTION(command->op) && strcmp(command->arguments.flow.label, "Math.multiply") == 0;
+    }
+    failures += expect("Math.multiply kept", kept, 1) < 0;
+    parserDestroy(&file.parser);
+    stackArenaRelease(&file.stack_arena);
+
+    if (result < 0 || emulatorLoadFile(emulator, output) < 0) {
+        fprintf(stderr, "FAIL translating %s\n", filename);
+        return failures + 1;
+    }
+
+    emulatorReset(emulator);
+    failures += expect("multiply status", emulatorRun(emulator, 100000), EMULATOR_HALTED) < 0;
+    failures += expect("static 1 (3 * 21845)", (int16_t) emulator->ram[17], (int16_t) (3 * 21845)) < 0;
+    failures += expect("static 2 (A.mul 3 3)", (int16_t) emulator->ram[18], 9) < 0;
+    return failures;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* output = "fold-test.asm";
+    int32_t failures = 0;
+    emulator_t emulator;
+
+    if (emulatorInitialize(&emulator) < 0) {
+        return -1;
+    }
+
+    /* B.twice and B.sum fold first, then B.quad once its calls go to A.twice */
+    size_t rom_sizes[2];
+    int32_t folded[2];
+    failures += run(&emulator, output, 0, &folded[0], &rom_sizes[0]);
+    failures += run(&emulator, output, 1, &folded[1], &rom_sizes[1]);
+    failures += expect("functions folded", folded[1], 3) < 0;
+    failures += expect("ROM shrinks", rom_sizes[1] < rom_sizes[0], 1) < 0;
+    fprintf(stdout, "ROM %zu -> %zu words\n", rom_sizes[0], rom_sizes[1]);
+    failures += runMultiply(&emulator, output);
+
+    emulatorDestroy(&emulator);
+
+    /* Code outside any function and an empty module leave nothing to fold */
+    file_t loose;
+    if (parseFile(&loose, "fold-loose.vm", "push constant 1\npush constant 2\nadd\n") < 0) {
+        fprintf(stderr, "FAIL parsing fold-loose.vm\n");
+        failures++;
+    }
+    else {
+        command_module_t empty = {NULL, 0, &loose.stack_arena};
+        command_module_t* modules[] = {&loose.command_module, &empty};
+        failures += expect("loose code optimized", optimizeCommands(&loose.command_module, 1, NULL, 0), 0) < 0;
+        failures += expect("loose code folded", optimizeFoldFunctions(modules, 2), 0) < 0;
+        failures += expect("loose commands kept", (int64_t) loose.command_module.total_commands, 3) < 0;
+        parserDestroy(&loose.parser);
+        stackArenaRelease(&loose.stack_arena);
+    }
+
+    fprintf(stdout, failures == 0 ? "PASS\n" : "FAILED\n");
+    return failures == 0 ? 0 : -1;
+}
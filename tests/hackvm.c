@@ -0,0 +1,219 @@
+/* Translates a VM file from memory through libhackvm on several threads at once,
+ * each with its own context, and checks every result matches what translating
+ * the file the usual way writes, through both the buffer and callback interfaces */
+
+#include "../include/hackvm.h"
+#include "../include/parser.h"
+#include "../include/command.h"
+#include "../include/assembly_gen.h"
+#include "../include/stack_arena.h"
+
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define THREADS 4
+#define ROUNDS  50
+
+typedef struct {
+    const char* source;
+    size_t      source_size;
+    const char* expected;
+    size_t      expected_size;
+    int32_t     failures;
+} job_t;
+
+typedef struct {
+    char*  data;
+    size_t size;
+    size_t capacity;
+} collected_t;
+
+static char* readFile(const char* filepath, size_t* size)
+{
+    FILE* file = fopen(filepath, "r");
+    if (file == NULL) {
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    *size = (size_t) ftell(file);
+    rewind(file);
+
+    char* data = malloc(*size + 1);
+    if (data != NULL && fread(data, 1, *size, file) != *size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    return data;
+}
+
+static int32_t collect(void* user, const char* data, size_t size)
+{
+    collected_t* collected = user;
+    if (collected->size + size > collected->capacity) {
+        return -1;
+    }
+    memcpy(collected->data + collected->size, data, size);
+    collected->size += size;
+    return 0;
+}
+
+static void* translateRounds(void* argument)
+{
+    job_t* job = argument;
+    hackvm_t hackvm;
+    char* buffer = malloc(job->expected_size);
+
+    if (buffer == NULL || hackvmInitialize(&hackvm, 0, 0) < 0) {
+        free(buffer);
+        job->failures++;
+        return NULL;
+    }
+
+    for (int32_t round = 0; round < ROUNDS; round++) {
+        size_t length = 0;
+        if (hackvmTranslateBuffer(&hackvm, job->source, job->source_size, "hackvm-test.vm",
+                                  buffer, job->expected_size, &length) < 0 ||
+            length != job->expected_size || memcmp(buffer, job->expected, length) != 0) {
+            job->failures++;
+        }
+
+        collected_t collected = {buffer, 0, job->expected_size};
+        memset(buffer, 0, job->expected_size);
+        if (hackvmTranslate(&hackvm, job->source, job->source_size, "hackvm-test.vm", collect, &collected) < 0 ||
+            collected.size != job->expected_size || memcmp(buffer, job->expected, collected.size) != 0) {
+            job->failures++;
+        }
+    }
+
+    hackvmDestroy(&hackvm);
+    free(buffer);
+    return NULL;
+}
+
+/* Translate the file the way Hack-VM does
+ * Return 0 on success
+ * Return -1 on failure */
+static int32_t translateFile(const char* input, const char* output)
+{
+    parser_t parser;
+    command_module_t command_module;
+    stack_arena_t stack_arena;
+    assembly_gen_t assembly_generator;
+
+    if (parserInitialize(&parser, input) < 0) {
+        return -1;
+    }
+
+    if (stackArenaInitialize(&stack_arena, 8 * parser.file_size) < 0) {
+        parserDestroy(&parser);
+        return -1;
+    }
+
+    int32_t result = -1;
+    if (parserParseCommands(&parser, &command_module, &stack_arena) == 0 &&
+        assemblyGenInitialize(&assembly_generator, output) == 0) {
+
+        if (assemblyGenPreamble(&assembly_generator, "main") == 0 &&
+            assemblyGen(&assembly_generator, &command_module, input) == 0) {
+            result = 0;
+        }
+        assemblyGenDestroy(&assembly_generator);
+    }
+
+    parserDestroy(&parser);
+    stackArenaRelease(&stack_arena);
+    return result;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* input = argc > 1 ? argv[1] : "emulator-test.vm";
+    const char* output = "hackvm-test.asm";
+    int32_t failures = 0;
+
+    job_t job;
+    memset(&job, 0, sizeof(job_t));
+
+    if (translateFile(input, output) < 0 ||
+        (job.source = readFile(input, &job.source_size)) == NULL ||
+        (job.expected = readFile(output, &job.expected_size)) == NULL) {
+        fprintf(stderr, "Failed to translate %s\n", input);
+        return -1;
+    }
+
+    job_t jobs[THREADS];
+    pthread_t threads[THREADS];
+    for (size_t index = 0; index < THREADS; index++) {
+        jobs[index] = job;
+        if (pthread_create(&threads[index], NULL, translateRounds, &jobs[index]) != 0) {
+            return -1;
+        }
+    }
+    for (size_t index = 0; index < THREADS; index++) {
+        pthread_join(threads[index], NULL);
+        failures += jobs[index].failures;
+    }
+    if (failures != 0) {
+        fprintf(stderr, "FAIL %d threaded translations differ\n", failures);
+    }
+
+    /* A buffer that is too small fails and reports the size needed */
+    hackvm_t hackvm;
+    char small[16];
+    size_t length = 0;
+    hackvmInitialize(&hackvm, 0, 0);
+    if (hackvmTranslateBuffer(&hackvm, job.source, job.source_size, "hackvm-test.vm", small, sizeof(small), &length) == 0 ||
+        length != job.expected_size) {
+        fprintf(stderr, "FAIL small buffer, length %zu\n", length);
+        failures++;
+    }
+
+    /* Bad VM code fails with a reason instead of aborting */
+    const char* bad = "function main 0\npush nowhere 1\n";
+    if (hackvmTranslateBuffer(&hackvm, bad, strlen(bad), "bad.vm", small, sizeof(small), &length) == 0 ||
+        hackvm.error == NULL) {
+        fprintf(stderr, "FAIL bad code translated\n");
+        failures++;
+    }
+    hackvmDestroy(&hackvm);
+
+    /* So does code outside any function, after the optimizer has been over it */
+    const char* loose = "push constant 1\n";
+    hackvmInitialize(&hackvm, 1, 0);
+    if (hackvmTranslateBuffer(&hackvm, loose, strlen(loose), "loose.vm", small, sizeof(small), &length) == 0 ||
+        hackvm.error == NULL) {
+        fprintf(stderr, "FAIL loose code translated\n");
+        failures++;
+    }
+    hackvmDestroy(&hackvm);
+
+    /* The commands only the optimizer produces aren't VM code */
+    static char assembly[1 << 16];
+    static const char* const INTERNAL[] = {
+        "function main 0\npush constant 1\nleaf-call f 1\nreturn\nfunction f 0\npush argument 0\nreturn\n",
+        "function main 0\npush constant 1\ntail-call main 1\n",
+        "function main 0\nmove constant 1 static 0\n",
+        "function main 0\npush constant 3\nmultiply constant 5\n",
+        "function main 0\npush constant 1\npush constant 2\nif-lt main\n",
+    };
+    hackvmInitialize(&hackvm, 0, 0);
+    for (size_t index = 0; index < sizeof(INTERNAL) / sizeof(INTERNAL[0]); index++) {
+        if (hackvmTranslateBuffer(&hackvm, INTERNAL[index], strlen(INTERNAL[index]), "internal.vm", assembly,
+                                  sizeof(assembly), &length) == 0 || hackvm.error == NULL) {
+            fprintf(stderr, "FAIL internal command translated, %zu\n", index);
+            failures++;
+        }
+    }
+    hackvmDestroy(&hackvm);
+
+    free((char*) job.source);
+    free((char*) job.expected);
+
+    fprintf(stdout, failures == 0 ? "PASS\n" : "FAILED\n");
+    return failures == 0 ? 0 : -1;
+}
@@ -0,0 +1,115 @@
+/* Translates a program calling Memory.peek, Memory.poke, Math.abs, Math.min and
+ * Math.max at -O 1, 2 and s, with the calls expanded in place and kept as calls,
+ * runs both and checks they leave the same static variables behind. From -O 2 up
+ * the expanded calls take fewer cycles and less ROM, -O 1 keeps every call. A program
+ * with its own Math.multiply and Math.divide gets its own ones called when the calls
+ * are kept */
+
+#include "../include/parser.h"
+#include "../include/command.h"
+#include "../include/assembly_gen.h"
+#include "../include/stack_arena.h"
+#include "../include/optimize.h"
+#include "../include/emulator.h"
+#include "test_optimize.h"
+
+
+#include <stdio.h>
+
+/* Translate a program whose Math.multiply subtracts and Math.divide adds at every level,
+ * keeping the calls they have to run as written
+ * Return the number of failed checks */
+static int32_t runOwnRoutines(emulator_t* emulator, const int32_t* levels, size_t total_levels)
+{
+    static const check_t CHECKS[] = {
+        {"static 0 (own multiply 6 3)", 16, 3}, {"static 1 (own multiply 3 6)", 17, -3},
+        {"static 2 (own divide 7 1)",   18, 8},
+    };
+    const char* input = "intrinsics-own.vm";
+    const char* output = "intrinsics-own.asm";
+    int32_t failures = 0;
+
+    FILE* file = fopen(input, "w");
+    if (file == NULL) {
+        return 1;
+    }
+    fputs("function main 0\npush constant 6\npush constant 3\ncall Math.multiply 2\npop static 0\n"
+          "push constant 3\npush constant 6\ncall Math.multiply 2\npop static 1\n"
+          "push constant 7\npush constant 1\ncall Math.divide 2\npop static 2\nlabel halt\ngoto halt\n"
+          "function Math.multiply 0\npush argument 0\npush argument 1\nsub\nreturn\n"
+          "function Math.divide 0\npush argument 0\npush argument 1\nadd\nreturn\n", file);
+    fclose(file);
+
+    for (size_t level = 0; level < total_levels; level++) {
+        translate_options_t options = {levels[level], 1, 0, 0, 0};
+        if (translateOptimized(input, output, &options) < 0 || emulatorLoadFile(emulator, output) < 0) {
+            fprintf(stderr, "FAIL translating %s at level %d\n", input, levels[level]);
+            failures++;
+            continue;
+        }
+
+        emulatorReset(emulator);
+        failures += expect("status", emulatorRun(emulator, 1000000), EMULATOR_HALTED) < 0;
+        for (size_t check = 0; check < sizeof(CHECKS) / sizeof(CHECKS[0]); check++) {
+            failures += expect(CHECKS[check].what, (int16_t) emulator->ram[CHECKS[check].address], CHECKS[check].value) < 0;
+        }
+    }
+
+    return failures;
+}
+
+int main(int argc, char* argv[])
+{
+    static const int32_t LEVELS[] = {1, OPTIMIZE_LEVEL_SPEED, OPTIMIZE_LEVEL_SIZE};
+    static const check_t CHECKS[] = {
+        {"static 0 (peek poked)", 16, 1234}, {"static 1 (abs -5)",   17, 5}, {"static 2 (abs 7)",    18, 7},
+        {"static 3 (min 3 9)",    19, 3},    {"static 4 (min 9 3)",  20, 3}, {"static 5 (max -4 2)", 21, 2},
+        {"static 6 (max 6 2)",    22, 6},    {"static 7 (min 5 5)",  23, 5}, {"static 8 (sum 0 - 9)", 24, 25},
+    };
+    const char* input = "intrinsics-test.vm";
+    const char* output = "intrinsics-test.asm";
+    int32_t failures = 0;
+    emulator_t emulator;
+
+    if (emulatorInitialize(&emulator) < 0) {
+        return -1;
+    }
+
+    for (size_t level = 0; level < sizeof(LEVELS) / sizeof(LEVELS[0]); level++) {
+        size_t rom_sizes[2];
+        uint64_t cycles[2];
+
+        for (int32_t keep_calls = 0; keep_calls < 2; keep_calls++) {
+            translate_options_t options = {LEVELS[level], keep_calls, 0, 0, 0};
+            if (translateOptimized(input, output, &options) < 0 || emulatorLoadFile(&emulator, output) < 0) {
+                fprintf(stderr, "FAIL translating %s at level %d\n", input, LEVELS[level]);
+                failures++;
+                continue;
+            }
+
+            emulatorReset(&emulator);
+            failures += expect("status", emulatorRun(&emulator, 1000000), EMULATOR_HALTED) < 0;
+            for (size_t check = 0; check < sizeof(CHECKS) / sizeof(CHECKS[0]); check++) {
+                failures += expect(CHECKS[check].what, (int16_t) emulator.ram[CHECKS[check].address], CHECKS[check].value) < 0;
+            }
+            rom_sizes[keep_calls] = emulator.rom_size;
+            cycles[keep_calls] = emulator.cycles;
+        }
+
+        if (LEVELS[level] == 1) {
+            failures += expect("-O 1 keeps the calls", rom_sizes[0], rom_sizes[1]) < 0;
+        }
+        else {
+            failures += expect("expanded calls take less ROM", rom_sizes[0] < rom_sizes[1], 1) < 0;
+            failures += expect("expanded calls take fewer cycles", cycles[0] < cycles[1], 1) < 0;
+        }
+        fprintf(stdout, "%s at level %d: ROM %zu -> %zu words, %llu -> %llu cycles expanded\n", input, LEVELS[level],
+                rom_sizes[1], rom_sizes[0], (unsigned long long) cycles[1], (unsigned long long) cycles[0]);
+    }
+
+    failures += runOwnRoutines(&emulator, LEVELS, sizeof(LEVELS) / sizeof(LEVELS[0]));
+    emulatorDestroy(&emulator);
+
+    fprintf(stdout, failures == 0 ? "PASS\n" : "FAILED\n");
+    return failures == 0 ? 0 : -1;
+}
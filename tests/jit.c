@@ -0,0 +1,118 @@
+/* Runs a translated VM program through the JIT and checks that it ends in
+ * exactly the same state as the interpreter, for whole runs and for runs cut
+ * short by cycle budgets */
+
+#include "../include/parser.h"
+#include "../include/command.h"
+#include "../include/assembly_gen.h"
+#include "../include/stack_arena.h"
+#include "../include/emulator.h"
+#include "../include/jit.h"
+#include "test_util.h"
+
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+
+/* Compare the machine state of two emulators */
+static int32_t sameState(const char* what, emulator_t* expected, emulator_t* actual, emulator_status_t expected_status,
+                         emulator_status_t actual_status)
+{
+    if (expected_status != actual_status || expected->a != actual->a || expected->d != actual->d ||
+        expected->pc != actual->pc || expected->cycles != actual->cycles ||
+        memcmp(expected->ram, actual->ram, EMULATOR_RAM_SIZE * sizeof(uint16_t)) != 0) {
+
+        fprintf(stderr, "FAIL %s: status %d/%d a %u/%u d %u/%u pc %u/%u cycles %llu/%llu\n", what,
+                expected_status, actual_status, expected->a, actual->a, expected->d, actual->d,
+                expected->pc, actual->pc, (unsigned long long) expected->cycles, (unsigned long long) actual->cycles);
+        return -1;
+    }
+    return 0;
+}
+
+static double elapsed(struct timespec* start, struct timespec* end)
+{
+    return (double) (end->tv_sec - start->tv_sec) + (double) (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char* argv[])
+{
+    emulator_t interpreter;
+    emulator_t native;
+    jit_t jit;
+    jit_t small_jit;
+    int32_t failures = 0;
+
+    const char* input = argc > 1 ? argv[1] : "emulator-test.vm";
+    const char* output = argc > 2 ? argv[2] : "jit-test.asm";
+
+    if (translate(input, output) < 0) {
+        fprintf(stderr, "Failed to translate %s\n", input);
+        return -1;
+    }
+
+    if (emulatorInitialize(&interpreter) < 0 || emulatorInitialize(&native) < 0 ||
+        emulatorLoadFile(&interpreter, output) < 0 || emulatorLoadFile(&native, output) < 0) {
+        fprintf(stderr, "Failed to load %s\n", output);
+        return -1;
+    }
+
+    if (jitInitialize(&jit, &native, 1 << 20) < 0 || jitInitialize(&small_jit, &native, 8192) < 0) {
+        fprintf(stderr, "Failed to initialize the JIT\n");
+        return -1;
+    }
+
+    /* Whole run */
+    struct timespec start, middle, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    emulator_status_t expected_status = emulatorRun(&interpreter, UINT64_MAX);
+    clock_gettime(CLOCK_MONOTONIC, &middle);
+    emulator_status_t status = jitRun(&jit, UINT64_MAX);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    failures += sameState("whole run", &interpreter, &native, expected_status, status) < 0;
+
+    fprintf(stdout, "%llu cycles, interpreter %.1f MIPS, jit %.1f MIPS (including compilation of %zu blocks)\n",
+            (unsigned long long) interpreter.cycles,
+            (double) interpreter.cycles / elapsed(&start, &middle) / 1e6,
+            (double) native.cycles / elapsed(&middle, &end) / 1e6, jit.total_blocks);
+
+    /* Budgets landing everywhere inside blocks */
+    for (uint64_t budget = 1; budget < 20000; budget += 7) {
+        emulatorReset(&interpreter);
+        emulatorReset(&native);
+
+        expected_status = emulatorRun(&interpreter, budget);
+        status = jitRun(&jit, budget);
+
+        if (sameState("budget", &interpreter, &native, expected_status, status) < 0) {
+            fprintf(stderr, "  with budget %llu\n", (unsigned long long) budget);
+            failures++;
+            break;
+        }
+    }
+
+    /* Resuming after every budget, through a code buffer small enough to keep flushing */
+    emulatorReset(&interpreter);
+    emulatorReset(&native);
+    expected_status = emulatorRun(&interpreter, UINT64_MAX);
+    do {
+        status = jitRun(&small_jit, 997);
+    } while (status == EMULATOR_BUDGET);
+
+    failures += sameState("resumed run", &interpreter, &native, expected_status, status) < 0;
+    if (small_jit.total_flushes == 0) {
+        fprintf(stderr, "FAIL small code buffer never flushed\n");
+        failures++;
+    }
+
+    jitDestroy(&small_jit);
+    jitDestroy(&jit);
+    emulatorDestroy(&native);
+    emulatorDestroy(&interpreter);
+
+    fprintf(stdout, failures == 0 ? "PASS\n" : "FAILED\n");
+    return failures == 0 ? 0 : -1;
+}
@@ -0,0 +1,89 @@
+/* Translates a program with a million comparisons and more calls in one function
+ * than a 16 bit counter holds, then checks every generated label in the output
+ * is defined once, numbered in order */
+
+#include "../include/parser.h"
+#include "../include/command.h"
+#include "../include/assembly_gen.h"
+#include "../include/stack_arena.h"
+#include "test_util.h"
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define COMPARISONS 1000000
+#define CALLS       70000
+
+static int32_t writeProgram(const char* filepath)
+{
+    FILE* file = fopen(filepath, "w");
+    if (file == NULL) {
+        return -1;
+    }
+
+    fprintf(file, "function main 0\npush constant 0\n");
+    for (int32_t index = 0; index < COMPARISONS; index++) {
+        fprintf(file, "push constant 1\neq\n");
+    }
+    for (int32_t index = 0; index < CALLS; index++) {
+        fprintf(file, "call f 0\npop temp 0\n");
+    }
+    fprintf(file, "label halt\ngoto halt\nfunction f 0\npush constant 0\nreturn\n");
+
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* input = "labels-test.vm";
+    const char* output = "labels-test.asm";
+    int32_t failures = 0;
+
+    if (writeProgram(input) < 0) {
+        fprintf(stderr, "Failed to write %s\n", input);
+        return -1;
+    }
+
+    clock_t start = clock();
+    if (translate(input, output) < 0) {
+        fprintf(stderr, "FAIL failed to translate %s\n", input);
+        fprintf(stdout, "FAILED\n");
+        return -1;
+    }
+    fprintf(stdout, "Translated %d comparisons and %d calls in %.2fs\n", COMPARISONS, CALLS,
+            (double) (clock() - start) / CLOCKS_PER_SEC);
+
+    FILE* file = fopen(output, "r");
+    if (file == NULL) {
+        return -1;
+    }
+
+    /* Every label of the file is defined once, in the order they were made */
+    char line[64];
+    unsigned long long expected = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strncmp(line, "($1.", 4) != 0) {
+            continue;
+        }
+
+        unsigned long long counter = strtoull(line + 4, NULL, 36);
+        if (counter != expected) {
+            fprintf(stderr, "FAIL label %s expected counter %llu\n", line, expected);
+            failures++;
+            break;
+        }
+        expected++;
+    }
+    fclose(file);
+
+    if (expected != COMPARISONS + CALLS) {
+        fprintf(stderr, "FAIL expected %d labels, found %llu\n", COMPARISONS + CALLS, expected);
+        failures++;
+    }
+
+    fprintf(stdout, failures == 0 ? "PASS\n" : "FAILED\n");
+    return failures == 0 ? 0 : -1;
+}
@@ -0,0 +1,187 @@
+/* Writes a program calling into a few functions of a large library and parses it
+ * both in full and only as far as main reaches. The reachable commands have to be
+ * the same, with the same lines, and run to the same results, in a fraction of
+ * the parse. A mistake in an unused function only fails the full parse, and
+ * without the entry function everything is parsed */
+
+#include "../include/parser.h"
+#include "../include/command.h"
+#include "../include/assembly_gen.h"
+#include "../include/stack_arena.h"
+#include "../include/emulator.h"
+#include "test_util.h"
+
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define LIBRARY_FUNCTIONS 4000
+
+/* main and the three library functions it reaches, Lib.again only through Lib.quad */
+static const char* PROGRAM =
+    "function main 0\n"
+    "push constant 6\ncall Lib.twice 1\npop static 0\n"
+    "push constant 7\ncall Lib.quad 1\npop static 1\n"
+    "label halt\ngoto halt\n";
+
+static const char* USED =
+    "function Lib.twice 0\npush argument 0\npush argument 0\nadd\nreturn\n"
+    "function Lib.quad 0\npush argument 0\ncall Lib.twice 1\ncall Lib.again 1\nreturn\n"
+    "function Lib.again 1\npush argument 0\npop local 0\npush local 0\npush local 0\nadd\nreturn\n";
+
+/* Commands in PROGRAM and USED */
+#define REACHABLE_COMMANDS 26
+
+/* Write the program with the used functions half way through the library, and a
+ * line no parser takes in the last unused function if broken is set
+ * Return 0 on success
+ * Return -1 on failure */
+static int32_t writeProgram(const char* filepath, int32_t broken)
+{
+    FILE* output = fopen(filepath, "w");
+    if (output == NULL) {
+        return -1;
+    }
+
+    fputs(PROGRAM, output);
+    for (size_t function = 0; function < LIBRARY_FUNCTIONS; function++) {
+        if (function == LIBRARY_FUNCTIONS / 2) {
+            fputs(USED, output);
+        }
+
+        /* Unused functions call each other, and Lib.twice */
+        fprintf(output, "function Lib.unused%zu 2\n", function);
+        for (size_t repeat = 0; repeat < 4; repeat++) {
+            fprintf(output, "push argument 0\npush constant %zu\nadd\npop local 1\n", repeat);
+            fprintf(output, "label LOOP%zu\npush local 1\nif-goto LOOP%zu\n", repeat, repeat);
+        }
+        fprintf(output, "push local 1\ncall Lib.unused%zu 1\ncall Lib.twice 1\nreturn\n", (function + 1) % LIBRARY_FUNCTIONS);
+    }
+    if (broken) {
+        fputs("push nowhere 3\n", output);
+    }
+
+    return fclose(output) != 0 ? -1 : 0;
+}
+
+/* Parse filepath in full, or as far as entry reaches unless entry is NULL
+ * Return 0 on success
+ * Return -1 on failure */
+static int32_t parse(const char* filepath, const char* entry, parser_t* parser, stack_arena_t* stack_arena,
+                     command_module_t* command_module, double* seconds)
+{
+    if (parserInitialize(parser, filepath) < 0) {
+        return -1;
+    }
+
+    if (stackArenaInitialize(stack_arena, 48 * parser->file_size + 4096) < 0) {
+        parserDestroy(parser);
+        return -1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int32_t result = entry != NULL ? parserParseReachable(parser, command_module, stack_arena, entry)
+                                   : parserParseCommands(parser, command_module, stack_arena);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    *seconds = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+    return result;
+}
+
+static void release(parser_t* parser, stack_arena_t* stack_arena)
+{
+    parserDestroy(parser);
+    stackArenaRelease(stack_arena);
+}
+
+int main(int argc, char* argv[])
+{
+    const char* input = "lazy-test.vm";
+    const char* output = "lazy-test.asm";
+    int32_t failures = 0;
+    double full_seconds, lazy_seconds, seconds;
+    parser_t full_parser, lazy_parser, parser;
+    stack_arena_t full_arena, lazy_arena, stack_arena;
+    command_module_t full, lazy, command_module;
+    emulator_t emulator;
+
+    if (writeProgram(input, 0) < 0 || parse(input, NULL, &full_parser, &full_arena, &full, &full_seconds) < 0 ||
+        parse(input, "main", &lazy_parser, &lazy_arena, &lazy, &lazy_seconds) < 0) {
+        fprintf(stderr, "Failed to parse %s\n", input);
+        return -1;
+    }
+
+    /* Every command parsed lazily is the one parsed in full from the same line */
+    failures += expect("reachable commands", (int64_t) lazy.total_commands, REACHABLE_COMMANDS) < 0;
+    for (size_t index = 0, line = 0; index < lazy.total_commands; index++) {
+        char expected[128], actual[128];
+
+        while (line < full.total_commands && full.commands[line].line != lazy.commands[index].line) {
+            line++;
+        }
+        if (line == full.total_commands) {
+            failures += expect("line of a reachable command", lazy.commands[index].line, 0) < 0;
+            break;
+        }
+
+        parserFormatCommand(&full.commands[line], expected, sizeof(expected));
+        parserFormatCommand(&lazy.commands[index], actual, sizeof(actual));
+        if (strcmp(expected, actual) != 0) {
+            fprintf(stderr, "FAIL line %u: expected %s, got %s\n", lazy.commands[index].line, expected, actual);
+            failures++;
+        }
+    }
+
+    /* What main reaches runs on its own */
+    assembly_gen_t assembly_generator;
+    int32_t result = -1;
+    if (assemblyGenInitialize(&assembly_generator, output) == 0) {
+        if (assemblyGenPreamble(&assembly_generator, "main") == 0 && assemblyGen(&assembly_generator, &lazy, input) == 0) {
+            result = 0;
+        }
+        assemblyGenDestroy(&assembly_generator);
+    }
+
+    if (result < 0 || emulatorInitialize(&emulator) < 0 || emulatorLoadFile(&emulator, output) < 0) {
+        fprintf(stderr, "FAIL translating the reachable commands\n");
+        failures++;
+    }
+    else {
+        emulatorReset(&emulator);
+        failures += expect("status", emulatorRun(&emulator, 100000), EMULATOR_HALTED) < 0;
+        failures += expect("static 0 (twice 6)", emulator.ram[16], 12) < 0;
+        failures += expect("static 1 (quad 7)", emulator.ram[17], 28) < 0;
+        emulatorDestroy(&emulator);
+    }
+
+    fprintf(stdout, "%zu commands parsed in %.2fms, %zu reachable in %.2fms\n", full.total_commands,
+            full_seconds * 1000.0, lazy.total_commands, lazy_seconds * 1000.0);
+    failures += expect("reachable parse is faster", lazy_seconds < full_seconds, 1) < 0;
+    release(&full_parser, &full_arena);
+    release(&lazy_parser, &lazy_arena);
+
+    /* Without the entry function it all goes in */
+    if (parse(input, "Nowhere.main", &parser, &stack_arena, &command_module, &seconds) < 0) {
+        failures += expect("parse without the entry function", -1, 0) < 0;
+    }
+    else {
+        failures += expect("commands without the entry function", (int64_t) command_module.total_commands,
+                           (int64_t) full.total_commands) < 0;
+        release(&parser, &stack_arena);
+    }
+
+    /* The broken line is only ever looked at by the full parse */
+    if (writeProgram(input, 1) < 0) {
+        return -1;
+    }
+    failures += expect("full parse of the broken program", parse(input, NULL, &parser, &stack_arena, &command_module, &seconds), -1) < 0;
+    release(&parser, &stack_arena);
+    failures += expect("reachable parse of the broken program",
+                       parse(input, "main", &parser, &stack_arena, &command_module, &seconds), 0) < 0;
+    release(&parser, &stack_arena);
+
+    fprintf(stdout, failures == 0 ? "PASS\n" : "FAILED\n");
+    return failures == 0 ? 0 : -1;
+}
@@ -0,0 +1,250 @@
+/* Translates programs with dead code, roundabout jumps, push / pop pairs,
+ * comparisons feeding jumps and calls multiplying by constants at every
+ * optimization level, runs each result on
+ * the emulator and checks they all compute the same thing while the optimized
+ * ones take less ROM and fewer cycles, -O s the least ROM and -O 2 the fewest */
+
+#include "../include/parser.h"
+#include "../include/command.h"
+#include "../include/assembly_gen.h"
+#include "../include/stack_arena.h"
+#include "../include/optimize.h"
+#include "../include/emulator.h"
+#include "test_optimize.h"
+
+
+#include <stdio.h>
+
+
+/* Translate input at every level, run each and check memory ends up as expected, with
+ * ROM and cycles going down from level 0 to 1 and on to the least of each at s and 2.
+ * total_commands are at level 0 and 1, the higher levels only change the expansions.
+ * RAM the program should overwrite is dirtied first
+ * Return the number of failed checks */
+static int32_t checkProgram(emulator_t* emulator, const char* input, const char* output, const size_t total_commands[2],
+                            const check_t* checks, size_t total_checks)
+{
+    int32_t failures = 0;
+    static const int32_t LEVELS[] = {0, 1, OPTIMIZE_LEVEL_SPEED, OPTIMIZE_LEVEL_SIZE};
+    size_t rom_sizes[4];
+    uint64_t cycles[4];
+
+    for (size_t run = 0; run < 4; run++) {
+        int32_t level = LEVELS[run];
+        translate_options_t options = {level, 0, level == OPTIMIZE_LEVEL_SIZE, 0, 0};
+        if (translateOptimized(input, output, &options) < 0 || emulatorLoadFile(emulator, output) < 0) {
+            fprintf(stderr, "FAIL translating %s at level %d\n", input, level);
+            return failures + 1;
+        }
+        failures += expect(input, options.total_commands, total_commands[level == 0 ? 0 : 1]) < 0;
+
+        emulatorReset(emulator);
+        for (size_t index = 0; index < total_checks; index++) {
+            emulator->ram[checks[index].address] = 0x5555;
+        }
+
+        failures += expect("status", emulatorRun(emulator, 1000000), EMULATOR_HALTED) < 0;
+        for (size_t index = 0; index < total_checks; index++) {
+            failures += expect(checks[index].what, (int16_t) emulator->ram[checks[index].address], checks[index].value) < 0;
+        }
+        rom_sizes[run] = emulator->rom_size;
+        cycles[run] = emulator->cycles;
+    }
+
+    failures += expect("ROM shrinks", rom_sizes[1] < rom_sizes[0], 1) < 0;
+    failures += expect("cycles go down", cycles[1] < cycles[0], 1) < 0;
+    failures += expect("-O s takes the least ROM", rom_sizes[3] < rom_sizes[1] && rom_sizes[3] <= rom_sizes[2], 1) < 0;
+    failures += expect("-O 2 takes the fewest cycles", cycles[2] < cycles[1] && cycles[2] <= cycles[3], 1) < 0;
+    fprintf(stdout, "%s: ROM %zu -> %zu words (-O 2 %zu, -O s %zu), %llu -> %llu cycles (-O 2 %llu, -O s %llu)\n",
+            input, rom_sizes[0], rom_sizes[1], rom_sizes[2], rom_sizes[3], (unsigned long long) cycles[0],
+            (unsigned long long) cycles[1], (unsigned long long) cycles[2], (unsigned long long) cycles[3]);
+    return failures;
+}
+
+/* main in one file calls B.f, which the other file calls too, so B.f has to keep the
+ * standard protocol when the two are translated together at the given level
+ * Return the number of failed checks */
+static int32_t checkModules(emulator_t* emulator, const char* output, int32_t level)
+{
+    static const char* SOURCES[] = {
+        "function main 0\npush constant 5\ncall B.f 1\npop static 0\n"
+        "push constant 3\ncall B.g 1\npop static 1\nlabel halt\ngoto halt\n",
+
+        "function B.g 0\npush argument 0\ncall B.f 1\npop static 1\npush static 1\nreturn\n"
+        "function B.f 0\npush argument 0\npush argument 0\nadd\nreturn\n",
+    };
+    const char* filenames[] = {"modules-a.vm", "modules-b.vm"};
+    parser_t parsers[2];
+    stack_arena_t stack_arenas[2];
+    command_module_t command_modules[2];
+    command_module_t* modules[] = {&command_modules[0], &command_modules[1]};
+    static_layout_t layouts[2];
+    assembly_gen_t assembly_generator;
+    size_t parsed = 0;
+    int32_t result = 0;
+
+    for (; parsed < 2 && result == 0; parsed++) {
+        FILE* file = fopen(filenames[parsed], "w");
+        result = file != NULL && fputs(SOURCES[parsed], file) >= 0 && fclose(file) == 0 ? 0 : -1;
+        if (result < 0 || parserInitialize(&parsers[parsed], filenames[parsed]) < 0) {
+            result = -1;
+            break;
+        }
+        if (stackArenaInitialize(&stack_arenas[parsed], 16 * parsers[parsed].file_size + 4096) < 0) {
+            parserDestroy(&parsers[parsed]);
+            result = -1;
+            break;
+        }
+        result = parserParseCommands(&parsers[parsed], &command_modules[parsed], &stack_arenas[parsed]) < 0 ||
+                 optimizeCommands(&command_modules[parsed], level, NULL, 0) < 0 ? -1 : 0;
+    }
+
+    if (result == 0 && optimizeFoldFunctions(modules, 2) >= 0 && optimizeLeafCalls(modules, 2, level, NULL) >= 0 &&
+        assemblyGenInitialize(&assembly_generator, output) == 0) {
+
+        assemblyGenSetGoal(&assembly_generator, optimizeGoal(level), modules[0], NULL);
+        result = assemblyGenLayoutStatics(&assembly_generator, layouts, modules, filenames, 2, stderr) == 0 &&
+                 assemblyGenPreamble(&assembly_generator, "main") == 0 &&
+                 assemblyGen(&assembly_generator, modules[0], filenames[0]) == 0 &&
+                 assemblyGen(&assembly_generator, modules[1], filenames[1]) == 0 ? 0 : -1;
+        assemblyGenDestroy(&assembly_generator);
+    }
+    else {
+        result = -1;
+    }
+
+    for (size_t index = 0; index < parsed; index++) {
+        parserDestroy(&parsers[index]);
+        stackArenaRelease(&stack_arenas[index]);
+    }
+
+    if (result < 0 || emulatorLoadFile(emulator, output) < 0) {
+        fprintf(stderr, "FAIL translating %s and %s at level %d\n", filenames[0], filenames[1], level);
+        return 1;
+    }
+
+    int32_t failures = 0;
+    emulatorReset(emulator);
+    failures += expect("two files status", emulatorRun(emulator, 100000), EMULATOR_HALTED) < 0;
+    failures += expect("static 0 (B.f 5 from the other file)", (int16_t) emulator->ram[16], 10) < 0;
+    failures += expect("static 1 (B.g 3)", (int16_t) emulator->ram[17], 6) < 0;
+    return failures;
+}
+
+int main(int argc, char* argv[])
+{
+    emulator_t emulator;
+    int32_t failures = 0;
+
+    const char* input = argc > 1 ? argv[1] : "optimize-test.vm";
+    const char* output = argc > 2 ? argv[2] : "optimize-test.asm";
+
+    if (emulatorInitialize(&emulator) < 0) {
+        return -1;
+    }
+
+    static const check_t RESULTS[] = {
+        {"static 0 (twice 3)", 16, 6}, {"static 1 (count 10)", 17, 10}, {"static 2 (pick 9)", 18, 1},
+        {"static 3 (pick 2)",  19, 2},
+    };
+
+    /* Ten commands are dead, nine unreachable and one unused label. main's goto skip
+     * then lands on the next command, and in pick the if-goto over a goto is inverted
+     * and goto first threads through to second, leaving two labels and two gotos behind.
+     * The three constants popped into locals become moves, and count's "lt, not, if-goto"
+     * and pick's "gt, if-goto" become single jumps */
+    static const size_t COMMANDS[] = {68, 45};
+    failures += checkProgram(&emulator, input, output, COMMANDS, RESULTS, sizeof(RESULTS) / sizeof(RESULTS[0]));
+
+    /* Every kind of push followed by a pop, as moves they have to leave memory the same */
+    static const check_t MOVES[] = {
+        {"static 0 (returned)",    16, 1239}, {"static 1 (from temp)",   17, 77},   {"static 2 (from static)", 18, 77},
+        {"static 3 (from that)",   19, 3050}, {"temp 0 (local 1)",       5,  1},    {"temp 3 (argument 1)",    8,  77},
+        {"this 0 (argument 1)",    3000, 5},  {"this 1 (local 3)",       3001, 1234}, {"this 7 (local 1)",     3007, 1},
+        {"that 0 (constant 77)",   3050, 77}, {"that 1 (constant 1)",    3051, 1},  {"that 2 (this 7)",        3052, 1},
+        {"that 9 (constant 0)",    3059, 0},  {"that 6 (pointer 0)",     3026, 3000},
+    };
+
+    /* 23 pairs, one of them puts local 2 back where it was and goes away */
+    static const size_t MOVE_COMMANDS[] = {60, 35};
+    failures += checkProgram(&emulator, "moves-test.vm", output, MOVE_COMMANDS, MOVES, sizeof(MOVES) / sizeof(MOVES[0]));
+
+    /* Comparisons straight into jumps, with nots in between, on negative numbers too */
+    static const check_t COMPARES[] = {
+        {"static 0 (3 < 5)",  16, 1}, {"static 1 (5 > 3)",     17, 3}, {"static 2 (4 = 4)",      18, 2},
+        {"static 3 (-2 < 7)", 19, 1}, {"static 4 (counted)",   20, 6}, {"static 5 (not not eq)", 21, 0},
+        {"static 6 (8 > 9)",  22, 0},
+    };
+
+    /* Five comparisons are fused, taking four nots and five if-gotos with them, and
+     * the five constants popped into statics become moves */
+    static const size_t COMPARE_COMMANDS[] = {71, 57};
+    failures += checkProgram(&emulator, "compares-test.vm", output, COMPARE_COMMANDS, COMPARES, sizeof(COMPARES) / sizeof(COMPARES[0]));
+
+    /* Tail calls between functions taking more, fewer and no arguments, and 1000 deep */
+    static const check_t TAILS[] = {
+        {"static 0 (even 20)",   16, 1}, {"static 1 (even 7)",  17, 0}, {"static 2 (sum 5)",     18, 15},
+        {"static 3 (spread 3)",  19, 113}, {"static 4 (zero)",  20, 7}, {"static 5 (deep 1000)", 21, 3000},
+    };
+
+    /* Six calls straight into returns, four comparisons into jumps and the argument popped into sum's local */
+    static const size_t TAIL_COMMANDS[] = {102, 91};
+    failures += checkProgram(&emulator, "tail-test.vm", output, TAIL_COMMANDS, TAILS, sizeof(TAILS) / sizeof(TAILS[0]));
+
+    /* Leaf functions taking no, one and two arguments, called from a loop, from a
+     * function with locals and with more than one return, next to a function with
+     * locals and one called with different numbers of arguments */
+    static const check_t LEAVES[] = {
+        {"static 1 (double 0 - 9)", 17, 90}, {"static 2 (diff 6 4)",   18, 2},  {"static 3 (seven)",   19, 7},
+        {"static 4 (triple 3)",     20, 9},  {"static 5 (either)",     21, 10}, {"static 6 (nested 9)", 22, 36},
+        {"static 7 (max both ways)", 23, 12},
+    };
+
+    /* The loop's "lt, not, if-goto" and max's "gt, if-goto" become jumps, and the two constants
+     * popped into statics and the two arguments popped into locals become moves */
+    static const size_t LEAF_COMMANDS[] = {96, 89};
+    failures += checkProgram(&emulator, "leaf-test.vm", output, LEAF_COMMANDS, LEAVES, sizeof(LEAVES) / sizeof(LEAVES[0]));
+
+    /* Nested loops, one left through a continue, one never entered and one already testing at the bottom */
+    static const check_t LAYOUTS[] = {
+        {"static 0 (nested 10)", 16, 45}, {"static 1 (evens 20)", 17, 10}, {"static 2 (nested 0)", 18, 0},
+        {"static 3 (search 5)",  19, 6},
+    };
+
+    /* The three loops testing at the top are rotated, each trading the label it exits to
+     * for one on its body and its goto back for one in. Six constants popped become moves */
+    static const size_t LAYOUT_COMMANDS[] = {100, 86};
+    failures += checkProgram(&emulator, "layout-test.vm", output, LAYOUT_COMMANDS, LAYOUTS, sizeof(LAYOUTS) / sizeof(LAYOUTS[0]));
+
+    /* Multiplications by constants on either side, wrapping past 16 bits and of a
+     * negative number, and divisions by 1 and 2 */
+    static const check_t STRENGTHS[] = {
+        {"static 0 (13 * 0)",    16, 0},     {"static 1 (13 * 1)",     17, 13},   {"static 2 (13 * 2)",   18, 26},
+        {"static 3 (13 * 3)",    19, 39},    {"static 4 (13 * 7)",     20, 91},   {"static 5 (13 * 8)",   21, 104},
+        {"static 6 (13 * 10)",   22, 130},   {"static 7 (13 * 255)",   23, 3315}, {"static 8 (13 * 1000)", 24, 13000},
+        {"static 9 (3 * 32767)", 25, 32765}, {"static 10 (-5 * 7)",    26, -35},  {"static 11 (6 * 13)",  27, 78},
+        {"static 12 (100 / 1)",  28, 100},   {"static 13 (100 / 2)",   29, 50},   {"static 14 (1 * 13)",  30, 13},
+        {"static 15 (sum 10)",   31, 540},
+    };
+
+    /* Fourteen calls to Math.multiply become multiplies, taking their constants with
+     * them. The two by 1 and the division by 1 go altogether, leaving three more pushes
+     * straight into pops to become moves */
+    static const size_t STRENGTH_COMMANDS[] = {151, 117};
+    failures += checkProgram(&emulator, "strength-test.vm", output, STRENGTH_COMMANDS, STRENGTHS, sizeof(STRENGTHS) / sizeof(STRENGTHS[0]));
+
+    /* The last run was optimized for size, deep never took the stack past its first frames */
+    size_t written = 0;
+    for (size_t address = 400; address < 6000; address++) {
+        written += emulator.ram[address] != 0;
+    }
+    failures += expect("stack words written past 400", (int64_t) written, 0) < 0;
+
+    failures += checkModules(&emulator, output, 1);
+    failures += checkModules(&emulator, output, OPTIMIZE_LEVEL_SPEED);
+
+    emulatorDestroy(&emulator);
+
+    fprintf(stdout, failures == 0 ? "PASS\n" : "FAILED\n");
+    return failures == 0 ? 0 : -1;
+}
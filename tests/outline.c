@@ -0,0 +1,174 @@
+/* Translates the optimizer's test programs at -O s as they are and with repeated
+ * runs of instructions outlined into routines, runs both and checks they leave the
+ * same static variables behind in less ROM. With a profile that finds every command
+ * hot nothing may be outlined, so the ROM has to stay the same. A program with more
+ * instructions than can be held back still translates, outlined up to where they
+ * ran out of room */
+
+#include "../include/parser.h"
+#include "../include/command.h"
+#include "../include/assembly_gen.h"
+#include "../include/stack_arena.h"
+#include "../include/optimize.h"
+#include "../include/profile.h"
+#include "../include/emulator.h"
+#include "test_optimize.h"
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BIG_BLOCKS 80000
+
+/* Translate and run input, static variables and the ROM size are what it leaves behind
+ * Return 0 on success
+ * Return -1 on failure */
+static int32_t run(emulator_t* emulator, const char* input, const char* output, int32_t outline, int32_t hot,
+                   uint16_t* statics, size_t* rom_size)
+{
+    translate_options_t options = {OPTIMIZE_LEVEL_SIZE, 0, outline, hot, 0};
+    if (translateOptimized(input, output, &options) < 0 || emulatorLoadFile(emulator, output) < 0) {
+        fprintf(stderr, "FAIL translating %s%s\n", input, outline ? ", outlined" : "");
+        return -1;
+    }
+
+    emulatorReset(emulator);
+    if (expect(input, emulatorRun(emulator, 1000000), EMULATOR_HALTED) < 0) {
+        return -1;
+    }
+
+    memcpy(statics, &emulator->ram[ASSEMBLY_STATIC_START], (ASSEMBLY_STATIC_END - ASSEMBLY_STATIC_START) * sizeof(uint16_t));
+    *rom_size = emulator->rom_size;
+    return 0;
+}
+
+/* Count the instructions of an assembly file and check every generated label in it
+ * is defined once
+ * Return the number of instructions on success
+ * Return -1 on failure */
+static int64_t countInstructions(const char* filepath)
+{
+    FILE* file = fopen(filepath, "r");
+    if (file == NULL) {
+        return -1;
+    }
+
+    /* Generated labels of file 1 are numbered from 0 on, ones outlining made included */
+    uint8_t* defined = calloc(1 << 22, 1);
+    int64_t instructions = 0;
+    int32_t failed = defined == NULL;
+    char line[64];
+    while (!failed && fgets(line, sizeof(line), file) != NULL) {
+        if (line[0] != '(') {
+            instructions++;
+        }
+        if (strncmp(line, "($1.", 4) == 0) {
+            unsigned long long counter = strtoull(line + 4, NULL, 36);
+            failed = counter >= (1 << 22) || defined[counter]++ != 0;
+        }
+    }
+    fclose(file);
+
+    /* Then every label used has to be one of them */
+    file = fopen(filepath, "r");
+    while (!failed && file != NULL && fgets(line, sizeof(line), file) != NULL) {
+        if (strncmp(line, "@$1.", 4) == 0) {
+            unsigned long long counter = strtoull(line + 4, NULL, 36);
+            failed = counter >= (1 << 22) || defined[counter] == 0;
+        }
+    }
+    if (file != NULL) {
+        fclose(file);
+    }
+
+    free(defined);
+    return failed || file == NULL ? -1 : instructions;
+}
+
+/* Translate a program too big to hold back with and without outlining, it has to
+ * come out whole and smaller outlined
+ * Return the number of failed checks */
+static int32_t runBig(void)
+{
+    const char* input = "outline-big.vm";
+    const char* output = "outline-big.asm";
+
+    FILE* file = fopen(input, "w");
+    if (file == NULL) {
+        return 1;
+    }
+    fprintf(file, "function main 0\n");
+    for (int32_t block = 0; block < BIG_BLOCKS; block++) {
+        fprintf(file, "push static 0\npush static 1\nadd\npush static 2\nsub\npop static 3\n");
+    }
+    fprintf(file, "label halt\ngoto halt\n");
+    if (fclose(file) != 0) {
+        return 1;
+    }
+
+    int64_t instructions[2];
+    for (int32_t outline = 0; outline < 2; outline++) {
+        translate_options_t options = {OPTIMIZE_LEVEL_SIZE, 0, outline, 0, 0};
+        if (translateOptimized(input, output, &options) < 0) {
+            fprintf(stderr, "FAIL translating %s%s\n", input, outline ? ", outlined" : "");
+            return 1;
+        }
+        instructions[outline] = countInstructions(output);
+        if (instructions[outline] < 0) {
+            fprintf(stderr, "FAIL generated labels of %s%s\n", output, outline ? ", outlined" : "");
+            return 1;
+        }
+    }
+
+    int32_t failures = 0;
+    failures += expect("more instructions than can be held", instructions[0] > (1 << 20), 1) < 0;
+    failures += expect("outlined up to there", instructions[1] < instructions[0], 1) < 0;
+    fprintf(stdout, "%s: -O s %lld -> %lld instructions outlined\n", input, (long long) instructions[0],
+            (long long) instructions[1]);
+    return failures;
+}
+
+int main(int argc, char* argv[])
+{
+    static const char* const INPUTS[] = {
+        "compares-test.vm", "tail-test.vm", "leaf-test.vm", "layout-test.vm",
+    };
+    const char* output = "outline-test.asm";
+    int32_t failures = 0;
+    emulator_t emulator;
+
+    if (emulatorInitialize(&emulator) < 0) {
+        return -1;
+    }
+
+    for (size_t input = 0; input < sizeof(INPUTS) / sizeof(INPUTS[0]); input++) {
+        uint16_t statics[2][ASSEMBLY_STATIC_END - ASSEMBLY_STATIC_START];
+        size_t rom_sizes[4];
+
+        if (run(&emulator, INPUTS[input], output, 0, 0, statics[0], &rom_sizes[0]) < 0 ||
+            run(&emulator, INPUTS[input], output, 1, 0, statics[1], &rom_sizes[1]) < 0) {
+            failures++;
+            continue;
+        }
+        failures += expect("same static variables", memcmp(statics[0], statics[1], sizeof(statics[0])) == 0, 1) < 0;
+        failures += expect("outlining shrinks ROM", rom_sizes[1] < rom_sizes[0], 1) < 0;
+
+        /* Hot code is never outlined */
+        if (run(&emulator, INPUTS[input], output, 0, 1, statics[0], &rom_sizes[2]) < 0 ||
+            run(&emulator, INPUTS[input], output, 1, 1, statics[1], &rom_sizes[3]) < 0) {
+            failures++;
+            continue;
+        }
+        failures += expect("same static variables when hot", memcmp(statics[0], statics[1], sizeof(statics[0])) == 0, 1) < 0;
+        failures += expect("hot ROM stays", rom_sizes[3], rom_sizes[2]) < 0;
+
+        fprintf(stdout, "%s: -O s ROM %zu -> %zu words outlined\n", INPUTS[input], rom_sizes[0], rom_sizes[1]);
+    }
+
+    failures += runBig();
+    emulatorDestroy(&emulator);
+
+    fprintf(stdout, failures == 0 ? "PASS\n" : "FAILED\n");
+    return failures == 0 ? 0 : -1;
+}
@@ -0,0 +1,289 @@
+/* Runs a program with a hot loop and code that never runs under the profiler,
+ * writes its execution counts and translates it again guided by them. With the
+ * counts -O 2 takes less ROM and lays the hotter arm of an if out to save its
+ * goto, and -O s runs faster than without while staying smaller than -O 2, all
+ * computing the same thing. A multiply -O s turns back into a call has its frame
+ * under the caller like any other call, and tail calls never leave a stack without main */
+
+#include "../include/parser.h"
+#include "../include/command.h"
+#include "../include/assembly_gen.h"
+#include "../include/stack_arena.h"
+#include "../include/optimize.h"
+#include "../include/profile.h"
+#include "../include/emulator.h"
+#include "../include/profiler.h"
+#include "test_util.h"
+
+
+#include <stdio.h>
+#include <string.h>
+
+
+typedef struct {
+    parser_t         parser;
+    stack_arena_t    stack_arena;
+    command_module_t command_module;
+    rom_range_t*     rom_ranges;
+} translation_t;
+
+/* Translate input at the given level into output, guided by the counts in profile_path
+ * unless it is NULL. The translation is kept for the profiler
+ * Return 0 on success
+ * Return -1 on failure */
+static int32_t translateProfiled(translation_t* translation, const char* input, const char* output, int32_t level,
+                                 const char* profile_path)
+{
+    assembly_gen_t assembly_generator;
+    profile_t profile;
+
+    if (parserInitialize(&translation->parser, input) < 0) {
+        return -1;
+    }
+
+    if (stackArenaInitialize(&translation->stack_arena, 16 * translation->parser.file_size) < 0) {
+        parserDestroy(&translation->parser);
+        return -1;
+    }
+
+    command_module_t* modules[] = {&translation->command_module};
+    const profile_t* profiles[] = {profile_path != NULL ? &profile : NULL};
+    int32_t result = -1;
+    if (parserParseCommands(&translation->parser, &translation->command_module, &translation->stack_arena) == 0 &&
+        (profile_path == NULL || profileLoad(&profile, profile_path, input, &translation->stack_arena) == 0) &&
+        optimizeCommands(&translation->command_module, level, profile_path != NULL ? &profile : NULL, 0) >= 0 &&
+        optimizeLeafCalls(modules, 1, level, profiles) >= 0 &&
+        assemblyGenInitialize(&assembly_generator, output) == 0) {
+
+        translation->rom_ranges = stackArenaPush(&translation->stack_arena,
+                                                 (translation->command_module.total_commands + 1) * sizeof(rom_range_t));
+        assembly_generator.rom_ranges = translation->rom_ranges;
+        assemblyGenSetGoal(&assembly_generator, optimizeGoal(level), &translation->command_module,
+                           profile_path != NULL ? &profile : NULL);
+
+        if (translation->rom_ranges != NULL &&
+            assemblyGenPreamble(&assembly_generator, "main") == 0 &&
+            assemblyGen(&assembly_generator, &translation->command_module, input) == 0) {
+            result = 0;
+        }
+        assemblyGenDestroy(&assembly_generator);
+    }
+
+    if (result < 0) {
+        parserDestroy(&translation->parser);
+        stackArenaRelease(&translation->stack_arena);
+    }
+    return result;
+}
+
+static void translationDestroy(translation_t* translation)
+{
+    parserDestroy(&translation->parser);
+    stackArenaRelease(&translation->stack_arena);
+}
+
+/* Translate and run, checking the loop's results, and note the ROM and cycles it took
+ * Return the number of failed checks */
+static int32_t run(emulator_t* emulator, const char* input, const char* output, int32_t level, const char* profile_path,
+                   size_t* rom_size, uint64_t* cycles)
+{
+    translation_t translation;
+    int32_t failures = 0;
+
+    if (translateProfiled(&translation, input, output, level, profile_path) < 0 || emulatorLoadFile(emulator, output) < 0) {
+        fprintf(stderr, "FAIL translating %s at level %d%s\n", input, level, profile_path != NULL ? " with a profile" : "");
+        return 1;
+    }
+    translationDestroy(&translation);
+
+    emulatorReset(emulator);
+    emulator->ram[16] = emulator->ram[17] = 0x5555;
+    failures += expect("status", emulatorRun(emulator, 1000000), EMULATOR_HALTED) < 0;
+    failures += expect("static 0 (steps between 3 and 100)", (int16_t) emulator->ram[16], -96) < 0;
+    failures += expect("static 1 (returned)", (int16_t) emulator->ram[17], -96) < 0;
+    failures += expect("static 3 (below 150)", (int16_t) emulator->ram[19], 150) < 0;
+    failures += expect("static 4 (from 150)", (int16_t) emulator->ram[20], 50) < 0;
+
+    *rom_size = emulator->rom_size;
+    *cycles = emulator->cycles;
+    return failures;
+}
+
+/* Translate input at the given level and run it to the end under the profiler, counting
+ * every cycle. The profiler and the translation its names come from are left for the
+ * caller to look at and destroy
+ * Return 0 on success
+ * Return -1 on failure */
+static int32_t profileRun(emulator_t* emulator, profiler_t* profiler, translation_t* translation, const char* input,
+                          const char* output, int32_t level)
+{
+    if (translateProfiled(translation, input, output, level, NULL) < 0 || emulatorLoadFile(emulator, output) < 0) {
+        fprintf(stderr, "FAIL translating %s at level %d\n", input, level);
+        return -1;
+    }
+
+    profiler_source_t source = {input, &translation->command_module, translation->rom_ranges};
+    emulatorReset(emulator);
+    if (profilerInitialize(profiler, emulator, NULL, &source, 1, "main", 1) < 0) {
+        translationDestroy(translation);
+        return -1;
+    }
+
+    if (profilerRun(profiler, 1000000) != EMULATOR_HALTED) {
+        fprintf(stderr, "FAIL running %s under the profiler\n", input);
+        profilerDestroy(profiler);
+        translationDestroy(translation);
+        return -1;
+    }
+    return 0;
+}
+
+/* Profile a multiply by a constant -O s calls Math.multiply for, every cycle spent in
+ * Math.multiply has to be under main
+ * Return the number of failed checks */
+static int32_t runMultiply(emulator_t* emulator)
+{
+    const char* filename = "pgo-multiply.vm";
+    translation_t translation;
+    profiler_t profiler;
+    int32_t failures = 0;
+
+    FILE* file = fopen(filename, "w");
+    if (file == NULL) {
+        return 1;
+    }
+    fputs("function main 0\npush constant 3\npop static 0\npush static 0\npush constant 21845\n"
+          "call Math.multiply 2\npop static 1\nlabel halt\ngoto halt\n"
+          "function Math.multiply 1\npush constant 0\npop local 0\nlabel LOOP\npush argument 0\n"
+          "if-goto BODY\npush local 0\nreturn\nlabel BODY\npush local 0\npush argument 1\nadd\n"
+          "pop local 0\npush argument 0\npush constant 1\nsub\npop argument 0\ngoto LOOP\n", file);
+    fclose(file);
+
+    if (profileRun(emulator, &profiler, &translation, filename, "pgo-multiply.asm", OPTIMIZE_LEVEL_SIZE) < 0) {
+        return 1;
+    }
+    failures += expect("3 * 21845", (int16_t) emulator->ram[17], (int16_t) (3 * 21845)) < 0;
+
+    uint64_t under_main = 0;
+    uint64_t multiply = 0;
+    for (size_t slot = 0; slot < profiler.stack_capacity; slot++) {
+        profiler_stack_t* stack = &profiler.stacks[slot];
+        const uint32_t* frames = &profiler.frames[stack->frames];
+        if (stack->depth == 0 || strcmp(profiler.functions[frames[0]].name, "Math.multiply") != 0) {
+            continue;
+        }
+        multiply += stack->cycles;
+        if (stack->depth == 2 && strcmp(profiler.functions[frames[1]].name, "main") == 0) {
+            under_main += stack->cycles;
+        }
+    }
+    failures += expect("Math.multiply ran", multiply > 0, 1) < 0;
+    failures += expect("main;Math.multiply stack", (int64_t) under_main, (int64_t) multiply) < 0;
+
+    profilerDestroy(&profiler);
+    translationDestroy(&translation);
+    return failures;
+}
+
+/* Profile tail calls at level 1, only the preamble runs outside of main, a sample taken
+ * while a tail call rebuilds its frame included
+ * Return the number of failed checks */
+static int32_t runTailCalls(emulator_t* emulator)
+{
+    translation_t translation;
+    profiler_t profiler;
+    uint64_t outside = 0;
+
+    if (profileRun(emulator, &profiler, &translation, "tail-test.vm", "pgo-tail.asm", 1) < 0) {
+        return 1;
+    }
+
+    for (size_t slot = 0; slot < profiler.stack_capacity; slot++) {
+        profiler_stack_t* stack = &profiler.stacks[slot];
+        const uint32_t* frames = &profiler.frames[stack->frames];
+        if (stack->depth == 0 || (stack->depth == 1 && strcmp(profiler.functions[frames[0]].name, "(runtime)") == 0)) {
+            continue;
+        }
+        if (strcmp(profiler.functions[frames[stack->depth - 1]].name, "main") != 0) {
+            outside += stack->cycles;
+        }
+    }
+
+    profilerDestroy(&profiler);
+    translationDestroy(&translation);
+    return expect("tail call cycles outside main", (int64_t) outside, 0) < 0;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* input = argc > 1 ? argv[1] : "pgo-test.vm";
+    const char* output = "pgo-test.asm";
+    const char* counts = "pgo-test.counts";
+    int32_t failures = 0;
+    emulator_t emulator;
+    translation_t translation;
+    profiler_t profiler;
+
+    if (emulatorInitialize(&emulator) < 0) {
+        return -1;
+    }
+
+    /* Count every execution at level 1 */
+    if (translateProfiled(&translation, input, output, 1, NULL) < 0 || emulatorLoadFile(&emulator, output) < 0) {
+        fprintf(stderr, "Failed to translate %s\n", input);
+        return -1;
+    }
+
+    profiler_source_t source = {input, &translation.command_module, translation.rom_ranges};
+    FILE* counts_file = fopen(counts, "w");
+    if (counts_file == NULL || profilerInitialize(&profiler, &emulator, NULL, &source, 1, "main", 1) < 0) {
+        fprintf(stderr, "Failed to initialize profiler\n");
+        return -1;
+    }
+
+    emulatorReset(&emulator);
+    failures += expect("profiled run", profilerRun(&profiler, 1000000), EMULATOR_HALTED) < 0;
+    failures += expect("counts written", profilerWriteCounts(&profiler, counts_file), 0) < 0;
+    fclose(counts_file);
+    profilerDestroy(&profiler);
+    translationDestroy(&translation);
+
+    /* The counts have to be exact, and report never ran */
+    profile_t profile;
+    stack_arena_t stack_arena;
+    if (stackArenaInitialize(&stack_arena, 4096) < 0 || profileLoad(&profile, counts, input, &stack_arena) < 0) {
+        fprintf(stderr, "Failed to load %s\n", counts);
+        return -1;
+    }
+    failures += expect("main ran once", (int64_t) PROFILE_COUNT(&profile, 2), 1) < 0;
+    failures += expect("loop test ran 201 times", (int64_t) PROFILE_COUNT(&profile, 31), 201) < 0;
+    failures += expect("step ran 200 times", (int64_t) PROFILE_COUNT(&profile, 67), 200) < 0;
+    failures += expect("report never ran", (int64_t) PROFILE_COUNT(&profile, 76), 0) < 0;
+    failures += expect("hot count", (int64_t) profile.hot_count, 201 / PROFILE_HOT_RATIO) < 0;
+    stackArenaRelease(&stack_arena);
+
+    size_t rom_sizes[4];
+    uint64_t cycles[4];
+    failures += run(&emulator, input, output, OPTIMIZE_LEVEL_SPEED, NULL, &rom_sizes[0], &cycles[0]);
+    failures += run(&emulator, input, output, OPTIMIZE_LEVEL_SPEED, counts, &rom_sizes[1], &cycles[1]);
+    failures += run(&emulator, input, output, OPTIMIZE_LEVEL_SIZE, NULL, &rom_sizes[2], &cycles[2]);
+    failures += run(&emulator, input, output, OPTIMIZE_LEVEL_SIZE, counts, &rom_sizes[3], &cycles[3]);
+
+    /* The loop's first arm ran 100 times more than its second, so they trade places and
+     * the goto over the second, two instructions, is taken 100 times less */
+    failures += expect("-O 2 cycles saved", (int64_t) (cycles[0] - cycles[1]), 200) < 0;
+    failures += expect("-O 2 takes less ROM", rom_sizes[1] < rom_sizes[0], 1) < 0;
+    failures += expect("-O s runs faster", cycles[3] < cycles[2], 1) < 0;
+    failures += expect("-O s stays smaller than -O 2", rom_sizes[3] < rom_sizes[0], 1) < 0;
+    fprintf(stdout, "%s: -O 2 ROM %zu -> %zu words, %llu -> %llu cycles; -O s ROM %zu -> %zu words, %llu -> %llu cycles\n",
+            input, rom_sizes[0], rom_sizes[1], (unsigned long long) cycles[0], (unsigned long long) cycles[1],
+            rom_sizes[2], rom_sizes[3], (unsigned long long) cycles[2], (unsigned long long) cycles[3]);
+
+    failures += runMultiply(&emulator);
+    failures += runTailCalls(&emulator);
+
+    emulatorDestroy(&emulator);
+
+    fprintf(stdout, failures == 0 ? "PASS\n" : "FAILED\n");
+    return failures == 0 ? 0 : -1;
+}
@@ -0,0 +1,162 @@
+/* Translates a generated program, large enough to span many batches and output
+ * buffers, both through the pipeline and in sequence, the assembly and source
+ * maps have to come out byte for byte the same */
+
+#include "../include/parser.h"
+#include "../include/command.h"
+#include "../include/assembly_gen.h"
+#include "../include/stack_arena.h"
+#include "../include/pipeline.h"
+
+
+#include <stdio.h>
+#include <string.h>
+
+
+#define FUNCTIONS 2000
+#define PADDING   20
+
+/* main sums the results of f0 ... fN into static 0, fi returns i */
+static int32_t writeProgram(const char* filepath)
+{
+    FILE* file = fopen(filepath, "w");
+    if (file == NULL) {
+        return -1;
+    }
+
+    fprintf(file, "function main 0\npush constant 0\npop static 0\n");
+    for (int32_t function = 0; function < FUNCTIONS; function++) {
+        fprintf(file, "call f%d 0\npush static 0\nadd\npop static 0\n", function);
+    }
+    fprintf(file, "label halt\ngoto halt\n");
+
+    for (int32_t function = 0; function < FUNCTIONS; function++) {
+        fprintf(file, "function f%d 1\npush constant %d\npop local 0\n", function, function);
+        for (int32_t index = 0; index < PADDING; index++) {
+            fprintf(file, "push local 0\npop local 0\n");
+        }
+        fprintf(file, "push local 0\nreturn\n");
+    }
+
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+/* Translate input in sequence or through the pipeline
+ * Return 0 on success
+ * Return -1 on failure */
+static int32_t translate(const char* input, const char* output, const char* map_path, const char* label_path,
+                         int32_t pipelined)
+{
+    parser_t parser;
+    command_module_t command_module;
+    stack_arena_t stack_arena;
+    assembly_gen_t assembly_generator;
+
+    if (parserInitialize(&parser, input) < 0) {
+        return -1;
+    }
+
+    if (assemblyGenInitialize(&assembly_generator, output) < 0 ||
+        assemblyGenOpenMap(&assembly_generator, map_path) < 0 ||
+        assemblyGenOpenLabelTable(&assembly_generator, label_path) < 0 ||
+        assemblyGenPreamble(&assembly_generator, "main") < 0) {
+        parserDestroy(&parser);
+        return -1;
+    }
+
+    int32_t result = 0;
+    if (pipelined) {
+        result = pipelineTranslate(&parser, &assembly_generator, input);
+    }
+    else if (stackArenaInitialize(&stack_arena, 8 * parser.file_size) == 0) {
+        if (parserParseCommands(&parser, &command_module, &stack_arena) < 0 ||
+            assemblyGen(&assembly_generator, &command_module, input) < 0) {
+            result = -1;
+        }
+        stackArenaRelease(&stack_arena);
+    }
+    else {
+        result = -1;
+    }
+
+    assemblyGenDestroy(&assembly_generator);
+    parserDestroy(&parser);
+    return result;
+}
+
+static int32_t sameFiles(const char* left_path, const char* right_path)
+{
+    FILE* left = fopen(left_path, "r");
+    FILE* right = fopen(right_path, "r");
+    int32_t same = left != NULL && right != NULL;
+
+    while (same) {
+        int left_c = fgetc(left);
+        int right_c = fgetc(right);
+        same = left_c == right_c;
+        if (left_c == EOF) {
+            break;
+        }
+    }
+
+    if (left != NULL) {
+        fclose(left);
+    }
+    if (right != NULL) {
+        fclose(right);
+    }
+    return same;
+}
+
+/* Return 1 if the file holds exactly text */
+static int32_t fileHolds(const char* path, const char* text)
+{
+    FILE* file = fopen(path, "r");
+    int32_t same = file != NULL;
+
+    for (; same && *text != '\0'; text++) {
+        same = fgetc(file) == (uint8_t) *text;
+    }
+    same = same && fgetc(file) == EOF;
+
+    if (file != NULL) {
+        fclose(file);
+    }
+    return same;
+}
+
+int main(int argc, char* argv[])
+{
+    int32_t failures = 0;
+    const char* input = "pipeline-test.vm";
+
+    if (writeProgram(input) < 0) {
+        fprintf(stderr, "Failed to write %s\n", input);
+        return -1;
+    }
+
+    if (translate(input, "pipeline-test.asm", "pipeline-test.map", "pipeline-test.labels", 0) < 0 ||
+        translate(input, "pipeline-test-threaded.asm", "pipeline-test-threaded.map", "pipeline-test-threaded.labels", 1) < 0) {
+        fprintf(stderr, "Failed to translate %s\n", input);
+        return -1;
+    }
+
+    if (!sameFiles("pipeline-test.asm", "pipeline-test-threaded.asm")) {
+        fprintf(stderr, "FAIL assembly differs\n");
+        failures++;
+    }
+    if (!sameFiles("pipeline-test.map", "pipeline-test-threaded.map")) {
+        fprintf(stderr, "FAIL source map differs\n");
+        failures++;
+    }
+
+    /* Generated labels are $<file id>.<counter>, the table names the files behind the ids */
+    const char* table = "# id\tfile\n0\t(preamble)\n1\tpipeline-test.vm\n";
+    if (!fileHolds("pipeline-test.labels", table) || !fileHolds("pipeline-test-threaded.labels", table)) {
+        fprintf(stderr, "FAIL label table\n");
+        failures++;
+    }
+
+    fprintf(stdout, failures == 0 ? "PASS\n" : "FAILED\n");
+    return failures == 0 ? 0 : -1;
+}
@@ -0,0 +1,191 @@
+/* Profiles the emulator test program and checks every cycle is accounted for,
+ * both exactly and sampled, on the interpreter and the JIT. The source map
+ * written alongside has to agree with the recorded ROM ranges */
+
+#include "../include/parser.h"
+#include "../include/command.h"
+#include "../include/assembly_gen.h"
+#include "../include/stack_arena.h"
+#include "../include/emulator.h"
+#include "../include/jit.h"
+#include "../include/profiler.h"
+#include "test_util.h"
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static uint64_t functionCycles(profiler_t* profiler, const char* name)
+{
+    for (size_t index = 0; index < profiler->total_functions; index++) {
+        if (strcmp(profiler->functions[index].name, name) == 0) {
+            return profiler->functions[index].cycles;
+        }
+    }
+    return 0;
+}
+
+/* Run the loaded program under the profiler and check its books balance */
+static int32_t profile(emulator_t* emulator, jit_t* jit, profiler_source_t* source, uint64_t period)
+{
+    profiler_t profiler;
+    int32_t failures = 0;
+    char what[64];
+
+    emulatorReset(emulator);
+    if (profilerInitialize(&profiler, emulator, jit, source, 1, "main", period) < 0) {
+        fprintf(stderr, "Failed to initialize profiler\n");
+        return 1;
+    }
+
+    snprintf(what, sizeof(what), "status (%s, period %llu)", jit != NULL ? "jit" : "interpreter",
+             (unsigned long long) period);
+    failures += expect(what, profilerRun(&profiler, 100000000), EMULATOR_HALTED) < 0;
+    failures += expect("total cycles", (int64_t) profiler.total_cycles, (int64_t) emulator->cycles) < 0;
+
+    uint64_t function_total = 0;
+    for (size_t index = 0; index < profiler.total_functions; index++) {
+        function_total += profiler.functions[index].cycles;
+    }
+    failures += expect("function cycles", (int64_t) function_total, (int64_t) profiler.total_cycles) < 0;
+
+    /* Everything outside the runtime routines belongs to some command */
+    uint64_t command_total = 0;
+    for (size_t index = 0; index < profiler.total_commands; index++) {
+        command_total += profiler.command_cycles[index];
+    }
+    failures += expect("command cycles", (int64_t) (command_total + functionCycles(&profiler, "(runtime)")),
+                       (int64_t) profiler.total_cycles) < 0;
+
+    uint64_t stack_total = profiler.dropped_cycles;
+    uint64_t mult_stack = 0;
+    for (size_t slot = 0; slot < profiler.stack_capacity; slot++) {
+        profiler_stack_t* stack = &profiler.stacks[slot];
+        if (stack->depth == 0) {
+            continue;
+        }
+        stack_total += stack->cycles;
+
+        const uint32_t* frames = &profiler.frames[stack->frames];
+        if (stack->depth == 2 && strcmp(profiler.functions[frames[0]].name, "mult") == 0 &&
+            strcmp(profiler.functions[frames[1]].name, "main") == 0) {
+            mult_stack = stack->cycles;
+        }
+    }
+    failures += expect("stack cycles", (int64_t) stack_total, (int64_t) profiler.total_cycles) < 0;
+
+    /* The multiply loop dominates, and all of mult's own cycles are spent under main */
+    failures += expect("mult dominates", functionCycles(&profiler, "mult") * 10 > profiler.total_cycles * 8, 1) < 0;
+    if (period == 1) {
+        failures += expect("main;mult stack", (int64_t) mult_stack, (int64_t) functionCycles(&profiler, "mult")) < 0;
+    }
+
+    profilerDestroy(&profiler);
+    return failures;
+}
+
+/* Read the source map back and check it line for line against the commands and ROM ranges */
+static int32_t checkMap(const char* map_path, const char* input, command_module_t* command_module, rom_range_t* rom_ranges)
+{
+    FILE* map_file = fopen(map_path, "r");
+    if (map_file == NULL) {
+        fprintf(stderr, "Failed to open %s\n", map_path);
+        return 1;
+    }
+
+    int32_t failures = 0;
+    char file[256], function[256];
+    unsigned line;
+    size_t start, end;
+
+    /* Header, then the preamble which has to end where the first command starts */
+    failures += expect("map header", fscanf(map_file, "# file line function rom_start rom_end ") == 0, 1) < 0;
+    failures += expect("map preamble", fscanf(map_file, "%255s %u %255s %zu %zu", file, &line, function, &start, &end), 5) < 0;
+    failures += expect("preamble end", (int64_t) end, rom_ranges[0].start) < 0;
+
+    const char* current = NULL;
+    for (size_t index = 0; index < command_module->total_commands; index++) {
+        command_t* command = &command_module->commands[index];
+        if (command->op == OP_FUNCTION) {
+            current = command->arguments.flow.label;
+        }
+
+        if (fscanf(map_file, "%255s %u %255s %zu %zu", file, &line, function, &start, &end) != 5) {
+            failures += expect("map entry", 0, 1) < 0;
+            break;
+        }
+
+        failures += expect("map file", strcmp(file, input), 0) < 0;
+        failures += expect("map line", line, command->line) < 0;
+        failures += expect("map function", strcmp(function, current), 0) < 0;
+        failures += expect("map start", (int64_t) start, rom_ranges[index].start) < 0;
+        failures += expect("map end", (int64_t) end, rom_ranges[index].end) < 0;
+    }
+
+    fclose(map_file);
+    return failures;
+}
+
+int main(int argc, char* argv[])
+{
+    parser_t parser;
+    command_module_t command_module;
+    stack_arena_t stack_arena;
+    assembly_gen_t assembly_generator;
+    emulator_t emulator;
+    jit_t jit;
+    int32_t failures = 0;
+
+    const char* input = argc > 1 ? argv[1] : "emulator-test.vm";
+    const char* output = argc > 2 ? argv[2] : "profiler-test.asm";
+    const char* map_path = argc > 3 ? argv[3] : "profiler-test.map";
+
+    if (parserInitialize(&parser, input) < 0 || stackArenaInitialize(&stack_arena, 8 * parser.file_size) < 0) {
+        fprintf(stderr, "Failed to read %s\n", input);
+        return -1;
+    }
+
+    if (parserParseCommands(&parser, &command_module, &stack_arena) < 0 ||
+        assemblyGenInitialize(&assembly_generator, output) < 0) {
+        fprintf(stderr, "Failed to parse %s\n", input);
+        return -1;
+    }
+
+    rom_range_t* rom_ranges = stackArenaPush(&stack_arena, command_module.total_commands * sizeof(rom_range_t));
+    assembly_generator.rom_ranges = rom_ranges;
+    if (rom_ranges == NULL || assemblyGenOpenMap(&assembly_generator, map_path) < 0 ||
+        assemblyGenPreamble(&assembly_generator, "main") < 0 ||
+        assemblyGen(&assembly_generator, &command_module, input) < 0) {
+        fprintf(stderr, "Failed to translate %s\n", input);
+        return -1;
+    }
+    assemblyGenDestroy(&assembly_generator);
+
+    /* Ranges have to be ordered and never overlap */
+    for (size_t index = 1; index < command_module.total_commands; index++) {
+        failures += expect("rom ranges ordered", rom_ranges[index].start >= rom_ranges[index - 1].end, 1) < 0;
+    }
+    failures += checkMap(map_path, input, &command_module, rom_ranges);
+
+    if (emulatorInitialize(&emulator) < 0 || emulatorLoadFile(&emulator, output) < 0 ||
+        jitInitialize(&jit, &emulator, 1 << 20) < 0) {
+        fprintf(stderr, "Failed to load %s\n", output);
+        return -1;
+    }
+
+    profiler_source_t source = {input, &command_module, rom_ranges};
+    failures += profile(&emulator, NULL, &source, 1);
+    failures += profile(&emulator, NULL, &source, 1009);
+    failures += profile(&emulator, &jit, &source, 1);
+    failures += profile(&emulator, &jit, &source, 4096);
+
+    jitDestroy(&jit);
+    emulatorDestroy(&emulator);
+    parserDestroy(&parser);
+    stackArenaRelease(&stack_arena);
+
+    fprintf(stdout, failures == 0 ? "PASS\n" : "FAILED\n");
+    return failures == 0 ? 0 : -1;
+}
@@ -0,0 +1,300 @@
+/* Sends framed requests to the server, over a pipe and over a Unix socket from
+ * several clients at once, and checks every response against translating the
+ * same text through libhackvm directly. Bad code and oversized requests have
+ * to come back as failures without disturbing the requests around them */
+
+#include "../include/server.h"
+#include "../include/hackvm.h"
+
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WORKERS  4
+#define CLIENTS  6
+#define REQUESTS 40
+
+static const char* BAD = "function main 0\npush nowhere 1\n";
+
+typedef struct {
+    char*  source;
+    size_t source_size;
+    char*  expected;
+    size_t expected_size;
+} program_t;
+
+typedef struct {
+    server_t*        server;
+    const program_t* program;
+    int              fd;
+    int              output_fd;         /* Stream mode responses */
+    const char*      socket_path;
+    int32_t          failures;
+} client_t;
+
+static char* readFile(const char* filepath, size_t* size)
+{
+    FILE* file = fopen(filepath, "r");
+    if (file == NULL) {
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    *size = (size_t) ftell(file);
+    rewind(file);
+
+    char* data = malloc(*size + 1);
+    if (data != NULL && fread(data, 1, *size, file) != *size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    return data;
+}
+
+static int32_t writeAll(int fd, const void* data, size_t size)
+{
+    for (size_t total = 0; total < size;) {
+        ssize_t bytes = write(fd, (const char*) data + total, size - total);
+        if (bytes <= 0) {
+            return -1;
+        }
+        total += (size_t) bytes;
+    }
+    return 0;
+}
+
+static int32_t readAll(int fd, void* data, size_t size)
+{
+    for (size_t total = 0; total < size;) {
+        ssize_t bytes = read(fd, (char*) data + total, size - total);
+        if (bytes <= 0) {
+            return -1;
+        }
+        total += (size_t) bytes;
+    }
+    return 0;
+}
+
+static int32_t sendRequest(int fd, const char* source, uint32_t size)
+{
+    uint8_t header[4] = {(uint8_t) size, (uint8_t) (size >> 8), (uint8_t) (size >> 16), (uint8_t) (size >> 24)};
+    return writeAll(fd, header, sizeof(header)) < 0 || writeAll(fd, source, size) < 0 ? -1 : 0;
+}
+
+/* Read a response and check it against what was expected, expected NULL means a failure
+ * Return 0 if it matches
+ * Return -1 otherwise */
+static int32_t checkResponse(int fd, const char* expected, size_t expected_size)
+{
+    uint8_t header[8];
+    if (readAll(fd, header, sizeof(header)) < 0) {
+        return -1;
+    }
+
+    uint32_t status = header[0] | header[1] << 8 | header[2] << 16 | (uint32_t) header[3] << 24;
+    uint32_t size = header[4] | header[5] << 8 | header[6] << 16 | (uint32_t) header[7] << 24;
+
+    char* data = malloc(size + 1);
+    if (data == NULL || readAll(fd, data, size) < 0) {
+        free(data);
+        return -1;
+    }
+
+    int32_t result = 0;
+    if (expected == NULL) {
+        result = status == SERVER_STATUS_FAILED && size != 0 ? 0 : -1;
+    }
+    else {
+        result = status == SERVER_STATUS_OK && size == expected_size && memcmp(data, expected, size) == 0 ? 0 : -1;
+    }
+
+    free(data);
+    return result;
+}
+
+/* Writes requests into the pipe the stream server reads, every fifth one bad */
+static void* streamWriter(void* argument)
+{
+    client_t* client = argument;
+
+    for (int32_t index = 0; index < REQUESTS; index++) {
+        int32_t result = index % 5 == 4 ? sendRequest(client->fd, BAD, (uint32_t) strlen(BAD))
+                                        : sendRequest(client->fd, client->program->source, (uint32_t) client->program->source_size);
+        if (result < 0) {
+            client->failures++;
+            break;
+        }
+    }
+
+    /* One too large to take, then one announced but never sent in full */
+    char* large = calloc(SERVER_MAX_REQUEST + 1, 1);
+    if (large == NULL || sendRequest(client->fd, large, SERVER_MAX_REQUEST + 1) < 0) {
+        client->failures++;
+    }
+    free(large);
+
+    uint8_t header[4] = {0xFF, 0xFF, 0xFF, 0xFF};
+    writeAll(client->fd, header, sizeof(header));
+
+    close(client->fd);
+    return NULL;
+}
+
+static void* streamServer(void* argument)
+{
+    client_t* client = argument;
+    client->failures = serverServeStream(client->server, client->fd, client->output_fd) < 0;
+    return NULL;
+}
+
+/* Connects and sends requests one after another on the same connection */
+static void* socketClient(void* argument)
+{
+    client_t* client = argument;
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, client->socket_path);
+
+    int fd = -1;
+    for (int32_t attempt = 0; attempt < 1000; attempt++) {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr*) &address, sizeof(address)) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+        usleep(1000);
+    }
+    if (fd < 0) {
+        client->failures++;
+        return NULL;
+    }
+
+    for (int32_t index = 0; index < REQUESTS; index++) {
+        int32_t bad = index % 7 == 3;
+        if (sendRequest(fd, bad ? BAD : client->program->source,
+                        bad ? (uint32_t) strlen(BAD) : (uint32_t) client->program->source_size) < 0 ||
+            checkResponse(fd, bad ? NULL : client->program->expected, client->program->expected_size) < 0) {
+            client->failures++;
+        }
+    }
+
+    close(fd);
+    return NULL;
+}
+
+static void* socketServer(void* argument)
+{
+    client_t* client = argument;
+    client->failures = serverServeSocket(client->server, client->socket_path) < 0;
+    return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* input = argc > 1 ? argv[1] : "emulator-test.vm";
+    int32_t failures = 0;
+    program_t program;
+    hackvm_t hackvm;
+    server_t server;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    /* The responses should match a direct translation */
+    program.source = readFile(input, &program.source_size);
+    program.expected = malloc(1024 * 1024);
+    if (program.source == NULL || program.expected == NULL || hackvmInitialize(&hackvm, 0, 0) < 0 ||
+        hackvmTranslateBuffer(&hackvm, program.source, program.source_size, "request.vm",
+                              program.expected, 1024 * 1024, &program.expected_size) < 0) {
+        fprintf(stderr, "Failed to translate %s\n", input);
+        return -1;
+    }
+    hackvmDestroy(&hackvm);
+
+    if (serverInitialize(&server, WORKERS, 0) < 0) {
+        fprintf(stderr, "Failed to initialize server\n");
+        return -1;
+    }
+
+    /* Stream mode, requests go in through one pipe and responses come out another */
+    int requests[2], responses[2];
+    if (pipe(requests) < 0 || pipe(responses) < 0) {
+        return -1;
+    }
+
+    client_t writer = {&server, &program, requests[1], -1, NULL, 0};
+    client_t stream = {&server, &program, requests[0], responses[1], NULL, 0};
+    pthread_t writer_thread, stream_thread;
+
+    pthread_create(&writer_thread, NULL, streamWriter, &writer);
+    pthread_create(&stream_thread, NULL, streamServer, &stream);
+
+    for (int32_t index = 0; index < REQUESTS; index++) {
+        if (checkResponse(responses[0], index % 5 == 4 ? NULL : program.expected, program.expected_size) < 0) {
+            fprintf(stderr, "FAIL stream response %d\n", index);
+            failures++;
+            break;
+        }
+    }
+
+    if (checkResponse(responses[0], NULL, 0) < 0) {
+        fprintf(stderr, "FAIL oversized request\n");
+        failures++;
+    }
+
+    pthread_join(writer_thread, NULL);
+    pthread_join(stream_thread, NULL);
+    close(responses[0]);
+    close(responses[1]);
+    close(requests[0]);
+
+    /* The stream ended part way through the oversized request, which the server reports */
+    if (writer.failures != 0 || stream.failures == 0) {
+        fprintf(stderr, "FAIL stream ending\n");
+        failures++;
+    }
+
+    /* Socket mode, clients at once each with a connection of its own */
+    const char* socket_path = "server-test.sock";
+    client_t listener = {&server, &program, -1, -1, socket_path, 0};
+    client_t clients[CLIENTS];
+    pthread_t listener_thread, client_threads[CLIENTS];
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_create(&listener_thread, NULL, socketServer, &listener);
+    for (size_t index = 0; index < CLIENTS; index++) {
+        clients[index] = (client_t) {&server, &program, -1, -1, socket_path, 0};
+        pthread_create(&client_threads[index], NULL, socketClient, &clients[index]);
+    }
+    for (size_t index = 0; index < CLIENTS; index++) {
+        pthread_join(client_threads[index], NULL);
+        failures += clients[index].failures;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    serverStop(&server);
+    pthread_join(listener_thread, NULL);
+    failures += listener.failures;
+
+    double seconds = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stdout, "%d socket requests in %.3fs\n", CLIENTS * REQUESTS, seconds);
+
+    serverDestroy(&server);
+    free(program.source);
+    free(program.expected);
+
+    fprintf(stdout, failures == 0 ? "PASS\n" : "FAILED\n");
+    return failures == 0 ? 0 : -1;
+}
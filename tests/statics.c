@@ -0,0 +1,180 @@
+/* Translates a program of two files into one, with their static variables laid out
+ * ahead of time in either order and chained file after file as before, runs each and
+ * checks no file's statics land on another's. Files that need more than RAM 16 - 255
+ * have to fail with a report, laid out or not */
+
+#include "../include/parser.h"
+#include "../include/command.h"
+#include "../include/assembly_gen.h"
+#include "../include/stack_arena.h"
+#include "../include/emulator.h"
+#include "test_util.h"
+
+
+#include <stdio.h>
+#include <string.h>
+
+#define TOTAL_FILES 3
+
+/* main sets its statics 0 - 2, set writes its static 0 */
+static const char* SOURCES[TOTAL_FILES] = {
+    "function main 0\n"
+    "push constant 1\npop static 0\npush constant 2\npop static 1\npush constant 3\npop static 2\n"
+    "call Set.set 0\npop temp 0\n"
+    "label halt\ngoto halt\n",
+
+    "function Set.set 0\n"
+    "push constant 7\npop static 0\npush constant 0\nreturn\n",
+
+    /* Big.fill takes every static word there is on its own */
+    "function Big.fill 0\n"
+    "push constant 9\npop static 239\npush constant 0\nreturn\n",
+};
+
+static const char* FILENAMES[TOTAL_FILES] = {"statics-main.vm", "statics-set.vm", "statics-big.vm"};
+
+typedef struct {
+    parser_t         parser;
+    stack_arena_t    stack_arena;
+    command_module_t command_module;
+} file_t;
+
+/* Return 0 on success
+ * Return -1 on failure */
+static int32_t parseFile(file_t* file, const char* filepath, const char* source)
+{
+    FILE* output = fopen(filepath, "w");
+    if (output == NULL || fputs(source, output) < 0 || fclose(output) != 0) {
+        return -1;
+    }
+
+    if (parserInitialize(&file->parser, filepath) < 0) {
+        return -1;
+    }
+
+    if (stackArenaInitialize(&file->stack_arena, 8 * file->parser.file_size + 4096) < 0 ||
+        parserParseCommands(&file->parser, &file->command_module, &file->stack_arena) < 0) {
+        parserDestroy(&file->parser);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Generate the files in order into output, laid out first unless report is NULL
+ * Return 0 on success
+ * Return -1 on failure */
+static int32_t translateFiles(file_t* files, const size_t* order, size_t total_files, const char* output, FILE* report)
+{
+    assembly_gen_t assembly_generator;
+    static_layout_t layouts[TOTAL_FILES];
+    command_module_t* modules[TOTAL_FILES];
+    const char* filenames[TOTAL_FILES];
+
+    for (size_t index = 0; index < total_files; index++) {
+        modules[index] = &files[order[index]].command_module;
+        filenames[index] = FILENAMES[order[index]];
+    }
+
+    if (assemblyGenInitialize(&assembly_generator, output) < 0) {
+        return -1;
+    }
+
+    int32_t result = -1;
+    if ((report == NULL ||
+         assemblyGenLayoutStatics(&assembly_generator, layouts, modules, filenames, total_files, report) == 0) &&
+        assemblyGenPreamble(&assembly_generator, "main") == 0) {
+
+        result = 0;
+        for (size_t index = 0; index < total_files && result == 0; index++) {
+            result = assemblyGen(&assembly_generator, modules[index], filenames[index]);
+        }
+    }
+
+    assemblyGenDestroy(&assembly_generator);
+    return result;
+}
+
+/* Run output and check the statics of main and Set.set start at the addresses given
+ * Return the number of failed checks */
+static int32_t checkRun(emulator_t* emulator, const char* output, const char* what, uint16_t main_base, uint16_t set_base)
+{
+    int32_t failures = 0;
+
+    if (emulatorLoadFile(emulator, output) < 0) {
+        fprintf(stderr, "FAIL loading %s\n", what);
+        return 1;
+    }
+
+    emulatorReset(emulator);
+    failures += expect(what, emulatorRun(emulator, 100000), EMULATOR_HALTED) < 0;
+    failures += expect("main static 0", emulator->ram[main_base], 1) < 0;
+    failures += expect("main static 1", emulator->ram[main_base + 1], 2) < 0;
+    failures += expect("main static 2", emulator->ram[main_base + 2], 3) < 0;
+    failures += expect("Set.set static 0", emulator->ram[set_base], 7) < 0;
+    return failures;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* output = "statics-test.asm";
+    int32_t failures = 0;
+    file_t files[TOTAL_FILES];
+    emulator_t emulator;
+
+    for (size_t index = 0; index < TOTAL_FILES; index++) {
+        if (parseFile(&files[index], FILENAMES[index], SOURCES[index]) < 0) {
+            fprintf(stderr, "Failed to parse %s\n", FILENAMES[index]);
+            return -1;
+        }
+    }
+
+    if (emulatorInitialize(&emulator) < 0) {
+        return -1;
+    }
+
+    /* Laid out in both orders, main takes three words and Set.set one */
+    static const size_t MAIN_FIRST[] = {0, 1};
+    static const size_t SET_FIRST[] = {1, 0};
+
+    failures += translateFiles(files, MAIN_FIRST, 2, output, stderr) < 0;
+    failures += checkRun(&emulator, output, "laid out, main first", 16, 19);
+    failures += translateFiles(files, SET_FIRST, 2, output, stderr) < 0;
+    failures += checkRun(&emulator, output, "laid out, Set.set first", 17, 16);
+
+    /* Chained file after file, Set.set has to start past main's static 2 */
+    failures += translateFiles(files, MAIN_FIRST, 2, output, NULL) < 0;
+    failures += checkRun(&emulator, output, "chained", 16, 19);
+
+    /* Big.fill fits on its own, but not with Set.set after it */
+    static const size_t BIG[] = {2};
+    static const size_t BIG_SET[] = {2, 1};
+    FILE* report = tmpfile();
+    if (report == NULL) {
+        return -1;
+    }
+
+    failures += expect("Big.fill alone", translateFiles(files, BIG, 1, output, report), 0) < 0;
+    failures += expect("Big.fill and Set.set", translateFiles(files, BIG_SET, 2, output, report), -1) < 0;
+    failures += expect("Big.fill and Set.set chained", translateFiles(files, BIG_SET, 2, output, NULL), -1) < 0;
+
+    char text[256];
+    size_t length = 0;
+    rewind(report);
+    length = fread(text, 1, sizeof(text) - 1, report);
+    text[length] = '\0';
+    fclose(report);
+
+    failures += expect("report names statics-big.vm", strstr(text, "statics-big.vm\t240 static variables") != NULL, 1) < 0;
+    failures += expect("report names statics-set.vm", strstr(text, "statics-set.vm\t1 static variables") != NULL, 1) < 0;
+    failures += expect("report gives the total", strstr(text, "241 static variables, RAM 16 - 255 holds 240") != NULL, 1) < 0;
+
+    for (size_t index = 0; index < TOTAL_FILES; index++) {
+        parserDestroy(&files[index].parser);
+        stackArenaRelease(&files[index].stack_arena);
+    }
+    emulatorDestroy(&emulator);
+
+    fprintf(stdout, failures == 0 ? "PASS\n" : "FAILED\n");
+    return failures == 0 ? 0 : -1;
+}
@@ -0,0 +1,78 @@
+#ifndef TEST_OPTIMIZE_H
+#define TEST_OPTIMIZE_H
+
+/* Helpers for the tests linking the optimizer, on top of test_util.h */
+
+#include "../include/parser.h"
+#include "../include/command.h"
+#include "../include/assembly_gen.h"
+#include "../include/stack_arena.h"
+#include "../include/optimize.h"
+#include "../include/profile.h"
+#include "test_util.h"
+
+
+#include <stdint.h>
+
+/* How translateOptimized treats the program */
+typedef struct {
+    int32_t level;          /* Optimization level, as Hack-VM -O */
+    int32_t keep_calls;     /* Keep calls to OS routines as calls, as Hack-VM -k */
+    int32_t outline;        /* Outline repeated runs of instructions, as -O s does */
+    int32_t hot;            /* Every command ran as often as the hottest */
+    size_t  total_commands; /* Set to what is left after optimizing */
+} translate_options_t;
+
+/* Translate input into output optimized as options asks, with the main function as entry
+ * Return 0 on success
+ * Return -1 on failure */
+static int32_t translateOptimized(const char* input, const char* output, translate_options_t* options)
+{
+    parser_t parser;
+    command_module_t command_module;
+    stack_arena_t stack_arena;
+    assembly_gen_t assembly_generator;
+
+    if (parserInitialize(&parser, input) < 0) {
+        return -1;
+    }
+
+    if (stackArenaInitialize(&stack_arena, 16 * parser.file_size + 4096) < 0) {
+        parserDestroy(&parser);
+        return -1;
+    }
+
+    command_module_t* modules[] = {&command_module};
+    int32_t result = -1;
+    if (parserParseCommands(&parser, &command_module, &stack_arena) == 0 &&
+        optimizeCommands(&command_module, options->level, NULL, options->keep_calls) >= 0 &&
+        optimizeLeafCalls(modules, 1, options->level, NULL) >= 0 &&
+        assemblyGenInitialize(&assembly_generator, output) == 0) {
+
+        profile_t profile = {NULL, parser.file_size + 1, 1, 1};
+        if (options->hot) {
+            profile.counts = stackArenaPush(&stack_arena, profile.total_lines * sizeof(uint64_t));
+            for (size_t line = 0; profile.counts != NULL && line < profile.total_lines; line++) {
+                profile.counts[line] = 1;
+            }
+        }
+
+        assembly_generator.keep_calls = options->keep_calls;
+        assemblyGenSetGoal(&assembly_generator, optimizeGoal(options->level), &command_module,
+                           profile.counts != NULL ? &profile : NULL);
+        if ((!options->outline || assemblyGenBeginOutline(&assembly_generator) == 0) &&
+            assemblyGenPreamble(&assembly_generator, "main") == 0 &&
+            assemblyGen(&assembly_generator, &command_module, input) == 0 &&
+            (!assembly_generator.outlining || assemblyGenEndOutline(&assembly_generator) == 0)) {
+            result = 0;
+        }
+        options->total_commands = command_module.total_commands;
+        assemblyGenDestroy(&assembly_generator);
+    }
+
+    parserDestroy(&parser);
+    stackArenaRelease(&stack_arena);
+    return result;
+}
+
+#endif
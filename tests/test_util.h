@@ -0,0 +1,69 @@
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+/* Helpers the tests share. Every test is built from a single source file, so they
+ * are static. Tests linking the optimizer also have test_optimize.h */
+
+#include "../include/parser.h"
+#include "../include/command.h"
+#include "../include/assembly_gen.h"
+#include "../include/stack_arena.h"
+
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* A word of RAM and what a program should leave in it */
+typedef struct {
+    const char* what;
+    uint16_t    address;
+    int16_t     value;
+} check_t;
+
+/* Return 0 if actual is expected
+ * Return -1 otherwise */
+static int32_t expect(const char* what, int64_t actual, int64_t expected)
+{
+    if (actual != expected) {
+        fprintf(stderr, "FAIL %s: expected %lld, got %lld\n", what, (long long) expected, (long long) actual);
+        return -1;
+    }
+    return 0;
+}
+
+/* Translate input into output as it is, with the main function as entry
+ * Return 0 on success
+ * Return -1 on failure */
+static int32_t translate(const char* input, const char* output)
+{
+    parser_t parser;
+    command_module_t command_module;
+    stack_arena_t stack_arena;
+    assembly_gen_t assembly_generator;
+
+    if (parserInitialize(&parser, input) < 0) {
+        return -1;
+    }
+
+    if (stackArenaInitialize(&stack_arena, 16 * parser.file_size + 4096) < 0) {
+        parserDestroy(&parser);
+        return -1;
+    }
+
+    int32_t result = -1;
+    if (parserParseCommands(&parser, &command_module, &stack_arena) == 0 &&
+        assemblyGenInitialize(&assembly_generator, output) == 0) {
+
+        if (assemblyGenPreamble(&assembly_generator, "main") == 0 &&
+            assemblyGen(&assembly_generator, &command_module, input) == 0) {
+            result = 0;
+        }
+        assemblyGenDestroy(&assembly_generator);
+    }
+
+    parserDestroy(&parser);
+    stackArenaRelease(&stack_arena);
+    return result;
+}
+
+#endif
@@ -0,0 +1,89 @@
+/* Translates a short program and checks the assembly of each command the
+ * translator used to get wrong, without running it: comparisons saving the
+ * return address before D holds the difference and jumping to the lower case
+ * preable routines, sub and lt taking their operands in order, call setting ARG
+ * to the first argument, push / pop of static and temp going straight to the
+ * address, push that reading THAT, pop pointer storing into THIS / THAT and pop
+ * through R14 storing into M */
+
+#include "../include/parser.h"
+#include "../include/command.h"
+#include "../include/assembly_gen.h"
+#include "../include/stack_arena.h"
+#include "test_util.h"
+
+
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_LINES 1024
+
+/* Check the lines of sequence follow each other somewhere in the assembly
+ * Return 0 if they do
+ * Return -1 otherwise */
+static int32_t expectSequence(const char* what, char lines[][64], size_t total_lines, const char* const* sequence)
+{
+    for (size_t start = 0; start < total_lines; start++) {
+        size_t matched = 0;
+        while (sequence[matched] != NULL && start + matched < total_lines &&
+               strcmp(lines[start + matched], sequence[matched]) == 0) {
+            matched++;
+        }
+        if (sequence[matched] == NULL) {
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "FAIL %s: no", what);
+    for (size_t index = 0; sequence[index] != NULL; index++) {
+        fprintf(stderr, " %s", sequence[index]);
+    }
+    fprintf(stderr, "\n");
+    return -1;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* input = "translator-test.vm";
+    const char* output = "translator-test.asm";
+    static char lines[MAX_LINES][64];
+    size_t total_lines = 0;
+    int32_t failures = 0;
+
+    FILE* assembly = translate(input, output) == 0 ? fopen(output, "r") : NULL;
+    if (assembly == NULL) {
+        fprintf(stderr, "FAIL translating %s\n", input);
+        return -1;
+    }
+    while (total_lines < MAX_LINES && fgets(lines[total_lines], sizeof(lines[0]), assembly) != NULL) {
+        lines[total_lines][strcspn(lines[total_lines], "\r\n")] = '\0';
+        total_lines++;
+    }
+    fclose(assembly);
+
+    static const char* const COMPARE[] = {"D=A", "@R13", "M=D", "@SP", "A=M", "D=M", "@SP", "AM=M-1", "MD=M-D",
+                                          "@preable_true", "D;JLT", "@preable_false", NULL};
+    static const char* const SUB[] = {"@SP", "AM=M-1", "M=M-D", NULL};
+    static const char* const CALL[] = {"@2", "D=A", "@SP", "D=M-D", "@ARG", "M=D", NULL};
+    static const char* const POP_TEMP[] = {"M=M-1", "@7", "M=D", NULL};
+    static const char* const PUSH_TEMP[] = {"@7", "D=M", "@SP", "AM=M+1", NULL};
+    static const char* const POP_STATIC[] = {"M=M-1", "@17", "M=D", NULL};
+    static const char* const PUSH_STATIC[] = {"@17", "D=M", "@SP", "AM=M+1", NULL};
+    static const char* const POP_POINTER[] = {"M=M-1", "@THAT", "M=D", NULL};
+    static const char* const PUSH_THAT[] = {"@THAT", "A=M", "D=M", "@SP", "AM=M+1", NULL};
+    static const char* const POP_THAT[] = {"@R14", "M=D", "@R13", "D=M", "@R14", "A=M", "M=D", NULL};
+
+    failures += expectSequence("lt saves the return address, then M-D into preable_true", lines, total_lines, COMPARE) < 0;
+    failures += expectSequence("sub is M-D", lines, total_lines, SUB) < 0;
+    failures += expectSequence("call 2 points ARG at the first argument", lines, total_lines, CALL) < 0;
+    failures += expectSequence("pop temp 2 stores to RAM 7", lines, total_lines, POP_TEMP) < 0;
+    failures += expectSequence("push temp 2 reads RAM 7", lines, total_lines, PUSH_TEMP) < 0;
+    failures += expectSequence("pop static 1 stores to RAM 17", lines, total_lines, POP_STATIC) < 0;
+    failures += expectSequence("push static 1 reads RAM 17", lines, total_lines, PUSH_STATIC) < 0;
+    failures += expectSequence("pop pointer 1 stores to THAT", lines, total_lines, POP_POINTER) < 0;
+    failures += expectSequence("push that 0 reads through THAT", lines, total_lines, PUSH_THAT) < 0;
+    failures += expectSequence("pop that 5 stores through R14", lines, total_lines, POP_THAT) < 0;
+
+    fprintf(stdout, failures == 0 ? "PASS\n" : "FAILED\n");
+    return failures == 0 ? 0 : -1;
+}